@@ -0,0 +1,219 @@
+/*
+    Ucollect - small utility for real-time analysis of network data
+    Copyright (C) 2015 CZ.NIC, z.s.p.o. (http://www.nic.cz/)
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+/*
+ * Compare the uplink compressions on captured traffic. Usage:
+ * codec_bench capture [messages per flush].
+ *
+ * The capture is the uncompressed stream of messages the client sends, as
+ * stored by ucollect built with UPLINK_CAPTURE=path. The messages are
+ * compressed the way the uplink does it, flushed after each group of
+ * messages (1 by default, the worst case; the uplink flushes once per
+ * loop iteration).
+ *
+ * The first half of the capture trains the zstd dictionary, all the
+ * compressions are measured on the second half. It reports the CPU time per
+ * MB of the uncompressed data for compression and decompression and the size
+ * of the compressed data relative to the uncompressed.
+ */
+
+#include "../core/codec.h"
+#include "../core/util.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <errno.h>
+#include <time.h>
+#include <arpa/inet.h>
+#ifdef UPLINK_ZSTD
+#include <zdict.h>
+#endif
+
+// The size of the trained dictionary
+#define DICT_SIZE (16 * 1024)
+
+struct capture {
+	uint8_t *data;
+	size_t size;
+	size_t *starts; // Offsets of the messages, with the end of the data as the last one
+	size_t count;
+};
+
+static struct capture capture_load(const char *path) {
+	FILE *file = fopen(path, "rb");
+	if (!file)
+		die("Can't open capture %s: %s\n", path, strerror(errno));
+	struct capture result = { .data = NULL };
+	size_t allocated = 0;
+	for (;;) {
+		if (result.size == allocated) {
+			allocated = allocated ? 2 * allocated : 1024 * 1024;
+			result.data = realloc(result.data, allocated);
+		}
+		size_t amount = fread(result.data + result.size, 1, allocated - result.size, file);
+		if (!amount)
+			break;
+		result.size += amount;
+	}
+	if (ferror(file))
+		die("Can't read capture %s\n", path);
+	fclose(file);
+	// Split it to the messages
+	size_t starts_allocated = 1024;
+	result.starts = malloc(starts_allocated * sizeof *result.starts);
+	size_t pos = 0;
+	while (pos < result.size) {
+		uint32_t length;
+		if (result.size - pos < sizeof length)
+			die("Truncated message at %zu in capture %s\n", pos, path);
+		memcpy(&length, result.data + pos, sizeof length);
+		length = ntohl(length);
+		if (result.size - pos - sizeof length < length)
+			die("Truncated message at %zu in capture %s\n", pos, path);
+		if (result.count + 1 == starts_allocated)
+			result.starts = realloc(result.starts, (starts_allocated *= 2) * sizeof *result.starts);
+		result.starts[result.count ++] = pos;
+		pos += sizeof length + length;
+	}
+	result.starts[result.count] = pos;
+	if (result.count < 2)
+		die("Capture %s has too few messages\n", path);
+	return result;
+}
+
+static uint64_t cpu_ns(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+struct setup {
+	enum codec_type type;
+	int level;
+};
+
+static void bench(const struct capture *capture, size_t first, size_t batch, const struct setup *setup, const uint8_t *dict, size_t dict_size) {
+	const uint8_t *input = capture->data + capture->starts[first];
+	size_t input_size = capture->starts[capture->count] - capture->starts[first];
+	// Each flush may add a few bytes
+	size_t output_allocated = codec_bound(input_size) + 16 * (capture->count - first);
+	uint8_t *output = malloc(output_allocated);
+	struct codec codec;
+	if (!codec_init(&codec, setup->type, true, setup->level, dict, dict_size))
+		die("Can't initialize %s compression\n", codec_name(setup->type));
+	struct codec_io io = {
+		.out = output,
+		.out_size = output_allocated
+	};
+	uint64_t start = cpu_ns();
+	for (size_t i = first; i < capture->count; i += batch) {
+		size_t end = i + batch < capture->count ? i + batch : capture->count;
+		io.in = capture->data + capture->starts[i];
+		io.in_size = capture->starts[end] - capture->starts[i];
+		if (!codec_compress(&codec, &io, CODEC_FLUSH_SYNC))
+			die("Output of %s compression overflow\n", codec_name(setup->type));
+	}
+	uint64_t compress_time = cpu_ns() - start;
+	codec_done(&codec);
+	size_t output_size = output_allocated - io.out_size;
+
+	// Check it decompresses to the same
+	uint8_t *check = malloc(input_size);
+	if (!codec_init(&codec, setup->type, false, 0, dict, dict_size))
+		die("Can't initialize %s decompression\n", codec_name(setup->type));
+	io = (struct codec_io) {
+		.in = output,
+		.in_size = output_size,
+		.out = check,
+		.out_size = input_size
+	};
+	start = cpu_ns();
+	while (io.in_size && io.out_size)
+		if (codec_decompress(&codec, &io) != CODEC_OK)
+			die("Broken %s stream\n", codec_name(setup->type));
+	uint64_t decompress_time = cpu_ns() - start;
+	codec_done(&codec);
+	if (io.out_size || memcmp(check, input, input_size) != 0)
+		die("%s decompressed to different data\n", codec_name(setup->type));
+
+	double mb = (double)input_size / (1024 * 1024);
+	printf("%-10s level %2d: compress %8.2f ms/MB, decompress %7.2f ms/MB, size %6.2f %%\n", codec_name(setup->type), setup->level,
+			compress_time / 1000000.0 / mb,
+			decompress_time / 1000000.0 / mb,
+			100.0 * output_size / input_size);
+	free(check);
+	free(output);
+}
+
+int main(int argc, const char *argv[]) {
+	if (argc < 2 || argc > 3)
+		die("Usage: %s capture [messages per flush]\n", argv[0]);
+	size_t batch = 1;
+	if (argc > 2) {
+		char *end;
+		batch = strtoull(argv[2], &end, 10);
+		if (!*argv[2] || *end || !batch)
+			die("Invalid messages per flush %s\n", argv[2]);
+	}
+	struct capture capture = capture_load(argv[1]);
+	size_t half = capture.count / 2;
+	printf("%zu messages, %zu bytes, measured on the last %zu messages (%zu bytes), %zu messages per flush\n", capture.count, capture.size, capture.count - half, capture.starts[capture.count] - capture.starts[half], batch);
+	const struct setup setups[] = {
+		{ CODEC_ZLIB, 1 },
+		{ CODEC_ZLIB, 6 },
+		{ CODEC_ZLIB, 9 },
+		{ CODEC_ZSTD, 1 },
+		{ CODEC_ZSTD, 3 },
+		{ CODEC_ZSTD, 9 },
+		{ CODEC_ZSTD, 19 },
+		{ CODEC_ZSTD_DICT, 1 },
+		{ CODEC_ZSTD_DICT, 3 },
+		{ CODEC_ZSTD_DICT, 9 },
+		{ CODEC_ZSTD_DICT, 19 }
+	};
+	uint8_t *dict = NULL;
+	size_t dict_size = 0;
+#ifdef UPLINK_ZSTD
+	// Train on the messages of the first half, each one is a sample
+	size_t *sizes = malloc(half * sizeof *sizes);
+	for (size_t i = 0; i < half; i ++)
+		sizes[i] = capture.starts[i + 1] - capture.starts[i];
+	dict = malloc(DICT_SIZE);
+	dict_size = ZDICT_trainFromBuffer(dict, DICT_SIZE, capture.data, sizes, half);
+	free(sizes);
+	if (ZDICT_isError(dict_size)) {
+		fprintf(stderr, "Can't train dictionary: %s\n", ZDICT_getErrorName(dict_size));
+		free(dict);
+		dict = NULL;
+		dict_size = 0;
+	} else
+		printf("Trained dictionary of %zu bytes\n", dict_size);
+#endif
+	for (size_t i = 0; i < sizeof setups / sizeof *setups; i ++) {
+		if (!codec_supported(setups[i].type) || (setups[i].type == CODEC_ZSTD_DICT && !dict))
+			continue;
+		bench(&capture, half, batch, &setups[i], dict, dict_size);
+	}
+	free(dict);
+	free(capture.starts);
+	free(capture.data);
+	return 0;
+}
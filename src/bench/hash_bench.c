@@ -0,0 +1,233 @@
+/*
+    Ucollect - small utility for real-time analysis of network data
+    Copyright (C) 2015 CZ.NIC, z.s.p.o. (http://www.nic.cz/)
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+/*
+ * Compare the fixed-key hash table (hash_table.h) with the tries on 5-tuple
+ * keys, like the ones of the flow plugin. Usage: hash_bench [max key count].
+ *
+ * The sets have 10^4, 10^5, ... up to the max (10^6 by default) keys. For each
+ * of them it reports the time to index all the keys, to look up existing and
+ * missing keys, to delete all the keys and the memory used per key.
+ *
+ * At the end, it keeps a small number of keys alive while inserting and
+ * deleting many others and checks the memory pool of the hash table doesn't
+ * grow once warmed up.
+ */
+
+#include "trie_impl.h"
+#include "keys.h"
+
+#include "../core/mem_pool.h"
+#include "../core/util.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+
+#define TUPLE_SIZE 14
+
+struct tuple {
+	uint8_t data[TUPLE_SIZE];
+};
+
+#define HASH_KEY struct tuple
+#define HASH_VALUE struct trie_data *
+#define HASH_NAME(X) tuple_##X
+#include "../core/hash_table.h"
+
+// The data pointers only need to be non-NULL
+static int marker_target;
+static struct trie_data *const marker = (struct trie_data *)&marker_target;
+
+struct result {
+	const char *name;
+	size_t size;
+	uint64_t index_time, hit_time, miss_time, delete_time;
+	size_t allocated;
+};
+
+static void print(const struct result *r, size_t count) {
+	printf("%8zu keys %-5s: index %7.1f ns, hit %7.1f ns, miss %7.1f ns, delete %7.1f ns, %6.1f B/key\n", r->size, r->name,
+			(double)r->index_time / count,
+			(double)r->hit_time / count,
+			(double)r->miss_time / count,
+			(double)r->delete_time / count,
+			(double)r->allocated / r->size);
+}
+
+static struct tuple tuple(const struct keys *keys, size_t i) {
+	struct tuple result;
+	memcpy(result.data, keys->keys[i], TUPLE_SIZE);
+	return result;
+}
+
+static struct result bench_hash(const struct keys *present, const struct keys *missing, const size_t *order) {
+	struct mem_pool *pool = mem_pool_create("Benchmark hash");
+	struct tuple_table *table = tuple_create(pool);
+	struct result result = { .name = "hash" };
+	size_t count = present->count;
+
+	uint64_t start = now_ns();
+	for (size_t i = 0; i < count; i ++) {
+		struct tuple key = tuple(present, i);
+		*tuple_index(table, &key, NULL) = marker;
+	}
+	result.index_time = now_ns() - start;
+	result.size = tuple_size(table);
+
+	start = now_ns();
+	for (size_t i = 0; i < count; i ++) {
+		struct tuple key = tuple(present, order[i]);
+		struct trie_data **data = tuple_lookup(table, &key);
+		if (!data || *data != marker)
+			die("Lost key %zu in hash\n", order[i]);
+	}
+	result.hit_time = now_ns() - start;
+
+	size_t found = 0;
+	start = now_ns();
+	for (size_t i = 0; i < count; i ++) {
+		struct tuple key = tuple(missing, i);
+		if (tuple_lookup(table, &key))
+			found ++;
+	}
+	result.miss_time = now_ns() - start;
+
+	result.allocated = mem_pool_allocated(pool);
+
+	start = now_ns();
+	for (size_t i = 0; i < count; i ++) {
+		struct tuple key = tuple(present, i);
+		tuple_remove(table, &key);
+	}
+	result.delete_time = now_ns() - start;
+	if (tuple_size(table))
+		die("%zu keys left in hash after delete\n", tuple_size(table));
+	mem_pool_destroy(pool);
+	return result;
+}
+
+static struct result bench_trie(const struct trie_impl *impl, const struct keys *present, const struct keys *missing, const size_t *order) {
+	struct mem_pool *pool = mem_pool_create("Benchmark trie");
+	struct trie *trie = impl->alloc(pool);
+	struct result result = { .name = impl->name };
+	size_t count = present->count;
+
+	uint64_t start = now_ns();
+	for (size_t i = 0; i < count; i ++)
+		*impl->index(trie, present->keys[i], TUPLE_SIZE) = marker;
+	result.index_time = now_ns() - start;
+	result.size = impl->size(trie);
+
+	start = now_ns();
+	for (size_t i = 0; i < count; i ++)
+		if (impl->lookup(trie, present->keys[order[i]], TUPLE_SIZE) != marker)
+			die("Lost key %zu in %s trie\n", order[i], impl->name);
+	result.hit_time = now_ns() - start;
+
+	size_t found = 0;
+	start = now_ns();
+	for (size_t i = 0; i < count; i ++)
+		if (impl->lookup(trie, missing->keys[i], TUPLE_SIZE))
+			found ++;
+	result.miss_time = now_ns() - start;
+
+	result.allocated = mem_pool_allocated(pool);
+
+	start = now_ns();
+	for (size_t i = 0; i < count; i ++)
+		impl->delete(trie, present->keys[i], TUPLE_SIZE);
+	result.delete_time = now_ns() - start;
+	if (impl->size(trie))
+		die("%zu keys left in %s trie after delete\n", impl->size(trie), impl->name);
+	mem_pool_destroy(pool);
+	return result;
+}
+
+#define CHURN_LIVE 1000
+#define CHURN_WARMUP 100000
+#define CHURN_OPS 10000000
+
+static struct tuple churn_key(size_t i) {
+	struct tuple result = { .data = { 0 } };
+	memcpy(result.data, &i, sizeof i);
+	return result;
+}
+
+/*
+ * Insert a new key and delete the oldest one, so there's constant number of
+ * live keys, but the deleted slots keep piling up and the table is rebuilt
+ * again and again at the same size.
+ */
+static void churn(void) {
+	struct mem_pool *pool = mem_pool_create("Benchmark churn");
+	struct tuple_table *table = tuple_create(pool);
+	size_t warm = 0;
+	uint64_t start = now_ns();
+	for (size_t i = 0; i < CHURN_OPS; i ++) {
+		struct tuple key = churn_key(i);
+		*tuple_index(table, &key, NULL) = marker;
+		if (i >= CHURN_LIVE) {
+			key = churn_key(i - CHURN_LIVE);
+			if (!tuple_remove(table, &key))
+				die("Lost key %zu in churn\n", i - CHURN_LIVE);
+		}
+		if (i == CHURN_WARMUP)
+			warm = mem_pool_allocated(pool);
+	}
+	uint64_t time = now_ns() - start;
+	size_t allocated = mem_pool_allocated(pool);
+	printf("%8d live keys churn: %7.1f ns per insert+delete, %zu B after warm-up, %zu B at the end\n", CHURN_LIVE, (double)time / CHURN_OPS, warm, allocated);
+	if (tuple_size(table) != CHURN_LIVE)
+		die("%zu keys in hash after churn, expected %d\n", tuple_size(table), CHURN_LIVE);
+	if (allocated > warm)
+		die("Hash table pool grew from %zu to %zu during churn\n", warm, allocated);
+	mem_pool_destroy(pool);
+}
+
+int main(int argc, const char *argv[]) {
+	size_t max = 1000000;
+	if (argc > 1) {
+		char *end;
+		max = strtoull(argv[1], &end, 10);
+		if (!*argv[1] || *end || max < 10000)
+			die("Invalid key count %s (at least 10000)\n", argv[1]);
+	}
+	for (size_t count = 10000; count <= max; count *= 10) {
+		struct keys present = keys_gen(count, gen_tuple);
+		struct keys missing = keys_gen(count, gen_tuple);
+		size_t *order = malloc(count * sizeof *order);
+		if (!order)
+			die("Not enough memory for %zu lookups\n", count);
+		for (size_t i = 0; i < count; i ++)
+			order[i] = rnd() % count;
+		struct result result = bench_hash(&present, &missing, order);
+		print(&result, count);
+		result = bench_trie(&trie_impl_list, &present, &missing, order);
+		print(&result, count);
+		result = bench_trie(&trie_impl_art, &present, &missing, order);
+		print(&result, count);
+		free(order);
+		keys_free(&present);
+		keys_free(&missing);
+	}
+	churn();
+	return 0;
+}
@@ -0,0 +1,51 @@
+/*
+    Ucollect - small utility for real-time analysis of network data
+    Copyright (C) 2015 CZ.NIC, z.s.p.o. (http://www.nic.cz/)
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+// The original linked-list splay trie, with its functions renamed.
+
+// Don't measure the debug logging
+#undef MAX_LOG_LEVEL
+#define MAX_LOG_LEVEL LLOG_WARN
+
+#define trie_alloc list_trie_alloc
+#define trie_index list_trie_index
+#define trie_lookup list_trie_lookup
+#define trie_size list_trie_size
+#define trie_delete list_trie_delete
+#define trie_walk list_trie_walk
+#define trie_iter_create list_trie_iter_create
+#define trie_iter_next list_trie_iter_next
+#define trie_iter_resume list_trie_iter_resume
+
+#include "../core/trie.c"
+
+#include "trie_impl.h"
+
+const struct trie_impl trie_impl_list = {
+	.name = "list",
+	.alloc = list_trie_alloc,
+	.index = list_trie_index,
+	.lookup = list_trie_lookup,
+	.size = list_trie_size,
+	.delete = list_trie_delete,
+	.walk = list_trie_walk,
+	.iter_create = list_trie_iter_create,
+	.iter_next = list_trie_iter_next,
+	.iter_resume = list_trie_iter_resume
+};
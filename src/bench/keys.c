@@ -0,0 +1,125 @@
+/*
+    Ucollect - small utility for real-time analysis of network data
+    Copyright (C) 2015 CZ.NIC, z.s.p.o. (http://www.nic.cz/)
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#include "keys.h"
+
+#include "../core/util.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+static uint64_t rnd_state = 0x2545F4914F6CDD1DULL;
+
+// Xorshift, deterministic so the runs are comparable
+uint64_t rnd(void) {
+	rnd_state ^= rnd_state << 13;
+	rnd_state ^= rnd_state >> 7;
+	rnd_state ^= rnd_state << 17;
+	return rnd_state;
+}
+
+// A remote IPv4 address. Most of the traffic goes to few big networks.
+static void remote_v4(uint8_t *dest) {
+	uint32_t addr = rnd();
+	if (rnd() % 100 < 70) {
+		// One of 64 popular /16 networks
+		uint32_t net = 0x08080000 + (uint32_t)(rnd() % 64) * 0x01230000;
+		addr = net | (addr & 0xFFFF);
+	}
+	for (size_t i = 0; i < 4; i ++)
+		dest[i] = addr >> (24 - 8 * i);
+}
+
+// A remote IPv6 address from one of few /48 networks, with random interface ID
+static void remote_v6(uint8_t *dest) {
+	static const uint8_t prefix[] = { 0x20, 0x01, 0x0d, 0xb8 };
+	memcpy(dest, prefix, sizeof prefix);
+	dest[4] = 0;
+	dest[5] = rnd() % 32;
+	for (size_t i = 6; i < 16; i ++)
+		dest[i] = rnd();
+}
+
+size_t gen_v4(uint8_t *key) {
+	remote_v4(key);
+	return 4;
+}
+
+size_t gen_v6(uint8_t *key) {
+	remote_v6(key);
+	return 16;
+}
+
+size_t gen_addr_port(uint8_t *key) {
+	remote_v4(key);
+	uint16_t port = rnd() % 4 ? 443 : rnd();
+	memcpy(key + 4, &port, sizeof port);
+	return 4 + sizeof port;
+}
+
+// The same layout as flow_key in the flow plugin
+size_t gen_tuple(uint8_t *key) {
+	static const uint16_t ports[] = { 80, 443, 53, 22, 123, 993 };
+	uint8_t *pos = key;
+	*pos ++ = '4';
+	*pos ++ = rnd() % 4 ? 'T' : 'U';
+	// Few local machines
+	const uint8_t local[] = { 192, 168, 1, 2 + rnd() % 16 };
+	memcpy(pos, local, sizeof local);
+	pos += sizeof local;
+	remote_v4(pos);
+	pos += 4;
+	uint16_t local_port = 32768 + rnd() % 28232;
+	uint16_t remote_port = rnd() % 8 ? ports[rnd() % (sizeof ports / sizeof *ports)] : rnd();
+	memcpy(pos, &local_port, sizeof local_port);
+	pos += sizeof local_port;
+	memcpy(pos, &remote_port, sizeof remote_port);
+	pos += sizeof remote_port;
+	return pos - key;
+}
+
+struct keys keys_alloc(size_t count) {
+	struct keys result = {
+		.count = count,
+		.keys = malloc(count * sizeof *result.keys),
+		.sizes = malloc(count * sizeof *result.sizes)
+	};
+	if (!result.keys || !result.sizes)
+		die("Not enough memory for %zu keys\n", count);
+	return result;
+}
+
+struct keys keys_gen(size_t count, size_t (*gen)(uint8_t *key)) {
+	struct keys result = keys_alloc(count);
+	for (size_t i = 0; i < count; i ++)
+		result.sizes[i] = gen(result.keys[i]);
+	return result;
+}
+
+void keys_free(struct keys *keys) {
+	free(keys->keys);
+	free(keys->sizes);
+}
+
+uint64_t now_ns(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
@@ -0,0 +1,51 @@
+/*
+    Ucollect - small utility for real-time analysis of network data
+    Copyright (C) 2015 CZ.NIC, z.s.p.o. (http://www.nic.cz/)
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#ifndef UCOLLECT_BENCH_KEYS_H
+#define UCOLLECT_BENCH_KEYS_H
+
+/*
+ * Key sets resembling what the plugins store, shared by the benchmarks. The
+ * random generator is deterministic, so the runs are comparable.
+ */
+
+#include <stdint.h>
+#include <stdlib.h>
+
+#define KEY_MAX 38
+
+struct keys {
+	size_t count;
+	uint8_t (*keys)[KEY_MAX];
+	size_t *sizes;
+};
+
+uint64_t rnd(void);
+// Generators of a single key, returning its size
+size_t gen_v4(uint8_t *key);
+size_t gen_v6(uint8_t *key);
+size_t gen_addr_port(uint8_t *key); // IPv4 address and port
+size_t gen_tuple(uint8_t *key); // The same layout as flow_key in the flow plugin
+// Space for count keys, not filled in
+struct keys keys_alloc(size_t count);
+struct keys keys_gen(size_t count, size_t (*gen)(uint8_t *key));
+void keys_free(struct keys *keys);
+uint64_t now_ns(void);
+
+#endif
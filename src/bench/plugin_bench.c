@@ -0,0 +1,207 @@
+/*
+    Ucollect - small utility for real-time analysis of network data
+    Copyright (C) 2015 CZ.NIC, z.s.p.o. (http://www.nic.cz/)
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+/*
+ * Measure the packet path of the plugins. Usage:
+ * plugin_bench [packets [plugin ...]].
+ *
+ * It creates a loop with an (unconnected) uplink, loads the plugins
+ * (libplugin_count.so, libplugin_bandwidth.so and libplugin_majordomo.so by
+ * default) the same way ucollect does and passes generated packets to them
+ * through the core, in batches of MAX_PACKETS like a PCAP read. The packets
+ * (10 million by default) are Ethernet frames with IPv4 and IPv6, TCP and UDP
+ * in 4096 flows, half of them in each direction.
+ *
+ * The same packets go through the loop first without any plugins (only the
+ * parsing and dispatch), then with the plugins. It reports the nanoseconds
+ * per packet for both and the difference, which is the time spent in the
+ * plugins and the calls between them and the core.
+ *
+ * When ucollect is built with STATIC=1, this links the plugins in too (see
+ * src/Makefile.dir), so it measures both builds.
+ */
+
+#include "../core/loop.h"
+#include "../core/uplink.h"
+#include "../core/tunable.h"
+#include "../core/util.h"
+
+#include <pcap/pcap.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <time.h>
+
+#define FLOWS 4096
+// The captured part of each frame, like a short snaplen
+#define CAPLEN 128
+#define ETH_LEN 14
+
+static uint64_t rnd_state = 42;
+
+static uint64_t rnd(void) {
+	// xorshift64*, good enough for the traffic
+	rnd_state ^= rnd_state >> 12;
+	rnd_state ^= rnd_state << 25;
+	rnd_state ^= rnd_state >> 27;
+	return rnd_state * 2685821657736338717ULL;
+}
+
+static uint64_t now_ns(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+struct frame {
+	unsigned char data[CAPLEN];
+	uint32_t len;
+	bool in;
+};
+
+static void put16(unsigned char *where, uint16_t value) {
+	where[0] = value >> 8;
+	where[1] = value;
+}
+
+// One frame of the flow, with the addresses and ports swapped if it comes in
+static void frame_make(struct frame *frame, size_t flow) {
+	memset(frame, 0, sizeof *frame);
+	unsigned char *data = frame->data;
+	frame->in = rnd() % 2;
+	frame->len = 80 + rnd() % 1434;
+	bool v6 = flow % 4 == 0;
+	bool tcp = flow % 3 != 0;
+	unsigned char local[16] = { 0xfd, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, flow % 8 }, remote[16];
+	for (size_t i = 0; i < sizeof remote; i ++)
+		remote[i] = ((flow * 2654435761U) >> (8 * (i % 4))) ^ i;
+	uint16_t local_port = 32768 + flow, remote_port = tcp ? 443 : 53;
+	const unsigned char *src = frame->in ? remote : local, *dst = frame->in ? local : remote;
+	uint16_t src_port = frame->in ? remote_port : local_port, dst_port = frame->in ? local_port : remote_port;
+	// Ethernet: the MAC addresses and the ethertype
+	memset(data, 0x02, 12);
+	put16(data + 12, v6 ? 0x86DD : 0x0800);
+	unsigned char *ip = data + ETH_LEN, *l4;
+	uint32_t ip_len = frame->len - ETH_LEN;
+	if (v6) {
+		ip[0] = 0x60;
+		put16(ip + 4, ip_len - 40);
+		ip[6] = tcp ? 6 : 17;
+		ip[7] = 64;
+		memcpy(ip + 8, src, 16);
+		memcpy(ip + 24, dst, 16);
+		l4 = ip + 40;
+	} else {
+		ip[0] = 0x45;
+		put16(ip + 2, ip_len);
+		ip[8] = 64;
+		ip[9] = tcp ? 6 : 17;
+		memcpy(ip + 12, src + 12, 4);
+		memcpy(ip + 16, dst + 12, 4);
+		l4 = ip + 20;
+	}
+	put16(l4, src_port);
+	put16(l4 + 2, dst_port);
+	if (tcp) {
+		l4[12] = 0x50;
+		l4[13] = rnd() % 8 == 0 ? 0x02 : 0x10; // A SYN sometimes, ACK otherwise
+	} else
+		put16(l4 + 4, ip_len - (l4 - ip));
+}
+
+static struct frame *traffic_make(size_t count) {
+	struct frame *frames = malloc(count * sizeof *frames);
+	if (!frames)
+		die("Not enough memory for %zu frames\n", count);
+	for (size_t i = 0; i < count; i ++)
+		frame_make(&frames[i], rnd() % FLOWS);
+	return frames;
+}
+
+// Feed the frames to the loop and return the nanoseconds per packet
+static double run(struct loop *loop, const struct frame *frames, size_t count, size_t packets) {
+	struct pcap_pkthdr headers[MAX_PACKETS];
+	const unsigned char *data[MAX_PACKETS];
+	uint64_t start = now_ns();
+	size_t pos = 0;
+	for (size_t done = 0; done < packets;) {
+		// The batch goes to one direction, like a PCAP read from one of the sub-interfaces
+		bool in = frames[pos].in;
+		size_t batch = 0;
+		while (batch < MAX_PACKETS && done + batch < packets) {
+			const struct frame *frame = &frames[pos];
+			pos = (pos + 1) % count;
+			if (frame->in != in)
+				continue;
+			uint64_t time = done + batch;
+			headers[batch] = (struct pcap_pkthdr) {
+				.ts = {
+					.tv_sec = time / 1000000,
+					.tv_usec = time % 1000000
+				},
+				.caplen = frame->len < CAPLEN ? frame->len : CAPLEN,
+				.len = frame->len
+			};
+			data[batch ++] = frame->data;
+		}
+		loop_packets_inject(loop, "bench", in, DLT_EN10MB, batch, headers, data);
+		done += batch;
+	}
+	return (double)(now_ns() - start) / packets;
+}
+
+int main(int argc, const char *argv[]) {
+	size_t packets = 10000000;
+	if (argc > 1) {
+		char *end;
+		packets = strtoull(argv[1], &end, 10);
+		if (!*argv[1] || *end || !packets)
+			die("Usage: %s [packets [plugin ...]]\n", argv[0]);
+	}
+	static const char *default_plugins[] = { "libplugin_count.so", "libplugin_bandwidth.so", "libplugin_majordomo.so" };
+	const char *const *plugins = argc > 2 ? argv + 2 : default_plugins;
+	size_t plugin_count = argc > 2 ? (size_t)argc - 2 : sizeof default_plugins / sizeof *default_plugins;
+	// Many different frames, so they don't all stay in the caches
+	size_t count = 1 << 16;
+	struct frame *frames = traffic_make(count);
+	struct loop *loop = loop_create();
+	uplink_create(loop);
+	// Warm up the caches and the pools first
+	run(loop, frames, count, count);
+	double bare = run(loop, frames, count, packets);
+	struct loop_configurator *configurator = loop_config_start(loop);
+	for (size_t i = 0; i < plugin_count; i ++) {
+		// The config section of a plugin always has at least this one
+		loop_set_plugin_opt(configurator, "libname", plugins[i]);
+		if (!loop_add_plugin(configurator, plugins[i]))
+			die("Can't load plugin %s\n", plugins[i]);
+	}
+	loop_config_commit(configurator);
+	run(loop, frames, count, count);
+	double full = run(loop, frames, count, packets);
+	printf("%zu packets, %zu plugins\n", packets, plugin_count);
+	printf("core only:    %6.1f ns/packet\n", bare);
+	printf("with plugins: %6.1f ns/packet\n", full);
+	printf("plugins:      %6.1f ns/packet\n", full - bare);
+	loop_destroy(loop);
+	free(frames);
+	return 0;
+}
@@ -0,0 +1,318 @@
+/*
+    Ucollect - small utility for real-time analysis of network data
+    Copyright (C) 2015 CZ.NIC, z.s.p.o. (http://www.nic.cz/)
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+/*
+ * Check and measure the spool of the uplink. Usage:
+ * spool_bench [file] [rounds].
+ *
+ * The file (/tmp/spool_bench by default) is created and removed afterwards.
+ * First it checks the behaviour the uplink relies on and dies on the first
+ * difference:
+ * - The records come out in order and with the same data, while the ring
+ *   wraps many times (the sizes vary, so the wrap happens at various
+ *   places).
+ * - Rewind returns the taken but not acknowledged records again and
+ *   acknowledgement drops only the ones up to the sequence number.
+ * - A discarded record is dropped once the ones before it are acknowledged,
+ *   even if it is the last one.
+ * - Reopening keeps the records, while a corrupted header or record and
+ *   a change of size drop them.
+ *
+ * Then it fills the spool and empties it in rounds (1000 by default) the
+ * way the uplink does while disconnected and then replaying, and reports the
+ * rate of appends and of taking and acknowledging records.
+ */
+
+#include "../core/spool.h"
+#include "../core/mem_pool.h"
+#include "../core/util.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <errno.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#define SPOOL_SIZE (256 * 1024)
+// The records have 1 to RECORD_MAX bytes
+#define RECORD_MAX 2048
+// Offsets in the file, from the layout in core/spool.c
+#define HEADER_END_OFFSET 24
+#define FIRST_RECORD_SIZE_OFFSET (48 + 4)
+
+static uint64_t rnd_state = 42;
+
+static uint64_t rnd(void) {
+	// xorshift64*, good enough for the sizes
+	rnd_state ^= rnd_state >> 12;
+	rnd_state ^= rnd_state << 25;
+	rnd_state ^= rnd_state >> 27;
+	return rnd_state * 2685821657736338717ULL;
+}
+
+static uint64_t now_ns(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+// The content of a record is given by its sequence number and size
+static void record_fill(uint8_t *data, uint32_t seq, size_t size) {
+	for (size_t i = 0; i < size; i ++)
+		data[i] = seq * 31 + i;
+}
+
+static size_t record_size(uint32_t seq) {
+	return 1 + (seq * 2654435761U) % RECORD_MAX;
+}
+
+static bool append(struct spool *spool, uint32_t seq) {
+	uint8_t data[RECORD_MAX];
+	size_t size = record_size(seq);
+	record_fill(data, seq, size);
+	return spool_append(spool, data, size);
+}
+
+// Take the next record and check it is the expected one
+static void take(struct spool *spool, uint32_t expected) {
+	uint32_t seq;
+	uint64_t when;
+	size_t size;
+	const uint8_t *data = spool_next(spool, &seq, &when, &size);
+	if (!data)
+		die("Record %u missing\n", (unsigned)expected);
+	if (seq != expected)
+		die("Got record %u instead of %u\n", (unsigned)seq, (unsigned)expected);
+	uint8_t buffer[RECORD_MAX];
+	if (size != record_size(seq))
+		die("Record %u has %zu bytes instead of %zu\n", (unsigned)seq, size, record_size(seq));
+	record_fill(buffer, seq, size);
+	if (memcmp(buffer, data, size) != 0)
+		die("Record %u has different data\n", (unsigned)seq);
+	spool_advance(spool);
+}
+
+static void expect_count(const struct spool *spool, size_t count, const char *when) {
+	if (spool_count(spool) != count)
+		die("%zu records %s, expected %zu\n", spool_count(spool), when, count);
+}
+
+static void file_corrupt(const char *path, off_t offset) {
+	int fd = open(path, O_WRONLY);
+	if (fd == -1)
+		die("Can't open %s: %s\n", path, strerror(errno));
+	const uint8_t garbage[8] = { 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0x7f };
+	if (pwrite(fd, garbage, sizeof garbage, offset) != sizeof garbage)
+		die("Can't write %s: %s\n", path, strerror(errno));
+	close(fd);
+}
+
+static struct spool *reopen(struct spool *spool, struct mem_pool *pool, const char *path, size_t size) {
+	if (spool)
+		spool_close(spool);
+	struct spool *result = spool_open(pool, path, size);
+	if (!result)
+		die("Can't open spool %s\n", path);
+	return result;
+}
+
+// The records come out the same and in order while the ring wraps
+static uint32_t check_wrap(struct spool *spool, uint32_t seq) {
+	uint32_t first = seq;
+	size_t bytes = 0;
+	while (bytes < 20 * SPOOL_SIZE) {
+		// Keep a random number of records in there, so the wrap moves
+		size_t keep = rnd() % 64;
+		while (append(spool, seq)) {
+			bytes += record_size(seq);
+			seq ++;
+		}
+		while (spool_count(spool) > keep) {
+			take(spool, first);
+			if (spool_ack(spool, first) != 1)
+				die("Acknowledging record %u didn't drop one\n", (unsigned)first);
+			first ++;
+		}
+	}
+	while (spool_pending(spool))
+		take(spool, first ++);
+	spool_ack(spool, first - 1);
+	expect_count(spool, 0, "after wrapping");
+	return seq;
+}
+
+static uint32_t check_rewind(struct spool *spool, uint32_t seq) {
+	for (size_t i = 0; i < 10; i ++)
+		if (!append(spool, seq + i))
+			die("Record %zu doesn't fit into empty spool\n", i);
+	for (size_t i = 0; i < 6; i ++)
+		take(spool, seq + i);
+	// Acknowledges only up to the one given, the rest is taken again after rewind
+	if (spool_ack(spool, seq + 2) != 3)
+		die("Acknowledgement dropped wrong number of records\n");
+	spool_rewind(spool);
+	for (size_t i = 3; i < 10; i ++)
+		take(spool, seq + i);
+	if (spool_pending(spool))
+		die("Records left after the last one\n");
+	// An old acknowledgement drops nothing
+	if (spool_ack(spool, seq))
+		die("Repeated acknowledgement dropped records\n");
+	spool_ack(spool, seq + 9);
+	expect_count(spool, 0, "after rewind");
+	return seq + 10;
+}
+
+static uint32_t check_discard(struct spool *spool, uint32_t seq) {
+	for (size_t i = 0; i < 4; i ++)
+		append(spool, seq + i);
+	take(spool, seq);
+	// Discarded between records waiting for acknowledgement
+	spool_discard(spool);
+	take(spool, seq + 2);
+	// The last one discarded, nothing after it would acknowledge it
+	spool_discard(spool);
+	expect_count(spool, 4, "before acknowledgement");
+	if (spool_ack(spool, seq) != 2)
+		die("Acknowledgement didn't drop the discarded record after it\n");
+	if (spool_ack(spool, seq + 2) != 2)
+		die("Acknowledgement didn't drop the last discarded record\n");
+	expect_count(spool, 0, "after discarding");
+	// A discarded one with nothing before it goes right away
+	append(spool, seq + 4);
+	spool_discard(spool);
+	expect_count(spool, 0, "after discarding the only one");
+	return seq + 5;
+}
+
+// Fill the spool so the records wrap (a half of them is taken out in between)
+static uint32_t fill_wrapped(struct spool *spool, uint32_t *first, uint32_t seq) {
+	while (append(spool, seq))
+		seq ++;
+	size_t half = spool_count(spool) / 2;
+	for (size_t i = 0; i < half; i ++) {
+		take(spool, *first);
+		spool_ack(spool, (*first) ++);
+	}
+	while (append(spool, seq))
+		seq ++;
+	return seq;
+}
+
+static struct spool *check_validation(struct spool *spool, struct mem_pool *pool, const char *path, uint32_t seq) {
+	uint32_t first = seq;
+	for (size_t i = 0; i < 3; i ++) {
+		seq = fill_wrapped(spool, &first, seq);
+		size_t count = spool_count(spool);
+		spool = reopen(spool, pool, path, SPOOL_SIZE);
+		expect_count(spool, count, "after reopening");
+		for (uint32_t j = first; j != seq; j ++)
+			take(spool, j);
+		spool_rewind(spool);
+		switch (i) {
+			case 0:
+				file_corrupt(path, HEADER_END_OFFSET);
+				spool = reopen(spool, pool, path, SPOOL_SIZE);
+				break;
+			case 1:
+				// The start of the data area holds one of the wrapped records
+				file_corrupt(path, FIRST_RECORD_SIZE_OFFSET);
+				spool = reopen(spool, pool, path, SPOOL_SIZE);
+				break;
+			case 2:
+				spool = reopen(spool, pool, path, SPOOL_SIZE / 2);
+				expect_count(spool, 0, "after resizing");
+				spool = reopen(spool, pool, path, SPOOL_SIZE);
+				break;
+		}
+		expect_count(spool, 0, "after corruption");
+		// The sequence continues
+		first = seq;
+		append(spool, seq ++);
+		take(spool, first);
+		spool_ack(spool, first ++);
+	}
+	return spool;
+}
+
+static void bench(struct spool *spool, size_t rounds) {
+	uint64_t append_time = 0, take_time = 0;
+	size_t records = 0, bytes = 0;
+	uint8_t data[RECORD_MAX];
+	memset(data, 0x42, sizeof data);
+	for (size_t i = 0; i < rounds; i ++) {
+		// Messages of typical sizes, until the spool is full
+		uint64_t start = now_ns();
+		for (;;) {
+			size_t size = 64 + rnd() % 1024;
+			if (!spool_append(spool, data, size))
+				break;
+			records ++;
+			bytes += size;
+		}
+		uint64_t middle = now_ns();
+		// Replay them, acknowledging in batches like the server replies come
+		uint32_t seq = 0;
+		size_t batch = 0, size;
+		uint64_t when;
+		while (spool_next(spool, &seq, &when, &size)) {
+			spool_advance(spool);
+			if (++ batch == 64) {
+				spool_ack(spool, seq);
+				batch = 0;
+			}
+		}
+		spool_ack(spool, seq);
+		take_time += now_ns() - middle;
+		append_time += middle - start;
+	}
+	printf("%zu records of %zu bytes on average, %zu rounds\n", records, bytes / records, rounds);
+	printf("append: %6.2f M/s %8.1f MB/s\n", (double)records * 1000 / append_time, (double)bytes * 1000 / append_time);
+	printf("take:   %6.2f M/s %8.1f MB/s\n", (double)records * 1000 / take_time, (double)bytes * 1000 / take_time);
+}
+
+int main(int argc, const char *argv[]) {
+	if (argc > 3)
+		die("Usage: %s [file] [rounds]\n", argv[0]);
+	const char *path = argc > 1 ? argv[1] : "/tmp/spool_bench";
+	size_t rounds = 1000;
+	if (argc > 2) {
+		char *end;
+		rounds = strtoull(argv[2], &end, 10);
+		if (!*argv[2] || *end || !rounds)
+			die("Invalid rounds %s\n", argv[2]);
+	}
+	unlink(path);
+	struct mem_pool *pool = mem_pool_create("Spool bench");
+	struct spool *spool = reopen(NULL, pool, path, SPOOL_SIZE);
+	uint32_t seq = 0;
+	seq = check_wrap(spool, seq);
+	seq = check_rewind(spool, seq);
+	seq = check_discard(spool, seq);
+	spool = check_validation(spool, pool, path, seq);
+	printf("Checks passed\n");
+	bench(spool, rounds);
+	spool_close(spool);
+	mem_pool_destroy(pool);
+	unlink(path);
+	return 0;
+}
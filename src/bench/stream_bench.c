@@ -0,0 +1,308 @@
+/*
+    Ucollect - small utility for real-time analysis of network data
+    Copyright (C) 2015 CZ.NIC, z.s.p.o. (http://www.nic.cz/)
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+/*
+ * Replay streams of keys with different access patterns against the
+ * structures in core. Usage: stream_bench [event count].
+ *
+ * There are streams of IPv4 and IPv6 addresses, address+port pairs and
+ * 5-tuples, each with these distributions:
+ * - uniform: Each event picks one key of the population at random.
+ * - zipf: The key of rank k is picked with probability proportional to 1/k,
+ *   so few busy connections get most of the packets.
+ * - scan: One source probing many destinations, each event is a new key.
+ *
+ * Each event is first indexed (creating the key if it is new, like the plugins
+ * do with packets), then the same stream is replayed by lookups only. It
+ * reports the rates of both, the throughput of walking the result and the
+ * memory used per key. The frozen trie has no index and walk, it is built from
+ * the result and looked up only.
+ */
+
+#include "trie_impl.h"
+#include "keys.h"
+
+#include "../core/trie.h"
+#include "../core/trie_frozen.h"
+#include "../core/mem_pool.h"
+#include "../core/util.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+
+// How many events there are for each key of the population (in the uniform and zipf streams)
+#define EVENTS_PER_KEY 8
+// All the key types fit in, shorter keys are padded by zeroes
+#define HASH_KEY_SIZE 16
+
+struct hash_key {
+	uint8_t data[HASH_KEY_SIZE];
+};
+
+#define HASH_KEY struct hash_key
+#define HASH_VALUE struct trie_data *
+#define HASH_NAME(X) key_##X
+#include "../core/hash_table.h"
+
+// The data pointers only need to be non-NULL
+static int marker_target;
+static struct trie_data *const marker = (struct trie_data *)&marker_target;
+
+struct key_type {
+	const char *name;
+	size_t (*gen)(uint8_t *key);
+	// The part of the key that changes during a scan (taken as big endian number)
+	size_t dest_offset, dest_size;
+};
+
+struct result {
+	const char *name;
+	size_t size;
+	uint64_t index_time, lookup_time, walk_time;
+	size_t allocated;
+};
+
+static double rate(size_t count, uint64_t time) {
+	return time ? (double)count * 1000 / time : 0;
+}
+
+static void print(const char *type, const char *dist, const struct result *r, size_t events) {
+	char index[16] = "     -", walk[16] = "     -";
+	if (r->index_time)
+		snprintf(index, sizeof index, "%6.2f", rate(events, r->index_time));
+	if (r->walk_time)
+		snprintf(walk, sizeof walk, "%6.2f", rate(r->size, r->walk_time));
+	printf("%-9s %-7s %-6s %8zu keys: index %s M/s, lookup %6.2f M/s, walk %s Mkeys/s, %6.1f B/key\n", type, dist, r->name, r->size,
+			index, rate(events, r->lookup_time), walk, (double)r->allocated / r->size);
+}
+
+static struct keys stream_uniform(const struct keys *population, size_t events) {
+	struct keys result = keys_alloc(events);
+	for (size_t i = 0; i < events; i ++) {
+		size_t k = rnd() % population->count;
+		memcpy(result.keys[i], population->keys[k], KEY_MAX);
+		result.sizes[i] = population->sizes[k];
+	}
+	return result;
+}
+
+static struct keys stream_zipf(const struct keys *population, size_t events) {
+	size_t count = population->count;
+	double *cdf = malloc(count * sizeof *cdf);
+	if (!cdf)
+		die("Not enough memory for zipf distribution of %zu keys\n", count);
+	double sum = 0;
+	for (size_t i = 0; i < count; i ++)
+		cdf[i] = sum += 1.0 / (i + 1);
+	struct keys result = keys_alloc(events);
+	for (size_t i = 0; i < events; i ++) {
+		double point = (double)(rnd() >> 11) / (1ULL << 53) * sum;
+		// The first rank with cdf above the point
+		size_t low = 0, high = count - 1;
+		while (low < high) {
+			size_t mid = (low + high) / 2;
+			if (cdf[mid] <= point)
+				low = mid + 1;
+			else
+				high = mid;
+		}
+		memcpy(result.keys[i], population->keys[low], KEY_MAX);
+		result.sizes[i] = population->sizes[low];
+	}
+	free(cdf);
+	return result;
+}
+
+static struct keys stream_scan(const struct key_type *type, size_t events) {
+	struct keys result = keys_alloc(events);
+	uint8_t source[KEY_MAX];
+	size_t size = type->gen(source);
+	for (size_t i = 0; i < events; i ++) {
+		memcpy(result.keys[i], source, KEY_MAX);
+		result.sizes[i] = size;
+		// Add i to the destination
+		uint64_t carry = i;
+		for (size_t b = type->dest_offset + type->dest_size; carry && b > type->dest_offset; b --) {
+			carry += result.keys[i][b - 1];
+			result.keys[i][b - 1] = carry;
+			carry >>= 8;
+		}
+	}
+	return result;
+}
+
+static void walk_count(const uint8_t *key, size_t key_size, struct trie_data *data, void *userdata) {
+	(void)key;
+	(void)key_size;
+	(void)data;
+	(*(size_t *)userdata) ++;
+}
+
+static struct result bench_trie(const struct trie_impl *impl, const struct keys *stream) {
+	struct mem_pool *pool = mem_pool_create("Benchmark trie");
+	struct mem_pool *temp_pool = mem_pool_create("Benchmark temp");
+	struct trie *trie = impl->alloc(pool);
+	struct result result = { .name = impl->name };
+
+	uint64_t start = now_ns();
+	for (size_t i = 0; i < stream->count; i ++) {
+		struct trie_data **data = impl->index(trie, stream->keys[i], stream->sizes[i]);
+		if (!*data)
+			*data = marker;
+	}
+	result.index_time = now_ns() - start;
+	result.size = impl->size(trie);
+	result.allocated = mem_pool_allocated(pool);
+
+	start = now_ns();
+	for (size_t i = 0; i < stream->count; i ++)
+		if (impl->lookup(trie, stream->keys[i], stream->sizes[i]) != marker)
+			die("Lost key %zu in %s trie\n", i, impl->name);
+	result.lookup_time = now_ns() - start;
+
+	size_t walked = 0;
+	start = now_ns();
+	impl->walk(trie, walk_count, &walked, temp_pool);
+	result.walk_time = now_ns() - start;
+	if (walked != result.size)
+		die("Walk of %s trie found %zu keys out of %zu\n", impl->name, walked, result.size);
+
+	mem_pool_destroy(temp_pool);
+	mem_pool_destroy(pool);
+	return result;
+}
+
+static struct hash_key hash_key(const struct keys *keys, size_t i) {
+	struct hash_key result = { .data = { 0 } };
+	memcpy(result.data, keys->keys[i], keys->sizes[i]);
+	return result;
+}
+
+static void hash_walk_count(const struct hash_key *key, struct trie_data **value, void *userdata) {
+	(void)key;
+	(void)value;
+	(*(size_t *)userdata) ++;
+}
+
+static struct result bench_hash(const struct keys *stream) {
+	struct mem_pool *pool = mem_pool_create("Benchmark hash");
+	struct key_table *table = key_create(pool);
+	struct result result = { .name = "hash" };
+
+	uint64_t start = now_ns();
+	for (size_t i = 0; i < stream->count; i ++) {
+		struct hash_key key = hash_key(stream, i);
+		*key_index(table, &key, NULL) = marker;
+	}
+	result.index_time = now_ns() - start;
+	result.size = key_size(table);
+	result.allocated = mem_pool_allocated(pool);
+
+	start = now_ns();
+	for (size_t i = 0; i < stream->count; i ++) {
+		struct hash_key key = hash_key(stream, i);
+		struct trie_data **data = key_lookup(table, &key);
+		if (!data || *data != marker)
+			die("Lost key %zu in hash\n", i);
+	}
+	result.lookup_time = now_ns() - start;
+
+	size_t walked = 0;
+	start = now_ns();
+	key_walk(table, hash_walk_count, &walked);
+	result.walk_time = now_ns() - start;
+	if (walked != result.size)
+		die("Walk of hash found %zu keys out of %zu\n", walked, result.size);
+
+	mem_pool_destroy(pool);
+	return result;
+}
+
+static struct result bench_frozen(const struct keys *stream) {
+	struct mem_pool *build_pool = mem_pool_create("Benchmark frozen source");
+	struct mem_pool *pool = mem_pool_create("Benchmark frozen");
+	struct trie *trie = trie_alloc(build_pool);
+	for (size_t i = 0; i < stream->count; i ++)
+		*trie_index(trie, stream->keys[i], stream->sizes[i]) = marker;
+	struct trie_frozen *frozen = trie_freeze(trie, pool);
+	mem_pool_destroy(build_pool);
+	struct result result = {
+		.name = "frozen",
+		.size = trie_frozen_size(frozen),
+		.allocated = mem_pool_allocated(pool)
+	};
+
+	uint64_t start = now_ns();
+	for (size_t i = 0; i < stream->count; i ++)
+		if (trie_frozen_lookup(frozen, stream->keys[i], stream->sizes[i]) != marker)
+			die("Lost key %zu in frozen trie\n", i);
+	result.lookup_time = now_ns() - start;
+
+	mem_pool_destroy(pool);
+	return result;
+}
+
+int main(int argc, const char *argv[]) {
+	size_t events = 1000000;
+	if (argc > 1) {
+		char *end;
+		events = strtoull(argv[1], &end, 10);
+		if (!*argv[1] || *end || events < EVENTS_PER_KEY)
+			die("Invalid event count %s (at least %d)\n", argv[1], EVENTS_PER_KEY);
+	}
+	const struct key_type types[] = {
+		{ "ipv4", gen_v4, 0, 4 },
+		{ "ipv6", gen_v6, 12, 4 },
+		{ "addr+port", gen_addr_port, 0, 6 },
+		{ "tuple", gen_tuple, 6, 4 } // The remote address
+	};
+	const struct trie_impl *impls[] = { &trie_impl_list, &trie_impl_art };
+	for (size_t t = 0; t < sizeof types / sizeof *types; t ++) {
+		const struct key_type *type = &types[t];
+		struct keys population = keys_gen(events / EVENTS_PER_KEY, type->gen);
+		if (population.sizes[0] > HASH_KEY_SIZE)
+			die("Keys of %s don't fit the hash table\n", type->name);
+		struct {
+			const char *name;
+			struct keys stream;
+		} streams[] = {
+			{ "uniform", stream_uniform(&population, events) },
+			{ "zipf", stream_zipf(&population, events) },
+			{ "scan", stream_scan(type, events) }
+		};
+		for (size_t s = 0; s < sizeof streams / sizeof *streams; s ++) {
+			const struct keys *stream = &streams[s].stream;
+			struct result result;
+			for (size_t i = 0; i < sizeof impls / sizeof *impls; i ++) {
+				result = bench_trie(impls[i], stream);
+				print(type->name, streams[s].name, &result, events);
+			}
+			result = bench_hash(stream);
+			print(type->name, streams[s].name, &result, events);
+			result = bench_frozen(stream);
+			print(type->name, streams[s].name, &result, events);
+		}
+		for (size_t s = 0; s < sizeof streams / sizeof *streams; s ++)
+			keys_free(&streams[s].stream);
+		keys_free(&population);
+	}
+	return 0;
+}
@@ -0,0 +1,155 @@
+/*
+    Ucollect - small utility for real-time analysis of network data
+    Copyright (C) 2015 CZ.NIC, z.s.p.o. (http://www.nic.cz/)
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+/*
+ * Compare the trie implementations on key sets resembling what the plugins
+ * store. Usage: trie_bench [key count].
+ *
+ * For each key set and implementation, it reports the time to index all the
+ * keys, to look up existing keys (skewed, most lookups go to a small hot set,
+ * like the packets of few busy connections), to look up missing keys, to walk
+ * the whole trie (by the callback and by the ordered iterator), to delete all
+ * the keys and the memory used per key.
+ */
+
+#include "trie_impl.h"
+#include "keys.h"
+
+#include "../core/mem_pool.h"
+#include "../core/util.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+
+#define LOOKUP_ROUNDS 4
+#define HOT_PERCENT 10
+#define HOT_HITS 90
+
+static void walk_count(const uint8_t *key, size_t key_size, struct trie_data *data, void *userdata) {
+	(void)key;
+	(void)key_size;
+	(void)data;
+	(*(size_t *)userdata) ++;
+}
+
+// The data pointers only need to be non-NULL
+static int marker_target;
+static struct trie_data *const marker = (struct trie_data *)&marker_target;
+
+static void bench(const struct trie_impl *impl, const char *set_name, const struct keys *present, const struct keys *missing, const size_t *order) {
+	struct mem_pool *pool = mem_pool_create("Benchmark trie");
+	struct mem_pool *temp_pool = mem_pool_create("Benchmark temp");
+	struct trie *trie = impl->alloc(pool);
+
+	uint64_t start = now_ns();
+	for (size_t i = 0; i < present->count; i ++)
+		*impl->index(trie, present->keys[i], present->sizes[i]) = marker;
+	uint64_t index_time = now_ns() - start;
+
+	size_t lookups = LOOKUP_ROUNDS * present->count;
+	start = now_ns();
+	for (size_t i = 0; i < lookups; i ++) {
+		size_t k = order[i];
+		if (impl->lookup(trie, present->keys[k], present->sizes[k]) != marker)
+			die("Lost key %zu in %s trie\n", k, impl->name);
+	}
+	uint64_t hit_time = now_ns() - start;
+
+	size_t found = 0;
+	start = now_ns();
+	for (size_t i = 0; i < missing->count; i ++)
+		if (impl->lookup(trie, missing->keys[i], missing->sizes[i]))
+			found ++;
+	uint64_t miss_time = now_ns() - start;
+
+	size_t walked = 0;
+	start = now_ns();
+	impl->walk(trie, walk_count, &walked, temp_pool);
+	uint64_t walk_time = now_ns() - start;
+	size_t size = impl->size(trie);
+	if (walked != size)
+		die("Walk of %s trie found %zu keys out of %zu\n", impl->name, walked, size);
+
+	size_t iterated = 0;
+	start = now_ns();
+	struct trie_iter *iter = impl->iter_create(trie, NULL, 0, true, temp_pool);
+	while (impl->iter_next(iter, NULL, NULL, NULL))
+		iterated ++;
+	uint64_t iter_time = now_ns() - start;
+	if (iterated != size)
+		die("Iterator of %s trie found %zu keys out of %zu\n", impl->name, iterated, size);
+
+	size_t allocated = mem_pool_allocated(pool);
+
+	start = now_ns();
+	for (size_t i = 0; i < present->count; i ++)
+		impl->delete(trie, present->keys[i], present->sizes[i]);
+	uint64_t delete_time = now_ns() - start;
+	if (impl->size(trie))
+		die("%zu keys left in %s trie after delete\n", impl->size(trie), impl->name);
+
+	printf("%-6s %-5s %8zu keys: index %7.1f ns, hit %7.1f ns, miss %7.1f ns (%zu found), walk %6.1f ns/key, iter %6.1f ns/key, delete %7.1f ns, %6.1f B/key\n", set_name, impl->name, size,
+			(double)index_time / present->count,
+			(double)hit_time / lookups,
+			(double)miss_time / missing->count, found,
+			(double)walk_time / size,
+			(double)iter_time / size,
+			(double)delete_time / present->count,
+			(double)allocated / size);
+	mem_pool_destroy(temp_pool);
+	mem_pool_destroy(pool);
+}
+
+int main(int argc, const char *argv[]) {
+	size_t count = 100000;
+	if (argc > 1) {
+		char *end;
+		count = strtoull(argv[1], &end, 10);
+		if (!*argv[1] || *end || !count)
+			die("Invalid key count %s\n", argv[1]);
+	}
+	const struct trie_impl *impls[] = { &trie_impl_list, &trie_impl_art };
+	const struct {
+		const char *name;
+		size_t (*gen)(uint8_t *key);
+	} sets[] = {
+		{ "ipv4", gen_v4 },
+		{ "ipv6", gen_v6 },
+		{ "tuple", gen_tuple }
+	};
+	// The skewed order of lookups. Most of them go to the hot keys.
+	size_t *order = malloc(LOOKUP_ROUNDS * count * sizeof *order);
+	if (!order)
+		die("Not enough memory for %zu lookups\n", LOOKUP_ROUNDS * count);
+	size_t hot = count * HOT_PERCENT / 100 + 1;
+	for (size_t i = 0; i < LOOKUP_ROUNDS * count; i ++)
+		order[i] = rnd() % 100 < HOT_HITS ? rnd() % hot : rnd() % count;
+	for (size_t s = 0; s < sizeof sets / sizeof *sets; s ++) {
+		struct keys present = keys_gen(count, sets[s].gen);
+		struct keys missing = keys_gen(count, sets[s].gen);
+		for (size_t i = 0; i < sizeof impls / sizeof *impls; i ++)
+			bench(impls[i], sets[s].name, &present, &missing, order);
+		keys_free(&present);
+		keys_free(&missing);
+	}
+	free(order);
+	return 0;
+}
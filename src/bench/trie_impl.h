@@ -0,0 +1,47 @@
+/*
+    Ucollect - small utility for real-time analysis of network data
+    Copyright (C) 2015 CZ.NIC, z.s.p.o. (http://www.nic.cz/)
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#ifndef UCOLLECT_BENCH_TRIE_IMPL_H
+#define UCOLLECT_BENCH_TRIE_IMPL_H
+
+/*
+ * Both the trie implementations from core, linked into single binary so they
+ * can be compared. Each impl_*.c includes one of the implementations with the
+ * public functions renamed and exports them through this table.
+ */
+
+#include "../core/trie.h"
+
+struct trie_impl {
+	const char *name;
+	struct trie *(*alloc)(struct mem_pool *pool);
+	struct trie_data **(*index)(struct trie *trie, const uint8_t *key, size_t key_size);
+	struct trie_data *(*lookup)(const struct trie *trie, const uint8_t *key, size_t key_size);
+	size_t (*size)(const struct trie *trie);
+	bool (*delete)(struct trie *trie, const uint8_t *key, size_t key_size);
+	void (*walk)(struct trie *trie, trie_walk_callback callback, void *userdata, struct mem_pool *temp_pool);
+	struct trie_iter *(*iter_create)(struct trie *trie, const uint8_t *prefix, size_t prefix_size, bool ordered, struct mem_pool *pool);
+	bool (*iter_next)(struct trie_iter *iter, const uint8_t **key, size_t *key_size, struct trie_data **data);
+	void (*iter_resume)(struct trie_iter *iter, const uint8_t *key, size_t key_size);
+};
+
+extern const struct trie_impl trie_impl_list;
+extern const struct trie_impl trie_impl_art;
+
+#endif
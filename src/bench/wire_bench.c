@@ -0,0 +1,158 @@
+/*
+    Ucollect - small utility for real-time analysis of network data
+    Copyright (C) 2015 CZ.NIC, z.s.p.o. (http://www.nic.cz/)
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+/*
+ * Compare the messages generated by wire_message.h with the format strings of
+ * uplink_parse and uplink_render_alloc. Usage: wire_bench [iterations].
+ *
+ * It renders the request for a diff update and parses the header of a diff
+ * (the messages of the flow and fwup plugins), checking both ways produce the
+ * same. It reports the time per message.
+ */
+
+#include "keys.h"
+
+#include "../core/uplink.h"
+#include "../core/mem_pool.h"
+#include "../core/util.h"
+#include "../libs/diffstore/diff_messages.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Reset the pool after this many messages, so it doesn't grow too much
+#define POOL_BATCH 1024
+
+static const char *const name = "flow-filter-blocklist";
+
+static uint64_t render_format(struct mem_pool *pool, size_t iterations, size_t *length) {
+	uint64_t start = now_ns();
+	for (size_t i = 0; i < iterations; i ++) {
+		if (i % POOL_BATCH == 0)
+			mem_pool_reset(pool);
+		uplink_render_alloc(length, 0, pool, "cbsuuu", 'U', false, name, strlen(name), (uint32_t)i, (uint32_t)i + 1, (uint32_t)i + 2);
+	}
+	return now_ns() - start;
+}
+
+static uint64_t render_wire(struct mem_pool *pool, size_t iterations, size_t *length) {
+	uint64_t start = now_ns();
+	for (size_t i = 0; i < iterations; i ++) {
+		if (i % POOL_BATCH == 0)
+			mem_pool_reset(pool);
+		const struct diff_update_request_msg request = {
+			.full = false,
+			.name = name,
+			.name_length = strlen(name),
+			.epoch = i,
+			.old_version = i + 1,
+			.new_version = i + 2
+		};
+		diff_update_request_render_alloc(&request, 0, length, pool);
+	}
+	return now_ns() - start;
+}
+
+static uint64_t parse_format(struct mem_pool *pool, size_t iterations, const uint8_t *message, size_t length, uint32_t *check) {
+	uint64_t start = now_ns();
+	for (size_t i = 0; i < iterations; i ++) {
+		if (i % POOL_BATCH == 0)
+			mem_pool_reset(pool);
+		const uint8_t *data = message;
+		size_t rest = length;
+		char *parsed_name;
+		bool full;
+		uint32_t epoch, from = 0, to;
+		uplink_parse(&data, &rest, "sbu",
+				&parsed_name, (size_t *)NULL, pool, "name",
+				&full, "full",
+				&epoch, "epoch");
+		if (!full)
+			from = uplink_parse_uint32(&data, &rest);
+		to = uplink_parse_uint32(&data, &rest);
+		*check += epoch + from + to + parsed_name[0];
+	}
+	return now_ns() - start;
+}
+
+static uint64_t parse_wire(struct mem_pool *pool, size_t iterations, const uint8_t *message, size_t length, uint32_t *check) {
+	uint64_t start = now_ns();
+	for (size_t i = 0; i < iterations; i ++) {
+		if (i % POOL_BATCH == 0)
+			mem_pool_reset(pool);
+		const uint8_t *data = message;
+		size_t rest = length;
+		struct diff_header_msg diff = { .from = 0 };
+		if (!diff_header_parse(&diff, &data, &rest, pool))
+			die("Diff header broken\n");
+		*check += diff.epoch + diff.from + diff.to + diff.name[0];
+	}
+	return now_ns() - start;
+}
+
+static void report(const char *what, uint64_t format_time, uint64_t wire_time, size_t iterations) {
+	printf("%-6s: format string %7.1f ns, generated %7.1f ns\n", what, (double)format_time / iterations, (double)wire_time / iterations);
+}
+
+int main(int argc, const char *argv[]) {
+	if (argc > 2)
+		die("Usage: %s [iterations]\n", argv[0]);
+	size_t iterations = 10 * 1000 * 1000;
+	if (argc > 1) {
+		char *end;
+		iterations = strtoull(argv[1], &end, 10);
+		if (!*argv[1] || *end || !iterations)
+			die("Invalid iteration count %s\n", argv[1]);
+	}
+	struct mem_pool *pool = mem_pool_create("Wire bench");
+
+	size_t format_length, wire_length;
+	uint64_t format_time = render_format(pool, iterations, &format_length);
+	uint64_t wire_time = render_wire(pool, iterations, &wire_length);
+	// Compare the last rendered messages
+	size_t length;
+	const uint8_t *format_message = uplink_render_alloc(&length, 0, pool, "cbsuuu", 'U', false, name, strlen(name), 1, 2, 3);
+	const struct diff_update_request_msg request = {
+		.name = name,
+		.name_length = strlen(name),
+		.epoch = 1,
+		.old_version = 2,
+		.new_version = 3
+	};
+	const uint8_t *wire_message = diff_update_request_render_alloc(&request, 0, &wire_length, pool);
+	if (format_length != wire_length || length != wire_length || memcmp(format_message, wire_message, length) != 0)
+		die("Rendered messages differ\n");
+	report("render", format_time, wire_time, iterations);
+
+	// The diff header has the same fields, just in different order
+	const uint8_t *header = uplink_render_alloc(&length, 0, pool, "sbuuu", name, strlen(name), false, 1, 2, 3);
+	uint8_t *header_copy = malloc(length);
+	memcpy(header_copy, header, length);
+	uint32_t format_check = 0, wire_check = 0;
+	format_time = parse_format(pool, iterations, header_copy, length, &format_check);
+	wire_time = parse_wire(pool, iterations, header_copy, length, &wire_check);
+	if (format_check != wire_check)
+		die("Parsed messages differ\n");
+	report("parse", format_time, wire_time, iterations);
+
+	free(header_copy);
+	mem_pool_destroy(pool);
+	return 0;
+}
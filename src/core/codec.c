@@ -0,0 +1,260 @@
+/*
+    Ucollect - small utility for real-time analysis of network data
+    Copyright (C) 2015 CZ.NIC, z.s.p.o. (http://www.nic.cz/)
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#include "codec.h"
+#include "util.h"
+#include "tunable.h"
+
+#include <string.h>
+
+bool codec_supported(enum codec_type type) {
+	switch (type) {
+		case CODEC_ZLIB:
+			return true;
+		case CODEC_ZSTD:
+		case CODEC_ZSTD_DICT:
+#ifdef UPLINK_ZSTD
+			return true;
+#else
+			return false;
+#endif
+	}
+	return false;
+}
+
+const char *codec_name(enum codec_type type) {
+	switch (type) {
+		case CODEC_ZLIB:
+			return "zlib";
+		case CODEC_ZSTD:
+			return "zstd";
+		case CODEC_ZSTD_DICT:
+			return "zstd-dict";
+	}
+	return "unknown";
+}
+
+bool codec_parse(const char *name, enum codec_type *type) {
+	const enum codec_type types[] = { CODEC_ZLIB, CODEC_ZSTD, CODEC_ZSTD_DICT };
+	for (size_t i = 0; i < sizeof types / sizeof *types; i ++)
+		if (strcmp(name, codec_name(types[i])) == 0) {
+			*type = types[i];
+			return true;
+		}
+	return false;
+}
+
+size_t codec_bound(size_t size) {
+	/*
+	 * Both zlib (stored blocks and the sync marker) and zstd (raw blocks
+	 * and the frame header) need less than this for incompressible data.
+	 */
+	return size + (size >> 8) + 64;
+}
+
+#ifdef UPLINK_ZSTD
+static bool zstd_check(size_t result, const char *what) {
+	if (ZSTD_isError(result)) {
+		ulog(LLOG_ERROR, "Zstd %s failed: %s\n", what, ZSTD_getErrorName(result));
+		return false;
+	}
+	return true;
+}
+
+static bool zstd_init(struct codec *codec, bool compress, int level, const uint8_t *dict, size_t dict_size) {
+	if (compress) {
+		if (!(codec->zstd_compress = ZSTD_createCCtx())) {
+			ulog(LLOG_ERROR, "Couldn't create zstd compression context\n");
+			return false;
+		}
+		// The window limits the memory needed on the other side
+		if (!zstd_check(ZSTD_CCtx_setParameter(codec->zstd_compress, ZSTD_c_compressionLevel, level), "setting level") ||
+				!zstd_check(ZSTD_CCtx_setParameter(codec->zstd_compress, ZSTD_c_windowLog, UPLINK_ZSTD_WINDOW_LOG), "setting window") ||
+				(dict && !zstd_check(ZSTD_CCtx_loadDictionary(codec->zstd_compress, dict, dict_size), "loading dictionary"))) {
+			ZSTD_freeCCtx(codec->zstd_compress);
+			return false;
+		}
+	} else {
+		if (!(codec->zstd_decompress = ZSTD_createDCtx())) {
+			ulog(LLOG_ERROR, "Couldn't create zstd decompression context\n");
+			return false;
+		}
+		if (!zstd_check(ZSTD_DCtx_setParameter(codec->zstd_decompress, ZSTD_d_windowLogMax, UPLINK_ZSTD_WINDOW_LOG), "setting window") ||
+				(dict && !zstd_check(ZSTD_DCtx_loadDictionary(codec->zstd_decompress, dict, dict_size), "loading dictionary"))) {
+			ZSTD_freeDCtx(codec->zstd_decompress);
+			return false;
+		}
+	}
+	return true;
+}
+#endif
+
+bool codec_init(struct codec *codec, enum codec_type type, bool compress, int level, const uint8_t *dict, size_t dict_size) {
+	*codec = (struct codec) {
+		.type = type,
+		.compress = compress
+	};
+	switch (type) {
+		case CODEC_ZLIB: {
+			// The zalloc, zfree and opaque are Z_NULL from the initialization above
+			int result = compress ? deflateInit(&codec->zlib, level) : inflateInit(&codec->zlib);
+			if (result != Z_OK) {
+				ulog(LLOG_ERROR, "Could not initialize zlib (%s stream)\n", compress ? "compression" : "decompression");
+				return false;
+			}
+			return true;
+		}
+		case CODEC_ZSTD:
+		case CODEC_ZSTD_DICT:
+#ifdef UPLINK_ZSTD
+			if (type == CODEC_ZSTD_DICT && !dict) {
+				ulog(LLOG_ERROR, "No dictionary for zstd\n");
+				return false;
+			}
+			return zstd_init(codec, compress, level, type == CODEC_ZSTD_DICT ? dict : NULL, dict_size);
+#else
+			(void) dict;
+			(void) dict_size;
+			break;
+#endif
+	}
+	ulog(LLOG_ERROR, "Compression %s is not supported\n", codec_name(type));
+	return false;
+}
+
+void codec_done(struct codec *codec) {
+	switch (codec->type) {
+		case CODEC_ZLIB:
+			if (codec->compress)
+				deflateEnd(&codec->zlib);
+			else
+				inflateEnd(&codec->zlib);
+			break;
+		case CODEC_ZSTD:
+		case CODEC_ZSTD_DICT:
+#ifdef UPLINK_ZSTD
+			if (codec->compress)
+				ZSTD_freeCCtx(codec->zstd_compress);
+			else
+				ZSTD_freeDCtx(codec->zstd_decompress);
+#endif
+			break;
+	}
+}
+
+bool codec_compress(struct codec *codec, struct codec_io *io, enum codec_flush flush) {
+	sanity(codec->compress, "Compressing with %s decompression codec\n", codec_name(codec->type));
+	switch (codec->type) {
+		case CODEC_ZLIB: {
+			z_stream *stream = &codec->zlib;
+			stream->next_in = (unsigned char *)io->in;
+			stream->avail_in = io->in_size;
+			stream->next_out = io->out;
+			stream->avail_out = io->out_size;
+			int result = deflate(stream, flush == CODEC_FLUSH_SYNC ? Z_SYNC_FLUSH : flush == CODEC_FLUSH_END ? Z_FINISH : Z_NO_FLUSH);
+			io->in = stream->next_in;
+			io->in_size = stream->avail_in;
+			io->out = stream->next_out;
+			io->out_size = stream->avail_out;
+			switch (flush) {
+				case CODEC_FLUSH_NONE:
+					return !io->in_size;
+				case CODEC_FLUSH_SYNC:
+					// If it filled the whole output, there may be more to flush
+					return !io->in_size && io->out_size;
+				case CODEC_FLUSH_END:
+					return result == Z_STREAM_END;
+			}
+			break;
+		}
+		case CODEC_ZSTD:
+		case CODEC_ZSTD_DICT: {
+#ifdef UPLINK_ZSTD
+			ZSTD_inBuffer in = { .src = io->in, .size = io->in_size };
+			ZSTD_outBuffer out = { .dst = io->out, .size = io->out_size };
+			size_t remaining = ZSTD_compressStream2(codec->zstd_compress, &out, &in, flush == CODEC_FLUSH_SYNC ? ZSTD_e_flush : flush == CODEC_FLUSH_END ? ZSTD_e_end : ZSTD_e_continue);
+			if (ZSTD_isError(remaining))
+				die("Zstd compression failed: %s\n", ZSTD_getErrorName(remaining));
+			io->in += in.pos;
+			io->in_size -= in.pos;
+			io->out += out.pos;
+			io->out_size -= out.pos;
+			return !io->in_size && (flush == CODEC_FLUSH_NONE || !remaining);
+#else
+			break;
+#endif
+		}
+	}
+	insane("Compressing with unsupported codec %s\n", codec_name(codec->type));
+}
+
+enum codec_status codec_decompress(struct codec *codec, struct codec_io *io) {
+	sanity(!codec->compress, "Decompressing with %s compression codec\n", codec_name(codec->type));
+	if (codec->ended)
+		return CODEC_END;
+	switch (codec->type) {
+		case CODEC_ZLIB: {
+			z_stream *stream = &codec->zlib;
+			stream->next_in = (unsigned char *)io->in;
+			stream->avail_in = io->in_size;
+			stream->next_out = io->out;
+			stream->avail_out = io->out_size;
+			int result = inflate(stream, Z_SYNC_FLUSH);
+			io->in = stream->next_in;
+			io->in_size = stream->avail_in;
+			io->out = stream->next_out;
+			io->out_size = stream->avail_out;
+			switch (result) {
+				case Z_OK:
+				case Z_BUF_ERROR: // No progress possible now, not an error
+					return CODEC_OK;
+				case Z_STREAM_END:
+					codec->ended = true;
+					return CODEC_END;
+				default:
+					return CODEC_ERROR;
+			}
+		}
+		case CODEC_ZSTD:
+		case CODEC_ZSTD_DICT: {
+#ifdef UPLINK_ZSTD
+			ZSTD_inBuffer in = { .src = io->in, .size = io->in_size };
+			ZSTD_outBuffer out = { .dst = io->out, .size = io->out_size };
+			size_t result = ZSTD_decompressStream(codec->zstd_decompress, &out, &in);
+			io->in += in.pos;
+			io->in_size -= in.pos;
+			io->out += out.pos;
+			io->out_size -= out.pos;
+			if (ZSTD_isError(result)) {
+				ulog(LLOG_ERROR, "Zstd decompression failed: %s\n", ZSTD_getErrorName(result));
+				return CODEC_ERROR;
+			}
+			if (!result) {
+				// The whole frame is decoded, we use a single frame per stream
+				codec->ended = true;
+				return CODEC_END;
+			}
+			return CODEC_OK;
+#else
+			break;
+#endif
+		}
+	}
+	insane("Decompressing with unsupported codec %s\n", codec_name(codec->type));
+}
@@ -0,0 +1,104 @@
+/*
+    Ucollect - small utility for real-time analysis of network data
+    Copyright (C) 2015 CZ.NIC, z.s.p.o. (http://www.nic.cz/)
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#ifndef UCOLLECT_CORE_CODEC_H
+#define UCOLLECT_CORE_CODEC_H
+
+/*
+ * Streaming compression of the uplink, hiding which compression library is
+ * used. Zlib is always available, zstd (also with a dictionary) when compiled
+ * with UPLINK_ZSTD=1.
+ *
+ * The codecs are identified by a letter, which is also how they are called in
+ * the uplink protocol.
+ */
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <zlib.h>
+#ifdef UPLINK_ZSTD
+#include <zstd.h>
+#endif
+
+enum codec_type {
+	CODEC_ZLIB = 'z',
+	CODEC_ZSTD = 's',
+	CODEC_ZSTD_DICT = 'd'
+};
+
+enum codec_flush {
+	CODEC_FLUSH_NONE, // Just feed the input, the output may lag behind
+	CODEC_FLUSH_SYNC, // Produce all the output, so the other side can decode all the input so far
+	CODEC_FLUSH_END // Finish the stream, the other side sees its end
+};
+
+enum codec_status {
+	CODEC_OK, // Some progress (possibly none, if there's not enough input)
+	CODEC_END, // The stream ended, the rest of the input isn't part of it
+	CODEC_ERROR // Corrupted data
+};
+
+// The buffers for one step of (de)compression. Updated to how far it got.
+struct codec_io {
+	const uint8_t *in;
+	size_t in_size;
+	uint8_t *out;
+	size_t out_size;
+};
+
+struct codec {
+	enum codec_type type;
+	bool compress;
+	bool ended; // Decompression reached the end of the stream
+	z_stream zlib;
+#ifdef UPLINK_ZSTD
+	ZSTD_CCtx *zstd_compress;
+	ZSTD_DCtx *zstd_decompress;
+#endif
+};
+
+/*
+ * Initialize a codec of the given type, either for compression or decompression.
+ * The level is used only for compression. The dictionary is used with
+ * CODEC_ZSTD_DICT only (it is copied).
+ *
+ * Returns false if the type is not supported (or the library failed).
+ */
+bool codec_init(struct codec *codec, enum codec_type type, bool compress, int level, const uint8_t *dict, size_t dict_size) __attribute__((nonnull(1)));
+// Release the resources of the codec. It can be initialized again afterwards.
+void codec_done(struct codec *codec) __attribute__((nonnull));
+// Is the codec type compiled in?
+bool codec_supported(enum codec_type type);
+const char *codec_name(enum codec_type type) __attribute__((returns_nonnull));
+// Find the codec by its name (as returned by codec_name). Returns false if there's no such one.
+bool codec_parse(const char *name, enum codec_type *type) __attribute__((nonnull));
+// How much output compressing size bytes (and flushing) can take at most, with any codec.
+size_t codec_bound(size_t size);
+
+/*
+ * Compress as much as fits into the output. Returns true if all the input is
+ * consumed and the flush (if any) is complete. If it returns false, call it
+ * again with more output space (and the same flush).
+ */
+bool codec_compress(struct codec *codec, struct codec_io *io, enum codec_flush flush) __attribute__((nonnull));
+// Decompress as much as possible into the output.
+enum codec_status codec_decompress(struct codec *codec, struct codec_io *io) __attribute__((nonnull));
+
+#endif
@@ -21,11 +21,14 @@
 #include "loop.h"
 #include "util.h"
 #include "mem_pool.h"
+#include "tunable.h"
+#include "codec.h"
 
 #include <uci.h>
 #include <stdlib.h>
 #include <assert.h>
 #include <string.h>
+#include <limits.h>
 
 struct config_params {
 	const char *config_dir;
@@ -119,12 +122,122 @@ static bool load_uplink(struct loop_configurator *configurator, struct uci_secti
 		return false;
 	}
 	loop_uplink_configure(configurator, name, service, login, password, cert);
+	const char *spool = uci_lookup_option_string(ctx, section, "spool");
+	if (spool) {
+		size_t spool_size = UPLINK_SPOOL_SIZE;
+		const char *size = uci_lookup_option_string(ctx, section, "spool_size");
+		if (size) {
+			char *end;
+			spool_size = 1024 * strtoull(size, &end, 10);
+			if (!*size || *end || !spool_size) {
+				ulog(LLOG_ERROR, "Invalid spool size %s\n", size);
+				return false;
+			}
+		}
+		loop_uplink_spool(configurator, spool, spool_size);
+	}
+	enum codec_type codec = CODEC_ZLIB;
+	const char *compression = uci_lookup_option_string(ctx, section, "compression");
+	if (compression && !codec_parse(compression, &codec)) {
+		ulog(LLOG_ERROR, "Unknown compression %s\n", compression);
+		return false;
+	}
+	if (!codec_supported(codec)) {
+		ulog(LLOG_WARN, "Compression %s is not compiled in, using zlib\n", compression);
+		codec = CODEC_ZLIB;
+	}
+	int level = codec == CODEC_ZLIB ? COMPRESSION_LEVEL : UPLINK_ZSTD_LEVEL;
+	const char *level_str = uci_lookup_option_string(ctx, section, "compression_level");
+	if (level_str) {
+		char *end;
+		level = strtol(level_str, &end, 10);
+		if (!*level_str || *end || level < 1 || level > (codec == CODEC_ZLIB ? 9 : 22)) {
+			ulog(LLOG_ERROR, "Invalid compression level %s\n", level_str);
+			return false;
+		}
+	}
+	loop_uplink_compression(configurator, codec, level);
+	return true;
+}
+
+// Read an unsigned number option, keeping the default if it is not there
+static bool load_uint(struct uci_section *section, struct uci_context *ctx, const char *name, uint32_t *result) {
+	const char *value = uci_lookup_option_string(ctx, section, name);
+	if (!value)
+		return true;
+	char *end;
+	unsigned long long parsed = strtoull(value, &end, 10);
+	if (!*value || *end || parsed > UINT32_MAX) {
+		ulog(LLOG_ERROR, "Invalid %s %s\n", name, value);
+		return false;
+	}
+	*result = parsed;
+	return true;
+}
+
+static bool load_overload(struct loop_configurator *configurator, struct uci_section *section, struct uci_context *ctx) {
+	ulog(LLOG_DEBUG, "Processing overload %s\n", section->e.name);
+	struct overload_config config = {
+		.steps = OVERLOAD_SAMPLE | OVERLOAD_SNAPLEN | OVERLOAD_DISSECT | OVERLOAD_PAUSE,
+		.drop_high = OVERLOAD_DROP_HIGH,
+		.drop_low = OVERLOAD_DROP_LOW,
+		.load_high = OVERLOAD_LOAD_HIGH,
+		.load_low = OVERLOAD_LOAD_LOW,
+		.hold = OVERLOAD_HOLD,
+		.sample_rate = OVERLOAD_SAMPLE_RATE,
+		.snaplen = OVERLOAD_SNAPLEN_DEFAULT,
+		.protect_priority = 0
+	};
+	struct uci_option *opt = uci_lookup_option(ctx, section, "step");
+	if (opt) {
+		if (opt->type != UCI_TYPE_LIST) {
+			ulog(LLOG_ERROR, "Step of overload is not a list\n");
+			return false;
+		}
+		config.steps = 0;
+		struct uci_element *e;
+		uci_foreach_element(&opt->v.list, e) {
+			if (strcmp(e->name, "sample") == 0)
+				config.steps |= OVERLOAD_SAMPLE;
+			else if (strcmp(e->name, "snaplen") == 0)
+				config.steps |= OVERLOAD_SNAPLEN;
+			else if (strcmp(e->name, "dissect") == 0)
+				config.steps |= OVERLOAD_DISSECT;
+			else if (strcmp(e->name, "pause") == 0)
+				config.steps |= OVERLOAD_PAUSE;
+			else {
+				ulog(LLOG_ERROR, "Unknown overload step %s\n", e->name);
+				return false;
+			}
+		}
+	}
+	if (!load_uint(section, ctx, "drop_high", &config.drop_high) || !load_uint(section, ctx, "drop_low", &config.drop_low) || !load_uint(section, ctx, "load_high", &config.load_high) || !load_uint(section, ctx, "load_low", &config.load_low) || !load_uint(section, ctx, "hold", &config.hold) || !load_uint(section, ctx, "sample_rate", &config.sample_rate) || !load_uint(section, ctx, "snaplen", &config.snaplen))
+		return false;
+	if (config.drop_low > config.drop_high || config.load_low > config.load_high) {
+		ulog(LLOG_ERROR, "The low overload thresholds must not be above the high ones\n");
+		return false;
+	}
+	if (config.sample_rate < 2 || !config.snaplen) {
+		ulog(LLOG_ERROR, "Invalid overload sample_rate or snaplen\n");
+		return false;
+	}
+	const char *protect = uci_lookup_option_string(ctx, section, "protect_priority");
+	if (protect) {
+		char *end;
+		long parsed = strtol(protect, &end, 10);
+		if (!*protect || *end || parsed < INT_MIN || parsed > INT_MAX) {
+			ulog(LLOG_ERROR, "Invalid protect_priority %s\n", protect);
+			return false;
+		}
+		config.protect_priority = parsed;
+	}
+	loop_overload_configure(configurator, &config);
 	return true;
 }
 
 static bool load_package(struct loop_configurator *configurator, struct uci_context *ctx, struct uci_package *p) {
 	struct uci_element *section;
-	bool seen_uplink = false;
+	bool seen_uplink = false, seen_overload = false;
 	uci_foreach_element(&p->sections, section) {
 		struct uci_section *s = uci_to_section(section);
 		if (strcmp(s->type, "interface") == 0) {
@@ -141,6 +254,14 @@ static bool load_package(struct loop_configurator *configurator, struct uci_cont
 			seen_uplink = true;
 			if (!load_uplink(configurator, s, ctx))
 				return false;
+		} else if (strcmp(s->type, "overload") == 0) {
+			if (seen_overload) {
+				ulog(LLOG_ERROR, "Multiple overload sections in configuration\n");
+				return false;
+			}
+			seen_overload = true;
+			if (!load_overload(configurator, s, ctx))
+				return false;
 		} else
 			ulog(LLOG_WARN, "Ignoring config section '%s' of unknown type '%s'\n", s->e.name, s->type);
 	}
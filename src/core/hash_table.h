@@ -0,0 +1,366 @@
+/*
+    Ucollect - small utility for real-time analysis of network data
+    Copyright (C) 2015 CZ.NIC, z.s.p.o. (http://www.nic.cz/)
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+/*
+ * This header is little bit special in that it generates new code.
+ * You define bunch of defines and macros and include the header.
+ * The header introduces bunch of functions and undefines the macros.
+ *
+ * The header doesn't have the usual #ifndef guard, since it is expected
+ * to include multiple times, with different defines.
+ *
+ * This one contains an open-addressing hash table with fixed-size keys,
+ * stored inline together with the values. It is meant for the per-packet
+ * state keyed by binary tuples (addresses, ports, ...), where the trie
+ * would need to allocate the key on every access.
+ *
+ * Each slot has a control byte ‒ empty, deleted or 7 bits of the hash of
+ * the key in it. The control bytes are kept in a separate array and
+ * examined 8 at a time (in a single 64-bit word), so most of the misses
+ * don't look at the keys at all.
+ *
+ * The table lives in a memory pool. When it gets full, a bigger one is
+ * allocated and the entries are moved there few at a time on each
+ * modification, so there's no long pause. The pool can't free, so the
+ * arrays are kept as a spare once all the entries are moved out of them.
+ * When the table is rebuilt only to get rid of the deleted slots (the
+ * capacity doesn't change), it reuses the spare and the pool doesn't grow.
+ * Only the retired smaller arrays stay in the pool until it is reset, which
+ * is less than the current size.
+ *
+ * The definitions are:
+ * - HASH_KEY: The type of the key. The keys are compared by memcmp, so
+ *   any padding in them must be zeroed.
+ * - HASH_VALUE: The type of the value.
+ * - HASH_NAME(X): Macro returning name of types and functions provided
+ *   part of the name. Could be something like prefix_##X.
+ * - HASH_FUNC(KEY): Optional, computes 64-bit hash of the key (passed as
+ *   a pointer). Defaults to hash of all the bytes of the key.
+ *
+ * The generated things are:
+ * - struct HASH_NAME(table): The opaque table.
+ * - HASH_NAME(create)(pool): Allocate an empty table from the pool.
+ * - HASH_NAME(index)(table, key, &created): Find the value for the key,
+ *   creating a zeroed one if it is not there.
+ * - HASH_NAME(lookup)(table, key): Find the value or return NULL. It
+ *   doesn't modify the table.
+ * - HASH_NAME(remove)(table, key): Remove the key, false if not there.
+ * - HASH_NAME(size)(table): Number of keys.
+ * - HASH_NAME(walk)(table, callback, userdata): Call the callback for
+ *   each key, in no particular order.
+ *
+ * The value pointers become invalid after the next index or remove.
+ *
+ * All the functions are inline, so the unused ones don't produce warnings.
+ */
+
+#include "mem_pool.h"
+#include "tunable.h"
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+
+// Check all needed defines are there
+#ifndef HASH_KEY
+#error "HASH_KEY not defined"
+#endif
+#ifndef HASH_VALUE
+#error "HASH_VALUE not defined"
+#endif
+#ifndef HASH_NAME
+#error "HASH_NAME not defined"
+#endif
+
+// Things common to all the hash tables, defined only once
+#ifndef UCOLLECT_HASH_TABLE_COMMON
+#define UCOLLECT_HASH_TABLE_COMMON
+
+#define HASH_CTRL_EMPTY 0x80
+#define HASH_CTRL_DELETED 0xFE
+#define HASH_GROUP 8
+#define HASH_LSBS 0x0101010101010101ULL
+#define HASH_MSBS 0x8080808080808080ULL
+
+static inline uint64_t hash_table_bytes(const void *data, size_t size) {
+	const uint8_t *pos = data;
+	uint64_t hash = 0x9E3779B97F4A7C15ULL ^ size;
+	uint64_t word;
+	while (size >= sizeof word) {
+		memcpy(&word, pos, sizeof word);
+		hash = (hash ^ word) * 0xFF51AFD7ED558CCDULL;
+		hash ^= hash >> 32;
+		pos += sizeof word;
+		size -= sizeof word;
+	}
+	word = 0;
+	memcpy(&word, pos, size);
+	hash = (hash ^ word) * 0xC4CEB9FE1A85EC53ULL;
+	return hash ^ (hash >> 29);
+}
+
+static inline uint64_t hash_group_load(const uint8_t *ctrl) {
+	uint64_t result;
+	memcpy(&result, ctrl, sizeof result);
+	return result;
+}
+
+/*
+ * The bytes of the group equal to the tag have their top bit set in the
+ * result. There may be false positives (but only after a real match), so
+ * the keys must be compared anyway.
+ */
+static inline uint64_t hash_group_match(uint64_t group, uint8_t tag) {
+	uint64_t diff = group ^ (HASH_LSBS * tag);
+	return (diff - HASH_LSBS) & ~diff & HASH_MSBS;
+}
+
+// Exact, the empty control byte is the only one with top bit set and the next one not.
+static inline uint64_t hash_group_empty(uint64_t group) {
+	return group & ~(group << 1) & HASH_MSBS;
+}
+
+static inline uint64_t hash_group_free(uint64_t group) {
+	return group & HASH_MSBS;
+}
+
+// Position of the first byte marked in the mask
+static inline size_t hash_group_first(uint64_t mask) {
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+	return __builtin_ctzll(mask) / 8;
+#else
+	return __builtin_clzll(mask) / 8;
+#endif
+}
+
+// Drop the first byte marked in the mask
+static inline uint64_t hash_group_next(uint64_t mask) {
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+	return mask & (mask - 1);
+#else
+	return mask & ~(0x8000000000000000ULL >> __builtin_clzll(mask));
+#endif
+}
+
+#endif
+
+#ifndef HASH_FUNC
+#define HASH_FUNC(KEY) hash_table_bytes((KEY), sizeof(HASH_KEY))
+#endif
+
+struct HASH_NAME(entry) {
+	HASH_KEY key;
+	HASH_VALUE value;
+};
+
+struct HASH_NAME(store) {
+	uint8_t *ctrl;
+	struct HASH_NAME(entry) *entries;
+	size_t mask; // Number of slots - 1, or 0 if there are no slots
+	size_t used; // Including the deleted ones
+};
+
+struct HASH_NAME(table) {
+	struct mem_pool *pool;
+	size_t count;
+	struct HASH_NAME(store) current;
+	// The store being moved to current, if any
+	struct HASH_NAME(store) old;
+	size_t migrate_pos;
+	// Arrays of a fully migrated store, for the next rebuild
+	struct HASH_NAME(store) spare;
+};
+
+typedef void (*HASH_NAME(walk_callback))(const HASH_KEY *key, HASH_VALUE *value, void *userdata);
+
+static inline struct HASH_NAME(table) *HASH_NAME(create)(struct mem_pool *pool) {
+	struct HASH_NAME(table) *result = mem_pool_alloc(pool, sizeof *result);
+	*result = (struct HASH_NAME(table)) {
+		.pool = pool
+	};
+	return result;
+}
+
+static inline size_t HASH_NAME(size)(const struct HASH_NAME(table) *table) {
+	return table->count;
+}
+
+static inline struct HASH_NAME(entry) *HASH_NAME(store_find)(const struct HASH_NAME(store) *store, const HASH_KEY *key, uint64_t hash, size_t *slot) {
+	if (!store->ctrl)
+		return NULL;
+	uint8_t tag = hash >> 57;
+	size_t pos = hash & store->mask & ~(size_t)(HASH_GROUP - 1);
+	for (size_t step = HASH_GROUP; ; step += HASH_GROUP) {
+		uint64_t group = hash_group_load(store->ctrl + pos);
+		for (uint64_t match = hash_group_match(group, tag); match; match = hash_group_next(match)) {
+			size_t i = pos + hash_group_first(match);
+			if (memcmp(&store->entries[i].key, key, sizeof *key) == 0) {
+				*slot = i;
+				return &store->entries[i];
+			}
+		}
+		if (hash_group_empty(group))
+			return NULL;
+		// Triangular probing visits all the groups, as their number is a power of 2
+		pos = (pos + step) & store->mask;
+	}
+}
+
+// Find a slot for a key that is known not to be in the store. The store must have a free slot.
+static inline struct HASH_NAME(entry) *HASH_NAME(store_place)(struct HASH_NAME(store) *store, uint64_t hash) {
+	size_t pos = hash & store->mask & ~(size_t)(HASH_GROUP - 1);
+	for (size_t step = HASH_GROUP; ; step += HASH_GROUP) {
+		uint64_t free_slots = hash_group_free(hash_group_load(store->ctrl + pos));
+		if (free_slots) {
+			size_t i = pos + hash_group_first(free_slots);
+			if (store->ctrl[i] == HASH_CTRL_EMPTY)
+				store->used ++;
+			store->ctrl[i] = hash >> 57;
+			return &store->entries[i];
+		}
+		pos = (pos + step) & store->mask;
+	}
+}
+
+static inline void HASH_NAME(store_delete)(struct HASH_NAME(store) *store, size_t slot) {
+	store->ctrl[slot] = HASH_CTRL_DELETED;
+}
+
+// Move some entries from the old store
+static inline void HASH_NAME(migrate)(struct HASH_NAME(table) *table, size_t amount) {
+	struct HASH_NAME(store) *old = &table->old;
+	if (!old->ctrl)
+		return;
+	size_t end = table->migrate_pos + amount;
+	if (end > old->mask + 1)
+		end = old->mask + 1;
+	for (size_t i = table->migrate_pos; i < end; i ++)
+		if (!(old->ctrl[i] & HASH_CTRL_EMPTY)) {
+			const struct HASH_NAME(entry) *entry = &old->entries[i];
+			*HASH_NAME(store_place)(&table->current, HASH_FUNC(&entry->key)) = *entry;
+			// So it is not found there any more
+			old->ctrl[i] = HASH_CTRL_DELETED;
+		}
+	table->migrate_pos = end;
+	if (end == old->mask + 1) {
+		// Keep the bigger one of the unused stores, the other one is lost in the pool
+		if (!table->spare.ctrl || table->spare.mask < old->mask)
+			table->spare = *old;
+		*old = (struct HASH_NAME(store)) { .ctrl = NULL };
+	}
+}
+
+// Make sure there's a room for one more entry in the current store
+static inline void HASH_NAME(reserve)(struct HASH_NAME(table) *table) {
+	struct HASH_NAME(store) *current = &table->current;
+	if (current->ctrl && current->used + 1 <= (current->mask + 1) / 8 * 7)
+		return;
+	// The previous resize must be complete before starting another one
+	HASH_NAME(migrate)(table, (size_t)-1 / 2);
+	size_t capacity = HASH_GROUP;
+	// Twice as much as needed now. If it is mostly deleted slots, it stays the same size.
+	while (capacity < 2 * (table->count + 1))
+		capacity *= 2;
+	table->old = *current;
+	table->migrate_pos = 0;
+	if (table->spare.ctrl && table->spare.mask + 1 >= capacity) {
+		// Reuse the arrays of the previous rebuild (always the case when only purging the deleted slots)
+		capacity = table->spare.mask + 1;
+		*current = table->spare;
+		current->used = 0;
+		table->spare = (struct HASH_NAME(store)) { .ctrl = NULL };
+	} else {
+		*current = (struct HASH_NAME(store)) {
+			.ctrl = mem_pool_alloc(table->pool, capacity),
+			.entries = mem_pool_alloc(table->pool, capacity * sizeof *current->entries),
+			.mask = capacity - 1
+		};
+	}
+	memset(current->ctrl, HASH_CTRL_EMPTY, capacity);
+}
+
+static inline HASH_VALUE *HASH_NAME(lookup)(const struct HASH_NAME(table) *table, const HASH_KEY *key) {
+	uint64_t hash = HASH_FUNC(key);
+	size_t slot;
+	struct HASH_NAME(entry) *entry = HASH_NAME(store_find)(&table->current, key, hash, &slot);
+	if (!entry)
+		entry = HASH_NAME(store_find)(&table->old, key, hash, &slot);
+	return entry ? &entry->value : NULL;
+}
+
+static inline HASH_VALUE *HASH_NAME(index)(struct HASH_NAME(table) *table, const HASH_KEY *key, bool *created) {
+	HASH_NAME(migrate)(table, HASH_TABLE_MIGRATE);
+	uint64_t hash = HASH_FUNC(key);
+	size_t slot;
+	struct HASH_NAME(entry) *entry = HASH_NAME(store_find)(&table->current, key, hash, &slot);
+	if (entry) {
+		if (created)
+			*created = false;
+		return &entry->value;
+	}
+	HASH_NAME(reserve)(table);
+	entry = HASH_NAME(store_find)(&table->old, key, hash, &slot);
+	struct HASH_NAME(entry) *result = HASH_NAME(store_place)(&table->current, hash);
+	if (entry) {
+		// Move it to the current store right away
+		*result = *entry;
+		HASH_NAME(store_delete)(&table->old, slot);
+		if (created)
+			*created = false;
+	} else {
+		memset(result, 0, sizeof *result);
+		memcpy(&result->key, key, sizeof *key);
+		table->count ++;
+		if (created)
+			*created = true;
+	}
+	return &result->value;
+}
+
+static inline bool HASH_NAME(remove)(struct HASH_NAME(table) *table, const HASH_KEY *key) {
+	HASH_NAME(migrate)(table, HASH_TABLE_MIGRATE);
+	uint64_t hash = HASH_FUNC(key);
+	size_t slot;
+	if (HASH_NAME(store_find)(&table->current, key, hash, &slot))
+		HASH_NAME(store_delete)(&table->current, slot);
+	else if (HASH_NAME(store_find)(&table->old, key, hash, &slot))
+		HASH_NAME(store_delete)(&table->old, slot);
+	else
+		return false;
+	table->count --;
+	return true;
+}
+
+static inline void HASH_NAME(store_walk)(struct HASH_NAME(store) *store, HASH_NAME(walk_callback) callback, void *userdata) {
+	if (!store->ctrl)
+		return;
+	for (size_t i = 0; i <= store->mask; i ++)
+		if (!(store->ctrl[i] & HASH_CTRL_EMPTY))
+			callback(&store->entries[i].key, &store->entries[i].value, userdata);
+}
+
+static inline void HASH_NAME(walk)(struct HASH_NAME(table) *table, HASH_NAME(walk_callback) callback, void *userdata) {
+	HASH_NAME(store_walk)(&table->current, callback, userdata);
+	HASH_NAME(store_walk)(&table->old, callback, userdata);
+}
+
+#undef HASH_KEY
+#undef HASH_VALUE
+#undef HASH_NAME
+#undef HASH_FUNC
@@ -35,29 +35,84 @@
 
 #ifdef STATIC
 
-#include <string.h>
 /*
- * The loader does not work with static linkage. We provide a stub here with
- * hard-coded plugins.
+ * The loader does not work with static linkage. The plugins and pluglibs are
+ * linked in and listed in static_plugins.h, generated by the build. The table
+ * is made by including it with the STATIC_PLUGIN(name, hash) and
+ * STATIC_PLUGLIB(name, hash) macros defined. The name is the directory of the
+ * plugin (or pluglib) and the hash is the hex sha256 of its sources, which
+ * stands in for the hash of the library.
  */
-struct plugin *plugin_info_count(void);
-struct plugin *plugin_info_buckets(void);
 
-static int dummy;
+#define STATIC_PLUGIN(NAME, HASH) \
+	struct plugin *plugin_info_##NAME(void); \
+	unsigned api_version_##NAME(void) __attribute__((weak));
+#define STATIC_PLUGLIB(NAME, HASH) \
+	struct pluglib *pluglib_info_##NAME(void);
+#include <static_plugins.h>
+#undef STATIC_PLUGIN
+#undef STATIC_PLUGLIB
 
-void *plugin_load(const char *libname, struct plugin *target) {
-	ulog(LLOG_INFO, "Want plugin %s\n", libname);
-	if (strcmp(libname, "libplugin_count.so") == 0) {
-		*target = *plugin_info_count();
-		return &dummy;
-	} else if (strcmp(libname, "libplugin_buckets.so") == 0) {
-		*target = *plugin_info_buckets();
-		return &dummy;
-	}
-	ulog(LLOG_ERROR, "Dynamic loading not allowed\n");
+struct static_lib {
+	const char *libname;
+	const char *hash;
+	struct plugin *(*plugin_info)(void);
+	unsigned (*api_version)(void); // NULL if the plugin doesn't have it (version 0)
+	struct pluglib *(*pluglib_info)(void);
+};
+
+static const struct static_lib static_libs[] = {
+#define STATIC_PLUGIN(NAME, HASH) { .libname = "libplugin_" #NAME ".so", .hash = HASH, .plugin_info = plugin_info_##NAME, .api_version = api_version_##NAME },
+#define STATIC_PLUGLIB(NAME, HASH) { .libname = "libpluglib_" #NAME ".so", .hash = HASH, .pluglib_info = pluglib_info_##NAME },
+#include <static_plugins.h>
+#undef STATIC_PLUGIN
+#undef STATIC_PLUGLIB
+	{ .libname = NULL }
+};
+
+static const struct static_lib *lib_find(const char *libname, uint8_t *hash) {
+	// The configuration may contain the whole path, as for the dynamic loader
+	const char *base = strrchr(libname, '/');
+	base = base ? base + 1 : libname;
+	for (const struct static_lib *lib = static_libs; lib->libname; lib ++)
+		if (strcmp(lib->libname, base) == 0) {
+			ulog(LLOG_INFO, "Using built-in plugin library %s\n", libname);
+			for (size_t i = 0; i < CHALLENGE_LEN / 2; i ++) {
+				unsigned byte;
+				sscanf(lib->hash + 2 * i, "%2x", &byte);
+				hash[i] = byte;
+			}
+			return lib;
+		}
+	ulog(LLOG_ERROR, "Plugin library %s is not built in and dynamic loading not allowed\n", libname);
 	return NULL;
 }
 
+void *plugin_load(const char *libname, struct plugin *target, uint8_t *hash, unsigned *api_version_ret) {
+	const struct static_lib *lib = lib_find(libname, hash);
+	if (!lib)
+		return NULL;
+	if (!lib->plugin_info) {
+		ulog(LLOG_ERROR, "%s is a plugin library, not a plugin\n", libname);
+		return NULL;
+	}
+	*target = *lib->plugin_info();
+	*api_version_ret = lib->api_version ? lib->api_version() : 0;
+	return (void *)lib;
+}
+
+void *pluglib_load(const char *libname, struct pluglib *target, uint8_t *hash) {
+	const struct static_lib *lib = lib_find(libname, hash);
+	if (!lib)
+		return NULL;
+	if (!lib->pluglib_info) {
+		ulog(LLOG_ERROR, "%s is a plugin, not a plugin library\n", libname);
+		return NULL;
+	}
+	*target = *lib->pluglib_info();
+	return (void *)lib;
+}
+
 void plugin_unload(void *library) {
 	(void) library;
 }
@@ -66,15 +121,146 @@ void plugin_unload(void *library) {
 
 #include <dlfcn.h>
 
-static void *lib_load(const char *libname, uint8_t *hash, char *libpath) {
-	ulog(LLOG_INFO, "Loading plugin library %s\n", libname);
-	dlerror(); // Reset errors
 #ifdef PLUGIN_PATH
-	snprintf(libpath, PATH_MAX + 1, PLUGIN_PATH "/%s", libname);
-	int libfile = open(libpath, O_RDONLY);
-	if (libfile == -1) {
-		ulog(LLOG_ERROR, "Plugin %s doesn't exist: %s\n", libpath, strerror(errno));
-		return NULL;
+
+/*
+ * Hashing the whole library is slow on a slow flash and the same libraries
+ * are loaded again on each reconfiguration and plugin crash. So remember the
+ * hashes of the files, keyed by their identity and modification. If the file
+ * is replaced or changed, some of these change and the hash is computed again.
+ *
+ * The cache is in memory only, unless compiled with PLUGIN_HASH_CACHE set to
+ * a file name. Then it is loaded from the file on the first use and written
+ * there whenever a new hash is computed, so it survives restarts too.
+ */
+struct hash_cache_entry {
+	dev_t dev;
+	ino_t ino;
+	off_t size;
+	time_t mtime;
+	long mtime_nsec;
+	uint8_t hash[CHALLENGE_LEN / 2];
+};
+
+static struct hash_cache_entry hash_cache[PLUGIN_HASH_CACHE_SIZE];
+// How many entries are valid and which one to replace next when full
+static size_t hash_cache_used, hash_cache_next;
+
+static bool hash_cache_match(const struct hash_cache_entry *entry, const struct stat *st) {
+	return entry->dev == st->st_dev && entry->ino == st->st_ino && entry->size == st->st_size && entry->mtime == st->st_mtim.tv_sec && entry->mtime_nsec == st->st_mtim.tv_nsec;
+}
+
+static void hash_cache_add(const struct hash_cache_entry *entry) {
+	for (size_t i = 0; i < hash_cache_used; i ++)
+		if (hash_cache[i].dev == entry->dev && hash_cache[i].ino == entry->ino) {
+			// The same file, modified. Replace the old hash.
+			hash_cache[i] = *entry;
+			return;
+		}
+	if (hash_cache_used < PLUGIN_HASH_CACHE_SIZE) {
+		hash_cache[hash_cache_used ++] = *entry;
+	} else {
+		hash_cache[hash_cache_next] = *entry;
+		hash_cache_next = (hash_cache_next + 1) % PLUGIN_HASH_CACHE_SIZE;
+	}
+}
+
+#ifdef PLUGIN_HASH_CACHE
+
+/*
+ * The file has one line per entry, with the device, inode, size, mtime
+ * (seconds and nanoseconds) and the hash in hex. Broken lines are skipped, the
+ * worst that can happen is computing the hash again.
+ */
+static void hash_cache_read(void) {
+	static bool read_done = false;
+	if (read_done)
+		return;
+	read_done = true;
+	FILE *file = fopen(PLUGIN_HASH_CACHE, "r");
+	if (!file) {
+		if (errno != ENOENT)
+			ulog(LLOG_WARN, "Can't read plugin hash cache %s: %s\n", PLUGIN_HASH_CACHE, strerror(errno));
+		return;
+	}
+	char line[256];
+	size_t count = 0;
+	while (fgets(line, sizeof line, file)) {
+		unsigned long long dev, ino, mtime;
+		long long size;
+		long mtime_nsec;
+		char hex[65];
+		if (sscanf(line, "%llu %llu %lld %llu %ld %64s", &dev, &ino, &size, &mtime, &mtime_nsec, hex) != 6 || strlen(hex) != CHALLENGE_LEN)
+			continue;
+		struct hash_cache_entry entry = {
+			.dev = dev,
+			.ino = ino,
+			.size = size,
+			.mtime = mtime,
+			.mtime_nsec = mtime_nsec
+		};
+		bool valid = true;
+		for (size_t i = 0; i < CHALLENGE_LEN / 2; i ++) {
+			unsigned byte;
+			if (sscanf(hex + 2 * i, "%2x", &byte) != 1)
+				valid = false;
+			entry.hash[i] = byte;
+		}
+		if (!valid)
+			continue;
+		hash_cache_add(&entry);
+		count ++;
+	}
+	fclose(file);
+	ulog(LLOG_DEBUG, "Read %zu plugin hashes from %s\n", count, PLUGIN_HASH_CACHE);
+}
+
+// Write the whole cache to a temporary file and move it over the old one, so it is never half-written
+static void hash_cache_write(void) {
+	const char *tmp_name = PLUGIN_HASH_CACHE ".tmp";
+	FILE *file = fopen(tmp_name, "w");
+	if (!file) {
+		ulog(LLOG_WARN, "Can't write plugin hash cache %s: %s\n", tmp_name, strerror(errno));
+		return;
+	}
+	for (size_t i = 0; i < hash_cache_used; i ++) {
+		const struct hash_cache_entry *entry = &hash_cache[i];
+		fprintf(file, "%llu %llu %lld %llu %ld ", (unsigned long long)entry->dev, (unsigned long long)entry->ino, (long long)entry->size, (unsigned long long)entry->mtime, entry->mtime_nsec);
+		for (size_t j = 0; j < CHALLENGE_LEN / 2; j ++)
+			fprintf(file, "%02hhx", entry->hash[j]);
+		fputc('\n', file);
+	}
+	if (fclose(file) == EOF) {
+		ulog(LLOG_WARN, "Can't write plugin hash cache %s: %s\n", tmp_name, strerror(errno));
+		unlink(tmp_name);
+		return;
+	}
+	if (rename(tmp_name, PLUGIN_HASH_CACHE) == -1) {
+		ulog(LLOG_WARN, "Can't replace plugin hash cache %s: %s\n", PLUGIN_HASH_CACHE, strerror(errno));
+		unlink(tmp_name);
+	}
+}
+
+#else
+
+static void hash_cache_read(void) { }
+static void hash_cache_write(void) { }
+
+#endif
+
+static bool lib_hash(int libfile, const char *libpath, uint8_t *hash) {
+	hash_cache_read();
+	struct stat st;
+	bool cacheable = fstat(libfile, &st) == 0;
+	if (cacheable) {
+		for (size_t i = 0; i < hash_cache_used; i ++)
+			if (hash_cache_match(&hash_cache[i], &st)) {
+				ulog(LLOG_DEBUG, "Using cached hash of plugin library %s\n", libpath);
+				memcpy(hash, hash_cache[i].hash, CHALLENGE_LEN / 2);
+				return true;
+			}
+	} else {
+		ulog(LLOG_WARN, "Can't stat plugin library %s, not caching its hash: %s\n", libpath, strerror(errno));
 	}
 	SHA256_CTX context;
 	SHA256_Init(&context);
@@ -85,13 +271,42 @@ static void *lib_load(const char *libname, uint8_t *hash, char *libpath) {
 		SHA256_Update(&context, buffer, result);
 	if (result < 0) {
 		ulog(LLOG_ERROR, "Error reading from plugin library %s: %s\n", libpath, strerror(errno));
-		close(libfile);
-		return NULL;
+		return false;
 	}
-	close(libfile);
 	uint8_t output[SHA256_DIGEST_LENGTH];
 	SHA256_Final(output, &context);
 	memcpy(hash, output, CHALLENGE_LEN / 2);
+	if (cacheable) {
+		struct hash_cache_entry entry = {
+			.dev = st.st_dev,
+			.ino = st.st_ino,
+			.size = st.st_size,
+			.mtime = st.st_mtim.tv_sec,
+			.mtime_nsec = st.st_mtim.tv_nsec
+		};
+		memcpy(entry.hash, hash, CHALLENGE_LEN / 2);
+		hash_cache_add(&entry);
+		hash_cache_write();
+	}
+	return true;
+}
+
+#endif
+
+static void *lib_load(const char *libname, uint8_t *hash, char *libpath) {
+	ulog(LLOG_INFO, "Loading plugin library %s\n", libname);
+	dlerror(); // Reset errors
+#ifdef PLUGIN_PATH
+	snprintf(libpath, PATH_MAX + 1, PLUGIN_PATH "/%s", libname);
+	int libfile = open(libpath, O_RDONLY);
+	if (libfile == -1) {
+		ulog(LLOG_ERROR, "Plugin %s doesn't exist: %s\n", libpath, strerror(errno));
+		return NULL;
+	}
+	bool hashed = lib_hash(libfile, libpath, hash);
+	close(libfile);
+	if (!hashed)
+		return NULL;
 #else
 	const char *libpath = libname;
 	ulog(LLOG_WARN, "Not having complete path. Can't compute hash, there might be problems logging in\n");
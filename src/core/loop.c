@@ -170,6 +170,9 @@ struct pcap_interface {
 	bool registered; // Registered inside the main loop
 	// Statistics from the last time, so we can return just the diffs
 	size_t captured, dropped, if_dropped;
+	// The same, for the overload controller (the pcap counters are unsigned and wrap around)
+	unsigned overload_received, overload_dropped;
+	bool overload_initialized;
 };
 
 struct pcap_list {
@@ -221,9 +224,26 @@ struct plugin_holder {
 	struct pluglib_node *pluglib_list_recycler;
 	bool mark; // Mark for configurator.
 	bool active; // Is the plugin activated? Is it allowed to talk to the server?
+	bool spool; // Was it active when the uplink got lost? Its messages may be spooled until the server decides again.
 	size_t failed;
 	uint8_t hash[CHALLENGE_LEN / 2];
 	unsigned api_version;
+	size_t memory_soft, memory_hard; // The memory budget, in bytes. 0 means unlimited.
+	bool memory_server; // The budget was set by the server, it overrides the config until reload
+	bool memory_pressure; // Is the plugin over its soft limit (and was already told)?
+	struct plugin_holder *same_hash; // The next plugin with the same hash of name, in the order of the list (see plugin_index)
+	uint32_t sample_rate; // Only one in sample_rate packets (or flows) is passed to the plugin. 0 and 1 mean all.
+	char sample_mode; // SAMPLE_PACKETS or SAMPLE_FLOWS
+	bool sample_server; // The sampling was set by the server, it overrides the config until reload
+	uint32_t sample_skip; // How many packets to skip before passing the next one, when sampling packets
+	uint32_t sample_active; // The rate in use, either sample_rate or the one of the overload controller
+	int priority; // The importance for the overload controller, from the priority option
+	uint32_t send_weight; // How many quanta of the uplink send queue it gets in a round, from the send_weight option
+	bool send_interactive; // Its messages go before the bulk ones, from the send_class option
+	bool overload_sampled; // Sampled by the overload controller
+	size_t paused; // Paused by the overload controller. The order in which it was paused (from 1), 0 if not paused.
+	uint64_t packets; // How many packets it got
+	uint64_t packet_time, packet_time_last, packet_time_total; // Estimated time in the packet callback (ns) since the last overload check, during the last interval and in total
 };
 
 struct plugin_list {
@@ -238,6 +258,21 @@ struct plugin_list {
 #define LIST_WANT_LFOR
 #include "link_list.h"
 
+/*
+ * Index of the plugins by the hash of their name, so the messages from the
+ * server don't need to compare the name with each plugin. It points to the
+ * first plugin with the hash, the rest is linked through same_hash. There
+ * may be multiple plugins with the same name (different versions) and, in
+ * theory, different names with the same hash, so the names still need to be
+ * compared.
+ */
+#define HASH_KEY uint64_t
+#define HASH_VALUE struct plugin_holder *
+#define HASH_NAME(X) plugin_index_##X
+// The key is already a hash
+#define HASH_FUNC(KEY) (*(KEY))
+#include "hash_table.h"
+
 #define LIST_NODE struct plugin_fd
 #define LIST_BASE struct plugin_holder
 #define LIST_NAME(X) plugin_fds_##X
@@ -318,6 +353,7 @@ GEN_CALL_WRAPPER_PARAM_2(uplink_data, const uint8_t *, size_t)
 GEN_CALL_WRAPPER_PARAM_2(fd, int, void *)
 GEN_CALL_WRAPPER_PARAM(config_finish, bool)
 GEN_CALL_WRAPPER_PARAM_2(child_died, int, pid_t)
+GEN_CALL_WRAPPER(memory_pressure)
 
 static char *gdb_command;
 static volatile sig_atomic_t in_signal = 0;
@@ -363,7 +399,165 @@ static void sig_handler(int signal, siginfo_t *info, void *unused) {
 	abort_safe();
 }
 
+/*
+ * Get the value of a single-valued option of the plugin. The value is set to
+ * NULL if the option is not present. Returns false if it has more values.
+ */
+static bool option_single(const struct plugin_holder *plugin, struct trie *config, const char *name, const char **value) {
+	*value = NULL;
+	if (!config)
+		return true;
+	const struct trie_data *data = trie_lookup(config, (const uint8_t *)name, strlen(name));
+	if (!data)
+		return true;
+	if (data->config.value_count != 1) {
+		ulog(LLOG_ERROR, "The %s option of plugin %s must have exactly one value, %zu found\n", name, plugin->plugin.name, data->config.value_count);
+		return false;
+	}
+	*value = data->config.values[0];
+	return true;
+}
+
+/*
+ * Read a memory limit (in KiB) from the plugin's configuration. It is stored
+ * to limit (in bytes) if the option is present. Returns false if the option is invalid.
+ */
+static bool memory_limit_parse(const struct plugin_holder *plugin, struct trie *config, const char *name, size_t *limit) {
+	const char *value;
+	if (!option_single(plugin, config, name, &value))
+		return false;
+	if (!value)
+		return true;
+	char *end;
+	errno = 0;
+	unsigned long long kib = strtoull(value, &end, 10);
+	if (!*value || *end || errno || kib > SIZE_MAX / 1024) {
+		ulog(LLOG_ERROR, "Invalid %s of plugin %s: %s\n", name, plugin->plugin.name, value);
+		return false;
+	}
+	*limit = kib * 1024;
+	return true;
+}
+
+static bool memory_budget_parse(const struct plugin_holder *plugin, struct trie *config, size_t *soft, size_t *hard) {
+	if (!memory_limit_parse(plugin, config, "memory_soft_limit", soft) || !memory_limit_parse(plugin, config, "memory_hard_limit", hard))
+		return false;
+	if (*soft && *hard && *soft > *hard) {
+		ulog(LLOG_ERROR, "Soft memory limit of plugin %s (%zu) is above the hard one (%zu)\n", plugin->plugin.name, *soft, *hard);
+		return false;
+	}
+	return true;
+}
+
+/*
+ * Read the packet sampling of the plugin from the sample_rate and sample_mode
+ * options. They are stored only if present, the mode defaults to flows if only
+ * the rate is set. Returns false if they are invalid.
+ */
+static bool sampling_parse(const struct plugin_holder *plugin, struct trie *config, char *mode, uint32_t *rate) {
+	const char *mode_value, *rate_value;
+	if (!option_single(plugin, config, "sample_mode", &mode_value) || !option_single(plugin, config, "sample_rate", &rate_value))
+		return false;
+	char new_mode = SAMPLE_FLOWS;
+	if (mode_value) {
+		if (strcmp(mode_value, "packet") == 0) {
+			new_mode = SAMPLE_PACKETS;
+		} else if (strcmp(mode_value, "flow") != 0) {
+			ulog(LLOG_ERROR, "Invalid sample_mode of plugin %s: %s (expected packet or flow)\n", plugin->plugin.name, mode_value);
+			return false;
+		}
+	}
+	if (!rate_value) {
+		if (mode_value)
+			*mode = new_mode;
+		return true;
+	}
+	char *end;
+	errno = 0;
+	unsigned long long new_rate = strtoull(rate_value, &end, 10);
+	if (!*rate_value || *end || errno || !new_rate || new_rate > UINT32_MAX) {
+		ulog(LLOG_ERROR, "Invalid sample_rate of plugin %s: %s\n", plugin->plugin.name, rate_value);
+		return false;
+	}
+	*mode = new_mode;
+	*rate = new_rate;
+	return true;
+}
+
+// Read the priority option of the plugin, 0 if it is not there
+static bool priority_parse(const struct plugin_holder *plugin, struct trie *config, int *priority) {
+	const char *value;
+	if (!option_single(plugin, config, "priority", &value))
+		return false;
+	*priority = 0;
+	if (!value)
+		return true;
+	char *end;
+	errno = 0;
+	long result = strtol(value, &end, 10);
+	if (!*value || *end || errno || result < INT_MIN || result > INT_MAX) {
+		ulog(LLOG_ERROR, "Invalid priority of plugin %s: %s\n", plugin->plugin.name, value);
+		return false;
+	}
+	*priority = result;
+	return true;
+}
+
+/*
+ * Read the send_weight and send_class options of the plugin, for scheduling
+ * its messages in the uplink send queue. The defaults are 1 and bulk.
+ */
+static bool send_class_parse(const struct plugin_holder *plugin, struct trie *config, uint32_t *weight, bool *interactive) {
+	const char *weight_value, *class_value;
+	if (!option_single(plugin, config, "send_weight", &weight_value) || !option_single(plugin, config, "send_class", &class_value))
+		return false;
+	*weight = 1;
+	*interactive = false;
+	if (weight_value) {
+		char *end;
+		errno = 0;
+		unsigned long long result = strtoull(weight_value, &end, 10);
+		if (!*weight_value || *end || errno || !result || result > UPLINK_QUEUE_WEIGHT_MAX) {
+			ulog(LLOG_ERROR, "Invalid send_weight of plugin %s: %s (expected 1 to %u)\n", plugin->plugin.name, weight_value, (unsigned)UPLINK_QUEUE_WEIGHT_MAX);
+			return false;
+		}
+		*weight = result;
+	}
+	if (class_value) {
+		if (strcmp(class_value, "interactive") == 0) {
+			*interactive = true;
+		} else if (strcmp(class_value, "bulk") != 0) {
+			ulog(LLOG_ERROR, "Invalid send_class of plugin %s: %s (expected interactive or bulk)\n", plugin->plugin.name, class_value);
+			return false;
+		}
+	}
+	return true;
+}
+
+// Does the plugin know about sampling? The others would send the sampled counts as if they were complete.
+static bool plugin_sample_scaled(const struct plugin_holder *plugin) {
+	return plugin->api_version >= 4 && plugin->plugin.sample_scaled;
+}
+
 static bool plugin_config_check(struct plugin_holder *plugin) {
+	size_t soft = 0, hard = 0;
+	if (!memory_budget_parse(plugin, plugin->config_candidate, &soft, &hard))
+		return false;
+	char sample_mode = SAMPLE_FLOWS;
+	uint32_t sample_rate = 0;
+	if (!sampling_parse(plugin, plugin->config_candidate, &sample_mode, &sample_rate))
+		return false;
+	if (sample_rate > 1 && !plugin_sample_scaled(plugin)) {
+		ulog(LLOG_ERROR, "Plugin %s doesn't scale its counts by the sample rate, it can't have sample_rate\n", plugin->plugin.name);
+		return false;
+	}
+	int priority;
+	if (!priority_parse(plugin, plugin->config_candidate, &priority))
+		return false;
+	uint32_t send_weight;
+	bool send_interactive;
+	if (!send_class_parse(plugin, plugin->config_candidate, &send_weight, &send_interactive))
+		return false;
 	if (!plugin->plugin.config_check_callback)
 		return true;
 	current_context = &plugin->context;
@@ -399,6 +593,7 @@ struct loop {
 	struct pcap_list pcap_interfaces;
 	// The plugins that handle the packets
 	struct plugin_list plugins;
+	struct plugin_index_table *plugin_index; // Lives in the config_pool, together with the plugins
 	struct uplink *uplink;
 	// Timeouts. Sorted by the 'when' element.
 	struct timeout *timeouts;
@@ -412,12 +607,23 @@ struct loop {
 	volatile sig_atomic_t reconfigure; // Set to 1 when there's SIGHUP and we should reconfigure
 	volatile sig_atomic_t reconfigure_full; // De-initialize first.
 	struct context *reinitialize_plugin; // Please reinitialize this plugin on return from jump
+	bool reinitialize_failure; // The reinitialization is because the plugin misbehaved, count it towards FAIL_COUNT
 	bool retry_reconfigure_on_failure;
 	bool fd_invalidated; // Did we invalidate any FD during this loop iteration? If so, skip the rest.
 	struct pluglib_list pluglibs; // All loaded plugin libraries
 	// The unused libraries
 	struct pluglib_node *pluglib_list_recycler;
 	struct pluglib *pluglib_recycler;
+	// The overload controller
+	struct overload_config overload;
+	bool overload_sample, overload_snaplen, overload_dissect; // Which steps are taken (the paused plugins are counted in overload_paused)
+	size_t overload_paused;
+	size_t overload_calm; // Number of checks in a row with low load
+	uint64_t overload_last; // Time of the last check
+	size_t packet_count; // To choose the packets to time
+	uint32_t drop_rate, load; // Measured by the last check
+	size_t overload_raised, overload_lowered, overload_max;
+	uint64_t overload_time; // How long (ms) some of the steps were taken
 };
 
 #define RECYCLER_NODE struct pluglib_node
@@ -467,24 +673,111 @@ struct loop_configurator {
 	struct pcap_list pcap_interfaces;
 	struct plugin_list plugins;
 	const char *remote_name, *remote_service, *login, *password, *cert;
+	const char *spool_path;
+	size_t spool_size;
+	char codec;
+	int codec_level;
 	struct trie *config_trie;
 	struct string_list pluglib_names;
 	bool need_new_versions;
+	struct overload_config overload;
+	bool reinit; // Only reinitializing a plugin, not a reload of the configuration
 };
 
-// Handle one packet.
-static void packet_handler(struct pcap_interface *interface, const struct pcap_pkthdr *header, const unsigned char *data) {
+/*
+ * Hash of the flow the packet belongs to. It is the same for both directions
+ * and in all the plugins, so the flow sampling selects the same flows
+ * everywhere. Uses the first IP layer, the link layer addresses otherwise.
+ * Returns false if the packet has no addresses to hash.
+ */
+static bool packet_flow_hash(const struct packet_info *info, uint64_t *hash) {
+	const struct packet_info *ip = info;
+	while (ip && ip->layer != 'I')
+		ip = ip->next;
+	if (ip && (ip->ip_protocol == 4 || ip->ip_protocol == 6))
+		info = ip;
+	if (!info->addr_len || !info->addresses[END_SRC] || !info->addresses[END_DST])
+		return false;
+	uint64_t ends[END_COUNT];
+	for (size_t i = 0; i < END_COUNT; i ++)
+		ends[i] = hash_table_bytes(info->addresses[i], info->addr_len) ^ info->ports[i];
+	// Add them, so the order of the endpoints doesn't matter
+	uint64_t flow = ends[END_SRC] + ends[END_DST] + info->app_protocol;
+	*hash = hash_table_bytes(&flow, sizeof flow);
+	return true;
+}
+
+/*
+ * Decide if the packet goes to a sampled plugin. The flow hash is computed
+ * only once for all the plugins, the first time it is needed.
+ */
+static bool plugin_sample(struct plugin_holder *plugin, const struct packet_info *info, uint64_t *flow_hash, int *flow_hashed) {
+	if (plugin->sample_mode != SAMPLE_PACKETS) {
+		if (*flow_hashed == -1)
+			*flow_hashed = packet_flow_hash(info, flow_hash);
+		if (*flow_hashed)
+			return *flow_hash % plugin->sample_active == 0;
+		// No flow to sample by, fall back to sampling packets
+	}
+	if (plugin->sample_skip) {
+		plugin->sample_skip --;
+		return false;
+	}
+	plugin->sample_skip = plugin->sample_active - 1;
+	return true;
+}
+
+// For timing the packet callbacks, finer than loop_now
+static uint64_t clock_ns(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * (uint64_t) 1000000000 + ts.tv_nsec;
+}
+
+// Parse one packet and pass it to the plugins.
+static void packet_dispatch(struct loop *loop, const char *interface, bool in, int datalink, const struct pcap_pkthdr *header, const unsigned char *data) {
 	struct packet_info info = {
 		.length = header->caplen,
+		.wire_length = header->len,
 		.timestamp = 1000000*(uint64_t)header->ts.tv_sec + (uint64_t)header->ts.tv_usec,
 		.data = data,
-		.interface = interface->name,
-		.direction = interface->in ? DIR_IN : DIR_OUT
+		.interface = interface,
+		.direction = in ? DIR_IN : DIR_OUT
 	};
-	ulog(LLOG_DEBUG_VERBOSE, "Packet of size %zu on interface %s (starting %016llX%016llX, on layer %d) at %" PRIu64 "\n", info.length, interface->name, *(long long unsigned *) info.data, *(1 + (long long unsigned *) info.data), interface->datalink, info.timestamp);
-	uc_parse_packet(&info, interface->loop->batch_pool, interface->datalink);
-	LFOR(plugin, plugin, &interface->loop->plugins)
-		plugin_packet(plugin, &info);
+	ulog(LLOG_DEBUG_VERBOSE, "Packet of size %zu on interface %s (starting %016llX%016llX, on layer %d) at %" PRIu64 "\n", info.length, interface, *(long long unsigned *) info.data, *(1 + (long long unsigned *) info.data), datalink, info.timestamp);
+	if (loop->overload_dissect)
+		uc_parse_packet_shallow(&info, loop->batch_pool, datalink);
+	else
+		uc_parse_packet(&info, loop->batch_pool, datalink);
+	uint64_t flow_hash;
+	int flow_hashed = -1; // Not yet known
+	// The overload controller needs to know how long the plugins take, but timing each packet would be too expensive
+	bool timed = loop->overload.steps && loop->packet_count ++ % OVERLOAD_TIMING_SAMPLE == 0;
+	LFOR(plugin, plugin, &loop->plugins) {
+		if (plugin->paused)
+			continue;
+		if (plugin->sample_active > 1 && !plugin_sample(plugin, &info, &flow_hash, &flow_hashed))
+			continue;
+		plugin->packets ++;
+		if (timed) {
+			uint64_t start = clock_ns();
+			plugin_packet(plugin, &info);
+			plugin->packet_time += (clock_ns() - start) * OVERLOAD_TIMING_SAMPLE;
+		} else
+			plugin_packet(plugin, &info);
+	}
+}
+
+// Handle one packet.
+static void packet_handler(struct pcap_interface *interface, const struct pcap_pkthdr *header, const unsigned char *data) {
+	packet_dispatch(interface->loop, interface->name, interface->in, interface->datalink, header, data);
+}
+
+void loop_packets_inject(struct loop *loop, const char *interface, bool in, int datalink, size_t count, const struct pcap_pkthdr *headers, const unsigned char *const *data) {
+	for (size_t i = 0; i < count; i ++)
+		packet_dispatch(loop, interface, in, datalink, &headers[i], data[i]);
+	// Like after a batch read from the PCAP in loop_run
+	mem_pool_reset(loop->batch_pool);
 }
 
 static void self_reconfigure(struct context *context, void *data, size_t id) {
@@ -679,8 +972,370 @@ static void fail_count_reset(struct context *context, void *data, size_t id) {
 	loop_timeout_add(loop, FAIL_COUNT_RESET, NULL, loop, fail_count_reset);
 }
 
+static size_t plugin_memory_usage(const struct plugin_holder *plugin) {
+	size_t result = mem_pool_allocated(plugin->context.permanent_pool);
+	for (const struct pool_node *pool = plugin->pool_list.head; pool; pool = pool->next)
+		result += mem_pool_allocated(pool->pool);
+	return result;
+}
+
+size_t loop_plugin_memory_usage(const struct context *context) {
+	const struct plugin_holder *holder = (const struct plugin_holder *) context;
+#ifdef DEBUG
+	assert(holder->canary == PLUGIN_HOLDER_CANARY);
+#endif
+	return plugin_memory_usage(holder);
+}
+
+static void memory_check(struct context *context, void *data, size_t id) {
+	// Params are unused
+	(void)context;
+	(void)id;
+	struct loop *loop = data;
+	// Schedule the next round first. We don't return from here if a plugin gets reinitialized.
+	loop_timeout_add(loop, MEMORY_CHECK_TIME, NULL, loop, memory_check);
+	LFOR(plugin, plugin, &loop->plugins) {
+		if (!plugin->memory_soft && !plugin->memory_hard)
+			continue;
+		size_t usage = plugin_memory_usage(plugin);
+		if (plugin->memory_hard && usage > plugin->memory_hard) {
+			ulog(LLOG_ERROR, "Plugin %s holds %zu bytes of memory, over its hard limit of %zu, reinitializing\n", plugin->plugin.name, usage, plugin->memory_hard);
+			// Like a crash, so a plugin that keeps growing over the limit gets disabled eventually
+			loop->reinitialize_failure = true;
+			loop_plugin_reinit(&plugin->context);
+		} else if (plugin->memory_soft && usage > plugin->memory_soft) {
+			if (plugin->memory_pressure)
+				continue; // Already told, don't repeat it every time
+			plugin->memory_pressure = true;
+			ulog(LLOG_WARN, "Plugin %s holds %zu bytes of memory, over its soft limit of %zu\n", plugin->plugin.name, usage, plugin->memory_soft);
+			if (plugin->api_version >= 3)
+				plugin_memory_pressure(plugin);
+		} else
+			plugin->memory_pressure = false;
+	}
+}
+
+static uint64_t plugin_name_hash(const char *name) {
+	return hash_table_bytes(name, strlen(name));
+}
+
+// Index the plugins after the list changed
+static void plugin_index_build(struct loop *loop) {
+	loop->plugin_index = plugin_index_create(loop->config_pool);
+	LFOR(plugin, plugin, &loop->plugins) {
+		plugin->same_hash = NULL;
+		uint64_t hash = plugin_name_hash(plugin->plugin.name);
+		// Append to the end of the chain, to keep the order of the list
+		struct plugin_holder **pos = plugin_index_index(loop->plugin_index, &hash, NULL);
+		while (*pos)
+			pos = &(*pos)->same_hash;
+		*pos = plugin;
+	}
+}
+
+// The first plugin with the name in the chain starting with the given one
+static struct plugin_holder *plugin_named(struct plugin_holder *plugin, const char *name) {
+	while (plugin && strcmp(plugin->plugin.name, name) != 0)
+		plugin = plugin->same_hash;
+	return plugin;
+}
+
+// The first plugin with the name, the next ones are found by plugin_named(plugin->same_hash, name)
+static struct plugin_holder *plugin_find(const struct loop *loop, const char *name) {
+	if (!loop->plugin_index)
+		return NULL;
+	uint64_t hash = plugin_name_hash(name);
+	struct plugin_holder **first = plugin_index_lookup(loop->plugin_index, &hash);
+	return first ? plugin_named(*first, name) : NULL;
+}
+
+// Compute the rate in use from the configured one and the overload controller's
+static void plugin_sample_update(struct plugin_holder *plugin) {
+	uint32_t rate = plugin->sample_rate > 1 ? plugin->sample_rate : 1;
+	const struct loop *loop = plugin->context.loop;
+	if (plugin->overload_sampled && loop->overload.sample_rate > rate)
+		rate = loop->overload.sample_rate;
+	plugin->sample_active = rate;
+	plugin->sample_skip = 0;
+}
+
+static void plugin_sampling_set(struct plugin_holder *plugin, char mode, uint32_t rate) {
+	bool was_sampled = plugin->sample_rate > 1, sampled = rate > 1;
+	if (was_sampled != sampled || (sampled && (plugin->sample_mode != mode || plugin->sample_rate != rate))) {
+		if (sampled)
+			ulog(LLOG_INFO, "Sampling 1 in %u %s for plugin %s\n", (unsigned)rate, mode == SAMPLE_PACKETS ? "packets" : "flows", plugin->plugin.name);
+		else
+			ulog(LLOG_INFO, "Passing all packets to plugin %s\n", plugin->plugin.name);
+	}
+	plugin->sample_mode = mode;
+	plugin->sample_rate = rate;
+	plugin_sample_update(plugin);
+}
+
+bool loop_plugin_sampling(struct loop *loop, const char *name, enum sample_mode mode, uint32_t rate) {
+	bool found = false;
+	for (struct plugin_holder *plugin = plugin_find(loop, name); plugin; plugin = plugin_named(plugin->same_hash, name)) {
+		found = true;
+		if (rate > 1 && !plugin_sample_scaled(plugin)) {
+			ulog(LLOG_WARN, "Not sampling plugin %s, it doesn't scale its counts by the sample rate\n", name);
+			continue;
+		}
+		plugin_sampling_set(plugin, mode, rate);
+		plugin->sample_server = true;
+	}
+	return found;
+}
+
+uint32_t loop_plugin_sample_rate(const struct context *context) {
+	const struct plugin_holder *holder = (const struct plugin_holder *) context;
+#ifdef DEBUG
+	assert(holder->canary == PLUGIN_HOLDER_CANARY);
+#endif
+	return holder->sample_active > 1 ? holder->sample_active : 1;
+}
+
+bool loop_plugin_memory_budget(struct loop *loop, const char *name, size_t soft_limit, size_t hard_limit) {
+	bool found = false;
+	for (struct plugin_holder *plugin = plugin_find(loop, name); plugin; plugin = plugin_named(plugin->same_hash, name)) {
+		ulog(LLOG_INFO, "Setting memory budget of %s to %zu/%zu bytes\n", name, soft_limit, hard_limit);
+		plugin->memory_soft = soft_limit;
+		plugin->memory_hard = hard_limit;
+		plugin->memory_server = true;
+		plugin->memory_pressure = false;
+		found = true;
+	}
+	return found;
+}
+
+static size_t overload_level(const struct loop *loop) {
+	return loop->overload_sample + loop->overload_snaplen + loop->overload_dissect + loop->overload_paused;
+}
+
+// May the overload controller pause the plugin? The plugins have to opt in by a priority below the protected one.
+static bool overload_candidate(const struct loop *loop, const struct plugin_holder *plugin) {
+	return plugin->priority < loop->overload.protect_priority;
+}
+
+// May the overload controller sample the plugin? It must also scale its counts, or it would report wrong ones.
+static bool overload_sample_candidate(const struct loop *loop, const struct plugin_holder *plugin) {
+	return overload_candidate(loop, plugin) && plugin_sample_scaled(plugin);
+}
+
+static void overload_sample_apply(struct loop *loop) {
+	LFOR(plugin, plugin, &loop->plugins) {
+		plugin->overload_sampled = loop->overload_sample && overload_sample_candidate(loop, plugin);
+		plugin_sample_update(plugin);
+	}
+}
+
+/*
+ * The snaplen can't be changed on an active capture. But the return value of a
+ * BPF filter is the number of bytes to keep, so a filter consisting of a
+ * single return does the same (and works in the kernel).
+ */
+static void overload_snaplen_apply(struct loop *loop) {
+	struct bpf_insn insn = BPF_STMT(BPF_RET | BPF_K, loop->overload_snaplen ? loop->overload.snaplen : UINT32_MAX);
+	struct bpf_program program = {
+		.bf_len = 1,
+		.bf_insns = &insn
+	};
+	LFOR(pcap, interface, &loop->pcap_interfaces)
+		for (size_t i = 0; i < 2; i ++)
+			if (pcap_setfilter(interface->directions[i].pcap, &program) == -1)
+				ulog(LLOG_WARN, "Can't set snaplen on %s: %s\n", interface->name, pcap_geterr(interface->directions[i].pcap));
+}
+
+// Number the paused plugins from 1 again, in the order they were paused (some might have been removed)
+static void overload_paused_renumber(struct loop *loop) {
+	size_t count = 0;
+	for (;;) {
+		struct plugin_holder *next = NULL;
+		LFOR(plugin, plugin, &loop->plugins)
+			if (plugin->paused > count && (!next || plugin->paused < next->paused))
+				next = plugin;
+		if (!next)
+			break;
+		next->paused = ++ count;
+	}
+	loop->overload_paused = count;
+}
+
+// Take the next step. Returns false if there's none left.
+static bool overload_raise(struct loop *loop) {
+	const struct overload_config *config = &loop->overload;
+	bool sample_candidates = false;
+	struct plugin_holder *victim = NULL;
+	LFOR(plugin, plugin, &loop->plugins) {
+		if (!overload_candidate(loop, plugin))
+			continue;
+		if (plugin_sample_scaled(plugin))
+			sample_candidates = true;
+		// The least important one, and the most expensive of those
+		if (!plugin->paused && (!victim || plugin->priority < victim->priority || (plugin->priority == victim->priority && plugin->packet_time_last > victim->packet_time_last)))
+			victim = plugin;
+	}
+	if ((config->steps & OVERLOAD_SAMPLE) && !loop->overload_sample && sample_candidates) {
+		ulog(LLOG_WARN, "Overloaded, sampling 1 in %u for low-priority plugins\n", (unsigned)config->sample_rate);
+		loop->overload_sample = true;
+		overload_sample_apply(loop);
+	} else if ((config->steps & OVERLOAD_SNAPLEN) && !loop->overload_snaplen) {
+		ulog(LLOG_WARN, "Overloaded, capturing only %u bytes of each packet\n", (unsigned)config->snaplen);
+		loop->overload_snaplen = true;
+		overload_snaplen_apply(loop);
+	} else if ((config->steps & OVERLOAD_DISSECT) && !loop->overload_dissect) {
+		ulog(LLOG_WARN, "Overloaded, not parsing tunneled packets\n");
+		loop->overload_dissect = true;
+	} else if ((config->steps & OVERLOAD_PAUSE) && victim) {
+		ulog(LLOG_WARN, "Overloaded, pausing plugin %s\n", victim->plugin.name);
+		victim->paused = ++ loop->overload_paused;
+	} else
+		return false;
+	loop->overload_raised ++;
+	if (overload_level(loop) > loop->overload_max)
+		loop->overload_max = overload_level(loop);
+	return true;
+}
+
+// Revert the last step taken
+static void overload_lower(struct loop *loop) {
+	if (loop->overload_paused) {
+		LFOR(plugin, plugin, &loop->plugins)
+			if (plugin->paused == loop->overload_paused) {
+				ulog(LLOG_INFO, "Load is low, resuming plugin %s\n", plugin->plugin.name);
+				plugin->paused = 0;
+			}
+		loop->overload_paused --;
+	} else if (loop->overload_dissect) {
+		ulog(LLOG_INFO, "Load is low, parsing tunneled packets again\n");
+		loop->overload_dissect = false;
+	} else if (loop->overload_snaplen) {
+		ulog(LLOG_INFO, "Load is low, capturing whole packets again\n");
+		loop->overload_snaplen = false;
+		overload_snaplen_apply(loop);
+	} else if (loop->overload_sample) {
+		ulog(LLOG_INFO, "Load is low, passing all packets to the plugins again\n");
+		loop->overload_sample = false;
+		overload_sample_apply(loop);
+	} else
+		return;
+	loop->overload_lowered ++;
+}
+
+// The drop rate (in per mille) of all the interfaces since the last check. Doesn't disturb loop_pcap_stats.
+static uint32_t overload_drop_rate(struct loop *loop) {
+	uint64_t received = 0, dropped = 0;
+	LFOR(pcap, interface, &loop->pcap_interfaces) {
+		unsigned interface_received = 0, interface_dropped = 0;
+		bool ok = true;
+		for (size_t i = 0; i < 2; i ++) {
+			struct pcap_stat ps;
+			if (pcap_stats(interface->directions[i].pcap, &ps)) {
+				ok = false;
+				break;
+			}
+			interface_received += ps.ps_recv;
+			interface_dropped += ps.ps_drop + ps.ps_ifdrop;
+		}
+		if (!ok)
+			continue;
+		if (interface->overload_initialized) {
+			received += interface_received - interface->overload_received;
+			dropped += interface_dropped - interface->overload_dropped;
+		}
+		interface->overload_received = interface_received;
+		interface->overload_dropped = interface_dropped;
+		interface->overload_initialized = true;
+	}
+	if (!dropped)
+		return 0;
+	return 1000 * dropped / (received + dropped);
+}
+
+static void overload_check(struct context *context, void *data, size_t id) {
+	// Params are unused
+	(void)context;
+	(void)id;
+	struct loop *loop = data;
+	loop_timeout_add(loop, OVERLOAD_CHECK_TIME, NULL, loop, overload_check);
+	uint64_t elapsed = loop->now - loop->overload_last;
+	loop->overload_last = loop->now;
+	uint64_t packet_time = 0;
+	LFOR(plugin, plugin, &loop->plugins) {
+		packet_time += plugin->packet_time;
+		plugin->packet_time_total += plugin->packet_time;
+		plugin->packet_time_last = plugin->packet_time;
+		plugin->packet_time = 0;
+	}
+	const struct overload_config *config = &loop->overload;
+	if (!config->steps)
+		return;
+	if (overload_level(loop))
+		loop->overload_time += elapsed;
+	loop->drop_rate = overload_drop_rate(loop);
+	// The time is in ns, elapsed in ms
+	loop->load = elapsed ? packet_time / (10000 * elapsed) : 0;
+	if (loop->drop_rate > config->drop_high || loop->load > config->load_high) {
+		loop->overload_calm = 0;
+		if (overload_raise(loop))
+			ulog(LLOG_INFO, "Overload level %zu with %u per mille of packets dropped and %u%% load\n", overload_level(loop), (unsigned)loop->drop_rate, (unsigned)loop->load);
+	} else if (loop->drop_rate <= config->drop_low && loop->load <= config->load_low && overload_level(loop)) {
+		// Wait for some time before stepping down, so we don't jump up and down all the time
+		if (++ loop->overload_calm >= config->hold) {
+			loop->overload_calm = 0;
+			overload_lower(loop);
+		}
+	} else
+		loop->overload_calm = 0;
+}
+
+// Bring the controller in line with a new configuration (and new plugins and interfaces)
+static void overload_reconfigure(struct loop *loop) {
+	const struct overload_config *config = &loop->overload;
+	LFOR(plugin, plugin, &loop->plugins)
+		if (!(config->steps & OVERLOAD_PAUSE) || !overload_candidate(loop, plugin))
+			plugin->paused = 0;
+	overload_paused_renumber(loop);
+	if (!(config->steps & OVERLOAD_DISSECT))
+		loop->overload_dissect = false;
+	bool snaplen = loop->overload_snaplen;
+	if (!(config->steps & OVERLOAD_SNAPLEN))
+		loop->overload_snaplen = false;
+	// The new interfaces need it too. And the old ones need it removed, if it is no longer allowed.
+	if (snaplen)
+		overload_snaplen_apply(loop);
+	if (!(config->steps & OVERLOAD_SAMPLE))
+		loop->overload_sample = false;
+	overload_sample_apply(loop);
+	loop->overload_calm = 0;
+}
+
+void loop_overload_configure(struct loop_configurator *configurator, const struct overload_config *config) {
+	configurator->overload = *config;
+}
+
+char *loop_stats(struct loop *loop, struct mem_pool *pool) {
+	char *result = mem_pool_printf(pool, "overload level %zu (max %zu), raised %zu times, lowered %zu times, overloaded for %llu ms, %u per mille dropped and %u%% load at the last check", overload_level(loop), loop->overload_max, loop->overload_raised, loop->overload_lowered, (unsigned long long)loop->overload_time, (unsigned)loop->drop_rate, (unsigned)loop->load);
+	if (loop->overload_sample)
+		result = mem_pool_printf(pool, "%s, sampling", result);
+	if (loop->overload_snaplen)
+		result = mem_pool_printf(pool, "%s, snaplen %u", result, (unsigned)loop->overload.snaplen);
+	if (loop->overload_dissect)
+		result = mem_pool_printf(pool, "%s, not parsing tunnels", result);
+	LFOR(plugin, plugin, &loop->plugins) {
+		result = mem_pool_printf(pool, "%s, plugin %s: %llu packets, %llu ms in callbacks", result, plugin->plugin.name, (unsigned long long)plugin->packets, (unsigned long long)(plugin->packet_time_total / 1000000));
+		if (plugin->sample_active > 1)
+			result = mem_pool_printf(pool, "%s, sampled 1 in %u", result, (unsigned)plugin->sample_active);
+		if (plugin->paused)
+			result = mem_pool_printf(pool, "%s, paused", result);
+	}
+	return result;
+}
+
 void loop_run(struct loop *loop) {
 	loop_timeout_add(loop, FAIL_COUNT_RESET, NULL, loop, fail_count_reset);
+	loop_timeout_add(loop, MEMORY_CHECK_TIME, NULL, loop, memory_check);
+	loop->overload_last = loop->now;
+	loop_timeout_add(loop, OVERLOAD_CHECK_TIME, NULL, loop, overload_check);
 	if (setjmp(abort_env)) {
 		abort_ready = 0;
 		// Avoid signal loop
@@ -715,11 +1370,14 @@ void loop_run(struct loop *loop) {
 	REINIT:
 	if (setjmp(jump_env)) {
 		volatile struct context *context;
-		bool failure = false;
+		bool failure = false, crash = false;
 		if (loop->reinitialize_plugin) {
 			context = loop->reinitialize_plugin;
 			loop->reinitialize_plugin = NULL;
+			failure = loop->reinitialize_failure;
+			loop->reinitialize_failure = false;
 		} else {
+			crash = true;
 			failure = true;
 			context = current_context;
 		}
@@ -733,10 +1391,15 @@ void loop_run(struct loop *loop) {
 			if (failure) {
 				reinit = holder->failed < FAIL_COUNT;
 				failed = holder->failed;
-				ulog(LLOG_ERROR, "Signal %d in plugin %s (failed %zu times before)\n", jump_signum, holder->plugin.name, failed);
+				if (crash)
+					ulog(LLOG_ERROR, "Signal %d in plugin %s (failed %zu times before)\n", jump_signum, holder->plugin.name, failed);
+				else
+					ulog(LLOG_ERROR, "Plugin %s failed (failed %zu times before)\n", holder->plugin.name, failed);
 			}
 			plugin_destroy(holder, true);
 			struct loop_configurator *configurator = loop_config_start(loop);
+			configurator->reinit = true;
+			configurator->overload = loop->overload;
 			holder->mark = false; // This one is already destroyed
 			const char *libname = holder->libname; // Make sure it is not picked up
 			holder->libname = "";
@@ -748,8 +1411,20 @@ void loop_run(struct loop *loop) {
 				} else if (reinit) {
 					if (!loop_add_plugin(configurator, libname))
 						ulog(LLOG_ERROR, "Reinit of %s failed, aborting plugin\n", libname);
-					else
-						configurator->plugins.tail->failed = failed + 1;
+					else {
+						struct plugin_holder *new = configurator->plugins.tail;
+						new->failed = failed + 1;
+						// The fresh holder knows only the config, keep what the server set
+						if (plugin->memory_server) {
+							new->memory_soft = plugin->memory_soft;
+							new->memory_hard = plugin->memory_hard;
+							new->memory_server = true;
+						}
+						if (plugin->sample_server) {
+							plugin_sampling_set(new, plugin->sample_mode, plugin->sample_rate);
+							new->sample_server = true;
+						}
+					}
 				}
 			}
 			LFOR(pcap, interface, &loop->pcap_interfaces) {
@@ -1270,6 +1945,17 @@ void loop_register_fd(struct loop *loop, int fd, struct epoll_handler *handler)
 		die("Can't register fd %d to epoll fd %d (%s)\n", fd, loop->epoll_fd, strerror(errno));
 }
 
+void loop_fd_want_write(struct loop *loop, int fd, struct epoll_handler *handler, bool want) {
+	struct epoll_event event = {
+		.events = EPOLLIN | EPOLLRDHUP | (want ? EPOLLOUT : 0),
+		.data = {
+			.ptr = handler
+		}
+	};
+	if (epoll_ctl(loop->epoll_fd, EPOLL_CTL_MOD, fd, &event) == -1)
+		die("Can't modify fd %d in epoll fd %d (%s)\n", fd, loop->epoll_fd, strerror(errno));
+}
+
 void loop_unregister_fd(struct loop *loop, int fd) {
 	if (epoll_ctl(loop->epoll_fd, EPOLL_CTL_DEL, fd, NULL) == -1) {
 		if (errno == EBADF || errno == ENOENT)
@@ -1306,14 +1992,13 @@ struct mem_pool *loop_temp_pool(struct loop *loop) {
 
 bool loop_plugin_send_data(struct loop *loop, const char *name, const uint8_t *data, size_t length) {
 	assert(loop->uplink);
-	LFOR(plugin, plugin, &loop->plugins)
-		if (strcmp(plugin->plugin.name, name) == 0) {
-			// Skip inactive plugins. There might, in theory, be another active version with the same name, so don't abort yet.
-			if (!plugin->active)
-				continue;
-			plugin_uplink_data(plugin, data, length);
-			return true;
-		}
+	for (struct plugin_holder *plugin = plugin_find(loop, name); plugin; plugin = plugin_named(plugin->same_hash, name)) {
+		// Skip inactive plugins. There might, in theory, be another active version with the same name, so don't abort yet.
+		if (!plugin->active)
+			continue;
+		plugin_uplink_data(plugin, data, length);
+		return true;
+	}
 	return false;
 }
 
@@ -1333,6 +2018,24 @@ bool loop_plugin_active(const struct context *context) {
 	return holder->active;
 }
 
+bool loop_plugin_may_spool(const struct context *context) {
+	const struct plugin_holder *holder = (struct plugin_holder *) context;
+#ifdef DEBUG
+	assert(holder->canary == PLUGIN_HOLDER_CANARY);
+#endif
+	return holder->spool;
+}
+
+uint32_t loop_plugin_send_weight(const struct context *context, bool *interactive) {
+	const struct plugin_holder *holder = (struct plugin_holder *) context;
+#ifdef DEBUG
+	assert(holder->canary == PLUGIN_HOLDER_CANARY);
+#endif
+	*interactive = holder->send_interactive;
+	// Not configured yet (during the init callback)
+	return holder->send_weight ? holder->send_weight : 1;
+}
+
 size_t loop_timeout_add(struct loop *loop, uint32_t after, struct context *context, void *data, void (*callback)(struct context *context, void *data, size_t id)) {
 	if (after == 0)
 		/*
@@ -1601,9 +2304,11 @@ void loop_config_commit(struct loop_configurator *configurator) {
 	}
 	// Change the uplink config or copy it
 	if (loop->uplink) {
-		if (configurator->remote_name)
+		if (configurator->remote_name) {
 			uplink_configure(loop->uplink, configurator->remote_name, configurator->remote_service, configurator->login, configurator->password, configurator->cert);
-		else
+			uplink_set_spool(loop->uplink, configurator->spool_path, configurator->spool_size);
+			uplink_set_compression(loop->uplink, configurator->codec, configurator->codec_level);
+		} else
 			uplink_realloc_config(loop->uplink, configurator->config_pool);
 	}
 	// Destroy the old configuration and merge the new one
@@ -1612,12 +2317,32 @@ void loop_config_commit(struct loop_configurator *configurator) {
 	loop->config_pool = configurator->config_pool;
 	loop->pcap_interfaces = configurator->pcap_interfaces;
 	loop->plugins = configurator->plugins;
+	plugin_index_build(loop);
 	// Initialize/commit configuration of the plugins
 	LFOR(plugin, plugin, &loop->plugins) {
 		plugin->config_trie = plugin->config_candidate;
 		plugin->config_candidate = NULL;
+		// A reload of the configuration drops what the server set
+		if (!configurator->reinit)
+			plugin->memory_server = plugin->sample_server = false;
+		if (!plugin->memory_server) {
+			plugin->memory_soft = plugin->memory_hard = 0;
+			// Already checked, so it can't fail. Unlimited if not configured.
+			memory_budget_parse(plugin, plugin->config_trie, &plugin->memory_soft, &plugin->memory_hard);
+		}
+		if (!plugin->sample_server) {
+			// All the packets if not configured
+			char sample_mode = SAMPLE_FLOWS;
+			uint32_t sample_rate = 0;
+			sampling_parse(plugin, plugin->config_trie, &sample_mode, &sample_rate);
+			plugin_sampling_set(plugin, sample_mode, sample_rate);
+		}
+		priority_parse(plugin, plugin->config_trie, &plugin->priority);
+		send_class_parse(plugin, plugin->config_trie, &plugin->send_weight, &plugin->send_interactive);
 		plugin_config_finish(plugin, true);
 	}
+	loop->overload = configurator->overload;
+	overload_reconfigure(loop);
 	// Clean up unused pluglibs
 	pluglibs_cleanup(configurator->loop);
 	if (configurator->need_new_versions && uplink_connected(loop->uplink))
@@ -1632,6 +2357,7 @@ void loop_uplink_disconnected(struct loop *loop) {
 	LFOR(plugin, plugin, &loop->plugins) {
 		if (plugin->active)
 			plugin_uplink_disconnected(plugin);
+		plugin->spool = plugin->active;
 		plugin->active = false;
 	}
 }
@@ -1650,6 +2376,16 @@ void loop_uplink_configure(struct loop_configurator *configurator, const char *r
 	configurator->cert = cert ? mem_pool_strdup(configurator->config_pool, cert) : NULL;
 }
 
+void loop_uplink_spool(struct loop_configurator *configurator, const char *path, size_t size) {
+	configurator->spool_path = mem_pool_strdup(configurator->config_pool, path);
+	configurator->spool_size = size;
+}
+
+void loop_uplink_compression(struct loop_configurator *configurator, char codec, int level) {
+	configurator->codec = codec;
+	configurator->codec_level = level;
+}
+
 uint64_t loop_now(struct loop *loop) {
 	return loop->now;
 }
@@ -1720,14 +2456,11 @@ pid_t loop_fork(struct loop *loop) {
 void loop_plugin_activation(struct loop *loop, struct plugin_activation *plugins, size_t count) {
 	bool changed = false;
 	for (size_t i = 0; i < count; i ++) {
-		struct plugin_holder *candidate = NULL;
-		LFOR(plugin, plugin, &loop->plugins) {
-			if (strcmp(plugin->plugin.name, plugins[i].name) == 0 && memcmp(plugin->hash, plugins[i].hash, sizeof plugins[i].hash) == 0) {
-				candidate = plugin;
-				break;
-			}
-		}
+		struct plugin_holder *candidate = plugin_find(loop, plugins[i].name);
+		while (candidate && memcmp(candidate->hash, plugins[i].hash, sizeof plugins[i].hash) != 0)
+			candidate = plugin_named(candidate->same_hash, plugins[i].name);
 		if (candidate) {
+			candidate->spool = false;
 			if (plugins[i].activate != candidate->active) {
 				changed = true;
 				candidate->active = plugins[i].activate;
@@ -33,6 +33,7 @@ struct plugin_activation;
 struct context;
 struct uplink;
 struct config_node;
+struct mem_pool;
 
 struct epoll_handler {
 	void (*handler)(void *data, uint32_t events);
@@ -42,6 +43,15 @@ struct loop *loop_create() __attribute__((malloc)) __attribute__((returns_nonnul
 // Warning: This one is not reentrant, due to signal handling :-(
 void loop_run(struct loop *loop) __attribute__((nonnull));
 void loop_break(struct loop *loop) __attribute__((nonnull));
+struct pcap_pkthdr;
+/*
+ * Pass a batch of packets to the plugins, as if they were captured on the
+ * given interface (in the given direction and with the given PCAP link
+ * type). The packets are handled the same way as the captured ones, except
+ * there's no capture. It is for the benchmarks, which run the plugins on
+ * generated traffic.
+ */
+void loop_packets_inject(struct loop *loop, const char *interface, bool in, int datalink, size_t count, const struct pcap_pkthdr *headers, const unsigned char *const *data) __attribute__((nonnull));
 void loop_destroy(struct loop *loop) __attribute__((nonnull));
 // Like fork, but closes FDs and stuff in the child. Do not use the loop in the child! Designed to exec in child afterwards.
 pid_t loop_fork(struct loop *loop) __attribute__((nonnull));
@@ -59,6 +69,8 @@ pid_t loop_fork(struct loop *loop) __attribute__((nonnull));
  * The statistics are diff from the last time this function was called.
  */
 size_t *loop_pcap_stats(struct context *context) __attribute__((nonnull)) __attribute__((malloc)) __attribute__((returns_nonnull));
+// Statistics of the loop (the overload controller and the plugins), as a string allocated from the pool.
+char *loop_stats(struct loop *loop, struct mem_pool *pool) __attribute__((nonnull)) __attribute__((malloc)) __attribute__((returns_nonnull));
 /*
  * When you want to configure the loop, you start by loop_config_start. You get
  * a handle to the configurator. You can then call loop_add_pcap and
@@ -84,6 +96,34 @@ bool loop_add_pcap(struct loop_configurator *configurator, const char *interface
 bool loop_add_plugin(struct loop_configurator *configurator, const char *plugin) __attribute__((nonnull));
 // Set the remote endpoint of the uplink
 void loop_uplink_configure(struct loop_configurator *configurator, const char *remote, const char *service, const char *login, const char *password, const char *cert) __attribute__((nonnull(1,2,3)));
+// Keep the plugin messages in a spool file of the given size while the uplink is down
+void loop_uplink_spool(struct loop_configurator *configurator, const char *path, size_t size) __attribute__((nonnull));
+// Set the compression of the uplink (the codec letter, see codec.h) and its level
+void loop_uplink_compression(struct loop_configurator *configurator, char codec, int level) __attribute__((nonnull));
+
+// The steps the overload controller may take, in the order it takes them
+enum overload_step {
+	OVERLOAD_SAMPLE = 1 << 0, // Sample the packets for the low-priority plugins
+	OVERLOAD_SNAPLEN = 1 << 1, // Capture only the start of each packet
+	OVERLOAD_DISSECT = 1 << 2, // Don't parse the tunneled packets
+	OVERLOAD_PAUSE = 1 << 3 // Stop passing packets to low-priority plugins, one by one
+};
+
+struct overload_config {
+	unsigned steps; // The allowed steps (enum overload_step). 0 disables the controller.
+	uint32_t drop_high, drop_low; // Drop rate of the capture, in per mille
+	uint32_t load_high, load_low; // Time spent in the packet callbacks, in per cent
+	uint32_t hold; // How many calm checks in a row before stepping down
+	uint32_t sample_rate; // For the OVERLOAD_SAMPLE step
+	uint32_t snaplen; // For the OVERLOAD_SNAPLEN step
+	int protect_priority; // Plugins with at least this priority are never sampled or paused (so the default priority 0 is protected by default)
+};
+
+/*
+ * Configure the overload controller. If not called, the controller is off
+ * with the new configuration.
+ */
+void loop_overload_configure(struct loop_configurator *configurator, const struct overload_config *config) __attribute__((nonnull));
 /*
  * Provide a configuration option for a plugin. This will be given to the next plugin loaded by loop_add_plugin.
  *
@@ -111,6 +151,14 @@ void loop_plugin_reinit(struct context *context) __attribute__((nonnull)) __attr
 
 const char *loop_plugin_get_name(const struct context *context) __attribute__((nonnull)) __attribute__((const));
 bool loop_plugin_active(const struct context *context) __attribute__((nonnull));
+// Was the plugin active when the uplink got disconnected (so it may spool its messages)?
+bool loop_plugin_may_spool(const struct context *context) __attribute__((nonnull));
+/*
+ * How the messages of the plugin are scheduled in the uplink send queue, from
+ * the send_weight and send_class options. Returns the weight (the quanta it
+ * gets in a round) and sets interactive if its messages go before the bulk ones.
+ */
+uint32_t loop_plugin_send_weight(const struct context *context, bool *interactive) __attribute__((nonnull));
 /*
  * Set the uplink used by this loop. This may be called at most once on
  * a given loop.
@@ -123,6 +171,8 @@ void loop_uplink_disconnected(struct loop *loop) __attribute__((nonnull));
 
 // Register a file descriptor for reading & closing events. Removed on close.
 void loop_register_fd(struct loop *loop, int fd, struct epoll_handler *handler) __attribute__((nonnull));
+// Start or stop watching the registered FD for being writable as well (eg. to wait for non-blocking connect)
+void loop_fd_want_write(struct loop *loop, int fd, struct epoll_handler *handler, bool want) __attribute__((nonnull));
 /*
  * Remove the FD from epoll.
  *
@@ -180,4 +230,42 @@ uint64_t loop_now(struct loop *loop) __attribute__((pure));
 // Activate or deactivate plugins. If needed, send update of plugin versions and/or errors.
 void loop_plugin_activation(struct loop *loop, struct plugin_activation *plugins, size_t count) __attribute__((nonnull));
 
+/*
+ * Set the memory budget of a plugin (in bytes, 0 means unlimited). When the memory
+ * held by all the plugin's pools crosses the soft limit, the plugin's
+ * memory_pressure_callback is called. When it crosses the hard limit, the plugin
+ * is reinitialized.
+ *
+ * The budget may also be set by the memory_soft_limit and memory_hard_limit
+ * options of the plugin (in KiB).
+ *
+ * Returns false if no such plugin exists.
+ */
+bool loop_plugin_memory_budget(struct loop *loop, const char *plugin, size_t soft_limit, size_t hard_limit) __attribute__((nonnull));
+// How many bytes of memory all the pools of the plugin hold.
+size_t loop_plugin_memory_usage(const struct context *context) __attribute__((nonnull));
+
+enum sample_mode {
+	SAMPLE_PACKETS = 'P', // Every sample_rate-th packet
+	SAMPLE_FLOWS = 'F' // All the packets of the flows whose hash is divisible by sample_rate
+};
+
+/*
+ * Pass only one in rate packets (or flows) to the plugin (1 means all of them).
+ * The flows are chosen by a hash of the addresses, ports and protocol, the
+ * same in both directions and in all the plugins. Packets without addresses
+ * are sampled one in rate even in the flow mode.
+ *
+ * It may also be set by the sample_rate and sample_mode (packet or flow)
+ * options of the plugin. Only plugins with sample_scaled set are sampled.
+ *
+ * Returns false if no such plugin exists.
+ */
+bool loop_plugin_sampling(struct loop *loop, const char *plugin, enum sample_mode mode, uint32_t rate) __attribute__((nonnull));
+/*
+ * The current sampling rate of the plugin (1 if it gets all the packets). The
+ * plugin may multiply its counts by it to estimate the real ones.
+ */
+uint32_t loop_plugin_sample_rate(const struct context *context) __attribute__((nonnull));
+
 #endif
@@ -0,0 +1,266 @@
+/*
+    Ucollect - small utility for real-time analysis of network data
+    Copyright (C) 2015 CZ.NIC, z.s.p.o. (http://www.nic.cz/)
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#include "lpm.h"
+#include "trie.h"
+#include "mem_pool.h"
+#include "util.h"
+#include "tunable.h"
+
+#include <string.h>
+#include <stdbool.h>
+
+/*
+ * A node handles the prefixes with length from 8 * level + 1 to
+ * 8 * level + 8 bits, where level is the depth of the node. Each byte value
+ * has the data of the longest of them covering it (and its length, so a
+ * longer one doesn't get overwritten by a shorter one).
+ */
+struct lpm_node {
+	struct lpm_data *data[256];
+	uint8_t lengths[256]; // Prefix length of the data, 0 if there's none
+	struct lpm_node **children; // Allocated when the first child is added
+	size_t used; // Non-NULL data entries
+	size_t child_count;
+	struct lpm_node *next; // For the recycler
+};
+
+struct lpm {
+	struct lpm_node *roots[LPM_ADDR_MAX + 1]; // Indexed by the address length
+	struct lpm_data *defaults[LPM_ADDR_MAX + 1]; // The prefixes of length 0
+	/*
+	 * The prefixes as inserted, to find the shorter prefix to take place of
+	 * a deleted one. Keyed by address length, prefix length and the address.
+	 */
+	struct trie *prefixes;
+	struct mem_pool *pool;
+	struct lpm_node *node_recycler;
+};
+
+struct trie_data {
+	struct lpm_data *data;
+};
+
+#define RECYCLER_NODE struct lpm_node
+#define RECYCLER_BASE struct lpm
+#define RECYCLER_HEAD node_recycler
+#define RECYCLER_NAME(X) node_recycler_##X
+#include "recycler.h"
+
+struct lpm *lpm_create(struct mem_pool *pool) {
+	ulog(LLOG_DEBUG, "Creating LPM table\n");
+	struct lpm *result = mem_pool_alloc(pool, sizeof *result);
+	*result = (struct lpm) {
+		.prefixes = trie_alloc(pool),
+		.pool = pool
+	};
+	return result;
+}
+
+static void check_prefix(size_t addr_len, size_t prefix_len) {
+	sanity(addr_len && addr_len <= LPM_ADDR_MAX, "Unsupported LPM address length %zu\n", addr_len);
+	sanity(prefix_len <= 8 * addr_len, "LPM prefix length %zu too long for %zu bytes of address\n", prefix_len, addr_len);
+}
+
+// The key of the prefix in the prefixes trie. Returns its length.
+static size_t prefix_key(uint8_t *key, const uint8_t *addr, size_t addr_len, size_t prefix_len) {
+	key[0] = addr_len;
+	key[1] = prefix_len;
+	size_t bytes = (prefix_len + 7) / 8;
+	memcpy(key + 2, addr, bytes);
+	if (prefix_len % 8)
+		key[1 + bytes] &= 0xFF << (8 - prefix_len % 8);
+	return 2 + bytes;
+}
+
+static struct lpm_data *original_get(const struct lpm *lpm, const uint8_t *addr, size_t addr_len, size_t prefix_len) {
+	uint8_t key[2 + LPM_ADDR_MAX];
+	struct trie_data *original = trie_lookup(lpm->prefixes, key, prefix_key(key, addr, addr_len, prefix_len));
+	return original ? original->data : NULL;
+}
+
+static struct lpm_node *node_create(struct lpm *lpm) {
+	bool recycled = lpm->node_recycler;
+	struct lpm_node *result = node_recycler_get(lpm, lpm->pool);
+	// The nodes are released only when empty, so the recycled ones are clean (maybe with an empty children array)
+	if (!recycled)
+		memset(result, 0, sizeof *result);
+	return result;
+}
+
+static void node_set(struct lpm_node *node, size_t byte, struct lpm_data *data, size_t prefix_len) {
+	if (!node->data[byte] && data)
+		node->used ++;
+	else if (node->data[byte] && !data)
+		node->used --;
+	node->data[byte] = data;
+	node->lengths[byte] = prefix_len;
+}
+
+// The range of byte values covered by the prefix in its node
+static void prefix_range(const uint8_t *addr, size_t prefix_len, size_t *level, size_t *first, size_t *count) {
+	*level = (prefix_len - 1) / 8;
+	size_t bits = prefix_len - 8 * *level;
+	*count = 1 << (8 - bits);
+	*first = addr[*level] & ~(*count - 1);
+}
+
+struct lpm_data *lpm_insert(struct lpm *lpm, const uint8_t *addr, size_t addr_len, size_t prefix_len, struct lpm_data *data) {
+	check_prefix(addr_len, prefix_len);
+	ulog(LLOG_DEBUG_VERBOSE, "Inserting LPM prefix of %zu bits to %zu-byte addresses\n", prefix_len, addr_len);
+	uint8_t key[2 + LPM_ADDR_MAX];
+	struct trie_data **original = trie_index(lpm->prefixes, key, prefix_key(key, addr, addr_len, prefix_len));
+	struct lpm_data *result = NULL;
+	if (*original) {
+		result = (*original)->data;
+	} else {
+		*original = mem_pool_alloc(lpm->pool, sizeof **original);
+	}
+	(*original)->data = data;
+	if (!prefix_len) {
+		lpm->defaults[addr_len] = data;
+		return result;
+	}
+	size_t level, first, count;
+	prefix_range(addr, prefix_len, &level, &first, &count);
+	struct lpm_node **node = &lpm->roots[addr_len];
+	for (size_t i = 0; i <= level; i ++) {
+		if (!*node)
+			*node = node_create(lpm);
+		if (i == level)
+			break;
+		struct lpm_node *parent = *node;
+		if (!parent->children) {
+			parent->children = mem_pool_alloc(lpm->pool, 256 * sizeof *parent->children);
+			memset(parent->children, 0, 256 * sizeof *parent->children);
+		}
+		node = &parent->children[addr[i]];
+		if (!*node)
+			parent->child_count ++;
+	}
+	for (size_t i = first; i < first + count; i ++)
+		if ((*node)->lengths[i] <= prefix_len)
+			node_set(*node, i, data, prefix_len);
+	return result;
+}
+
+struct lpm_data *lpm_delete(struct lpm *lpm, const uint8_t *addr, size_t addr_len, size_t prefix_len) {
+	check_prefix(addr_len, prefix_len);
+	ulog(LLOG_DEBUG_VERBOSE, "Deleting LPM prefix of %zu bits from %zu-byte addresses\n", prefix_len, addr_len);
+	uint8_t key[2 + LPM_ADDR_MAX];
+	size_t key_size = prefix_key(key, addr, addr_len, prefix_len);
+	struct trie_data *original = trie_lookup(lpm->prefixes, key, key_size);
+	if (!original)
+		return NULL;
+	struct lpm_data *result = original->data;
+	trie_delete(lpm->prefixes, key, key_size);
+	if (!prefix_len) {
+		lpm->defaults[addr_len] = NULL;
+		return result;
+	}
+	size_t level, first, count;
+	prefix_range(addr, prefix_len, &level, &first, &count);
+	// The path to the node, to remove the ones left empty
+	struct lpm_node **path[LPM_ADDR_MAX];
+	path[0] = &lpm->roots[addr_len];
+	for (size_t i = 0; i < level; i ++)
+		path[i + 1] = &(*path[i])->children[addr[i]];
+	struct lpm_node *node = *path[level];
+	for (size_t i = first; i < first + count; i ++) {
+		if (node->lengths[i] != prefix_len)
+			continue; // Covered by a longer prefix
+		// Find the next shorter prefix in this node covering the byte
+		uint8_t covered[LPM_ADDR_MAX];
+		memcpy(covered, addr, level);
+		covered[level] = i;
+		struct lpm_data *replacement = NULL;
+		size_t replacement_len = prefix_len - 1;
+		for (; replacement_len > 8 * level; replacement_len --)
+			if ((replacement = original_get(lpm, covered, addr_len, replacement_len)))
+				break;
+		node_set(node, i, replacement, replacement ? replacement_len : 0);
+	}
+	// Drop the nodes without any data and children
+	for (size_t i = level + 1; i > 0; i --) {
+		node = *path[i - 1];
+		if (node->used || node->child_count)
+			break;
+		*path[i - 1] = NULL;
+		if (i > 1)
+			(*path[i - 2])->child_count --;
+		node_recycler_release(lpm, node);
+	}
+	return result;
+}
+
+struct lpm *lpm_build(struct mem_pool *pool, const struct lpm_prefix *prefixes, size_t count) {
+	struct lpm *result = lpm_create(pool);
+	for (size_t i = 0; i < count; i ++)
+		lpm_insert(result, prefixes[i].addr, prefixes[i].addr_len, prefixes[i].prefix_len, prefixes[i].data);
+	return result;
+}
+
+struct lpm_data *lpm_lookup(const struct lpm *lpm, const uint8_t *addr, size_t addr_len) {
+	sanity(addr_len && addr_len <= LPM_ADDR_MAX, "Unsupported LPM address length %zu\n", addr_len);
+	struct lpm_data *result = lpm->defaults[addr_len];
+	const struct lpm_node *node = lpm->roots[addr_len];
+	for (size_t i = 0; node && i < addr_len; i ++) {
+		uint8_t byte = addr[i];
+		if (node->data[byte])
+			result = node->data[byte];
+		node = node->children ? node->children[byte] : NULL;
+	}
+	return result;
+}
+
+void lpm_lookup_batch(const struct lpm *lpm, const uint8_t *const *addrs, size_t addr_len, size_t count, struct lpm_data **results) {
+	sanity(addr_len && addr_len <= LPM_ADDR_MAX, "Unsupported LPM address length %zu\n", addr_len);
+	for (size_t base = 0; base < count; base += LPM_BATCH) {
+		size_t batch = count - base < LPM_BATCH ? count - base : LPM_BATCH;
+		const uint8_t *const *batch_addrs = addrs + base;
+		struct lpm_data **batch_results = results + base;
+		const struct lpm_node *nodes[LPM_BATCH];
+		for (size_t i = 0; i < batch; i ++) {
+			nodes[i] = lpm->roots[addr_len];
+			batch_results[i] = lpm->defaults[addr_len];
+		}
+		bool active = true;
+		for (size_t level = 0; active && level < addr_len; level ++) {
+			active = false;
+			for (size_t i = 0; i < batch; i ++) {
+				const struct lpm_node *node = nodes[i];
+				if (!node)
+					continue;
+				uint8_t byte = batch_addrs[i][level];
+				if (node->data[byte])
+					batch_results[i] = node->data[byte];
+				node = nodes[i] = node->children ? node->children[byte] : NULL;
+				if (node && level + 1 < addr_len) {
+					// Start loading the next level, it'll be needed after the rest of the batch
+					__builtin_prefetch(&node->data[batch_addrs[i][level + 1]]);
+					active = true;
+				}
+			}
+		}
+	}
+}
+
+size_t lpm_size(const struct lpm *lpm) {
+	return trie_size(lpm->prefixes);
+}
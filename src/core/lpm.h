@@ -0,0 +1,81 @@
+/*
+    Ucollect - small utility for real-time analysis of network data
+    Copyright (C) 2015 CZ.NIC, z.s.p.o. (http://www.nic.cz/)
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#ifndef UCOLLECT_CORE_LPM_H
+#define UCOLLECT_CORE_LPM_H
+
+/*
+ * Longest prefix match table, mapping address prefixes (like 192.0.2.0/24
+ * or 2001:db8::/32) to user data.
+ *
+ * It is a multi-bit trie, branching on a whole byte of the address in each
+ * level. The prefixes not ending on a byte boundary are expanded to all the
+ * byte values they cover, so the lookup is a single array access per byte
+ * of the address (at most 4 for IPv4 and 16 for IPv6), no matter how many
+ * prefixes there are.
+ *
+ * Addresses of different lengths (eg. IPv4 and IPv6) live in the same table
+ * independently of each other. The address length may be at most
+ * LPM_ADDR_MAX bytes.
+ */
+
+#include <stdint.h>
+#include <stdlib.h>
+
+#define LPM_ADDR_MAX 16
+
+// User data to store in the table. Each module/plugin can have different implementation.
+struct lpm_data;
+struct lpm;
+struct mem_pool;
+
+struct lpm_prefix {
+	const uint8_t *addr;
+	size_t addr_len; // In bytes
+	size_t prefix_len; // In bits
+	struct lpm_data *data;
+};
+
+/*
+ * Create an empty table, allocated from the pool. There's no destroy
+ * function, reset the pool.
+ */
+struct lpm *lpm_create(struct mem_pool *pool) __attribute__((nonnull)) __attribute__((malloc)) __attribute__((returns_nonnull));
+// Create a table and fill it with the prefixes. If some prefix is there multiple times, the last one wins.
+struct lpm *lpm_build(struct mem_pool *pool, const struct lpm_prefix *prefixes, size_t count) __attribute__((nonnull(1))) __attribute__((malloc)) __attribute__((returns_nonnull));
+/*
+ * Add a prefix (the bits of the address after the prefix length are ignored).
+ * If the same prefix is already there, its data is replaced and the old one
+ * is returned. Otherwise NULL is returned. The data must not be NULL.
+ */
+struct lpm_data *lpm_insert(struct lpm *lpm, const uint8_t *addr, size_t addr_len, size_t prefix_len, struct lpm_data *data) __attribute__((nonnull(1, 5)));
+// Remove a prefix. Returns its data, or NULL if it was not there.
+struct lpm_data *lpm_delete(struct lpm *lpm, const uint8_t *addr, size_t addr_len, size_t prefix_len) __attribute__((nonnull(1)));
+// Find the data of the longest prefix containing the address, NULL if none does.
+struct lpm_data *lpm_lookup(const struct lpm *lpm, const uint8_t *addr, size_t addr_len) __attribute__((nonnull)) __attribute__((pure));
+/*
+ * Look up multiple addresses of the same length at once. The walks through the
+ * levels of the table are interleaved, so the memory accesses of one address
+ * overlap with the others.
+ */
+void lpm_lookup_batch(const struct lpm *lpm, const uint8_t *const *addrs, size_t addr_len, size_t count, struct lpm_data **results) __attribute__((nonnull));
+// Number of prefixes in the table.
+size_t lpm_size(const struct lpm *lpm) __attribute__((nonnull)) __attribute__((pure));
+
+#endif
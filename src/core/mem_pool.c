@@ -17,6 +17,11 @@
     51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
 */
 
+#ifdef MEM_POOL_PROFILE
+// For dladdr
+#define _GNU_SOURCE
+#endif
+
 #include "mem_pool.h"
 #include "util.h"
 #include "tunable.h"
@@ -30,6 +35,17 @@
 #include <stdlib.h>
 #include <stdint.h>
 
+#ifdef MEM_POOL_PROFILE
+#ifdef MEM_POOL_DEBUG
+#error "MEM_POOL_PROFILE can't be used together with MEM_POOL_DEBUG"
+#endif
+#include <dlfcn.h>
+// Who called the public function we are in. It must be used directly in it, not in some helper.
+#define CALLER __builtin_return_address(0)
+#else
+#define CALLER NULL
+#endif
+
 static void store(struct mem_pool *pool);
 static void drop(struct mem_pool *pool);
 
@@ -69,7 +85,8 @@ struct mem_pool *mem_pool_create(const char *name) {
 	return pool;
 }
 
-void *mem_pool_alloc(struct mem_pool *pool, size_t size) {
+static void *pool_alloc(struct mem_pool *pool, size_t size, const void *caller) {
+	(void) caller;
 	struct pool_chunk *chunk = malloc(sizeof *chunk + size + sizeof(uint32_t));
 	chunk->canary = POOL_CANARY_BEGIN;
 	// cppcheck-suppress uninitStructMember The data is not initialized, but we are allocation routine, it's up to the caller
@@ -83,6 +100,10 @@ void *mem_pool_alloc(struct mem_pool *pool, size_t size) {
 	return chunk->data;
 }
 
+void *mem_pool_alloc(struct mem_pool *pool, size_t size) {
+	return pool_alloc(pool, size, CALLER);
+}
+
 void mem_pool_reset(struct mem_pool *pool) {
 	while (pool->head) {
 		struct pool_chunk *current = pool->head;
@@ -123,6 +144,24 @@ struct pool_page {
 static struct pool_page *page_cache[PAGE_CACHE_SIZE];
 static size_t page_cache_size;
 
+#ifdef MEM_POOL_PROFILE
+// One call site seen allocating from a pool.
+struct pool_site {
+	const void *caller;
+	// Number of sampled allocations and bytes in them.
+	size_t samples, bytes;
+};
+
+struct pool_profile {
+	// How many allocations to skip before taking another sample.
+	size_t countdown;
+	// Statistics about the reset cycles. The current (unfinished) one is not included.
+	size_t cycles, cycle_max;
+	uint64_t cycle_total;
+	struct pool_site sites[MEM_POOL_PROFILE_SITES];
+};
+#endif
+
 struct mem_pool {
 	// First page.
 	struct pool_page *first;
@@ -132,6 +171,9 @@ struct mem_pool {
 	size_t available;
 	size_t pool_index;
 	size_t used, allocated, requests;
+#ifdef MEM_POOL_PROFILE
+	struct pool_profile profile;
+#endif
 	// The name of this memory pool (for debug and errors).
 	char name[];
 };
@@ -199,6 +241,83 @@ static void *page_alloc(unsigned char **pos, size_t *available, size_t size) {
 	return result;
 }
 
+#ifdef MEM_POOL_PROFILE
+/*
+ * Record a sample of an allocation. If all the slots for call sites are taken,
+ * the least used one is replaced and the new one inherits its counts (so the
+ * numbers of the newcomer are an upper bound). This makes sure the heavy
+ * allocators stay in the table even if there are more call sites than slots.
+ */
+static void profile_sample(struct pool_profile *profile, size_t size, const void *caller) {
+	if (profile->countdown) {
+		profile->countdown --;
+		return;
+	}
+	profile->countdown = MEM_POOL_PROFILE_SAMPLE - 1;
+	struct pool_site *victim = &profile->sites[0];
+	for (size_t i = 0; i < MEM_POOL_PROFILE_SITES; i ++) {
+		struct pool_site *site = &profile->sites[i];
+		// The slots are never freed, so the empty ones are after all the used ones.
+		if (site->caller == caller || !site->caller) {
+			victim = site;
+			break;
+		}
+		if (site->samples < victim->samples)
+			victim = site;
+	}
+	victim->caller = caller;
+	victim->samples ++;
+	victim->bytes += size;
+}
+
+static void profile_cycle(struct pool_profile *profile, size_t used) {
+	profile->cycles ++;
+	profile->cycle_total += used;
+	if (used > profile->cycle_max)
+		profile->cycle_max = used;
+}
+
+static const char *profile_site_name(struct mem_pool *tmp_pool, const void *caller) {
+	Dl_info info;
+	if (dladdr(caller, &info) && info.dli_fname) {
+		const char *file = rindex(info.dli_fname, '/');
+		file = file ? file + 1 : info.dli_fname;
+		if (info.dli_sname)
+			return mem_pool_printf(tmp_pool, "%s:%s+0x%zx", file, info.dli_sname, (size_t)((const uint8_t *)caller - (const uint8_t *)info.dli_saddr));
+		else
+			return mem_pool_printf(tmp_pool, "%s+0x%zx", file, (size_t)((const uint8_t *)caller - (const uint8_t *)info.dli_fbase));
+	} else
+		return mem_pool_printf(tmp_pool, "%p", caller);
+}
+
+/*
+ * Describe the profile of the pool. The numbers of the call sites are estimates
+ * (the samples multiplied by the sampling rate).
+ *
+ * Don't use commas in the output, the statistics are split by them.
+ */
+static const char *profile_describe(struct mem_pool *tmp_pool, const struct mem_pool *pool) {
+	const struct pool_profile *profile = &pool->profile;
+	struct pool_site sites[MEM_POOL_PROFILE_SITES];
+	memcpy(sites, profile->sites, sizeof sites);
+	const char *result = mem_pool_printf(tmp_pool, " cycles=%zu avg=%zu max=%zu top=", profile->cycles, profile->cycles ? (size_t)(profile->cycle_total / profile->cycles) : pool->used, profile->cycle_max > pool->used ? profile->cycle_max : pool->used);
+	for (size_t i = 0; i < MEM_POOL_PROFILE_TOP && i < MEM_POOL_PROFILE_SITES; i ++) {
+		// Select the i-th biggest allocator
+		size_t best = i;
+		for (size_t j = i + 1; j < MEM_POOL_PROFILE_SITES; j ++)
+			if (sites[j].bytes > sites[best].bytes)
+				best = j;
+		if (!sites[best].caller)
+			break;
+		struct pool_site tmp = sites[i];
+		sites[i] = sites[best];
+		sites[best] = tmp;
+		result = mem_pool_printf(tmp_pool, "%s%s%s ~%zuB/~%zu", result, i ? " | " : "", profile_site_name(tmp_pool, sites[i].caller), sites[i].bytes * MEM_POOL_PROFILE_SAMPLE, sites[i].samples * MEM_POOL_PROFILE_SAMPLE);
+	}
+	return result;
+}
+#endif
+
 static void page_walk_and_delete(struct pool_page *page, const char *name) {
 	// As the name is in the first page, do it from the end, using recursion.
 	if (page) {
@@ -245,7 +364,7 @@ void mem_pool_destroy(struct mem_pool *pool) {
 	page_walk_and_delete(pool->first, pool->name);
 }
 
-void *mem_pool_alloc(struct mem_pool *pool, size_t size) {
+static void *pool_alloc(struct mem_pool *pool, size_t size, const void *caller) {
 	void *result = page_alloc(&pool->pos, &pool->available, size);
 	if (!result) { // There's not enough space in this page, get another one.
 		/*
@@ -280,9 +399,18 @@ void *mem_pool_alloc(struct mem_pool *pool, size_t size) {
 	}
 	pool->used += size;
 	pool->requests ++;
+#ifdef MEM_POOL_PROFILE
+	profile_sample(&pool->profile, size, caller);
+#else
+	(void) caller;
+#endif
 	return result;
 }
 
+void *mem_pool_alloc(struct mem_pool *pool, size_t size) {
+	return pool_alloc(pool, size, CALLER);
+}
+
 void mem_pool_reset(struct mem_pool *pool) {
 	// Release all the pages except the first one (may be NULL).
 	page_walk_and_delete(pool->first->next, pool->name);
@@ -291,6 +419,9 @@ void mem_pool_reset(struct mem_pool *pool) {
 	pool->available = pool->first->size - sizeof *pool->first;
 	pool->first->next = NULL;
 	pool->allocated = PAGE_SIZE;
+#ifdef MEM_POOL_PROFILE
+	profile_cycle(&pool->profile, pool->used);
+#endif
 	pool->used = 0;
 	pool->requests = 0;
 	// Allocate the pool (again) from the page. It is already there.
@@ -306,6 +437,10 @@ void mem_pool_reset(struct mem_pool *pool) {
 static struct mem_pool **pools;
 size_t pool_count;
 
+size_t mem_pool_allocated(const struct mem_pool *pool) {
+	return pool->allocated;
+}
+
 static void store(struct mem_pool *pool) {
 	// cppcheck-suppress memleakOnRealloc ‒ if it returns NULL, we crash anyway
 	pools = realloc(pools, (++ pool_count) * sizeof *pools);
@@ -324,7 +459,7 @@ static void drop(struct mem_pool *pool) {
 
 char *mem_pool_strdup(struct mem_pool *pool, const char *string) {
 	size_t length = strlen(string);
-	char *result = mem_pool_alloc(pool, length + 1);
+	char *result = pool_alloc(pool, length + 1, CALLER);
 	strcpy(result, string);
 	return result;
 }
@@ -336,7 +471,7 @@ char *mem_pool_printf(struct mem_pool *pool, const char *format, ...) {
 	// First find out how many bytes are needed
 	size_t needed = vsnprintf(NULL, 0, format, args) + 1;
 	// Allocate and render the result
-	char *result = mem_pool_alloc(pool, needed);
+	char *result = pool_alloc(pool, needed, CALLER);
 	size_t written = vsnprintf(result, needed, format, args_copy);
 	va_end(args);
 	va_end(args_copy);
@@ -346,7 +481,7 @@ char *mem_pool_printf(struct mem_pool *pool, const char *format, ...) {
 }
 
 char *mem_pool_hex(struct mem_pool *pool, const uint8_t *data, size_t size) {
-	char *result = mem_pool_alloc(pool, 3*size);
+	char *result = pool_alloc(pool, 3*size, CALLER);
 	for (size_t i = 0; i < size; i ++)
 		sprintf(result + 3*i, "%.2hhX%c", data[i], ((i+1) % 4) ? ':' : ' ');
 	result[size ? 3*size-1 : 0] = '\0';
@@ -358,7 +493,11 @@ char *mem_pool_stats(struct mem_pool *tmp_pool) {
 	size_t len = 1;
 	for (size_t i = 0; i < pool_count; i ++) {
 		struct mem_pool *p = pools[i];
+#ifdef MEM_POOL_PROFILE
+		parts[i] = mem_pool_printf(tmp_pool, "%s: %zu/%zu (%zu)%s", p->name, p->used, p->allocated, p->requests, profile_describe(tmp_pool, p));
+#else
 		parts[i] = mem_pool_printf(tmp_pool, "%s: %zu/%zu (%zu)", p->name, p->used, p->allocated, p->requests);
+#endif
 		len += 2 + strlen(parts[i]);
 	}
 	char *result = mem_pool_alloc(tmp_pool, len);
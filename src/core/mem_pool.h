@@ -35,6 +35,8 @@ void mem_pool_destroy(struct mem_pool *pool) __attribute__((nonnull));
 void *mem_pool_alloc(struct mem_pool *pool, size_t size) __attribute__((malloc)) __attribute__((nonnull)) __attribute__((alloc_size(2))) __attribute__((returns_nonnull));
 // Free all memory allocated from this memory pool. The pool can be used to get more allocations.
 void mem_pool_reset(struct mem_pool *pool) __attribute__((nonnull));
+// How many bytes of memory the pool holds (including the overhead and unused space).
+size_t mem_pool_allocated(const struct mem_pool *pool) __attribute__((nonnull)) __attribute__((pure));
 
 // Some convenience functions
 
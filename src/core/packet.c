@@ -54,7 +54,9 @@ struct tcp_ports {
 	uint8_t flags;
 };
 
-static void parse_internal(struct packet_info *packet, struct mem_pool *pool) {
+static void parse_packet(struct packet_info *packet, struct mem_pool *pool, int datalink, bool tunnels);
+
+static void parse_internal(struct packet_info *packet, struct mem_pool *pool, bool tunnels) {
 	ulog(LLOG_DEBUG_VERBOSE, "Parse IP packet\n");
 	packet->app_protocol_raw = 0xff;
 	/*
@@ -125,15 +127,18 @@ static void parse_internal(struct packet_info *packet, struct mem_pool *pool) {
 		case 41: // And v6
 			packet->app_protocol = packet->app_protocol_raw == 4 ? '4' : '6';
 			ulog(LLOG_DEBUG_VERBOSE, "There's a IPv%c packet inside\n", packet->app_protocol);
+			if (!tunnels)
+				return; // Asked not to look inside
 			// Create a new structure for the packet and parse recursively
 			struct packet_info *next = mem_pool_alloc(pool, sizeof *packet->next);
 			packet->next = next;
 			next->data = below_ip;
 			next->length = length_rest;
+			next->wire_length = packet->wire_length - packet->hdr_length;
 			next->interface = packet->interface;
 			next->direction = packet->direction;
 			next->timestamp = packet->timestamp;
-			uc_parse_packet(next, pool, DLT_RAW);
+			parse_packet(next, pool, DLT_RAW, tunnels);
 			return; // And we're done (no ports here)
 		case 6: // TCP
 			if (length_rest < sizeof *tcp_ports)
@@ -194,7 +199,7 @@ static void postprocess(struct packet_info *packet) {
 		packet->vlan_tag = 0;
 }
 
-static void parse_type(struct packet_info *packet, struct mem_pool *pool, const unsigned char *data) {
+static void parse_type(struct packet_info *packet, struct mem_pool *pool, const unsigned char *data, bool tunnels) {
 	uint16_t type = ntohs(*(uint16_t *) data);
 	// VLAN tagging
 	size_t skipped = data - (const uint8_t *)packet->data;
@@ -228,6 +233,7 @@ static void parse_type(struct packet_info *packet, struct mem_pool *pool, const
 	(*next) = (struct packet_info) {
 		.data = data,
 		.length = packet->length - skipped,
+		.wire_length = packet->wire_length - skipped,
 		.interface = packet->interface,
 		.direction = packet->direction,
 		.timestamp = packet->timestamp,
@@ -242,7 +248,7 @@ static void parse_type(struct packet_info *packet, struct mem_pool *pool, const
 		IP:
 			packet->app_protocol = 'I';
 			// Parse the IP part
-			uc_parse_packet(next, pool, DLT_RAW);
+			parse_packet(next, pool, DLT_RAW, tunnels);
 			// Put the packet in.
 			packet->next = next;
 			break;
@@ -269,7 +275,7 @@ static void parse_type(struct packet_info *packet, struct mem_pool *pool, const
 	}
 }
 
-static void parse_ethernet(struct packet_info *packet, struct mem_pool *pool) {
+static void parse_ethernet(struct packet_info *packet, struct mem_pool *pool, bool tunnels) {
 	ulog(LLOG_DEBUG_VERBOSE, "Parse ethernet\n");
 	const unsigned char *data = packet->data;
 	if (packet->length < 14)
@@ -286,13 +292,13 @@ static void parse_ethernet(struct packet_info *packet, struct mem_pool *pool) {
 	packet->addresses[END_SRC] = data;
 	data += 6;
 	packet->addr_len = 6;
-	parse_type(packet, pool, data);
+	parse_type(packet, pool, data, tunnels);
 }
 
 /*
  * The linux cooked capture. Slightly different than ethernet, but not that much.
  */
-static void parse_cooked(struct packet_info *packet, struct mem_pool *pool) {
+static void parse_cooked(struct packet_info *packet, struct mem_pool *pool, bool tunnels) {
 	const unsigned char *data = packet->data;
 	if (packet->length < 16)
 		return;
@@ -305,29 +311,41 @@ static void parse_cooked(struct packet_info *packet, struct mem_pool *pool) {
 	packet->addresses[END_DST] = NULL;
 	packet->addresses[END_SRC] = data;
 	data += 8;
-	parse_type(packet, pool, data);
+	parse_type(packet, pool, data, tunnels);
 }
 
-void uc_parse_packet(struct packet_info *packet, struct mem_pool *pool, int datalink) {
+static void parse_packet(struct packet_info *packet, struct mem_pool *pool, int datalink, bool tunnels) {
 	ulog(LLOG_DEBUG_VERBOSE, "Uc parse packet at %i\n", datalink);
 	packet->layer_raw = datalink;
 	switch (datalink) {
 		case DLT_EN10MB: // Ethernet II
 		case DLT_IEEE802: // The same format, but different signalling which we're not interested in.
 			packet->layer = 'E';
-			parse_ethernet(packet, pool);
+			parse_ethernet(packet, pool, tunnels);
 			break;
 		case DLT_RAW: // RAW IP (already parsed out, possibly)
 			packet->layer = 'I';
-			parse_internal(packet, pool);
+			parse_internal(packet, pool, tunnels);
 			postprocess(packet);
 			break;
 		case DLT_LINUX_SLL: // Linux cooked capture
 			packet->layer = 'S';
-			parse_cooked(packet, pool);
+			parse_cooked(packet, pool, tunnels);
 			break;
 		default:
 			packet->layer = '?';
 			break;
 	}
 }
+
+void uc_parse_packet(struct packet_info *packet, struct mem_pool *pool, int datalink) {
+	if (packet->wire_length < packet->length)
+		packet->wire_length = packet->length;
+	parse_packet(packet, pool, datalink, true);
+}
+
+void uc_parse_packet_shallow(struct packet_info *packet, struct mem_pool *pool, int datalink) {
+	if (packet->wire_length < packet->length)
+		packet->wire_length = packet->length;
+	parse_packet(packet, pool, datalink, false);
+}
@@ -133,13 +133,25 @@ struct packet_info {
 	uint8_t tcp_flags;
 	// If non-zero, it holds the IEEE 802.1Q VLAN tag. The AD tags are not preserved here.
 	uint16_t vlan_tag;
+	/*
+	 * Length of the packet on the wire. It is larger than length if only the
+	 * start of the packet was captured (the overload controller may do that).
+	 * Count the traffic by this one, but access the data by length.
+	 */
+	size_t wire_length;
 };
 
 /*
  * Parse the stuff in the passed packet. It expects length and data are already
- * set, it fills the addresses, protocols, etc.
+ * set, it fills the addresses, protocols, etc. The wire_length may be set too,
+ * it is set to length if it is smaller.
  */
 void uc_parse_packet(struct packet_info *packet, struct mem_pool *pool, int datalink) __attribute__((nonnull));
+/*
+ * The same, but it doesn't parse the packets encapsulated in IP (app_protocol
+ * '4' and '6'), their next stays NULL. Used to save some work when overloaded.
+ */
+void uc_parse_packet_shallow(struct packet_info *packet, struct mem_pool *pool, int datalink) __attribute__((nonnull));
 
 /*
  * Which endpoint is the local one for the given direction?
@@ -58,8 +58,14 @@ struct plugin {
 	/* ----- The below things are available only from API version 2 and above ----- */
 	// Broadcasted when a child of ucollect dies. It may belong to other plugin, for example. The state is one from the wait() function.
 	void (*child_died_callback)(struct context *context, int state, pid_t child);
+	/* ----- The below things are available only from API version 3 and above ----- */
+	// The plugin's memory crossed its soft limit. It should free whatever it can (flush data, drop caches…).
+	void (*memory_pressure_callback)(struct context *context);
+	/* ----- The below things are available only from API version 4 and above ----- */
+	// The plugin scales its counts by loop_plugin_sample_rate(). Only such plugins are ever sampled.
+	bool sample_scaled;
 };
 
-#define UCOLLECT_PLUGIN_API_VERSION 2
+#define UCOLLECT_PLUGIN_API_VERSION 4
 
 #endif
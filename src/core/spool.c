@@ -0,0 +1,317 @@
+/*
+    Ucollect - small utility for real-time analysis of network data
+    Copyright (C) 2015 CZ.NIC, z.s.p.o. (http://www.nic.cz/)
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#include "spool.h"
+#include "mem_pool.h"
+#include "util.h"
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <time.h>
+
+// "UCS2" ‒ ucollect spool, version 2 (the records have flags)
+#define SPOOL_MAGIC 0x55435332
+#define SPOOL_ALIGN 8
+
+/*
+ * The file starts with the header, the rest is a ring of records. The records
+ * don't wrap. When there's not enough space at the end of the file for
+ * a record, it is placed at the start of the data area and the wrap remembers
+ * where the records before it end.
+ *
+ * So the records are either between begin and end, or between begin and wrap
+ * and then between the start of the data area and end.
+ */
+struct spool_header {
+	uint32_t magic;
+	uint32_t next_seq; // The sequence number of the next record appended
+	uint64_t size; // Of the whole file
+	uint64_t begin, end, wrap; // Offsets in the file, wrap is 0 if the records don't wrap
+	uint64_t count; // Records held
+};
+
+#define HEADER_SIZE ((sizeof(struct spool_header) + SPOOL_ALIGN - 1) / SPOOL_ALIGN * SPOOL_ALIGN)
+
+enum record_flags {
+	RECORD_DISCARDED = 1 << 0 // Taken, but it won't be acknowledged. Dropped once the ones before it are.
+};
+
+struct spool_record {
+	uint32_t seq;
+	uint32_t size; // Of the data, without this header and padding
+	uint64_t time;
+	uint32_t flags;
+	uint32_t padding;
+	uint8_t data[];
+};
+
+struct spool {
+	const char *path;
+	int fd;
+	uint8_t *map;
+	struct spool_header *header;
+	uint64_t cursor; // Offset of the record for spool_next
+	size_t taken; // Records between begin and cursor
+};
+
+static size_t record_len(size_t size) {
+	return (sizeof(struct spool_record) + size + SPOOL_ALIGN - 1) / SPOOL_ALIGN * SPOOL_ALIGN;
+}
+
+static struct spool_record *record_get(const struct spool *spool, uint64_t offset) {
+	return (struct spool_record *)(spool->map + offset);
+}
+
+// The offset of the record after the one at offset
+static uint64_t record_skip(const struct spool *spool, uint64_t offset) {
+	offset += record_len(record_get(spool, offset)->size);
+	if (spool->header->wrap && offset == spool->header->wrap)
+		offset = HEADER_SIZE;
+	return offset;
+}
+
+static void spool_reset(struct spool *spool) {
+	struct spool_header *header = spool->header;
+	header->begin = header->end = HEADER_SIZE;
+	header->wrap = 0;
+	header->count = 0;
+	spool->cursor = HEADER_SIZE;
+	spool->taken = 0;
+}
+
+// Check the records left from the last run are consistent with the header
+static bool records_valid(const struct spool *spool) {
+	const struct spool_header *header = spool->header;
+	if (header->begin < HEADER_SIZE || header->end < HEADER_SIZE || header->end > header->size || header->begin > header->size)
+		return false;
+	if (header->wrap ? (header->wrap < header->begin || header->wrap > header->size || header->end > header->begin) : header->end < header->begin)
+		return false;
+	uint64_t offset = header->begin;
+	for (uint64_t i = 0; i < header->count; i ++) {
+		// The record must end before the end or wrap of its part of the ring
+		uint64_t limit = header->wrap && offset >= header->begin ? header->wrap : header->end;
+		if (offset + sizeof(struct spool_record) > limit || offset + record_len(record_get(spool, offset)->size) > limit)
+			return false;
+		offset = record_skip(spool, offset);
+	}
+	return offset == header->end;
+}
+
+struct spool *spool_open(struct mem_pool *pool, const char *path, size_t size) {
+	ulog(LLOG_INFO, "Opening spool %s of %zu bytes\n", path, size);
+	if (size < HEADER_SIZE + record_len(0)) {
+		ulog(LLOG_ERROR, "Spool size %zu is too small\n", size);
+		return NULL;
+	}
+	int fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+	if (fd == -1) {
+		ulog(LLOG_ERROR, "Can't open spool %s: %s\n", path, strerror(errno));
+		return NULL;
+	}
+	struct stat st;
+	if (fstat(fd, &st) == -1) {
+		ulog(LLOG_ERROR, "Can't stat spool %s: %s\n", path, strerror(errno));
+		goto FAIL;
+	}
+	// Look at the old content before resizing, it may get cut
+	struct spool_header old = { .magic = 0 };
+	if ((size_t)st.st_size >= sizeof old && pread(fd, &old, sizeof old, 0) != sizeof old)
+		old.magic = 0;
+	bool keep = old.magic == SPOOL_MAGIC && old.size == (uint64_t)st.st_size && old.size == size;
+	if (old.magic == SPOOL_MAGIC && old.count && !keep)
+		ulog(LLOG_WARN, "Spool %s changed size from %llu to %zu, dropping %llu records\n", path, (unsigned long long)old.size, size, (unsigned long long)old.count);
+	if ((size_t)st.st_size != size && ftruncate(fd, size) == -1) {
+		ulog(LLOG_ERROR, "Can't resize spool %s: %s\n", path, strerror(errno));
+		goto FAIL;
+	}
+	// Reserve the space, so writing into the mapping doesn't crash with SIGBUS on full disk
+	int error = posix_fallocate(fd, 0, size);
+	if (error) {
+		ulog(LLOG_ERROR, "Can't allocate %zu bytes for spool %s: %s\n", size, path, strerror(error));
+		goto FAIL;
+	}
+	uint8_t *map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (map == MAP_FAILED) {
+		ulog(LLOG_ERROR, "Can't map spool %s: %s\n", path, strerror(errno));
+		goto FAIL;
+	}
+	struct spool *result = mem_pool_alloc(pool, sizeof *result);
+	*result = (struct spool) {
+		.path = mem_pool_strdup(pool, path),
+		.fd = fd,
+		.map = map,
+		.header = (struct spool_header *)map
+	};
+	if (keep && !records_valid(result)) {
+		ulog(LLOG_WARN, "Spool %s is corrupted, dropping %llu records\n", path, (unsigned long long)old.count);
+		keep = false;
+	}
+	if (keep) {
+		result->cursor = result->header->begin;
+		ulog(LLOG_INFO, "Spool %s holds %zu records\n", path, spool_count(result));
+	} else {
+		*result->header = (struct spool_header) {
+			.magic = SPOOL_MAGIC,
+			// Continue the sequence, in case some of the old records still travel
+			.next_seq = old.magic == SPOOL_MAGIC ? old.next_seq : 0,
+			.size = size
+		};
+		spool_reset(result);
+	}
+	return result;
+FAIL:
+	close(fd);
+	return NULL;
+}
+
+void spool_close(struct spool *spool) {
+	ulog(LLOG_INFO, "Closing spool %s with %zu records\n", spool->path, spool_count(spool));
+	if (munmap(spool->map, spool->header->size) == -1)
+		ulog(LLOG_ERROR, "Can't unmap spool %s: %s\n", spool->path, strerror(errno));
+	if (close(spool->fd) == -1)
+		ulog(LLOG_ERROR, "Can't close spool %s: %s\n", spool->path, strerror(errno));
+}
+
+bool spool_appendv(struct spool *spool, const struct iovec *iov, size_t count) {
+	struct spool_header *header = spool->header;
+	size_t size = 0;
+	for (size_t i = 0; i < count; i ++)
+		size += iov[i].iov_len;
+	if (size > UINT32_MAX)
+		return false;
+	size_t len = record_len(size);
+	uint64_t offset = header->end;
+	if (header->wrap) {
+		if (header->end + len > header->begin)
+			return false;
+	} else if (header->size - header->end < len) {
+		// Doesn't fit to the end, try the start of the data area
+		if (!header->count || HEADER_SIZE + len > header->begin)
+			return false; // If it's empty, the end is at the start already
+		offset = HEADER_SIZE;
+	}
+	struct spool_record *record = record_get(spool, offset);
+	record->seq = header->next_seq ++;
+	record->size = size;
+	record->time = time(NULL);
+	record->flags = 0;
+	record->padding = 0;
+	uint8_t *pos = record->data;
+	for (size_t i = 0; i < count; i ++)
+		if (iov[i].iov_len) {
+			memcpy(pos, iov[i].iov_base, iov[i].iov_len);
+			pos += iov[i].iov_len;
+		}
+	// Publish the record only after it is complete
+	if (offset != header->end)
+		header->wrap = header->end;
+	header->end = offset + len;
+	header->count ++;
+	return true;
+}
+
+bool spool_append(struct spool *spool, const void *data, size_t size) {
+	struct iovec iov = {
+		.iov_base = (void *)data,
+		.iov_len = size
+	};
+	return spool_appendv(spool, &iov, 1);
+}
+
+const uint8_t *spool_next(const struct spool *spool, uint32_t *seq, uint64_t *time, size_t *size) {
+	if (!spool_pending(spool))
+		return NULL;
+	const struct spool_record *record = record_get(spool, spool->cursor);
+	*seq = record->seq;
+	*time = record->time;
+	*size = record->size;
+	return record->data;
+}
+
+void spool_advance(struct spool *spool) {
+	sanity(spool_pending(spool), "Advancing past the end of spool %s\n", spool->path);
+	spool->cursor = record_skip(spool, spool->cursor);
+	spool->taken ++;
+}
+
+void spool_rewind(struct spool *spool) {
+	spool->cursor = spool->header->begin;
+	spool->taken = 0;
+}
+
+// Drop the oldest record, it must be taken
+static void record_drop(struct spool *spool) {
+	struct spool_header *header = spool->header;
+	uint64_t next = record_skip(spool, header->begin);
+	if (next < header->begin)
+		header->wrap = 0; // Got past the wrap, the rest is continuous
+	header->begin = next;
+	header->count --;
+	spool->taken --;
+}
+
+// Drop the discarded records at the start, nothing before them waits for acknowledgement
+static size_t discarded_drop(struct spool *spool) {
+	size_t dropped = 0;
+	while (spool->taken && (record_get(spool, spool->header->begin)->flags & RECORD_DISCARDED)) {
+		record_drop(spool);
+		dropped ++;
+	}
+	if (!spool->header->count)
+		spool_reset(spool);
+	return dropped;
+}
+
+size_t spool_ack(struct spool *spool, uint32_t seq) {
+	size_t dropped = 0;
+	// Compare with wrap-around of the sequence numbers
+	while (spool->taken && (int32_t)(seq - record_get(spool, spool->header->begin)->seq) >= 0) {
+		record_drop(spool);
+		dropped ++;
+	}
+	return dropped + discarded_drop(spool);
+}
+
+void spool_discard(struct spool *spool) {
+	sanity(spool_pending(spool), "Discarding past the end of spool %s\n", spool->path);
+	record_get(spool, spool->cursor)->flags |= RECORD_DISCARDED;
+	spool_advance(spool);
+	discarded_drop(spool);
+}
+
+size_t spool_count(const struct spool *spool) {
+	return spool->header->count;
+}
+
+size_t spool_used(const struct spool *spool) {
+	const struct spool_header *header = spool->header;
+	if (header->wrap)
+		return (header->wrap - header->begin) + (header->end - HEADER_SIZE);
+	else
+		return header->end - header->begin;
+}
+
+bool spool_pending(const struct spool *spool) {
+	return spool->taken < spool->header->count;
+}
@@ -0,0 +1,88 @@
+/*
+    Ucollect - small utility for real-time analysis of network data
+    Copyright (C) 2015 CZ.NIC, z.s.p.o. (http://www.nic.cz/)
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#ifndef UCOLLECT_CORE_SPOOL_H
+#define UCOLLECT_CORE_SPOOL_H
+
+/*
+ * A persistent FIFO of records, kept in a memory-mapped file of fixed size
+ * (usually on flash or tmpfs). It holds the messages that can't be sent
+ * right now, so they don't take RAM.
+ *
+ * Records are appended at the end and numbered by a sequence number. They
+ * are taken out in order (spool_next and spool_advance), but they stay in
+ * the file until acknowledged (spool_ack). The not acknowledged ones can be
+ * taken again after spool_rewind. The space of the acknowledged ones is
+ * reused once the end of the file is reached.
+ *
+ * The content survives restart of the program (but not necessarily a power
+ * loss, the file is not synced).
+ */
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <sys/uio.h>
+
+struct spool;
+struct mem_pool;
+
+/*
+ * Open the spool file, creating or resizing it to size bytes if needed.
+ * The records already there are kept if they fit. Returns NULL on error
+ * (after logging it).
+ *
+ * The spool structure is allocated from the pool, but spool_close must be
+ * called before the pool is reset.
+ */
+struct spool *spool_open(struct mem_pool *pool, const char *path, size_t size) __attribute__((nonnull)) __attribute__((malloc));
+void spool_close(struct spool *spool) __attribute__((nonnull));
+// Append a record. Returns false if it doesn't fit.
+bool spool_append(struct spool *spool, const void *data, size_t size) __attribute__((nonnull(1)));
+// Append a record made of count pieces (concatenated). Returns false if it doesn't fit.
+bool spool_appendv(struct spool *spool, const struct iovec *iov, size_t count) __attribute__((nonnull(1)));
+/*
+ * Get the oldest record not taken yet. Its sequence number, the time it was
+ * appended (unix timestamp) and size are stored. Returns NULL if there's none.
+ *
+ * The data are valid until the next spool_append or spool_close.
+ */
+const uint8_t *spool_next(const struct spool *spool, uint32_t *seq, uint64_t *time, size_t *size) __attribute__((nonnull));
+// Mark the record returned by spool_next as taken.
+void spool_advance(struct spool *spool) __attribute__((nonnull));
+// Make all the not acknowledged records available to spool_next again.
+void spool_rewind(struct spool *spool) __attribute__((nonnull));
+/*
+ * Drop all the taken records up to (and including) seq. Returns how many were
+ * dropped (including the discarded ones directly after them).
+ */
+size_t spool_ack(struct spool *spool, uint32_t seq) __attribute__((nonnull));
+/*
+ * Take the record returned by spool_next without sending it (it is broken).
+ * It is dropped as soon as all the records before it are acknowledged, it
+ * doesn't wait for an acknowledgement of its own.
+ */
+void spool_discard(struct spool *spool) __attribute__((nonnull));
+// Number of records held (acknowledged ones not included) and the bytes they take
+size_t spool_count(const struct spool *spool) __attribute__((nonnull));
+size_t spool_used(const struct spool *spool) __attribute__((nonnull));
+// Are there any records not taken yet?
+bool spool_pending(const struct spool *spool) __attribute__((nonnull));
+
+#endif
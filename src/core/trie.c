@@ -20,6 +20,7 @@
 #include "trie.h"
 #include "mem_pool.h"
 #include "util.h"
+#include "tunable.h"
 
 #include <stdbool.h>
 #include <string.h>
@@ -37,19 +38,57 @@ struct trie_node {
 #define LIST_BASE struct trie_node
 #define LIST_PREV prev
 #define LIST_NAME(X) trie_##X
-#define LIST_WANT_APPEND_POOL
 #define LIST_WANT_LFOR
 #define LIST_WANT_INSERT_AFTER
 #define LIST_WANT_REMOVE
 #include "link_list.h"
 
+// An unused piece of key memory, waiting to be reused
+struct key_chunk {
+	struct key_chunk *next;
+};
+
+#define KEY_CLASSES (TRIE_RECYCLE_MAX / sizeof(struct key_chunk) + 1)
+
 struct trie {
 	struct trie_node root;
 	size_t active_count;
 	size_t max_key_len;
 	struct mem_pool *pool;
+	// Memory released by trie_delete
+	struct trie_node *node_recycler;
+	struct key_chunk *key_recycler[KEY_CLASSES]; // Indexed by the size in multiples of chunk size
 };
 
+#define RECYCLER_NODE struct trie_node
+#define RECYCLER_BASE struct trie
+#define RECYCLER_HEAD node_recycler
+#define RECYCLER_NAME(X) node_recycler_##X
+#include "recycler.h"
+
+static size_t key_class(size_t size) {
+	return (size + sizeof(struct key_chunk) - 1) / sizeof(struct key_chunk);
+}
+
+static uint8_t *key_get(struct trie *trie, size_t size) {
+	size_t class = key_class(size);
+	if (class < KEY_CLASSES && trie->key_recycler[class]) {
+		struct key_chunk *result = trie->key_recycler[class];
+		trie->key_recycler[class] = result->next;
+		return (uint8_t *)result;
+	}
+	return mem_pool_alloc(trie->pool, class * sizeof(struct key_chunk));
+}
+
+static void key_release(struct trie *trie, const uint8_t *key, size_t size) {
+	size_t class = key_class(size);
+	if (!class || class >= KEY_CLASSES)
+		return; // Too large to keep around, it stays in the pool until it is reset
+	struct key_chunk *chunk = (struct key_chunk *)key;
+	chunk->next = trie->key_recycler[class];
+	trie->key_recycler[class] = chunk;
+}
+
 struct trie *trie_alloc(struct mem_pool *pool) {
 	ulog(LLOG_DEBUG, "Allocating new trie\n");
 	struct trie *result = mem_pool_alloc(pool, sizeof *result);
@@ -59,7 +98,7 @@ struct trie *trie_alloc(struct mem_pool *pool) {
 	return result;
 }
 
-size_t trie_size(struct trie *trie) {
+size_t trie_size(const struct trie *trie) {
 	return trie->active_count;
 }
 
@@ -89,23 +128,22 @@ static size_t lcp(const uint8_t *_1, size_t s1, const uint8_t *_2, size_t s2) {
 	return s1 < s2 ? s1 : s2;
 }
 
-static struct trie_data **trie_new_node(struct trie *trie, struct trie_node *parent, const uint8_t *key, size_t key_size, bool insert_new) {
-	if (!insert_new)
-		return NULL;
+static struct trie_data **trie_new_node(struct trie *trie, struct trie_node *parent, const uint8_t *key, size_t key_size) {
 	ulog(LLOG_DEBUG_VERBOSE, "Creating new node with %zu bytes of key\n", key_size);
-	struct trie_node *new = trie_append_pool(parent, trie->pool);
+	struct trie_node *new = node_recycler_get(trie, trie->pool);
+	trie_insert_after(parent, new, parent->tail);
 	new->active = true;
 	trie->active_count ++;
 	new->head = new->tail = NULL; // No children yet
 	new->data = NULL;
-	uint8_t *new_key = mem_pool_alloc(trie->pool, key_size);
+	uint8_t *new_key = key_get(trie, key_size);
 	new->key = new_key;
 	memcpy(new_key, key, key_size);
 	new->key_size = key_size;
 	return &new->data;
 }
 
-static struct trie_data **trie_index_internal(struct trie *trie, struct trie_node *node, const uint8_t *key, size_t key_size, bool insert_new) {
+static struct trie_data **trie_index_internal(struct trie *trie, struct trie_node *node, const uint8_t *key, size_t key_size) {
 	size_t prefix = lcp(key, key_size, node->key, node->key_size);
 	if (prefix == node->key_size) { // We went the whole length of the node's path
 		// Eath the part of key we already used
@@ -115,7 +153,7 @@ static struct trie_data **trie_index_internal(struct trie *trie, struct trie_nod
 		if (key_size == 0) {
 			// We found the position
 			ulog(LLOG_DEBUG_VERBOSE, "Trie exact hit\n");
-			if (!node->active && insert_new) {
+			if (!node->active) {
 				ulog(LLOG_DEBUG_VERBOSE, "Making node active\n");
 				node->active = true;
 				trie->active_count ++;
@@ -130,25 +168,34 @@ static struct trie_data **trie_index_internal(struct trie *trie, struct trie_nod
 					// Move the child to the front. In practice, most of the traffic happens with similar packets (same addresses, etc), so have them to the front most of the time
 					trie_remove(node, child);
 					trie_insert_after(node, child, NULL);
-					return trie_index_internal(trie, child, key, key_size, insert_new);
+					return trie_index_internal(trie, child, key, key_size);
 				}
 			}
 			// Not found any matching child, create a new one
-			return trie_new_node(trie, node, key, key_size, insert_new);
+			return trie_new_node(trie, node, key, key_size);
 		}
-	} else if (insert_new) {
+	} else {
 		ulog(LLOG_DEBUG_VERBOSE, "Splitting node with key of %zu bytes after %zu bytes\n", node->key_size, prefix);
 		/*
 		 * We traversed only part of the path. We need to split it in half, and create a new node for the
 		 * rest of the path, and another new node for the one we want to index.
 		 */
-		struct trie_node *new = mem_pool_alloc(trie->pool, sizeof *new);
+		struct trie_node *new = node_recycler_get(trie, trie->pool);
 		// Move the content to the new node
 		*new = *node;
 		// Rip out the new node from the list
 		new->next = new->prev = NULL;
-		// Move the new key after the prefix
-		new->key += prefix;
+		/*
+		 * Split the key in two. Each node owns its key, so it can be
+		 * released on its own by trie_delete.
+		 */
+		uint8_t *head = key_get(trie, prefix);
+		memcpy(head, node->key, prefix);
+		uint8_t *rest = key_get(trie, node->key_size - prefix);
+		memcpy(rest, node->key + prefix, node->key_size - prefix);
+		key_release(trie, node->key, node->key_size);
+		node->key = head;
+		new->key = rest;
 		new->key_size -= prefix;
 		// Reset data in the old node
 		node->active = false;
@@ -158,24 +205,294 @@ static struct trie_data **trie_index_internal(struct trie *trie, struct trie_nod
 		node->key_size = prefix;
 		// Add the new node as child
 		trie_insert_after(node, new, NULL);
+		if (prefix == key_size) {
+			// The key ends exactly at the split, so it belongs to the split node itself
+			node->active = true;
+			trie->active_count ++;
+			return &node->data;
+		}
 		// And now add the rest of the index at the split node
-		return trie_new_node(trie, node, key + prefix, key_size - prefix, insert_new);
-	} else
-		return NULL; // Not inserting a new one
+		return trie_new_node(trie, node, key + prefix, key_size - prefix);
+	}
 }
 
 struct trie_data **trie_index(struct trie *trie, const uint8_t *key, size_t key_size) {
 	ulog(LLOG_DEBUG_VERBOSE, "Indexing trie by %zu bytes of key\n", key_size);
 	if (key_size > trie->max_key_len)
 		trie->max_key_len = key_size;
-	return trie_index_internal(trie, &trie->root, key, key_size, true);
+	return trie_index_internal(trie, &trie->root, key, key_size);
 }
 
-struct trie_data *trie_lookup(struct trie *trie, const uint8_t *key, size_t key_size) {
+/*
+ * Unlike trie_index, this one doesn't move the found children to the front.
+ * It only reads the structure, so it doesn't dirty the cache lines of the
+ * nodes and any number of readers can run at once while nobody modifies
+ * the trie.
+ */
+struct trie_data *trie_lookup(const struct trie *trie, const uint8_t *key, size_t key_size) {
 	ulog(LLOG_DEBUG_VERBOSE, "Looking up in trie with %zu bytes of key\n", key_size);
-	struct trie_data **data = trie_index_internal(trie, &trie->root, key, key_size, false);
+	const struct trie_node *node = &trie->root;
+	for (;;) {
+		if (key_size < node->key_size || (node->key_size && memcmp(node->key, key, node->key_size) != 0))
+			return NULL;
+		key += node->key_size;
+		key_size -= node->key_size;
+		if (key_size == 0)
+			return node->active ? node->data : NULL;
+		const struct trie_node *found = NULL;
+		for (const struct trie_node *child = node->head; child; child = child->next)
+			if (*child->key == *key) {
+				found = child;
+				break;
+			}
+		if (!found)
+			return NULL;
+		node = found;
+	}
+}
+
+/*
+ * The node lost its data or a child. Remove it if it is useless now or merge
+ * it with its only child. The root stays always.
+ */
+static void node_compact(struct trie *trie, struct trie_node *parent, struct trie_node *node) {
+	if (!parent || node->active)
+		return;
+	if (!node->head) {
+		ulog(LLOG_DEBUG_VERBOSE, "Dropping empty node with %zu bytes of key\n", node->key_size);
+		trie_remove(parent, node);
+		key_release(trie, node->key, node->key_size);
+		node_recycler_release(trie, node);
+	} else if (node->head == node->tail) {
+		// Single child and no data, so there's no branching here any more
+		struct trie_node *child = node->head;
+		ulog(LLOG_DEBUG_VERBOSE, "Merging node with %zu bytes of key with its child with %zu bytes\n", node->key_size, child->key_size);
+		uint8_t *key = key_get(trie, node->key_size + child->key_size);
+		memcpy(key, node->key, node->key_size);
+		memcpy(key + node->key_size, child->key, child->key_size);
+		key_release(trie, node->key, node->key_size);
+		key_release(trie, child->key, child->key_size);
+		node->key = key;
+		node->key_size += child->key_size;
+		node->data = child->data;
+		node->active = child->active;
+		node->head = child->head;
+		node->tail = child->tail;
+		node_recycler_release(trie, child);
+	}
+}
+
+static bool trie_delete_internal(struct trie *trie, struct trie_node *parent, struct trie_node *node, const uint8_t *key, size_t key_size) {
+	size_t prefix = lcp(key, key_size, node->key, node->key_size);
+	if (prefix != node->key_size)
+		return false;
+	key += prefix;
+	key_size -= prefix;
+	if (key_size == 0) {
+		if (!node->active)
+			return false;
+		node->active = false;
+		node->data = NULL;
+		trie->active_count --;
+	} else {
+		struct trie_node *found = NULL;
+		LFOR(trie, child, node)
+			if (*child->key == *key) {
+				found = child;
+				break;
+			}
+		if (!found || !trie_delete_internal(trie, node, found, key, key_size))
+			return false;
+	}
+	node_compact(trie, parent, node);
+	return true;
+}
+
+bool trie_delete(struct trie *trie, const uint8_t *key, size_t key_size) {
+	ulog(LLOG_DEBUG_VERBOSE, "Deleting from trie by %zu bytes of key\n", key_size);
+	return trie_delete_internal(trie, NULL, &trie->root, key, key_size);
+}
+
+struct iter_frame {
+	const struct trie_node *node;
+	size_t keypos; // Length of the key up to the end of the node
+	// The children not visited yet
+	const struct trie_node *next; // When not ordered
+	const struct trie_node **sorted; // When ordered (by the first byte of key)
+	size_t sorted_pos, sorted_count;
+};
+
+struct trie_iter {
+	struct trie *trie;
+	struct mem_pool *pool;
+	uint8_t *prefix;
+	size_t prefix_size;
+	bool ordered;
+	bool emit_top; // The node on the top of the stack still needs to be returned
+	uint8_t *keybuf;
+	struct iter_frame *frames;
+	size_t capacity, depth;
+};
+
+static void iter_push(struct trie_iter *iter, const struct trie_node *node, size_t keypos) {
+	assert(iter->depth < iter->capacity);
+	struct iter_frame *frame = &iter->frames[iter->depth ++];
+	if (node->key_size) // The root has NULL key
+		memcpy(iter->keybuf + keypos, node->key, node->key_size);
+	frame->node = node;
+	frame->keypos = keypos + node->key_size;
+	if (iter->ordered) {
+		if (!frame->sorted) // Each node has at most 256 children, they differ in the first byte
+			frame->sorted = mem_pool_alloc(iter->pool, 256 * sizeof *frame->sorted);
+		// Insertion sort, the lists are short
+		size_t count = 0;
+		for (const struct trie_node *child = node->head; child; child = child->next) {
+			size_t pos = count ++;
+			for (; pos && *frame->sorted[pos - 1]->key > *child->key; pos --)
+				frame->sorted[pos] = frame->sorted[pos - 1];
+			frame->sorted[pos] = child;
+		}
+		frame->sorted_pos = 0;
+		frame->sorted_count = count;
+	} else {
+		frame->next = node->head;
+	}
+}
+
+static const struct trie_node *iter_child(struct iter_frame *frame, bool ordered) {
+	if (ordered)
+		return frame->sorted_pos < frame->sorted_count ? frame->sorted[frame->sorted_pos ++] : NULL;
+	const struct trie_node *result = frame->next;
+	if (result)
+		frame->next = result->next;
+	return result;
+}
+
+// Place the node under which all the keys with the prefix live (if any) on the stack
+static void iter_restart(struct trie_iter *iter) {
+	struct trie *trie = iter->trie;
+	if (iter->capacity < trie->max_key_len + 1) {
+		// The trie grew (or this is the first time), the old buffers are left in the pool
+		iter->capacity = trie->max_key_len + 1;
+		iter->keybuf = mem_pool_alloc(iter->pool, iter->capacity + 1);
+		iter->frames = mem_pool_alloc(iter->pool, iter->capacity * sizeof *iter->frames);
+		memset(iter->frames, 0, iter->capacity * sizeof *iter->frames);
+	}
+	iter->depth = 0;
+	iter->emit_top = false;
+	const struct trie_node *node = &trie->root;
+	size_t keypos = 0;
+	for (;;) {
+		size_t prefix_rest = iter->prefix_size - keypos;
+		size_t prefix = lcp(iter->prefix + keypos, prefix_rest, node->key, node->key_size);
+		if (prefix == prefix_rest) {
+			// The prefix ends inside this node, so all its keys start with the prefix
+			iter_push(iter, node, keypos);
+			iter->emit_top = true;
+			return;
+		}
+		if (prefix < node->key_size)
+			return; // Mismatch, no such key
+		if (node->key_size)
+			memcpy(iter->keybuf + keypos, node->key, node->key_size);
+		keypos += node->key_size;
+		const struct trie_node *found = NULL;
+		for (const struct trie_node *child = node->head; child; child = child->next)
+			if (*child->key == iter->prefix[keypos]) {
+				found = child;
+				break;
+			}
+		if (!found)
+			return;
+		node = found;
+	}
+}
+
+struct trie_iter *trie_iter_create(struct trie *trie, const uint8_t *prefix, size_t prefix_size, bool ordered, struct mem_pool *pool) {
+	ulog(LLOG_DEBUG, "Creating %s trie iterator with %zu bytes of prefix\n", ordered ? "ordered" : "unordered", prefix_size);
+	struct trie_iter *result = mem_pool_alloc(pool, sizeof *result);
+	*result = (struct trie_iter) {
+		.trie = trie,
+		.pool = pool,
+		.prefix = mem_pool_alloc(pool, prefix_size),
+		.prefix_size = prefix_size,
+		.ordered = ordered
+	};
+	if (prefix_size)
+		memcpy(result->prefix, prefix, prefix_size);
+	iter_restart(result);
+	return result;
+}
+
+bool trie_iter_next(struct trie_iter *iter, const uint8_t **key, size_t *key_size, struct trie_data **data) {
+	bool found = false;
+	if (iter->emit_top) {
+		iter->emit_top = false;
+		found = iter->frames[iter->depth - 1].node->active;
+	}
+	while (!found && iter->depth) {
+		struct iter_frame *top = &iter->frames[iter->depth - 1];
+		const struct trie_node *child = iter_child(top, iter->ordered);
+		if (child) {
+			iter_push(iter, child, top->keypos);
+			found = child->active;
+		} else {
+			iter->depth --;
+		}
+	}
+	if (!found)
+		return false;
+	const struct iter_frame *top = &iter->frames[iter->depth - 1];
+	iter->keybuf[top->keypos] = '\0';
+	if (key)
+		*key = iter->keybuf;
+	if (key_size)
+		*key_size = top->keypos;
 	if (data)
-		return *data;
-	else
-		return NULL;
+		*data = top->node->data;
+	return true;
+}
+
+void trie_iter_resume(struct trie_iter *iter, const uint8_t *key, size_t key_size) {
+	sanity(iter->ordered, "Resuming unordered trie iterator\n");
+	iter_restart(iter);
+	if (!iter->depth)
+		return;
+	// Compare the key with the path to the top node
+	struct iter_frame *top = &iter->frames[0];
+	size_t common = lcp(key, key_size, iter->keybuf, top->keypos);
+	if (common < top->keypos) {
+		if (common < key_size && key[common] > iter->keybuf[common]) {
+			// All the keys are smaller
+			iter->depth = 0;
+			iter->emit_top = false;
+		}
+		// Otherwise all the keys are larger, start from the beginning
+		return;
+	}
+	// The top node is not larger than the key, go down the path of the key and skip the smaller children
+	iter->emit_top = false;
+	for (;;) {
+		top = &iter->frames[iter->depth - 1];
+		if (top->keypos == key_size)
+			return; // The key ends in this node, all the children are larger
+		uint8_t byte = key[top->keypos];
+		while (top->sorted_pos < top->sorted_count && *top->sorted[top->sorted_pos]->key < byte)
+			top->sorted_pos ++;
+		if (top->sorted_pos == top->sorted_count || *top->sorted[top->sorted_pos]->key > byte)
+			return;
+		const struct trie_node *child = top->sorted[top->sorted_pos];
+		const uint8_t *rest = key + top->keypos;
+		size_t rest_size = key_size - top->keypos;
+		common = lcp(rest, rest_size, child->key, child->key_size);
+		if (common == child->key_size) {
+			// The child is on the path of the key, descend (but don't return the child itself)
+			top->sorted_pos ++;
+			iter_push(iter, child, top->keypos);
+			continue;
+		}
+		if (common < rest_size && child->key[common] < rest[common])
+			top->sorted_pos ++; // The whole child is smaller
+		return;
+	}
 }
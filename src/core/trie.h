@@ -25,19 +25,28 @@
  * arbitrary length.
  *
  * The trie can be used to access values indexed by the keys fast and new keys can
- * be added at any time. However, it doesn't support deletions and it can be only
- * destroyed as a whole.
+ * be added or deleted at any time. The memory of deleted keys is reused by the
+ * trie, but it is returned to the memory pool only when the whole trie is
+ * destroyed.
  *
  * Each node holds linked list of subnodes. Each subnode keeps part of the key
  * from the node to the subnode. The subnodes' parts of keys always differ in
  * the first byte.
  *
- * On each access, the currently accessed subnode is moved to the front of the
- * linked list, to keep the most often used ones somewhere to the front.
+ * On each trie_index, the currently accessed subnode is moved to the front of
+ * the linked list, to keep the most often used ones somewhere to the front.
+ * The lookups only read the structure.
+ *
+ * When compiled with TRIE_ART=1, an adaptive radix tree (trie_art.c) is used
+ * instead. It has the same interface, but the walk goes in the lexicographic
+ * order of the keys.
+ *
+ * For tables that are built once and then only read, see trie_frozen.h.
  */
 
 #include <stdint.h>
 #include <stdlib.h>
+#include <stdbool.h>
 
 // User data to store in the trie. Each module/plugin can have different implementation.
 struct trie_data;
@@ -67,19 +76,27 @@ struct trie_data **trie_index(struct trie *trie, const uint8_t *key, size_t key_
  * Similar to trie_index, but in case the key is not present there, NULL is returned.
  *
  * Returs the pointer directly, not pointer to pointer, so you can't use it to exchange the data.
- * This is read-only function in some sense, however it does change internal representation.
+ * It doesn't write anything to the trie, so it is safe to run multiple lookups at once,
+ * as long as nothing modifies the trie at the same time.
  */
-struct trie_data *trie_lookup(struct trie *trie, const uint8_t *key, size_t key_size) __attribute__((nonnull(1))) __attribute__((pure));
+struct trie_data *trie_lookup(const struct trie *trie, const uint8_t *key, size_t key_size) __attribute__((nonnull(1))) __attribute__((pure));
+/*
+ * Remove the key from the trie. Returns false if it was not there. The data
+ * pointer is simply forgotten, it is up to the caller to release it if needed.
+ *
+ * The nodes left without purpose are merged or dropped and their memory is kept
+ * for reuse by further trie_index calls.
+ */
+bool trie_delete(struct trie *trie, const uint8_t *key, size_t key_size) __attribute__((nonnull(1)));
 // Return count of different positions accessed by trie_index
-size_t trie_size(struct trie *trie) __attribute__((nonnull)) __attribute__((pure));
+size_t trie_size(const struct trie *trie) __attribute__((nonnull)) __attribute__((pure));
 /*
  * Walk the whole trie and call the callback for each key previously accessed
  * by trie_index. The value in key pointer will change (it is not valid after
  * end of the callback).
  *
- * The order is stable as long as the trie is not modified. The functions
- * trie_index and trie_lookup do modify it, even in case the set of keys
- * present does not.
+ * The order is stable as long as the trie is not modified. The function
+ * trie_index does modify it, even in case the set of keys present does not.
  *
  * The passed key is also 0-terminated, to easy up situation when the keys are
  * ordinary strings, not bytestrings.
@@ -87,4 +104,31 @@ size_t trie_size(struct trie *trie) __attribute__((nonnull)) __attribute__((pure
 typedef void (*trie_walk_callback)(const uint8_t *key, size_t key_size, struct trie_data *data, void *userdata);
 void trie_walk(struct trie *trie, trie_walk_callback callback, void *userdata, struct mem_pool *temp_pool) __attribute__((nonnull(1,2,4)));
 
+/*
+ * An explicit cursor over the keys of the trie, for when the callback of
+ * trie_walk is not convenient (eg. the walk needs to be split into several
+ * parts). Only the keys starting with the prefix are visited (use 0
+ * prefix_size for all of them). If ordered is set, the keys come in the
+ * lexicographic order (a key goes before the longer keys it is prefix of),
+ * otherwise in the same order as with trie_walk.
+ *
+ * The iterator is allocated from the pool. It becomes invalid when the trie is
+ * modified (by trie_index or trie_delete). An ordered one can be brought back
+ * by trie_iter_resume, though.
+ */
+struct trie_iter;
+struct trie_iter *trie_iter_create(struct trie *trie, const uint8_t *prefix, size_t prefix_size, bool ordered, struct mem_pool *pool) __attribute__((nonnull(1,5))) __attribute__((malloc)) __attribute__((returns_nonnull));
+/*
+ * Move to the next key. Returns false if there are no more keys. The key is
+ * 0-terminated and valid until the next call. Any of the output parameters may
+ * be NULL.
+ */
+bool trie_iter_next(struct trie_iter *iter, const uint8_t **key, size_t *key_size, struct trie_data **data) __attribute__((nonnull(1)));
+/*
+ * Continue an ordered walk from the first key greater than the given one
+ * (which is usually the last one returned and doesn't have to be present any
+ * more). The trie may have been modified in between.
+ */
+void trie_iter_resume(struct trie_iter *iter, const uint8_t *key, size_t key_size) __attribute__((nonnull(1)));
+
 #endif
@@ -0,0 +1,887 @@
+/*
+    Ucollect - small utility for real-time analysis of network data
+    Copyright (C) 2015 CZ.NIC, z.s.p.o. (http://www.nic.cz/)
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+/*
+ * Adaptive radix tree implementation of the trie.h API. It is used instead of
+ * trie.c when compiled with TRIE_ART.
+ *
+ * Inner nodes branch on a single byte of the key. They come in four sizes
+ * (for up to 4, 16, 48 and 256 children) and grow into the bigger one when
+ * full. Runs of bytes without branching are compressed into the prefix of the
+ * node. The leaves hold the whole key and the user data. A key that ends
+ * right after the prefix of an inner node (because it is a prefix of some
+ * other keys) is stored in the value slot of that node.
+ *
+ * The children pointers are tagged ‒ the lowest bit is set for leaves. The
+ * memory pool aligns all allocations to pointer size, so the bit is free.
+ *
+ * The lookups don't modify the structure and the walk is in the lexicographic
+ * order of keys.
+ *
+ * The prefix of a node always points into a key of some leaf below the node.
+ * When the leaf is deleted, the nodes above it are pointed to another one.
+ */
+
+#include "trie.h"
+#include "mem_pool.h"
+#include "util.h"
+#include "tunable.h"
+
+#include <stdbool.h>
+#include <string.h>
+#include <assert.h>
+
+enum node_type {
+	NODE4,
+	NODE16,
+	NODE48,
+	NODE256,
+	NODE_TYPES
+};
+
+struct leaf {
+	struct trie_data *data;
+	size_t key_size;
+	uint8_t key[]; // 0-terminated, for the walk
+};
+
+struct node {
+	enum node_type type;
+	size_t count; // Number of children (not including the value)
+	const uint8_t *prefix; // Points into the key of some leaf below
+	size_t prefix_len;
+	struct leaf *value;
+};
+
+struct node4 {
+	struct node node;
+	uint8_t keys[4]; // Sorted
+	void *children[4];
+};
+
+struct node16 {
+	struct node node;
+	uint8_t keys[16]; // Sorted
+	void *children[16];
+};
+
+struct node48 {
+	struct node node;
+	uint8_t index[256]; // Position in children + 1, 0 means no child
+	void *children[48];
+};
+
+struct node256 {
+	struct node node;
+	void *children[256];
+};
+
+// An unused piece of memory, waiting to be reused
+struct chunk {
+	struct chunk *next;
+};
+
+#define LEAF_CLASSES (TRIE_RECYCLE_MAX / sizeof(struct chunk) + 1)
+
+struct trie {
+	void *root;
+	size_t active_count;
+	struct mem_pool *pool;
+	// Memory released by trie_delete
+	struct chunk *node_recycler[NODE_TYPES];
+	struct chunk *leaf_recycler[LEAF_CLASSES]; // Indexed by the size in multiples of chunk size
+};
+
+#define IS_LEAF(PTR) ((uintptr_t)(PTR) & 1)
+#define TO_LEAF(PTR) ((struct leaf *)((uintptr_t)(PTR) & ~(uintptr_t)1))
+#define TAG_LEAF(LEAF) ((void *)((uintptr_t)(LEAF) | 1))
+
+struct trie *trie_alloc(struct mem_pool *pool) {
+	ulog(LLOG_DEBUG, "Allocating new trie\n");
+	struct trie *result = mem_pool_alloc(pool, sizeof *result);
+	*result = (struct trie) {
+		.pool = pool
+	};
+	return result;
+}
+
+size_t trie_size(const struct trie *trie) {
+	return trie->active_count;
+}
+
+// Longest common prefix
+static size_t lcp(const uint8_t *_1, size_t s1, const uint8_t *_2, size_t s2) {
+	for (size_t i = 0; i < s1 && i < s2; i ++)
+		if (_1[i] != _2[i])
+			return i;
+	return s1 < s2 ? s1 : s2;
+}
+
+static size_t leaf_class(size_t key_size) {
+	return (sizeof(struct leaf) + key_size + 1 + sizeof(struct chunk) - 1) / sizeof(struct chunk);
+}
+
+static struct leaf *leaf_create(struct trie *trie, const uint8_t *key, size_t key_size) {
+	ulog(LLOG_DEBUG_VERBOSE, "Creating new leaf with %zu bytes of key\n", key_size);
+	size_t class = leaf_class(key_size);
+	struct leaf *leaf;
+	if (class < LEAF_CLASSES && trie->leaf_recycler[class]) {
+		leaf = (struct leaf *)trie->leaf_recycler[class];
+		trie->leaf_recycler[class] = trie->leaf_recycler[class]->next;
+	} else
+		leaf = mem_pool_alloc(trie->pool, class * sizeof(struct chunk));
+	leaf->data = NULL;
+	leaf->key_size = key_size;
+	memcpy(leaf->key, key, key_size);
+	leaf->key[key_size] = '\0';
+	trie->active_count ++;
+	return leaf;
+}
+
+static void leaf_release(struct trie *trie, struct leaf *leaf) {
+	size_t class = leaf_class(leaf->key_size);
+	if (class >= LEAF_CLASSES)
+		return; // Too large to keep around, it stays in the pool until it is reset
+	struct chunk *chunk = (struct chunk *)leaf;
+	chunk->next = trie->leaf_recycler[class];
+	trie->leaf_recycler[class] = chunk;
+}
+
+static bool leaf_matches(const struct leaf *leaf, const uint8_t *key, size_t key_size) {
+	return leaf->key_size == key_size && memcmp(leaf->key, key, key_size) == 0;
+}
+
+static const size_t node_sizes[] = {
+	[NODE4] = sizeof(struct node4),
+	[NODE16] = sizeof(struct node16),
+	[NODE48] = sizeof(struct node48),
+	[NODE256] = sizeof(struct node256)
+};
+
+static struct node *node_create(struct trie *trie, enum node_type type) {
+	struct node *result;
+	if (trie->node_recycler[type]) {
+		result = (struct node *)trie->node_recycler[type];
+		trie->node_recycler[type] = trie->node_recycler[type]->next;
+	} else
+		result = mem_pool_alloc(trie->pool, node_sizes[type]);
+	memset(result, 0, node_sizes[type]);
+	result->type = type;
+	return result;
+}
+
+static void node_release(struct trie *trie, struct node *node) {
+	struct chunk *chunk = (struct chunk *)node;
+	enum node_type type = node->type;
+	chunk->next = trie->node_recycler[type];
+	trie->node_recycler[type] = chunk;
+}
+
+// Find the slot with the child for the given byte. NULL if there's no such child.
+static void **child_find(struct node *node, uint8_t byte) {
+	switch (node->type) {
+		case NODE4: {
+			struct node4 *n = (struct node4 *)node;
+			for (size_t i = 0; i < node->count; i ++)
+				if (n->keys[i] == byte)
+					return &n->children[i];
+			return NULL;
+		}
+		case NODE16: {
+			struct node16 *n = (struct node16 *)node;
+			// The keys are sorted, so we can stop early
+			for (size_t i = 0; i < node->count && n->keys[i] <= byte; i ++)
+				if (n->keys[i] == byte)
+					return &n->children[i];
+			return NULL;
+		}
+		case NODE48: {
+			struct node48 *n = (struct node48 *)node;
+			if (n->index[byte])
+				return &n->children[n->index[byte] - 1];
+			return NULL;
+		}
+		case NODE256: {
+			struct node256 *n = (struct node256 *)node;
+			if (n->children[byte])
+				return &n->children[byte];
+			return NULL;
+		}
+		case NODE_TYPES:
+			break;
+	}
+	insane("Unknown trie node type %d\n", (int)node->type);
+}
+
+// Insert into one of the sorted arrays of the small nodes
+static void sorted_insert(uint8_t *keys, void **children, size_t count, uint8_t byte, void *child) {
+	size_t pos = 0;
+	while (pos < count && keys[pos] < byte)
+		pos ++;
+	memmove(keys + pos + 1, keys + pos, count - pos);
+	memmove(children + pos + 1, children + pos, (count - pos) * sizeof *children);
+	keys[pos] = byte;
+	children[pos] = child;
+}
+
+// Create a node of another type with the same header
+static struct node *node_convert(struct trie *trie, struct node *node, enum node_type type) {
+	ulog(LLOG_DEBUG_VERBOSE, "Converting trie node of type %d with %zu children to type %d\n", (int)node->type, node->count, (int)type);
+	struct node *result = node_create(trie, type);
+	result->count = node->count;
+	result->prefix = node->prefix;
+	result->prefix_len = node->prefix_len;
+	result->value = node->value;
+	return result;
+}
+
+/*
+ * Add a child (which is not there yet) to the node. If the node is full, it
+ * is replaced by a bigger one and the ref is updated.
+ */
+static void child_add(struct trie *trie, void **ref, struct node *node, uint8_t byte, void *child) {
+	switch (node->type) {
+		case NODE4: {
+			struct node4 *n = (struct node4 *)node;
+			if (node->count < 4) {
+				sorted_insert(n->keys, n->children, node->count ++, byte, child);
+				return;
+			}
+			struct node16 *bigger = (struct node16 *)node_convert(trie, node, NODE16);
+			memcpy(bigger->keys, n->keys, sizeof n->keys);
+			memcpy(bigger->children, n->children, sizeof n->children);
+			node_release(trie, node);
+			*ref = bigger;
+			child_add(trie, ref, &bigger->node, byte, child);
+			return;
+		}
+		case NODE16: {
+			struct node16 *n = (struct node16 *)node;
+			if (node->count < 16) {
+				sorted_insert(n->keys, n->children, node->count ++, byte, child);
+				return;
+			}
+			struct node48 *bigger = (struct node48 *)node_convert(trie, node, NODE48);
+			for (size_t i = 0; i < 16; i ++) {
+				bigger->children[i] = n->children[i];
+				bigger->index[n->keys[i]] = i + 1;
+			}
+			node_release(trie, node);
+			*ref = bigger;
+			child_add(trie, ref, &bigger->node, byte, child);
+			return;
+		}
+		case NODE48: {
+			struct node48 *n = (struct node48 *)node;
+			if (node->count < 48) {
+				n->children[node->count] = child;
+				n->index[byte] = ++ node->count;
+				return;
+			}
+			struct node256 *bigger = (struct node256 *)node_convert(trie, node, NODE256);
+			for (size_t i = 0; i < 256; i ++)
+				if (n->index[i])
+					bigger->children[i] = n->children[n->index[i] - 1];
+			node_release(trie, node);
+			*ref = bigger;
+			child_add(trie, ref, &bigger->node, byte, child);
+			return;
+		}
+		case NODE256: {
+			struct node256 *n = (struct node256 *)node;
+			n->children[byte] = child;
+			node->count ++;
+			return;
+		}
+		case NODE_TYPES:
+			break;
+	}
+	insane("Unknown trie node type %d\n", (int)node->type);
+}
+
+// Put a leaf under a fresh node, either as a child or as the value if the key ends at depth.
+static void leaf_place(struct trie *trie, void **ref, struct node *node, struct leaf *leaf, size_t depth) {
+	if (leaf->key_size == depth)
+		node->value = leaf;
+	else
+		child_add(trie, ref, node, leaf->key[depth], TAG_LEAF(leaf));
+}
+
+static struct trie_data **index_internal(struct trie *trie, void **ref, const uint8_t *key, size_t key_size, size_t depth) {
+	for (;;) {
+		if (IS_LEAF(*ref)) {
+			struct leaf *leaf = TO_LEAF(*ref);
+			if (leaf_matches(leaf, key, key_size)) {
+				ulog(LLOG_DEBUG_VERBOSE, "Trie exact hit\n");
+				return &leaf->data;
+			}
+			/*
+			 * Lazy expansion ‒ the leaf stands for a whole subtree with
+			 * single key. Now we have two, so make an inner node for the
+			 * common part and hang both leaves below it.
+			 */
+			struct leaf *new = leaf_create(trie, key, key_size);
+			size_t common = lcp(leaf->key + depth, leaf->key_size - depth, key + depth, key_size - depth);
+			ulog(LLOG_DEBUG_VERBOSE, "Expanding leaf after %zu common bytes\n", common);
+			struct node *node = node_create(trie, NODE4);
+			node->prefix = new->key + depth;
+			node->prefix_len = common;
+			*ref = node;
+			leaf_place(trie, ref, node, leaf, depth + common);
+			leaf_place(trie, ref, node, new, depth + common);
+			return &new->data;
+		}
+		struct node *node = *ref;
+		if (node->prefix_len) {
+			size_t common = lcp(node->prefix, node->prefix_len, key + depth, key_size - depth);
+			if (common < node->prefix_len) {
+				ulog(LLOG_DEBUG_VERBOSE, "Splitting prefix of %zu bytes after %zu bytes\n", node->prefix_len, common);
+				// Only part of the prefix matches. Put a new node above for the common part.
+				struct node *parent = node_create(trie, NODE4);
+				parent->prefix = node->prefix;
+				parent->prefix_len = common;
+				uint8_t byte = node->prefix[common];
+				node->prefix += common + 1;
+				node->prefix_len -= common + 1;
+				*ref = parent;
+				child_add(trie, ref, parent, byte, node);
+				struct leaf *new = leaf_create(trie, key, key_size);
+				leaf_place(trie, ref, parent, new, depth + common);
+				return &new->data;
+			}
+			depth += node->prefix_len;
+		}
+		if (depth == key_size) {
+			if (!node->value) {
+				ulog(LLOG_DEBUG_VERBOSE, "Creating value of inner node\n");
+				node->value = leaf_create(trie, key, key_size);
+			}
+			return &node->value->data;
+		}
+		void **child = child_find(node, key[depth]);
+		if (!child) {
+			struct leaf *new = leaf_create(trie, key, key_size);
+			child_add(trie, ref, node, key[depth], TAG_LEAF(new));
+			return &new->data;
+		}
+		ulog(LLOG_DEBUG_VERBOSE, "Descending into a child %hhu/'%c'\n", key[depth], key[depth]);
+		ref = child;
+		depth ++;
+	}
+}
+
+struct trie_data **trie_index(struct trie *trie, const uint8_t *key, size_t key_size) {
+	ulog(LLOG_DEBUG_VERBOSE, "Indexing trie by %zu bytes of key\n", key_size);
+	if (!trie->root) {
+		struct leaf *leaf = leaf_create(trie, key, key_size);
+		trie->root = TAG_LEAF(leaf);
+		return &leaf->data;
+	}
+	return index_internal(trie, &trie->root, key, key_size, 0);
+}
+
+struct trie_data *trie_lookup(const struct trie *trie, const uint8_t *key, size_t key_size) {
+	ulog(LLOG_DEBUG_VERBOSE, "Looking up in trie with %zu bytes of key\n", key_size);
+	const void *current = trie->root;
+	size_t depth = 0;
+	while (current) {
+		if (IS_LEAF(current)) {
+			const struct leaf *leaf = TO_LEAF(current);
+			return leaf_matches(leaf, key, key_size) ? leaf->data : NULL;
+		}
+		struct node *node = (struct node *)current;
+		if (node->prefix_len) {
+			if (key_size - depth < node->prefix_len || memcmp(node->prefix, key + depth, node->prefix_len) != 0)
+				return NULL;
+			depth += node->prefix_len;
+		}
+		if (depth == key_size)
+			return node->value ? node->value->data : NULL;
+		void **child = child_find(node, key[depth ++]);
+		current = child ? *child : NULL;
+	}
+	return NULL;
+}
+
+static void walk_node(void *current, trie_walk_callback callback, void *userdata) {
+	if (IS_LEAF(current)) {
+		struct leaf *leaf = TO_LEAF(current);
+		callback(leaf->key, leaf->key_size, leaf->data, userdata);
+		return;
+	}
+	struct node *node = current;
+	// The shorter key goes first
+	if (node->value)
+		callback(node->value->key, node->value->key_size, node->value->data, userdata);
+	switch (node->type) {
+		case NODE4:
+		case NODE16: {
+			// The keys and children arrays are at the same positions in both
+			void **children = node->type == NODE4 ? ((struct node4 *)node)->children : ((struct node16 *)node)->children;
+			for (size_t i = 0; i < node->count; i ++)
+				walk_node(children[i], callback, userdata);
+			break;
+		}
+		case NODE48: {
+			struct node48 *n = (struct node48 *)node;
+			for (size_t i = 0; i < 256; i ++)
+				if (n->index[i])
+					walk_node(n->children[n->index[i] - 1], callback, userdata);
+			break;
+		}
+		case NODE256: {
+			struct node256 *n = (struct node256 *)node;
+			for (size_t i = 0; i < 256; i ++)
+				if (n->children[i])
+					walk_node(n->children[i], callback, userdata);
+			break;
+		}
+		case NODE_TYPES:
+			insane("Unknown trie node type %d\n", (int)node->type);
+	}
+}
+
+void trie_walk(struct trie *trie, trie_walk_callback callback, void *userdata, struct mem_pool *temp_pool) {
+	(void)temp_pool; // The leaves hold the whole keys, no need for a buffer
+	ulog(LLOG_DEBUG, "Walking trie with %zu active nodes\n", trie->active_count);
+	if (trie->root)
+		walk_node(trie->root, callback, userdata);
+}
+
+// Remove a child (which must be there) from the node
+static void child_remove(struct node *node, uint8_t byte) {
+	switch (node->type) {
+		case NODE4:
+		case NODE16: {
+			uint8_t *keys = node->type == NODE4 ? ((struct node4 *)node)->keys : ((struct node16 *)node)->keys;
+			void **children = node->type == NODE4 ? ((struct node4 *)node)->children : ((struct node16 *)node)->children;
+			size_t pos = 0;
+			while (keys[pos] != byte)
+				pos ++;
+			node->count --;
+			memmove(keys + pos, keys + pos + 1, node->count - pos);
+			memmove(children + pos, children + pos + 1, (node->count - pos) * sizeof *children);
+			return;
+		}
+		case NODE48: {
+			struct node48 *n = (struct node48 *)node;
+			size_t pos = n->index[byte] - 1;
+			n->index[byte] = 0;
+			node->count --;
+			if (pos != node->count) {
+				// Keep the children compact, move the last one to the hole
+				n->children[pos] = n->children[node->count];
+				for (size_t i = 0; i < 256; i ++)
+					if (n->index[i] == node->count + 1) {
+						n->index[i] = pos + 1;
+						break;
+					}
+			}
+			return;
+		}
+		case NODE256:
+			((struct node256 *)node)->children[byte] = NULL;
+			node->count --;
+			return;
+		case NODE_TYPES:
+			break;
+	}
+	insane("Unknown trie node type %d\n", (int)node->type);
+}
+
+// Convert the node to a smaller type
+static void node_shrink(struct trie *trie, void **ref, struct node *node, enum node_type type) {
+	struct node *result = node_convert(trie, node, type);
+	switch (node->type) {
+		case NODE16: {
+			struct node16 *n = (struct node16 *)node;
+			struct node4 *r = (struct node4 *)result;
+			memcpy(r->keys, n->keys, node->count);
+			memcpy(r->children, n->children, node->count * sizeof *r->children);
+			break;
+		}
+		case NODE48: {
+			struct node48 *n = (struct node48 *)node;
+			struct node16 *r = (struct node16 *)result;
+			size_t pos = 0;
+			for (size_t i = 0; i < 256; i ++)
+				if (n->index[i]) {
+					r->keys[pos] = i;
+					r->children[pos ++] = n->children[n->index[i] - 1];
+				}
+			break;
+		}
+		case NODE256: {
+			struct node256 *n = (struct node256 *)node;
+			struct node48 *r = (struct node48 *)result;
+			size_t pos = 0;
+			for (size_t i = 0; i < 256; i ++)
+				if (n->children[i]) {
+					r->children[pos] = n->children[i];
+					r->index[i] = ++ pos;
+				}
+			break;
+		}
+		default:
+			insane("Can't shrink trie node of type %d\n", (int)node->type);
+	}
+	node_release(trie, node);
+	*ref = result;
+}
+
+// Some child of the node (which must have at least one)
+static void *child_first(struct node *node) {
+	switch (node->type) {
+		case NODE4:
+			return ((struct node4 *)node)->children[0];
+		case NODE16:
+			return ((struct node16 *)node)->children[0];
+		case NODE48:
+			return ((struct node48 *)node)->children[0];
+		case NODE256: {
+			struct node256 *n = (struct node256 *)node;
+			size_t i = 0;
+			while (!n->children[i])
+				i ++;
+			return n->children[i];
+		}
+		case NODE_TYPES:
+			break;
+	}
+	insane("Unknown trie node type %d\n", (int)node->type);
+}
+
+// Get some leaf in the subtree, to point a prefix into its key
+static struct leaf *leaf_any(void *current) {
+	while (!IS_LEAF(current)) {
+		struct node *node = current;
+		if (node->value)
+			return node->value;
+		current = child_first(node);
+	}
+	return TO_LEAF(current);
+}
+
+/*
+ * The node at ref (starting at depth) lost a child or its value. Replace it
+ * by the only thing left in it or make it smaller if it is too sparse.
+ */
+static void node_compact(struct trie *trie, void **ref, size_t depth) {
+	struct node *node = *ref;
+	if (node->count + (node->value ? 1 : 0) == 1) {
+		if (node->value) {
+			*ref = TAG_LEAF(node->value);
+		} else {
+			void *child = child_first(node);
+			if (!IS_LEAF(child)) {
+				// Glue the prefixes together, with the branching byte in between
+				struct node *c = child;
+				c->prefix_len += node->prefix_len + 1;
+				c->prefix = leaf_any(c)->key + depth;
+			}
+			*ref = child;
+		}
+		ulog(LLOG_DEBUG_VERBOSE, "Collapsing trie node with single entry\n");
+		node_release(trie, node);
+		return;
+	}
+	switch (node->type) {
+		case NODE16:
+			if (node->count <= 3)
+				node_shrink(trie, ref, node, NODE4);
+			break;
+		case NODE48:
+			if (node->count <= 12)
+				node_shrink(trie, ref, node, NODE16);
+			break;
+		case NODE256:
+			if (node->count <= 37)
+				node_shrink(trie, ref, node, NODE48);
+			break;
+		default:
+			break;
+	}
+}
+
+/*
+ * Remove the key from the subtree at ref, the depth bytes of key are already
+ * consumed. Returns the removed leaf or NULL if the key is not there.
+ */
+static struct leaf *delete_internal(struct trie *trie, void **ref, const uint8_t *key, size_t key_size, size_t depth) {
+	if (IS_LEAF(*ref)) {
+		struct leaf *leaf = TO_LEAF(*ref);
+		if (!leaf_matches(leaf, key, key_size))
+			return NULL;
+		*ref = NULL; // The parent removes the slot
+		return leaf;
+	}
+	struct node *node = *ref;
+	size_t node_depth = depth;
+	if (node->prefix_len) {
+		if (key_size - depth < node->prefix_len || memcmp(node->prefix, key + depth, node->prefix_len) != 0)
+			return NULL;
+		depth += node->prefix_len;
+	}
+	struct leaf *leaf;
+	if (depth == key_size) {
+		leaf = node->value;
+		if (!leaf)
+			return NULL;
+		node->value = NULL;
+	} else {
+		uint8_t byte = key[depth];
+		void **child = child_find(node, byte);
+		if (!child)
+			return NULL;
+		leaf = delete_internal(trie, child, key, key_size, depth + 1);
+		if (!leaf)
+			return NULL;
+		if (!*child)
+			child_remove(node, byte);
+	}
+	node_compact(trie, ref, node_depth);
+	// The prefix might have pointed to the key of the removed leaf
+	if (!IS_LEAF(*ref)) {
+		struct node *current = *ref;
+		if (current->prefix_len && current->prefix >= leaf->key && current->prefix < leaf->key + leaf->key_size)
+			current->prefix = leaf_any(current)->key + node_depth;
+	}
+	return leaf;
+}
+
+bool trie_delete(struct trie *trie, const uint8_t *key, size_t key_size) {
+	ulog(LLOG_DEBUG_VERBOSE, "Deleting from trie by %zu bytes of key\n", key_size);
+	if (!trie->root)
+		return false;
+	struct leaf *leaf = delete_internal(trie, &trie->root, key, key_size, 0);
+	if (!leaf)
+		return false;
+	trie->active_count --;
+	leaf_release(trie, leaf);
+	return true;
+}
+
+struct iter_frame {
+	struct node *node;
+	size_t depth; // Position of the byte the node branches on
+	unsigned next; // The smallest byte of a child not visited yet
+};
+
+struct trie_iter {
+	struct trie *trie;
+	struct mem_pool *pool;
+	uint8_t *prefix;
+	size_t prefix_size;
+	bool ordered; // Always ordered here, but the resume needs to be asked for the right thing
+	struct leaf *pending; // To be returned before going on with the stack
+	struct iter_frame *frames;
+	size_t capacity, depth;
+};
+
+// The first child with byte at least from
+static void *child_next(struct node *node, unsigned from, unsigned *byte) {
+	switch (node->type) {
+		case NODE4:
+		case NODE16: {
+			const uint8_t *keys = node->type == NODE4 ? ((struct node4 *)node)->keys : ((struct node16 *)node)->keys;
+			void **children = node->type == NODE4 ? ((struct node4 *)node)->children : ((struct node16 *)node)->children;
+			for (size_t i = 0; i < node->count; i ++)
+				if (keys[i] >= from) {
+					*byte = keys[i];
+					return children[i];
+				}
+			return NULL;
+		}
+		case NODE48: {
+			struct node48 *n = (struct node48 *)node;
+			for (unsigned i = from; i < 256; i ++)
+				if (n->index[i]) {
+					*byte = i;
+					return n->children[n->index[i] - 1];
+				}
+			return NULL;
+		}
+		case NODE256: {
+			struct node256 *n = (struct node256 *)node;
+			for (unsigned i = from; i < 256; i ++)
+				if (n->children[i]) {
+					*byte = i;
+					return n->children[i];
+				}
+			return NULL;
+		}
+		case NODE_TYPES:
+			break;
+	}
+	insane("Unknown trie node type %d\n", (int)node->type);
+}
+
+static bool leaf_greater(const struct leaf *leaf, const uint8_t *key, size_t key_size) {
+	size_t common = lcp(leaf->key, leaf->key_size, key, key_size);
+	if (common < leaf->key_size && common < key_size)
+		return leaf->key[common] > key[common];
+	return leaf->key_size > key_size;
+}
+
+static void iter_push(struct trie_iter *iter, struct node *node, size_t depth) {
+	if (iter->depth == iter->capacity) {
+		size_t capacity = iter->capacity ? 2 * iter->capacity : 16;
+		struct iter_frame *frames = mem_pool_alloc(iter->pool, capacity * sizeof *frames);
+		if (iter->depth)
+			memcpy(frames, iter->frames, iter->depth * sizeof *frames);
+		iter->frames = frames;
+		iter->capacity = capacity;
+	}
+	iter->frames[iter->depth ++] = (struct iter_frame) {
+		.node = node,
+		.depth = depth
+	};
+}
+
+// Find the subtree holding all the keys with the prefix (if any)
+static void iter_restart(struct trie_iter *iter) {
+	iter->depth = 0;
+	iter->pending = NULL;
+	const uint8_t *prefix = iter->prefix;
+	size_t prefix_size = iter->prefix_size;
+	void *current = iter->trie->root;
+	size_t depth = 0;
+	while (current) {
+		if (IS_LEAF(current)) {
+			struct leaf *leaf = TO_LEAF(current);
+			if (leaf->key_size >= prefix_size && memcmp(leaf->key, prefix, prefix_size) == 0)
+				iter->pending = leaf;
+			return;
+		}
+		struct node *node = current;
+		size_t rest = prefix_size - depth;
+		size_t common = lcp(prefix + depth, rest, node->prefix, node->prefix_len);
+		if (common == rest) {
+			// The prefix ends inside this node
+			iter_push(iter, node, depth + node->prefix_len);
+			iter->pending = node->value;
+			return;
+		}
+		if (common < node->prefix_len)
+			return;
+		depth += node->prefix_len;
+		void **child = child_find(node, prefix[depth ++]);
+		current = child ? *child : NULL;
+	}
+}
+
+struct trie_iter *trie_iter_create(struct trie *trie, const uint8_t *prefix, size_t prefix_size, bool ordered, struct mem_pool *pool) {
+	ulog(LLOG_DEBUG, "Creating %s trie iterator with %zu bytes of prefix\n", ordered ? "ordered" : "unordered", prefix_size);
+	struct trie_iter *result = mem_pool_alloc(pool, sizeof *result);
+	*result = (struct trie_iter) {
+		.trie = trie,
+		.pool = pool,
+		.prefix = mem_pool_alloc(pool, prefix_size),
+		.prefix_size = prefix_size,
+		.ordered = ordered
+	};
+	if (prefix_size)
+		memcpy(result->prefix, prefix, prefix_size);
+	iter_restart(result);
+	return result;
+}
+
+bool trie_iter_next(struct trie_iter *iter, const uint8_t **key, size_t *key_size, struct trie_data **data) {
+	struct leaf *found = iter->pending;
+	iter->pending = NULL;
+	while (!found && iter->depth) {
+		struct iter_frame *top = &iter->frames[iter->depth - 1];
+		unsigned byte;
+		void *child = child_next(top->node, top->next, &byte);
+		if (!child) {
+			iter->depth --;
+			continue;
+		}
+		top->next = byte + 1;
+		if (IS_LEAF(child)) {
+			found = TO_LEAF(child);
+		} else {
+			struct node *node = child;
+			// The shorter key goes first
+			iter_push(iter, node, top->depth + 1 + node->prefix_len);
+			found = node->value;
+		}
+	}
+	if (!found)
+		return false;
+	if (key)
+		*key = found->key;
+	if (key_size)
+		*key_size = found->key_size;
+	if (data)
+		*data = found->data;
+	return true;
+}
+
+void trie_iter_resume(struct trie_iter *iter, const uint8_t *key, size_t key_size) {
+	sanity(iter->ordered, "Resuming unordered trie iterator\n");
+	iter_restart(iter);
+	if (!iter->depth) {
+		// Nothing or a single leaf
+		if (iter->pending && !leaf_greater(iter->pending, key, key_size))
+			iter->pending = NULL;
+		return;
+	}
+	// Compare the key with the path to the top node
+	struct iter_frame *top = &iter->frames[0];
+	const uint8_t *path = leaf_any(top->node)->key;
+	size_t common = lcp(key, key_size, path, top->depth);
+	if (common < top->depth) {
+		if (common < key_size && key[common] > path[common]) {
+			// All the keys are smaller
+			iter->depth = 0;
+			iter->pending = NULL;
+		}
+		// Otherwise all the keys are larger, start from the beginning
+		return;
+	}
+	// The value has the key of the path, which is not larger than the key. Go down the path of the key and skip the smaller children.
+	iter->pending = NULL;
+	for (;;) {
+		top = &iter->frames[iter->depth - 1];
+		if (top->depth == key_size)
+			return; // The key ends here, all the children are larger
+		uint8_t byte = key[top->depth];
+		top->next = byte;
+		void **ref = child_find(top->node, byte);
+		if (!ref)
+			return;
+		if (IS_LEAF(*ref)) {
+			if (!leaf_greater(TO_LEAF(*ref), key, key_size))
+				top->next = byte + 1;
+			return;
+		}
+		struct node *node = *ref;
+		const uint8_t *rest = key + top->depth + 1;
+		size_t rest_size = key_size - top->depth - 1;
+		common = lcp(rest, rest_size, node->prefix, node->prefix_len);
+		if (common < node->prefix_len) {
+			if (common < rest_size && node->prefix[common] < rest[common])
+				top->next = byte + 1; // The whole child is smaller
+			return;
+		}
+		top->next = byte + 1;
+		iter_push(iter, node, top->depth + 1 + node->prefix_len);
+	}
+}
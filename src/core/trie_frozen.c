@@ -0,0 +1,120 @@
+/*
+    Ucollect - small utility for real-time analysis of network data
+    Copyright (C) 2015 CZ.NIC, z.s.p.o. (http://www.nic.cz/)
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#include "trie_frozen.h"
+#include "trie.h"
+#include "mem_pool.h"
+#include "util.h"
+#include "tunable.h"
+
+#include <string.h>
+
+struct slot {
+	const uint8_t *key; // NULL in an empty slot
+	struct trie_data *data;
+	uint32_t hash;
+	uint32_t key_size;
+};
+
+struct trie_frozen {
+	struct slot *slots;
+	size_t mask; // Number of slots - 1
+	size_t count;
+};
+
+// FNV-1a
+static uint32_t key_hash(const uint8_t *key, size_t key_size) {
+	uint32_t hash = 2166136261U;
+	for (size_t i = 0; i < key_size; i ++) {
+		hash ^= key[i];
+		hash *= 16777619U;
+	}
+	return hash;
+}
+
+struct build {
+	struct trie_frozen *frozen;
+	uint8_t *keys; // Where to copy the next key
+	size_t key_bytes;
+};
+
+static void key_count(const uint8_t *key, size_t key_size, struct trie_data *data, void *userdata) {
+	(void)key;
+	(void)data;
+	struct build *build = userdata;
+	build->key_bytes += key_size;
+}
+
+static void key_insert(const uint8_t *key, size_t key_size, struct trie_data *data, void *userdata) {
+	struct build *build = userdata;
+	struct trie_frozen *frozen = build->frozen;
+	sanity(key_size <= UINT32_MAX, "Key of %zu bytes too long to freeze\n", key_size);
+	uint32_t hash = key_hash(key, key_size);
+	size_t pos = hash & frozen->mask;
+	while (frozen->slots[pos].key)
+		pos = (pos + 1) & frozen->mask;
+	memcpy(build->keys, key, key_size);
+	frozen->slots[pos] = (struct slot) {
+		.key = build->keys,
+		.data = data,
+		.hash = hash,
+		.key_size = key_size
+	};
+	build->keys += key_size;
+	frozen->count ++;
+}
+
+struct trie_frozen *trie_freeze(struct trie *trie, struct mem_pool *pool) {
+	size_t count = trie_size(trie);
+	size_t slots = 1;
+	while (slots < TRIE_FROZEN_SLOTS_PER_KEY * count)
+		slots <<= 1;
+	ulog(LLOG_DEBUG, "Freezing trie with %zu keys into %zu slots\n", count, slots);
+	struct trie_frozen *result = mem_pool_alloc(pool, sizeof *result);
+	*result = (struct trie_frozen) {
+		.slots = mem_pool_alloc(pool, slots * sizeof *result->slots),
+		.mask = slots - 1
+	};
+	memset(result->slots, 0, slots * sizeof *result->slots);
+	struct build build = {
+		.frozen = result
+	};
+	// The walk needs only a small key buffer, so use the target pool for it
+	trie_walk(trie, key_count, &build, pool);
+	// One more byte, so even the empty key has non-NULL position
+	build.keys = mem_pool_alloc(pool, build.key_bytes + 1);
+	trie_walk(trie, key_insert, &build, pool);
+	sanity(result->count == count, "Froze %zu keys out of %zu\n", result->count, count);
+	return result;
+}
+
+struct trie_data *trie_frozen_lookup(const struct trie_frozen *frozen, const uint8_t *key, size_t key_size) {
+	uint32_t hash = key_hash(key, key_size);
+	// There's always an empty slot, so the loop terminates
+	for (size_t pos = hash & frozen->mask; frozen->slots[pos].key; pos = (pos + 1) & frozen->mask) {
+		const struct slot *slot = &frozen->slots[pos];
+		if (slot->hash == hash && slot->key_size == key_size && (!key_size || memcmp(slot->key, key, key_size) == 0))
+			return slot->data;
+	}
+	return NULL;
+}
+
+size_t trie_frozen_size(const struct trie_frozen *frozen) {
+	return frozen->count;
+}
@@ -0,0 +1,53 @@
+/*
+    Ucollect - small utility for real-time analysis of network data
+    Copyright (C) 2015 CZ.NIC, z.s.p.o. (http://www.nic.cz/)
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#ifndef UCOLLECT_CORE_TRIE_FROZEN_H
+#define UCOLLECT_CORE_TRIE_FROZEN_H
+
+/*
+ * A read-only snapshot of a trie, for tables that are built once (eg. from
+ * configuration) and then only looked up in the hot path.
+ *
+ * The keys are copied into a single block and indexed by an open-addressing
+ * hash table, so a lookup usually touches only a slot and the key bytes. The
+ * snapshot is never modified after it is built, so it can be shared by any
+ * number of readers without locking.
+ */
+
+#include <stdint.h>
+#include <stdlib.h>
+
+struct trie;
+struct trie_data;
+struct mem_pool;
+
+struct trie_frozen;
+
+/*
+ * Build a snapshot of the keys present in the trie. Everything is allocated
+ * from the pool. The snapshot doesn't reference the trie afterwards (so the
+ * trie may be modified or its pool reset), but the data pointers are shared.
+ */
+struct trie_frozen *trie_freeze(struct trie *trie, struct mem_pool *pool) __attribute__((nonnull)) __attribute__((malloc)) __attribute__((returns_nonnull));
+// Find the data for the key, NULL if it is not present. Key may be NULL if key_size is 0.
+struct trie_data *trie_frozen_lookup(const struct trie_frozen *frozen, const uint8_t *key, size_t key_size) __attribute__((nonnull(1))) __attribute__((pure));
+// Number of keys in the snapshot.
+size_t trie_frozen_size(const struct trie_frozen *frozen) __attribute__((nonnull)) __attribute__((pure));
+
+#endif
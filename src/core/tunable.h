@@ -26,6 +26,40 @@
 #define PCAP_TIMEOUT 100
 #define PCAP_BUFFER 3276800
 
+/*
+ * The trie keeps the memory released by trie_delete for reuse. Pieces (keys or
+ * leaves) up to this many bytes are recycled, larger ones stay unused in the
+ * memory pool until it is reset.
+ */
+#define TRIE_RECYCLE_MAX 128
+// A frozen trie has at least this many hash table slots per key (rounded up to power of 2)
+#define TRIE_FROZEN_SLOTS_PER_KEY 2
+// How many slots of the old array a hash table (hash_table.h) moves to the new one on each modification during resize
+#define HASH_TABLE_MIGRATE 32
+// How many addresses lpm_lookup_batch walks through the levels of the table together
+#define LPM_BATCH 8
+
+// How often to check the memory budgets of plugins (milliseconds)
+#define MEMORY_CHECK_TIME 1000
+
+/*
+ * The overload controller (the defaults of the overload config section). It
+ * checks the load every OVERLOAD_CHECK_TIME milliseconds. It steps up when the
+ * capture drops more than OVERLOAD_DROP_HIGH per mille of the packets or the
+ * packet callbacks take more than OVERLOAD_LOAD_HIGH per cent of the time. It
+ * steps down once both are below the _LOW ones for OVERLOAD_HOLD checks in a row.
+ * Only one in OVERLOAD_TIMING_SAMPLE packets is timed, to keep the cost low.
+ */
+#define OVERLOAD_CHECK_TIME 1000
+#define OVERLOAD_DROP_HIGH 10
+#define OVERLOAD_DROP_LOW 1
+#define OVERLOAD_LOAD_HIGH 80
+#define OVERLOAD_LOAD_LOW 40
+#define OVERLOAD_HOLD 30
+#define OVERLOAD_SAMPLE_RATE 8
+#define OVERLOAD_SNAPLEN_DEFAULT 128
+#define OVERLOAD_TIMING_SAMPLE 16
+
 // How many times a plugin may fail before we give up and disable it
 #define FAIL_COUNT 5
 // After how many milliseconds do we reset the count to zero?
@@ -42,17 +76,37 @@
 // If nothing comes in 50 + a bit minutes, panic and do a full reconfigure
 #define WATCHDOG_MISSED_COUNT 5
 
+// How many hashes of plugin libraries to remember (keyed by the file identity and modification)
+#define PLUGIN_HASH_CACHE_SIZE 32
+
 // For the memory pool
 #define PAGE_CACHE_SIZE 20
+/*
+ * Allocation profiling of the memory pools (only when compiled with MEM_POOL_PROFILE).
+ * Every MEM_POOL_PROFILE_SAMPLE-th allocation of each pool is recorded together
+ * with its call site. Each pool keeps at most MEM_POOL_PROFILE_SITES call sites
+ * and MEM_POOL_PROFILE_TOP of them are reported in the statistics.
+ */
+#define MEM_POOL_PROFILE_SAMPLE 64
+#define MEM_POOL_PROFILE_SITES 16
+#define MEM_POOL_PROFILE_TOP 3
 
-// Uplink compression level
+// Uplink compression level (of zlib, unless configured otherwise)
 #define COMPRESSION_LEVEL 9
+// The default level of zstd compression of the uplink
+#define UPLINK_ZSTD_LEVEL 3
+// The zstd window (log2 of bytes), it limits the memory needed to decompress
+#define UPLINK_ZSTD_WINDOW_LOG 17
+// How long to wait for the server to choose the compression before continuing with zlib (milliseconds)
+#define UPLINK_CODEC_TIMEOUT (5 * 1000)
 
 // Buffer size for compression/decompression
 #define COMPRESSION_BUFFSIZE 1024
 // WARNING: Code was tested with small buffers and limiting is size for output
 // buffer of deflate(). There must be free space to store complete block header
 // (from 4 to 6 bytes) and some output. Do not use smaller buffers than 10 bytes.
+// The buffer for receiving from the uplink starts at COMPRESSION_BUFFSIZE and doubles each time a read fills it, up to this
+#define UPLINK_RECV_BUFFER_MAX (64 * 1024)
 
 // Uplink reconnect times
 // First attempt after 2 seconds
@@ -69,13 +123,43 @@
 // If so many pings are not answered, consider the link dead
 #define PING_COUNT 2
 
+// The longest session token from the server the uplink keeps for resuming the session
+#define UPLINK_SESSION_TOKEN_MAX 64
 // The challenge length in bytes to send to server
 #define CHALLENGE_LEN 32
 // Minimum time between connection attempts
 #define RECONN_TIME 1000
+// At most this many addresses of the server are used (they must fit into a single write to a pipe)
+#define UPLINK_ADDR_MAX 16
+// Kill the resolution of the server name if it takes longer than this (milliseconds)
+#define UPLINK_RESOLVE_TIMEOUT (30 * 1000)
+// Start connecting to the next address of the server if the previous one doesn't answer in this time (milliseconds)
+#define UPLINK_EYEBALLS_DELAY 250
 
 // Time to sleep when we receive the stray read (milliseconds)
 #define STRAY_READ_SLEEP 500
+// How long the sending to the server may stay blocked before the connection is considered broken (milliseconds)
+#define UPLINK_SEND_TIMEOUT (30 * 1000)
+// The size of a piece of the uplink send queue
+#define UPLINK_CHUNK_SIZE 4096
+// The most compressed bytes waiting in the uplink send queue. Messages that don't fit are dropped.
+#define UPLINK_QUEUE_MAX (1024 * 1024)
+// The most a single plugin may take of the uplink send queue
+#define UPLINK_QUEUE_PLUGIN_MAX (512 * 1024)
+// Messages of the plugins wait (uncompressed) for their turn while the uplink send queue has this many bytes, so the pings and pongs don't get stuck behind them
+#define UPLINK_QUEUE_LOW (16 * 1024)
+// How many bytes of its messages a plugin may put into the send queue in one round, before the next plugin goes (multiplied by its send_weight)
+#define UPLINK_QUEUE_QUANTUM 4096
+// The largest send_weight option of a plugin
+#define UPLINK_QUEUE_WEIGHT_MAX 64
+// How often the uplink writes the traffic of the plugins to the status file and reports it to the server (if it asks for it)
+#define UPLINK_TRAFFIC_INTERVAL (15 * 60 * 1000)
+// Flush the compression of the coalesced messages once they have so many uncompressed bytes, without waiting for the end of the loop iteration
+#define UPLINK_COALESCE_MAX (64 * 1024)
+// The default size of the spool file for plugin messages while the uplink is down
+#define UPLINK_SPOOL_SIZE (4 * 1024 * 1024)
+// How many spooled messages to put into the send queue before letting the loop run
+#define UPLINK_SPOOL_BATCH 64
 
 // How many attempts to log in before giving up and exiting?
 #define LOGIN_FAILURE_LIMIT 10
@@ -84,6 +168,6 @@
 #define STAT_DUMP_TIMEOUT (3600 * 1000)
 
 // Base protocol version
-#define PROTOCOL_VERSION 1
+#define PROTOCOL_VERSION 3
 
 #endif
@@ -22,10 +22,15 @@
 #include "loop.h"
 #include "util.h"
 #include "context.h"
+#include "spool.h"
+#include "codec.h"
 
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/epoll.h>
 #include <sys/stat.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
 #include <fcntl.h>
 #include <stdio.h>
 #include <netdb.h>
@@ -34,11 +39,19 @@
 #include <string.h>
 #include <stdarg.h>
 #include <unistd.h>
+#include <stdlib.h>
 #include <openssl/sha.h>
 #include <atsha204.h>
 #include <time.h>
 #include <stdio.h>
-#include <zlib.h>
+#include <stddef.h>
+#include <limits.h>
+#include <signal.h>
+#ifndef UPLINK_SOCAT
+#include <openssl/ssl.h>
+#include <openssl/err.h>
+#include <openssl/x509.h>
+#endif
 
 static void atsha_log_callback(const char *msg) {
 	ulog(LLOG_ERROR, "ATSHA: %s\n", msg);
@@ -58,15 +71,160 @@ enum rdd_status {
 };
 
 #define IPV6_LEN 16
+#define TLS_CIPHERS "HIGH:!LOW:!MEDIUM:!SSLv2:!aNULL:!eNULL:!DES:!3DES:!AES128:!CAMELLIA128"
 
 struct uplink;
 
+#ifdef UPLINK_SOCAT
 struct err_handler {
 	struct epoll_handler handler;
 	struct uplink *uplink;
 	int fd;
 	struct err_handler *next;
 };
+#else
+// One of the connections to the server started in parallel, the first one to succeed is used
+struct connect_attempt {
+	struct epoll_handler handler;
+	struct uplink *uplink;
+	int fd; // -1 if not in progress
+	socklen_t addr_len;
+	struct sockaddr_storage addr;
+};
+#endif
+
+// The resolution of the server name, running in a child process not to block the loop
+struct resolver {
+	struct epoll_handler handler;
+	struct uplink *uplink;
+	int fd; // Reading end of the pipe from the child, -1 if not running
+	pid_t pid;
+	bool connect; // Connect to the server once the addresses are known
+	bool timeout_scheduled;
+	size_t timeout_id;
+};
+
+// What the child sends through the pipe, in a single write
+struct resolved {
+	int error; // Of getaddrinfo
+	size_t count;
+	struct {
+		socklen_t len;
+		struct sockaddr_storage addr;
+	} addrs[UPLINK_ADDR_MAX];
+};
+
+// Address of the server, with the addrinfo pointing to it for uplink_addrinfo
+struct uplink_addr {
+	struct addrinfo info;
+	struct sockaddr_storage addr;
+};
+
+// A piece of the compressed outgoing stream, waiting to be sent
+struct queue_chunk {
+	struct queue_chunk *next;
+	size_t start, end; // The unsent data are between these
+	uint8_t data[UPLINK_CHUNK_SIZE];
+};
+
+// How much of the send queue a plugin uses
+// What a kind of messages costs, for the stats and the traffic reports
+struct uplink_traffic {
+	uint64_t messages;
+	uint64_t raw, compressed; // Bytes before and after the compression
+	uint64_t compress_time; // Spent in the compression (ns)
+	uint64_t wait_time; // How long the messages waited in the queue for the socket, summed (ms)
+	uint64_t offline; // Messages dropped because the connection was down
+};
+
+// The classes of the plugin messages waiting in the send queue. The interactive ones go first.
+enum send_class {
+	SEND_INTERACTIVE,
+	SEND_BULK,
+	SEND_CLASS_COUNT
+};
+
+struct plugin_queue {
+	struct plugin_queue *next;
+	const char *name;
+	struct uplink_traffic traffic;
+	size_t queued; // Compressed bytes of its messages not sent yet
+	size_t refused, refused_bytes; // Messages that didn't fit into the queue
+	size_t refused_now; // Messages refused since the queue got full for it last time
+	// Messages waiting for their turn to enter the compression, uncompressed in the wire format
+	struct queue_chunk *pending_head, *pending_tail;
+	size_t pending; // Their bytes
+	size_t deficit; // How many bytes it may still put into the compression in this round
+	uint32_t weight; // How many quanta it gets in a round
+	enum send_class class; // The round it joins when it gets pending messages
+	bool active; // Is it in a round (has pending messages)?
+	struct plugin_queue *next_active;
+};
+
+// The plugins with pending messages of one class, taking turns
+struct send_round {
+	struct plugin_queue *head, *tail;
+};
+
+struct plugin_queues {
+	struct plugin_queue *head, *tail;
+};
+
+#define LIST_NODE struct plugin_queue
+#define LIST_BASE struct plugin_queues
+#define LIST_NAME(X) plugin_queues_##X
+#define LIST_WANT_APPEND_POOL
+#define LIST_WANT_LFOR
+#include "link_list.h"
+
+// Where a plugin message ends in the queue, to return its size to the plugin once it is sent
+struct queue_mark {
+	struct queue_mark *next;
+	struct plugin_queue *plugin;
+	uint64_t end; // 0 until the message is flushed out of the compression
+	size_t size;
+	uint64_t queued_at; // When it got into the queue
+	char type;
+};
+
+// One entry of the traffic report, for a plugin ('P') or for a type of messages ('T')
+#define WIRE_NAME(X) traffic_entry_##X
+#define WIRE_FIELDS(FIELD, FIELD_IF) \
+	FIELD(char, kind) \
+	FIELD(string, name) \
+	FIELD(uint32, messages) \
+	FIELD(uint32, raw) \
+	FIELD(uint32, compressed) \
+	FIELD(uint32, compress_time) \
+	FIELD(uint32, wait_time) \
+	FIELD(uint32, offline)
+#include "wire_message.h"
+
+// Half of the login challenge (the server sends one, the other one is ours)
+#define HALF_SIZE 16
+
+// Issued by the server after login, to resume the session after a reconnect
+#define WIRE_NAME(X) session_token_##X
+#define WIRE_OPCODE 'I'
+#define WIRE_FIELDS(FIELD, FIELD_IF) \
+	FIELD(string, token) \
+	FIELD(uint32, lifetime)
+#include "wire_message.h"
+
+// Sent instead of the login to resume the session
+#define WIRE_NAME(X) session_resume_##X
+#define WIRE_OPCODE 'R'
+#define WIRE_FIELDS(FIELD, FIELD_IF) \
+	FIELD(string, token)
+#include "wire_message.h"
+
+// The server sets the packet sampling of a plugin
+#define WIRE_NAME(X) sampling_##X
+#define WIRE_FIELDS(FIELD, FIELD_IF) \
+	FIELD(string, plugin) \
+	FIELD(char, mode) \
+	FIELD(uint32, rate)
+#include "wire_message.h"
 
 struct uplink {
 	// Will always be uplink_read, this is to be able to use it as epoll_handler
@@ -74,17 +232,85 @@ struct uplink {
 	struct loop *loop;
 	struct mem_pool *buffer_pool;
 	const char *remote_name, *service, *login, *password, *cert;
-	struct addrinfo *addrinfo;
+	struct addrinfo *addrinfo; // List of the server addresses, in the addr_pool
+	struct mem_pool *addr_pool;
+	struct resolver resolver;
+	int good_family; // The last connection worked over this one, AF_UNSPEC if none did
 	const uint8_t *buffer;
 	uint8_t *buffer_pos;
+	uint8_t size_buffer[sizeof(uint32_t)]; // The size of the next message is received here
+	bool dispatching; // A plugin processes a message from the buffer_pool, don't reset it
+#ifdef UPLINK_SOCAT
 	struct err_handler *empty_handler;
+#else
+	SSL_CTX *tls_ctx;
+	SSL *tls;
+	SSL_SESSION *tls_session; // From the last connection, to resume it on reconnect
+	// Connecting to the addresses in parallel (happy eyeballs)
+	struct connect_attempt attempts[UPLINK_ADDR_MAX];
+	size_t attempt_count, attempt_next, attempts_open;
+	bool eyeballs_scheduled;
+	size_t eyeballs_id; // The ID of the timeout to start the next attempt
+	bool tls_handshake; // Still connecting or in the TLS handshake
+	bool tls_broken; // A fatal error happened, the connection can't be shut down cleanly
+	bool read_scheduled; // Reading data left in the TLS buffers is scheduled
+	size_t read_id; // The ID of the timeout to read them
+	bool tls_want_write; // The TLS needs to write before it can continue (including the connect)
+#endif
+	// The send queue
+	struct queue_chunk *queue_head, *queue_tail, *chunk_recycler;
+	struct queue_mark *mark_head, *mark_tail, *mark_recycler;
+	struct plugin_queues plugin_queues;
+	size_t queued; // Bytes in the queue
+	size_t queue_peak; // The most bytes in the queue since the last stats
+	uint64_t queue_appended, queue_sent; // Bytes put to and taken out of the queue during this connection
+	// Messages compressed since the last flush of the compression, to be flushed together
+	size_t coalesced; // Their uncompressed bytes
+	struct queue_mark *coalesced_mark; // The first mark of them
+	bool sync_scheduled;
+	size_t sync_id; // The ID of the timeout to flush them
+	size_t messages, syncs; // Messages queued and flushes of the compression, for the stats
+	// The plugins with pending messages, taking turns in putting them into the compression, a round for each class
+	struct send_round rounds[SEND_CLASS_COUNT];
+	size_t pending; // Bytes of the pending messages of all the plugins
+	bool feed_scheduled;
+	size_t feed_id; // The ID of the timeout to move the pending messages into the compression
+	bool send_blocked; // The socket is full, waiting for it to become writable
+	bool write_watched; // Is the loop watching the socket for being writable?
+	uint64_t stall_start; // When the socket got full
+	uint64_t stall_time; // How long the sending was blocked in total (ms)
+	size_t stall_count; // How many times it got blocked
+	size_t refused; // Messages not sent because the queue was full
+	size_t refused_now; // Messages of the core refused since the queue got full last time
+	size_t send_interrupted, send_partial; // Sends interrupted by a signal and the ones that took only part of the data
+	struct uplink_traffic type_traffic[UCHAR_MAX + 1]; // By the type of the message
+	uint64_t message_time; // Spent compressing the current message so far (ns)
+	char last_type; // Of the last compressed message, the output of the flush is accounted to it
+	bool traffic_wanted; // The server asked for the traffic reports in this connection
+	bool traffic_scheduled;
+	size_t traffic_id; // The ID of the timeout to report the traffic
+	// The spool of plugin messages while disconnected
+	struct spool *spool;
+	struct mem_pool *spool_pool;
+	const char *spool_path;
+	size_t spool_size;
+	bool spool_accepted; // The server takes the spooled messages in this connection
+	bool replay_scheduled; // Continuation of the replay is scheduled
+	size_t replay_id; // The ID of the timeout to continue
+	size_t spooled, replayed, acked; // Messages put into the spool, sent from there and acknowledged by the server
+	size_t spool_refused; // Messages not spooled because the spool was full
+	size_t spool_refused_now; // Messages refused since the spool got full last time
 	size_t buffer_size, size_rest;
 	uint32_t reconnect_timeout;
 	bool has_size;
-	bool last_ipv6; // Was the last attempt over IPv6?
+#ifdef UPLINK_SOCAT
+	int attempt_family; // The one socat was told to use last time
+#endif
 	// Timeouts for pings, etc.
 	size_t ping_timeout; // The ID of the timeout.
 	size_t pings_unanswered; // Number of pings sent without answer (in a row)
+	uint64_t ping_end; // Where the last ping ends in the queue (compare with queue_sent)
+	uint64_t ping_progress; // The queue_sent at the last ping timeout
 	bool ping_scheduled;
 	bool reconnect_scheduled;
 	bool seen_data;
@@ -95,13 +321,136 @@ struct uplink {
 	uint8_t address[IPV6_LEN];
 	enum auth_status auth_status;
 	size_t login_failure_count;
-	z_stream zstrm_send;
-	z_stream zstrm_recv;
+	// The compression of the connection
+	struct codec codec_send, codec_recv;
+	struct mem_pool *inc_pool;
 	uint8_t *inc_buffer;
 	size_t inc_buffer_size;
+	bool inc_grow; // The last read filled the whole inc_buffer, use a bigger one for the next
+	const uint8_t *inc_pos; // Received data not decompressed yet
+	size_t inc_avail;
+	uint64_t raw_total, compressed_total; // Bytes before and after the compression, for the stats
+	enum codec_type codec_wanted; // Configured, anything but zlib is negotiated at login
+	int codec_level;
+	enum codec_type codec_chosen; // By the server, for the current connection
+	bool codec_wait; // Offered the compression, waiting for the answer before logging in
+	size_t codec_timeout_id;
+	bool recv_switch; // Switch the decompression to codec_chosen once the zlib stream from the server ends
+	uint8_t challenge[HALF_SIZE]; // Kept while waiting for the answer
+	// The session the server lets us resume after a reconnect, skipping the login and the resync of the plugins
+	uint8_t session_token[UPLINK_SESSION_TOKEN_MAX];
+	size_t session_token_size; // 0 if there's none
+	uint64_t session_expire; // When the server forgets it (loop_now time)
+	bool session_held; // Disconnected, but the plugins were not told, waiting to resume
+	bool resume_sent; // Asked the server to resume, waiting for the answer
+	bool session_timeout_scheduled;
+	size_t session_timeout_id;
+	// The zstd dictionary provided by the server, kept across the connections
+	struct mem_pool *dict_pool;
+	uint8_t *dict;
+	size_t dict_size;
+	uint32_t dict_id;
+#ifdef UPLINK_CAPTURE
+	FILE *capture; // The uncompressed stream is stored there, for benchmarking the compression
+#endif
 	const char *status_file;
 };
 
+#define RECYCLER_NODE struct queue_chunk
+#define RECYCLER_BASE struct uplink
+#define RECYCLER_HEAD chunk_recycler
+#define RECYCLER_NAME(X) chunk_recycler_##X
+#include "recycler.h"
+
+#define RECYCLER_NODE struct queue_mark
+#define RECYCLER_BASE struct uplink
+#define RECYCLER_HEAD mark_recycler
+#define RECYCLER_NAME(X) mark_recycler_##X
+#include "recycler.h"
+
+// Make the loop watch the socket for writing if either the send queue or the TLS needs it
+static void update_write_watch(struct uplink *uplink) {
+	bool want = uplink->send_blocked;
+#ifndef UPLINK_SOCAT
+	want = want || uplink->tls_want_write;
+#endif
+	if (want != uplink->write_watched) {
+		loop_fd_want_write(uplink->loop, uplink->fd, (struct epoll_handler *) uplink, want);
+		uplink->write_watched = want;
+	}
+}
+
+// Return the plugins' shares of what got sent
+static void queue_marks_release(struct uplink *uplink) {
+	while (uplink->mark_head && uplink->mark_head->end && uplink->mark_head->end <= uplink->queue_sent) {
+		struct queue_mark *mark = uplink->mark_head;
+		mark->plugin->queued -= mark->size;
+		uint64_t wait = loop_now(uplink->loop) - mark->queued_at;
+		mark->plugin->traffic.wait_time += wait;
+		uplink->type_traffic[(unsigned char) mark->type].wait_time += wait;
+		uplink->mark_head = mark->next;
+		if (!uplink->mark_head)
+			uplink->mark_tail = NULL;
+		mark_recycler_release(uplink, mark);
+	}
+}
+
+static void stall_end(struct uplink *uplink) {
+	if (uplink->send_blocked) {
+		uplink->stall_time += loop_now(uplink->loop) - uplink->stall_start;
+		uplink->send_blocked = false;
+	}
+}
+
+// Drop everything queued (the connection is gone and the compression starts anew with the next one)
+static void queue_clear(struct uplink *uplink) {
+	while (uplink->queue_head) {
+		struct queue_chunk *chunk = uplink->queue_head;
+		uplink->queue_head = chunk->next;
+		chunk_recycler_release(uplink, chunk);
+	}
+	uplink->queue_tail = NULL;
+	while (uplink->mark_head) {
+		struct queue_mark *mark = uplink->mark_head;
+		uplink->mark_head = mark->next;
+		mark_recycler_release(uplink, mark);
+	}
+	uplink->mark_tail = NULL;
+	LFOR(plugin_queues, plugin, &uplink->plugin_queues) {
+		while (plugin->pending_head) {
+			struct queue_chunk *chunk = plugin->pending_head;
+			plugin->pending_head = chunk->next;
+			chunk_recycler_release(uplink, chunk);
+		}
+		plugin->pending_tail = NULL;
+		plugin->queued = plugin->pending = plugin->deficit = 0;
+		plugin->active = false;
+		plugin->next_active = NULL;
+	}
+	for (size_t i = 0; i < SEND_CLASS_COUNT; i ++)
+		uplink->rounds[i] = (struct send_round) { .head = NULL };
+	uplink->queued = uplink->pending = 0;
+	uplink->queue_appended = uplink->queue_sent = 0;
+	uplink->ping_end = uplink->ping_progress = 0;
+	uplink->coalesced = 0;
+	uplink->coalesced_mark = NULL;
+	if (uplink->sync_scheduled)
+		loop_timeout_cancel(uplink->loop, uplink->sync_id);
+	uplink->sync_scheduled = false;
+	if (uplink->feed_scheduled)
+		loop_timeout_cancel(uplink->loop, uplink->feed_id);
+	uplink->feed_scheduled = false;
+	stall_end(uplink);
+}
+
+static bool traffic_used(const struct uplink_traffic *traffic) {
+	return traffic->messages || traffic->offline;
+}
+
+static void traffic_print(FILE *sf, const char *kind, const char *name, const struct uplink_traffic *traffic) {
+	fprintf(sf, "%s\t%s\t%llu\t%llu\t%llu\t%llu\t%llu\t%llu\n", kind, name, (unsigned long long) traffic->messages, (unsigned long long) traffic->raw, (unsigned long long) traffic->compressed, (unsigned long long) traffic->compress_time / 1000, (unsigned long long) traffic->wait_time, (unsigned long long) traffic->offline);
+}
+
 static void dump_status(struct uplink *uplink) {
 	const char *status = "unknown";
 	if (uplink->fd == -1) {
@@ -129,41 +478,179 @@ static void dump_status(struct uplink *uplink) {
 		return;
 	}
 	fprintf(sf, "%s\t%llu\n", status, (unsigned long long)time(NULL));
+	// What the messages cost, one line for each plugin and each type of messages
+	LFOR(plugin_queues, plugin, &uplink->plugin_queues)
+		traffic_print(sf, "plugin", plugin->name, &plugin->traffic);
+	for (size_t i = 0; i <= UCHAR_MAX; i ++)
+		if (traffic_used(&uplink->type_traffic[i]))
+			traffic_print(sf, "type", (const char []) { (char) i, '\0' }, &uplink->type_traffic[i]);
 	if (fclose(sf) == EOF)
 		ulog(LLOG_WARN, "Error closing status file %s/%p: %s\n", uplink->status_file, (void *)sf, strerror(errno));
 }
 
 static void uplink_disconnect(struct uplink *uplink, bool reset_reconnect);
 static void connect_fail(struct uplink *uplink);
-
-static void update_addrinfo(struct uplink *uplink) {
-	if (uplink->addrinfo) {
-		freeaddrinfo(uplink->addrinfo);
-		uplink->addrinfo = NULL;
-	}
-	if (!uplink->remote_name || !uplink->service)
-		return; // No info to run through.
-	int result = getaddrinfo(uplink->remote_name, uplink->service, &(struct addrinfo) {
-		.ai_family = AF_UNSPEC
-	}, &uplink->addrinfo);
-	if (result) {
-		ulog(LLOG_ERROR, "Failed to resolve uplink %s:%s: %s\n", uplink->remote_name, uplink->service, gai_strerror(result));
-		freeaddrinfo(uplink->addrinfo);
-		uplink->addrinfo = NULL;
-	}
+static void spool_replay(struct uplink *uplink);
+static void queue_feed(struct uplink *uplink);
+static void feed_schedule(struct uplink *uplink);
+static void queue_compress(struct uplink *uplink, const uint8_t *data, size_t size, enum codec_flush flush);
+static void traffic_send(struct uplink *uplink);
+static void traffic_timeout(struct context *context_unused, void *data, size_t id_unused);
+
+static void connect_start(struct uplink *uplink);
+static void connect_established(struct uplink *uplink);
+
+// Replace the addresses of the server by the resolved ones
+static void addrs_set(struct uplink *uplink, const struct resolved *resolved) {
+	mem_pool_reset(uplink->addr_pool);
+	uplink->addrinfo = NULL;
+	struct addrinfo **tail = &uplink->addrinfo;
 	bool seen_v4 = false, seen_v6 = false;
-	for (struct addrinfo *info = uplink->addrinfo; info; info = info->ai_next) {
-		if (info->ai_family == AF_INET)
+	for (size_t i = 0; i < resolved->count; i ++) {
+		struct uplink_addr *addr = mem_pool_alloc(uplink->addr_pool, sizeof *addr);
+		memcpy(&addr->addr, &resolved->addrs[i].addr, resolved->addrs[i].len);
+		addr->info = (struct addrinfo) {
+			.ai_family = addr->addr.ss_family,
+			.ai_socktype = SOCK_STREAM,
+			.ai_addrlen = resolved->addrs[i].len,
+			.ai_addr = (struct sockaddr *) &addr->addr
+		};
+		*tail = &addr->info;
+		tail = &addr->info.ai_next;
+		if (addr->addr.ss_family == AF_INET)
 			seen_v4 = true;
-		else if (info->ai_family == AF_INET6)
+		else if (addr->addr.ss_family == AF_INET6)
 			seen_v6 = true;
 	}
+	ulog(LLOG_DEBUG, "Resolved %s:%s to %zu addresses\n", uplink->remote_name, uplink->service, resolved->count);
 	if (!seen_v4)
 		ulog(LLOG_WARN, "Didn't get any V4 address in resolution of %s\n", uplink->remote_name);
 	if (!seen_v6)
 		ulog(LLOG_WARN, "Didn't get any V6 address in resolution of %s\n", uplink->remote_name);
 }
 
+// Runs in the child. The result is smaller than PIPE_BUF, so it arrives whole or not at all.
+static void resolve_child(const char *remote_name, const char *service, int fd) __attribute__((noreturn));
+static void resolve_child(const char *remote_name, const char *service, int fd) {
+	struct resolved result = { .count = 0 };
+	struct addrinfo *addrinfo = NULL;
+	result.error = getaddrinfo(remote_name, service, &(struct addrinfo) {
+		.ai_family = AF_UNSPEC,
+		.ai_socktype = SOCK_STREAM
+	}, &addrinfo);
+	for (struct addrinfo *info = addrinfo; !result.error && info && result.count < UPLINK_ADDR_MAX; info = info->ai_next)
+		if (info->ai_addrlen <= sizeof result.addrs[0].addr) {
+			result.addrs[result.count].len = info->ai_addrlen;
+			memcpy(&result.addrs[result.count].addr, info->ai_addr, info->ai_addrlen);
+			result.count ++;
+		}
+	if (addrinfo)
+		freeaddrinfo(addrinfo);
+	size_t size = offsetof(struct resolved, addrs) + result.count * sizeof result.addrs[0];
+	// Don't run the atexit handlers of the parent
+	_exit(write(fd, &result, size) == (ssize_t) size ? 0 : 1);
+}
+
+static void resolve_stop(struct uplink *uplink, bool kill_child) {
+	struct resolver *resolver = &uplink->resolver;
+	resolver->connect = false;
+	if (resolver->fd == -1)
+		return;
+	loop_unregister_fd(uplink->loop, resolver->fd);
+	close(resolver->fd);
+	resolver->fd = -1;
+	if (resolver->timeout_scheduled)
+		loop_timeout_cancel(uplink->loop, resolver->timeout_id);
+	resolver->timeout_scheduled = false;
+	// The loop picks up the dead child
+	if (kill_child && kill(resolver->pid, SIGKILL) == -1)
+		ulog(LLOG_WARN, "Couldn't kill resolver %d of uplink: %s\n", (int) resolver->pid, strerror(errno));
+}
+
+static void resolve_read(void *data, uint32_t unused) {
+	(void) unused;
+	struct resolver *resolver = data;
+	struct uplink *uplink = resolver->uplink;
+	struct resolved result;
+	ssize_t amount = read(resolver->fd, &result, sizeof result);
+	int error = errno;
+	bool connect = resolver->connect;
+	resolve_stop(uplink, false);
+	bool resolved = false;
+	if (amount == -1)
+		ulog(LLOG_ERROR, "Couldn't read resolution of uplink %s:%s: %s\n", uplink->remote_name, uplink->service, strerror(error));
+	else if ((size_t) amount < offsetof(struct resolved, addrs) || (size_t) amount != offsetof(struct resolved, addrs) + result.count * sizeof result.addrs[0])
+		ulog(LLOG_ERROR, "Resolution of uplink %s:%s ended without result\n", uplink->remote_name, uplink->service);
+	else if (result.error)
+		ulog(LLOG_ERROR, "Failed to resolve uplink %s:%s: %s\n", uplink->remote_name, uplink->service, gai_strerror(result.error));
+	else {
+		addrs_set(uplink, &result);
+		resolved = uplink->addrinfo != NULL;
+	}
+	// If it was just a refresh, the old addresses stay on failure
+	if (!connect)
+		return;
+	if (resolved)
+		connect_start(uplink);
+	else if (!uplink->reconnect_scheduled)
+		connect_fail(uplink);
+}
+
+static void resolve_timeout(struct context *context_unused, void *data, size_t id_unused) {
+	(void) context_unused;
+	(void) id_unused;
+	struct uplink *uplink = data;
+	uplink->resolver.timeout_scheduled = false;
+	ulog(LLOG_ERROR, "Resolution of uplink %s:%s timed out\n", uplink->remote_name, uplink->service);
+	bool connect = uplink->resolver.connect;
+	resolve_stop(uplink, true);
+	if (connect && !uplink->reconnect_scheduled)
+		connect_fail(uplink);
+}
+
+/*
+ * Start resolving the server name in a child process, so the loop (and the
+ * capture) doesn't stall on DNS. If connect is set, the connection starts once
+ * the addresses are known. Returns false if the resolution couldn't start.
+ */
+static bool resolve_start(struct uplink *uplink, bool connect) {
+	struct resolver *resolver = &uplink->resolver;
+	if (resolver->fd != -1) {
+		// Already running, the result comes soon
+		resolver->connect = resolver->connect || connect;
+		return true;
+	}
+	if (!uplink->remote_name || !uplink->service)
+		return false; // No info to run through.
+	int fds[2];
+	if (pipe(fds) == -1) {
+		ulog(LLOG_ERROR, "Couldn't create pipe for resolver: %s\n", strerror(errno));
+		return false;
+	}
+	pid_t pid = loop_fork(uplink->loop);
+	if (pid == -1) {
+		ulog(LLOG_ERROR, "Can't fork resolver: %s\n", strerror(errno));
+		close(fds[0]);
+		close(fds[1]);
+		return false;
+	}
+	if (!pid) {
+		close(fds[0]);
+		resolve_child(uplink->remote_name, uplink->service, fds[1]);
+	}
+	close(fds[1]);
+	ulog(LLOG_DEBUG, "Resolving %s:%s in process %d\n", uplink->remote_name, uplink->service, (int) pid);
+	resolver->fd = fds[0];
+	resolver->pid = pid;
+	resolver->connect = connect;
+	loop_register_fd(uplink->loop, resolver->fd, &resolver->handler);
+	resolver->timeout_id = loop_timeout_add(uplink->loop, UPLINK_RESOLVE_TIMEOUT, NULL, uplink, resolve_timeout);
+	resolver->timeout_scheduled = true;
+	return true;
+}
+
+#ifdef UPLINK_SOCAT
+
 static void err_read(void *data, uint32_t unused) {
 	(void) unused;
 	struct err_handler *handler = data;
@@ -221,6 +708,29 @@ static void err_read(void *data, uint32_t unused) {
 	}
 }
 
+/*
+ * Socat won't, unfortunately, try both IPv4 and IPv6 if both are available.
+ * It goes for the one we tell it. Use the one that worked last time. If none
+ * did yet (or it stopped working), switch to the other one on each attempt,
+ * but only if the server has addresses of both. See ticket #3106.
+ */
+static int socat_family(struct uplink *uplink) {
+	bool seen_v4 = false, seen_v6 = false;
+	for (struct addrinfo *info = uplink->addrinfo; info; info = info->ai_next) {
+		if (info->ai_family == AF_INET)
+			seen_v4 = true;
+		else if (info->ai_family == AF_INET6)
+			seen_v6 = true;
+	}
+	if (!seen_v6)
+		return AF_INET;
+	if (!seen_v4)
+		return AF_INET6;
+	if (uplink->good_family != AF_UNSPEC)
+		return uplink->good_family;
+	return uplink->attempt_family == AF_INET6 ? AF_INET : AF_INET6;
+}
+
 static bool uplink_connect_internal(struct uplink *uplink) {
 	int sockets[2];
 	if (socketpair(AF_UNIX, SOCK_STREAM, 0, sockets) == -1) {
@@ -243,7 +753,7 @@ static bool uplink_connect_internal(struct uplink *uplink) {
 		ulog(LLOG_ERROR, "Can't fork: %s\n", strerror(errno));
 		return false;
 	}
-	uplink->last_ipv6 = !uplink->last_ipv6;
+	uplink->attempt_family = socat_family(uplink);
 	if (socat) {
 		close(sockets[1]);
 		close(errs[1]);
@@ -264,7 +774,7 @@ static bool uplink_connect_internal(struct uplink *uplink) {
 		};
 		loop_register_fd(uplink->loop, errs[0], &handler->handler);
 		ulog(LLOG_INFO, "Socat started\n");
-		dump_status(uplink);
+		connect_established(uplink);
 		return true;
 	} else {
 		close(sockets[0]);
@@ -275,26 +785,459 @@ static bool uplink_connect_internal(struct uplink *uplink) {
 		}
 		close(sockets[1]);
 		close(errs[1]);
-		/*
-		 * Explanation of the last_ipv6:
-		 * Socat won't, unfortunately, try both IPv4 and IPv6 if both are
-		 * available. So it goes for IPv4 or IPv6 ‒ but whatever we chose
-		 * might be the wrong choice. So we keep switching from one to
-		 * another on each connection attempt. If only one is available,
-		 * every other connection attempt will fail, but that's acceptable.
-		 * We could do something more clever, but this is simple and works.
-		 * See ticket #3106.
-		 */
-		const char *remote = mem_pool_printf(loop_temp_pool(uplink->loop), "OPENSSL:%s:%s,cafile=%s,cipher=HIGH:!LOW:!MEDIUM:!SSLv2:!aNULL:!eNULL:!DES:!3DES:!AES128:!CAMELLIA128,method=TLS1.2,pf=ip%d", uplink->remote_name, uplink->service, uplink->cert, uplink->last_ipv6 ? 6 : 4);
+		const char *remote = mem_pool_printf(loop_temp_pool(uplink->loop), "OPENSSL:%s:%s,cafile=%s,cipher=" TLS_CIPHERS ",method=TLS1.2,pf=ip%d", uplink->remote_name, uplink->service, uplink->cert, uplink->attempt_family == AF_INET6 ? 6 : 4);
 		ulog(LLOG_DEBUG, "Starting socat with %s\n", remote);
 		execlp("socat", "socat", "STDIO", remote, (char *) NULL);
 		die("Exec should never have exited but it did: %s\n", strerror(errno));
 	}
 }
 
+// The socat takes care of the encryption, we just talk to it over the socket pair
+static ssize_t transport_recv(struct uplink *uplink, void *buffer, size_t size) {
+	return recv(uplink->fd, buffer, size, MSG_DONTWAIT);
+}
+
+static ssize_t transport_send(struct uplink *uplink, const void *buffer, size_t size) {
+	return send(uplink->fd, buffer, size, MSG_NOSIGNAL | MSG_DONTWAIT);
+}
+
+#else
+
+static void tls_log_errors(struct uplink *uplink, const char *operation) {
+	bool any = false;
+	unsigned long error;
+	while ((error = ERR_get_error())) {
+		char buffer[256];
+		ERR_error_string_n(error, buffer, sizeof buffer);
+		ulog(LLOG_ERROR, "TLS %s with %s:%s failed: %s\n", operation, uplink->remote_name, uplink->service, buffer);
+		any = true;
+	}
+	if (!any)
+		ulog(LLOG_ERROR, "TLS %s with %s:%s failed: %s\n", operation, uplink->remote_name, uplink->service, strerror(errno));
+}
+
+// Called by OpenSSL whenever the server gives us a session we may resume later
+static int tls_new_session(SSL *tls, SSL_SESSION *session) {
+	struct uplink *uplink = SSL_CTX_get_app_data(SSL_get_SSL_CTX(tls));
+	if (uplink->tls_session)
+		SSL_SESSION_free(uplink->tls_session);
+	uplink->tls_session = session;
+	return 1; // We keep the reference
+}
+
+// Drop the context and the session, they are for the old server and certificate
+static void tls_forget(struct uplink *uplink) {
+	if (uplink->tls_session) {
+		SSL_SESSION_free(uplink->tls_session);
+		uplink->tls_session = NULL;
+	}
+	if (uplink->tls_ctx) {
+		SSL_CTX_free(uplink->tls_ctx);
+		uplink->tls_ctx = NULL;
+	}
+}
+
+static bool tls_ctx_prepare(struct uplink *uplink) {
+	if (uplink->tls_ctx)
+		return true;
+	SSL_library_init();
+	SSL_load_error_strings();
+	SSL_CTX *ctx = SSL_CTX_new(SSLv23_client_method());
+	if (!ctx) {
+		tls_log_errors(uplink, "context creation");
+		return false;
+	}
+	// The same policy as we used to ask socat for ‒ only TLS 1.2 with strong ciphers. The data are compressed already.
+	SSL_CTX_set_options(ctx, SSL_OP_NO_SSLv2 | SSL_OP_NO_SSLv3 | SSL_OP_NO_TLSv1 | SSL_OP_NO_TLSv1_1 | SSL_OP_NO_COMPRESSION
+#ifdef SSL_OP_NO_TLSv1_3
+			| SSL_OP_NO_TLSv1_3
+#endif
+			);
+	if (!SSL_CTX_set_cipher_list(ctx, TLS_CIPHERS) || SSL_CTX_load_verify_locations(ctx, uplink->cert, NULL) != 1) {
+		tls_log_errors(uplink, "setup");
+		SSL_CTX_free(ctx);
+		return false;
+	}
+	SSL_CTX_set_verify(ctx, SSL_VERIFY_PEER, NULL);
+	// Retrying a blocked write may come from different buffer (the compression one is from the temp pool)
+	SSL_CTX_set_mode(ctx, SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER);
+	// Only keep the last session of the single server, inside the uplink
+	SSL_CTX_set_session_cache_mode(ctx, SSL_SESS_CACHE_CLIENT | SSL_SESS_CACHE_NO_INTERNAL_STORE);
+	SSL_CTX_sess_set_new_cb(ctx, tls_new_session);
+	SSL_CTX_set_app_data(ctx, uplink);
+	uplink->tls_ctx = ctx;
+	return true;
+}
+
+static void attempt_ready(void *data, uint32_t events);
+static void eyeballs_timeout(struct context *context, void *data, size_t id);
+
+static const char *addr_str(struct uplink *uplink, const struct sockaddr_storage *addr) {
+	char buffer[INET6_ADDRSTRLEN];
+	const void *data;
+	if (addr->ss_family == AF_INET6)
+		data = &((const struct sockaddr_in6 *) addr)->sin6_addr;
+	else
+		data = &((const struct sockaddr_in *) addr)->sin_addr;
+	if (!inet_ntop(addr->ss_family, data, buffer, sizeof buffer))
+		return "<unknown>";
+	return mem_pool_strdup(loop_temp_pool(uplink->loop), buffer);
+}
+
+/*
+ * Order the addresses for the connection attempts. The families alternate,
+ * starting with the one that worked last time (or IPv6 if none did yet).
+ */
+static void eyeballs_prepare(struct uplink *uplink) {
+	int first = uplink->good_family == AF_INET ? AF_INET : AF_INET6;
+	// Position in the list of the first family and of the others
+	struct addrinfo *cursors[2] = { uplink->addrinfo, uplink->addrinfo };
+	size_t count = 0;
+	for (size_t turn = 0; count < UPLINK_ADDR_MAX; turn ++) {
+		size_t c = turn % 2;
+		while (cursors[c] && (cursors[c]->ai_family == first) != (c == 0))
+			cursors[c] = cursors[c]->ai_next;
+		if (!cursors[0] && !cursors[1])
+			break;
+		if (!cursors[c])
+			continue;
+		struct connect_attempt *attempt = &uplink->attempts[count ++];
+		*attempt = (struct connect_attempt) {
+			.handler = {
+				.handler = attempt_ready
+			},
+			.uplink = uplink,
+			.fd = -1,
+			.addr_len = cursors[c]->ai_addrlen
+		};
+		memcpy(&attempt->addr, cursors[c]->ai_addr, cursors[c]->ai_addrlen);
+		cursors[c] = cursors[c]->ai_next;
+	}
+	uplink->attempt_count = count;
+	uplink->attempt_next = uplink->attempts_open = 0;
+}
+
+static void attempt_close(struct uplink *uplink, struct connect_attempt *attempt) {
+	loop_unregister_fd(uplink->loop, attempt->fd);
+	close(attempt->fd);
+	attempt->fd = -1;
+	uplink->attempts_open --;
+}
+
+// Cancel all the attempts still in progress
+static void eyeballs_stop(struct uplink *uplink) {
+	for (size_t i = 0; i < uplink->attempt_count; i ++)
+		if (uplink->attempts[i].fd != -1)
+			attempt_close(uplink, &uplink->attempts[i]);
+	if (uplink->eyeballs_scheduled)
+		loop_timeout_cancel(uplink->loop, uplink->eyeballs_id);
+	uplink->eyeballs_scheduled = false;
+	uplink->attempt_count = uplink->attempt_next = 0;
+}
+
+/*
+ * Start connecting to the next address, without waiting for the ones already
+ * in progress. Returns false if there's nothing in progress and nothing left
+ * to try.
+ */
+static bool eyeballs_next(struct uplink *uplink) {
+	if (uplink->eyeballs_scheduled)
+		loop_timeout_cancel(uplink->loop, uplink->eyeballs_id);
+	uplink->eyeballs_scheduled = false;
+	while (uplink->attempt_next < uplink->attempt_count) {
+		struct connect_attempt *attempt = &uplink->attempts[uplink->attempt_next ++];
+		int fd = socket(attempt->addr.ss_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+		if (fd == -1) {
+			ulog(LLOG_ERROR, "Couldn't create uplink socket: %s\n", strerror(errno));
+			continue;
+		}
+		if (connect(fd, (const struct sockaddr *) &attempt->addr, attempt->addr_len) == -1 && errno != EINPROGRESS) {
+			ulog(LLOG_WARN, "Couldn't connect to %s:%s at %s: %s\n", uplink->remote_name, uplink->service, addr_str(uplink, &attempt->addr), strerror(errno));
+			close(fd);
+			continue;
+		}
+		ulog(LLOG_DEBUG, "Connecting to %s:%s at %s\n", uplink->remote_name, uplink->service, addr_str(uplink, &attempt->addr));
+		attempt->fd = fd;
+		uplink->attempts_open ++;
+		// Wait for the non-blocking connect to finish
+		loop_register_fd(uplink->loop, fd, &attempt->handler);
+		loop_fd_want_write(uplink->loop, fd, &attempt->handler, true);
+		if (uplink->attempt_next < uplink->attempt_count) {
+			uplink->eyeballs_id = loop_timeout_add(uplink->loop, UPLINK_EYEBALLS_DELAY, NULL, uplink, eyeballs_timeout);
+			uplink->eyeballs_scheduled = true;
+		}
+		return true;
+	}
+	return uplink->attempts_open > 0;
+}
+
+static void eyeballs_fail(struct uplink *uplink) {
+	ulog(LLOG_ERROR, "Failed to connect to any address and port for uplink %s:%s\n", uplink->remote_name, uplink->service);
+	connect_fail(uplink);
+}
+
+// The previous address didn't answer in time, try the next one in parallel
+static void eyeballs_timeout(struct context *context_unused, void *data, size_t id_unused) {
+	(void) context_unused;
+	(void) id_unused;
+	struct uplink *uplink = data;
+	uplink->eyeballs_scheduled = false;
+	if (!eyeballs_next(uplink))
+		eyeballs_fail(uplink);
+}
+
+// Start the TLS on the connected socket
+static bool tls_start(struct uplink *uplink, int fd) {
+	SSL *tls = SSL_new(uplink->tls_ctx);
+	/*
+	 * The server is identified by the certificate in the CA file (it is
+	 * usually self-signed, without the host name), like with the socat.
+	 * So the name is only sent, not checked.
+	 */
+	if (!tls || !SSL_set_fd(tls, fd) || !SSL_set_tlsext_host_name(tls, uplink->remote_name)) {
+		tls_log_errors(uplink, "setup");
+		if (tls)
+			SSL_free(tls);
+		close(fd);
+		return false;
+	}
+	SSL_set_connect_state(tls);
+	if (uplink->tls_session)
+		SSL_set_session(tls, uplink->tls_session);
+	uplink->tls = tls;
+	uplink->fd = fd;
+	uplink->tls_handshake = true;
+	uplink->tls_broken = false;
+	uplink->auth_status = NOT_STARTED;
+	connect_established(uplink);
+	return true;
+}
+
+// One of the attempts finished connecting, successfully or not
+static void attempt_ready(void *data, uint32_t unused) {
+	(void) unused;
+	struct connect_attempt *attempt = data;
+	struct uplink *uplink = attempt->uplink;
+	if (attempt->fd == -1)
+		return; // Closed already, the event was queued before that
+	int error = 0;
+	socklen_t error_len = sizeof error;
+	if (getsockopt(attempt->fd, SOL_SOCKET, SO_ERROR, &error, &error_len) == -1)
+		error = errno;
+	if (error) {
+		ulog(LLOG_WARN, "Couldn't connect to %s:%s at %s: %s\n", uplink->remote_name, uplink->service, addr_str(uplink, &attempt->addr), strerror(error));
+		attempt_close(uplink, attempt);
+		// Don't wait for the delay, the next address may work
+		if (!eyeballs_next(uplink))
+			eyeballs_fail(uplink);
+		return;
+	}
+	// The winner. Hand the socket over to the uplink and drop the rest.
+	int fd = attempt->fd;
+	loop_unregister_fd(uplink->loop, fd);
+	attempt->fd = -1;
+	uplink->attempts_open --;
+	eyeballs_stop(uplink);
+	uplink->good_family = attempt->addr.ss_family;
+	ulog(LLOG_INFO, "Connected to %s:%s at %s\n", uplink->remote_name, uplink->service, addr_str(uplink, &attempt->addr));
+	if (!tls_start(uplink, fd))
+		connect_fail(uplink);
+}
+
+/*
+ * Start connecting. The addresses are tried in parallel (each next one a while
+ * after the previous, or once it fails) and the first one to connect is used.
+ * The TLS handshake is then finished by tls_handshake when the loop sees the
+ * socket ready.
+ */
+static bool uplink_connect_internal(struct uplink *uplink) {
+	if (!tls_ctx_prepare(uplink))
+		return false;
+	eyeballs_prepare(uplink);
+	ulog(LLOG_INFO, "Connecting to %s:%s (%zu addresses)\n", uplink->remote_name, uplink->service, uplink->attempt_count);
+	return eyeballs_next(uplink);
+}
+
+/*
+ * OpenSSL writes to the socket by itself, without MSG_NOSIGNAL. Keep the
+ * SIGPIPE blocked meanwhile and throw it away if it came, we get EPIPE anyway.
+ */
+static void sigpipe_block(sigset_t *old) {
+	sigset_t set;
+	sigemptyset(&set);
+	sigaddset(&set, SIGPIPE);
+	sigprocmask(SIG_BLOCK, &set, old);
+}
+
+static void sigpipe_restore(const sigset_t *old) {
+	sigset_t pending;
+	if (!sigismember(old, SIGPIPE) && sigpending(&pending) == 0 && sigismember(&pending, SIGPIPE)) {
+		sigset_t set;
+		sigemptyset(&set);
+		sigaddset(&set, SIGPIPE);
+		sigtimedwait(&set, NULL, &(struct timespec) { .tv_sec = 0 });
+	}
+	sigprocmask(SIG_SETMASK, old, NULL);
+}
+
+static void tls_fail(struct uplink *uplink) {
+	uplink->tls_broken = true;
+	// Don't try to resume what didn't work
+	if (uplink->tls_session) {
+		SSL_SESSION_free(uplink->tls_session);
+		uplink->tls_session = NULL;
+	}
+	uplink_disconnect(uplink, true);
+	connect_fail(uplink);
+}
+
+// Continue connecting after the socket got ready. Returns true when the connection is complete.
+static bool tls_handshake(struct uplink *uplink) {
+	int error = 0;
+	socklen_t error_len = sizeof error;
+	if (getsockopt(uplink->fd, SOL_SOCKET, SO_ERROR, &error, &error_len) == -1)
+		error = errno;
+	if (error) {
+		ulog(LLOG_ERROR, "Couldn't connect to %s:%s: %s\n", uplink->remote_name, uplink->service, strerror(error));
+		tls_fail(uplink);
+		return false;
+	}
+	sigset_t sigmask;
+	sigpipe_block(&sigmask);
+	ERR_clear_error();
+	int result = SSL_do_handshake(uplink->tls);
+	sigpipe_restore(&sigmask);
+	if (result == 1) {
+		uplink->tls_handshake = false;
+		uplink->tls_want_write = false;
+		update_write_watch(uplink);
+		ulog(LLOG_INFO, "TLS connection to %s:%s established (%s)\n", uplink->remote_name, uplink->service, SSL_session_reused(uplink->tls) ? "resumed session" : "full handshake");
+		return true;
+	}
+	switch (SSL_get_error(uplink->tls, result)) {
+		case SSL_ERROR_WANT_READ:
+		case SSL_ERROR_WANT_WRITE:
+			uplink->tls_want_write = SSL_get_error(uplink->tls, result) == SSL_ERROR_WANT_WRITE;
+			update_write_watch(uplink);
+			return false;
+		default: {
+			long verify = SSL_get_verify_result(uplink->tls);
+			if (verify != X509_V_OK)
+				ulog(LLOG_ERROR, "Certificate of %s:%s not accepted: %s\n", uplink->remote_name, uplink->service, X509_verify_cert_error_string(verify));
+			tls_log_errors(uplink, "handshake");
+			tls_fail(uplink);
+			return false;
+		}
+	}
+}
+
+// Like recv with MSG_DONTWAIT, but through the TLS
+static ssize_t transport_recv(struct uplink *uplink, void *buffer, size_t size) {
+	ERR_clear_error();
+	int result = SSL_read(uplink->tls, buffer, size);
+	if (result > 0)
+		return result;
+	switch (SSL_get_error(uplink->tls, result)) {
+		case SSL_ERROR_WANT_WRITE:
+			// Renegotiation. Continue when the socket is writable.
+			uplink->tls_want_write = true;
+			update_write_watch(uplink);
+			// Fall through
+		case SSL_ERROR_WANT_READ:
+			errno = EAGAIN;
+			return -1;
+		case SSL_ERROR_ZERO_RETURN:
+			return 0;
+		case SSL_ERROR_SYSCALL:
+			if (!ERR_peek_error()) {
+				if (result == 0 || errno == 0) {
+					// Closed without the TLS goodbye
+					uplink->tls_broken = true;
+					return 0;
+				}
+				if (errno == EINTR)
+					return -1;
+			}
+			// Fall through
+		default:
+			tls_log_errors(uplink, "read");
+			uplink->tls_broken = true;
+			errno = ECONNRESET;
+			return -1;
+	}
+}
+
+// Like send with MSG_DONTWAIT, but through the TLS
+static ssize_t transport_send(struct uplink *uplink, const void *buffer, size_t size) {
+	sigset_t sigmask;
+	sigpipe_block(&sigmask);
+	ERR_clear_error();
+	int result = SSL_write(uplink->tls, buffer, size);
+	int error = result > 0 ? SSL_ERROR_NONE : SSL_get_error(uplink->tls, result);
+	int saved_errno = errno;
+	sigpipe_restore(&sigmask);
+	errno = saved_errno;
+	switch (error) {
+		case SSL_ERROR_NONE:
+			return result;
+		case SSL_ERROR_WANT_READ: // Renegotiation, the reads try to send again
+		case SSL_ERROR_WANT_WRITE:
+			errno = EAGAIN;
+			return -1;
+		case SSL_ERROR_SYSCALL:
+			if (!ERR_peek_error() && errno == EINTR)
+				return -1;
+			// Fall through
+		default:
+			tls_log_errors(uplink, "write");
+			uplink->tls_broken = true;
+			errno = ECONNRESET;
+			return -1;
+	}
+}
+
+static void uplink_read(struct uplink *uplink, uint32_t events);
+
+static void read_pending(struct context *context_unused, void *data, size_t id_unused) {
+	(void) context_unused;
+	(void) id_unused;
+	struct uplink *uplink = data;
+	uplink->read_scheduled = false;
+	uplink_read(uplink, 0);
+}
+
+#endif
+
 static void send_ping(struct context *context, void *data, size_t id);
 
-// Connect to remote. Blocking.
+// Replace the receive buffer by one of the given size. It must not hold any data.
+static void inc_resize(struct uplink *uplink, size_t size) {
+	sanity(!uplink->inc_avail, "Resizing receive buffer of uplink with %zu bytes in it\n", uplink->inc_avail);
+	ulog(LLOG_DEBUG, "Receive buffer of uplink has %zu bytes now\n", size);
+	mem_pool_reset(uplink->inc_pool);
+	uplink->inc_buffer = mem_pool_alloc(uplink->inc_pool, size);
+	uplink->inc_buffer_size = size;
+	uplink->inc_grow = false;
+}
+
+// Each connection starts with fresh zlib streams, other compression may be negotiated later
+static void codec_restart(struct uplink *uplink) {
+	codec_done(&uplink->codec_send);
+	codec_done(&uplink->codec_recv);
+	if (!codec_init(&uplink->codec_send, CODEC_ZLIB, true, uplink->codec_wanted == CODEC_ZLIB ? uplink->codec_level : COMPRESSION_LEVEL, NULL, 0))
+		die("Could not initialize zlib (compression stream)\n");
+	if (!codec_init(&uplink->codec_recv, CODEC_ZLIB, false, 0, NULL, 0))
+		die("Could not initialize zlib (decompression stream)\n");
+	uplink->codec_chosen = CODEC_ZLIB;
+	uplink->recv_switch = false;
+	uplink->inc_avail = 0;
+	// Start small again, the new connection may not need the big one
+	if (uplink->inc_buffer_size != COMPRESSION_BUFFSIZE)
+		inc_resize(uplink, COMPRESSION_BUFFSIZE);
+	uplink->inc_grow = false;
+}
+
+// Connect to remote. Doesn't block, the connection is established later.
 static void uplink_connect(struct uplink *uplink) {
 	assert(uplink->fd == -1);
 	if (uplink->last_connect + RECONN_TIME > loop_now(uplink->loop)) {
@@ -305,12 +1248,28 @@ static void uplink_connect(struct uplink *uplink) {
 	if (uplink->login_failure_count ++ >= LOGIN_FAILURE_LIMIT)
 		die("Too many login failures, giving up\n");
 	uplink->last_connect = loop_now(uplink->loop);
-	bool connected = uplink_connect_internal(uplink);
-	if (!connected) {
+	if (!uplink->addrinfo) {
+		// Nothing to connect to yet, it starts once the name is resolved
+		if (!resolve_start(uplink, true)) {
+			ulog(LLOG_ERROR, "Can't resolve uplink %s:%s\n", uplink->remote_name, uplink->service);
+			connect_fail(uplink);
+		}
+		return;
+	}
+	// Use the known addresses right away, but refresh them for the next time
+	resolve_start(uplink, false);
+	connect_start(uplink);
+}
+
+static void connect_start(struct uplink *uplink) {
+	if (!uplink_connect_internal(uplink)) {
 		ulog(LLOG_ERROR, "Failed to connect to any address and port for uplink %s:%s\n", uplink->remote_name, uplink->service);
 		connect_fail(uplink);
-		return;
 	}
+}
+
+// The transport got its socket, start talking over it
+static void connect_established(struct uplink *uplink) {
 	// We connected. Reset the reconnect timeout.
 	if (uplink->seen_data)
 		uplink->reconnect_timeout = 0;
@@ -320,9 +1279,14 @@ static void uplink_connect(struct uplink *uplink) {
 	uplink->ping_timeout = loop_timeout_add(uplink->loop, PING_TIMEOUT, NULL, uplink, send_ping);
 	uplink->ping_scheduled = true;
 	loop_register_fd(uplink->loop, uplink->fd, (struct epoll_handler *) uplink);
-	update_addrinfo(uplink);
-	deflateReset(&(uplink->zstrm_send));
-	inflateReset(&(uplink->zstrm_recv));
+	uplink->write_watched = false;
+#ifndef UPLINK_SOCAT
+	// Wait for the non-blocking connect to finish
+	uplink->tls_want_write = true;
+#endif
+	update_write_watch(uplink);
+	codec_restart(uplink);
+	dump_status(uplink);
 }
 
 static void reconnect_now(struct context *unused, void *data, size_t id_unused) {
@@ -351,11 +1315,63 @@ static void connect_fail(struct uplink *uplink) {
 	uplink->reconnect_scheduled = true;
 }
 
-static void buffer_reset(struct uplink *uplink) {
+// Start receiving the next message from scratch, but leave the data of the current one in the pool
+static void buffer_detach(struct uplink *uplink) {
 	uplink->buffer_size = uplink->size_rest = 0;
 	uplink->buffer = uplink->buffer_pos = NULL;
 	uplink->has_size = false;
-	mem_pool_reset(uplink->buffer_pool);
+}
+
+static void buffer_reset(struct uplink *uplink) {
+	buffer_detach(uplink);
+	// The plugin may cause a disconnect while processing the message, the data must stay valid for it
+	if (!uplink->dispatching)
+		mem_pool_reset(uplink->buffer_pool);
+}
+
+// Stop waiting for the resume of the session, the plugins learn the connection is gone
+static void session_release(struct uplink *uplink) {
+	if (uplink->session_timeout_scheduled)
+		loop_timeout_cancel(uplink->loop, uplink->session_timeout_id);
+	uplink->session_timeout_scheduled = false;
+	bool held = uplink->session_held;
+	uplink->session_held = false;
+	if (held)
+		loop_uplink_disconnected(uplink->loop);
+}
+
+static void session_forget(struct uplink *uplink) {
+	uplink->session_token_size = 0;
+	uplink->resume_sent = false;
+	session_release(uplink);
+}
+
+static void session_expired(struct context *context_unused, void *data, size_t id_unused) {
+	(void) context_unused;
+	(void) id_unused;
+	struct uplink *uplink = data;
+	uplink->session_timeout_scheduled = false;
+	ulog(LLOG_INFO, "Session with %s:%s expired before it could be resumed\n", uplink->remote_name, uplink->service);
+	session_forget(uplink);
+}
+
+static bool session_resumable(const struct uplink *uplink) {
+	return uplink->session_token_size && uplink->session_expire > loop_now(uplink->loop);
+}
+
+// The connection is gone. Tell the plugins, unless the session can be resumed later.
+static void session_disconnected(struct uplink *uplink) {
+	if (uplink->session_held)
+		return; // Still waiting from the last time
+	if (uplink->auth_status != AUTHENTICATED || !session_resumable(uplink)) {
+		loop_uplink_disconnected(uplink->loop);
+		return;
+	}
+	uint64_t now = loop_now(uplink->loop);
+	ulog(LLOG_INFO, "Keeping the session with %s:%s for %llu seconds, to resume it\n", uplink->remote_name, uplink->service, (unsigned long long) (uplink->session_expire - now) / 1000);
+	uplink->session_held = true;
+	uplink->session_timeout_id = loop_timeout_add(uplink->loop, uplink->session_expire - now, NULL, uplink, session_expired);
+	uplink->session_timeout_scheduled = true;
 }
 
 static void uplink_disconnect(struct uplink *uplink, bool reset_reconnect) {
@@ -363,19 +1379,60 @@ static void uplink_disconnect(struct uplink *uplink, bool reset_reconnect) {
 		loop_timeout_cancel(uplink->loop, uplink->reconnect_id);
 		uplink->reconnect_scheduled = false;
 	}
+	// Don't finish connecting in the background (the resolution may go on, the addresses are still useful)
+	uplink->resolver.connect = false;
+#ifndef UPLINK_SOCAT
+	eyeballs_stop(uplink);
+#endif
 	if (uplink->fd != -1) {
 		ulog(LLOG_DEBUG, "Closing uplink connection %d to %s:%s\n", uplink->fd, uplink->remote_name, uplink->service);
-		loop_uplink_disconnected(uplink->loop);
+		session_disconnected(uplink);
+		uplink->resume_sent = false;
 		loop_unregister_fd(uplink->loop, uplink->fd);
+#ifndef UPLINK_SOCAT
+		if (uplink->read_scheduled) {
+			loop_timeout_cancel(uplink->loop, uplink->read_id);
+			uplink->read_scheduled = false;
+		}
+		if (!uplink->tls_broken && !uplink->tls_handshake) {
+			// Say goodbye, so the session stays resumable. We don't wait for the answer.
+			sigset_t sigmask;
+			sigpipe_block(&sigmask);
+			SSL_shutdown(uplink->tls);
+			sigpipe_restore(&sigmask);
+		}
+		ERR_clear_error();
+		SSL_free(uplink->tls);
+		uplink->tls = NULL;
+#endif
 		int result = close(uplink->fd);
 		if (result != 0)
 			ulog(LLOG_ERROR, "Couldn't close uplink connection to %s:%s, leaking file descriptor %d (%s)\n", uplink->remote_name, uplink->service, uplink->fd, strerror(errno));
 		uplink->fd = -1;
 		buffer_reset(uplink);
+		queue_clear(uplink);
+		// The unacknowledged spooled messages may have got lost with the connection, send them again next time
+		if (uplink->replay_scheduled)
+			loop_timeout_cancel(uplink->loop, uplink->replay_id);
+		uplink->replay_scheduled = false;
+		uplink->spool_accepted = false;
+		uplink->traffic_wanted = false;
+		if (uplink->spool)
+			spool_rewind(uplink->spool);
+		if (uplink->codec_wait)
+			loop_timeout_cancel(uplink->loop, uplink->codec_timeout_id);
+		uplink->codec_wait = false;
+#ifndef UPLINK_SOCAT
+		uplink->tls_want_write = false;
+#endif
 		if (uplink->ping_scheduled)
 			loop_timeout_cancel(uplink->loop, uplink->ping_timeout);
 		uplink->ping_scheduled = false;
 		uplink->addr_len = 0;
+#ifdef UPLINK_SOCAT
+		// We don't know if socat connected, only whether anything came through
+		uplink->good_family = uplink->seen_data ? uplink->attempt_family : AF_UNSPEC;
+#endif
 	} else
 		ulog(LLOG_DEBUG, "Uplink connection to %s:%s not open\n", uplink->remote_name, uplink->service);
 	dump_status(uplink);
@@ -386,17 +1443,25 @@ static void send_ping(struct context *context_unused, void *data, size_t id_unus
 	(void) id_unused;
 	struct uplink *uplink = data;
 	uplink->ping_scheduled = false;
-	// How long does it not answer pings?
-	if (uplink->pings_unanswered >= PING_COUNT) {
-		ulog(LLOG_ERROR, "Too many pings not answered on %s:%s, reconnecting\n", uplink->remote_name, uplink->service);
-		// Let the connect be called from the loop, so it works even if uplink_disconnect makes a plugin crash
-		uplink_reconnect(uplink);
-		uplink->pings_unanswered = 0;
-		return;
+	bool progress = uplink->queue_sent != uplink->ping_progress;
+	uplink->ping_progress = uplink->queue_sent;
+	if (uplink->queue_sent < uplink->ping_end && progress) {
+		// The last ping is still in the queue behind other data, but these leave. The server had no chance to answer yet.
+		ulog(LLOG_DEBUG, "Ping to %s:%s still queued, not sending another\n", uplink->remote_name, uplink->service);
+	} else {
+		// How long does it not answer pings?
+		if (uplink->pings_unanswered >= PING_COUNT) {
+			ulog(LLOG_ERROR, "Too many pings not answered on %s:%s, reconnecting\n", uplink->remote_name, uplink->service);
+			// Let the connect be called from the loop, so it works even if uplink_disconnect makes a plugin crash
+			uplink_reconnect(uplink);
+			uplink->pings_unanswered = 0;
+			return;
+		}
+		ulog(LLOG_DEBUG, "Sending ping to %s:%s\n", uplink->remote_name, uplink->service);
+		uplink->pings_unanswered ++;
+		uplink_send_message(uplink, 'P', NULL, 0);
+		uplink->ping_end = uplink->queue_appended;
 	}
-	ulog(LLOG_DEBUG, "Sending ping to %s:%s\n", uplink->remote_name, uplink->service);
-	uplink->pings_unanswered ++;
-	uplink_send_message(uplink, 'P', NULL, 0);
 	// Schedule new ping
 	uplink->ping_timeout = loop_timeout_add(uplink->loop, PING_TIMEOUT, NULL, uplink, send_ping);
 	uplink->ping_scheduled = true;
@@ -621,14 +1686,221 @@ static void handle_activation(struct uplink *uplink) {
 	if (rest != 0) {
 		ulog(LLOG_WARN, "Extra %zu bytes in activation message, ignoring\n", rest);
 	}
-	/*
-	 * Reset the buffer and clean up before calling the loop.
-	 * It may contain callbacks to the plugins. If they contained an error,
-	 * They are handled by a longjump directly to the loop, so the end of the
-	 * function might not be called.
-	 */
-	buffer_reset(uplink);
-	loop_plugin_activation(uplink->loop, plugins, amount);
+	/*
+	 * Reset the buffer and clean up before calling the loop.
+	 * It may contain callbacks to the plugins. If they contained an error,
+	 * They are handled by a longjump directly to the loop, so the end of the
+	 * function might not be called.
+	 */
+	buffer_reset(uplink);
+	loop_plugin_activation(uplink->loop, plugins, amount);
+}
+
+// Answer the challenge of the server and say hello
+static void send_login(struct uplink *uplink, const uint8_t *challenge, size_t challenge_size) {
+	struct mem_pool *temp_pool = loop_temp_pool(uplink->loop);
+	if (uplink->session_held && session_resumable(uplink)) {
+		// Try to resume instead. If the server refuses, we log in with the challenge.
+		sanity(challenge_size == HALF_SIZE, "Wrong length of server challenge, giving up\n");
+		memmove(uplink->challenge, challenge, HALF_SIZE);
+		ulog(LLOG_DEBUG, "Resuming session with %s:%s\n", uplink->remote_name, uplink->service);
+		const struct session_resume_msg resume = {
+			.token = (const char *) uplink->session_token,
+			.token_length = uplink->session_token_size
+		};
+		size_t length;
+		const uint8_t *message = session_resume_render_alloc(&resume, 0, &length, temp_pool);
+		uplink_send_message(uplink, 'T', message, length);
+		uplink->resume_sent = true;
+		uplink->auth_status = SENT;
+		return;
+	}
+	// We send a „sesssion ID“ ‒ our PID. This way, the server will know if it's the same process reconnecting and drop the old connection sooner.
+	ulog(LLOG_DEBUG, "Sending session ID\n");
+	uint32_t sid = htonl(getpid());
+	uplink_send_message(uplink, 'S', &sid, sizeof sid);
+	ulog(LLOG_DEBUG, "Sending login info\n");
+	// Prepare data
+	atsha_big_int server_challenge, client_response;
+	uint8_t local_half[HALF_SIZE] = PASSWD_HALF;
+	sanity(HALF_SIZE + challenge_size == sizeof(server_challenge.data), "Wrong length of server challenge, givint up\n");
+	server_challenge.bytes = HALF_SIZE + challenge_size;
+	memcpy(server_challenge.data, local_half, HALF_SIZE);
+	memcpy(server_challenge.data + HALF_SIZE, challenge, challenge_size);
+	// Get the chip handle
+	atsha_set_log_callback(atsha_log_callback);
+	struct atsha_handle *cryptochip = atsha_open();
+	if (!cryptochip)
+		die("Couldn't open the ATSHA204 chip\n");
+	// Read the serial number
+	atsha_big_int serial;
+	int result = atsha_serial_number(cryptochip, &serial);
+	if (result != ATSHA_ERR_OK)
+		die("Don't known my own name: %s\n", atsha_error_name(result));
+
+	// Compute response to the server challenge
+	result = atsha_challenge_response(cryptochip, server_challenge, &client_response);
+	if (result != ATSHA_ERR_OK)
+		die("Can't answer challenge: %s\n", atsha_error_name(result));
+	// Close the chip (and unlock)
+	atsha_close(cryptochip);
+
+	// Send all computed stuff
+	size_t len = 1 + 2*sizeof(uint32_t) + serial.bytes + client_response.bytes;
+	uint8_t *message = mem_pool_alloc(temp_pool, len);
+	message[0] = 'O';
+	uint8_t *message_pos = message + 1;
+	size_t len_pos = len - 1;
+	uplink_render_string(serial.data, serial.bytes, &message_pos, &len_pos);
+	uplink_render_string(client_response.data, client_response.bytes, &message_pos, &len_pos);
+	assert(!len_pos);
+	uplink_send_message(uplink, 'L', message, len);
+	/*
+	 * Send 'H'ello. For now, it is empty. In future, we expect to have program & protocol version,
+	 * list of plugins and possibly other things too.
+	 */
+	uplink->auth_status = SENT;
+	uint8_t proto_version = PROTOCOL_VERSION;
+	uplink_send_message(uplink, 'H', &proto_version, sizeof proto_version);
+	loop_uplink_connected(uplink->loop);
+}
+
+static void codec_timeout(struct context *context_unused, void *data, size_t id_unused) {
+	(void) context_unused;
+	(void) id_unused;
+	struct uplink *uplink = data;
+	uplink->codec_wait = false;
+	// Probably an older server that doesn't know the offer
+	ulog(LLOG_WARN, "Server %s:%s didn't choose compression, staying with zlib\n", uplink->remote_name, uplink->service);
+	send_login(uplink, uplink->challenge, HALF_SIZE);
+}
+
+/*
+ * Offer the configured compression (and the fallbacks) to the server. The login waits
+ * for the answer, so the server can switch the compression before the real traffic starts.
+ */
+static void codec_offer(struct uplink *uplink) {
+	sanity(uplink->buffer_size == HALF_SIZE, "Wrong length of server challenge, giving up\n");
+	memcpy(uplink->challenge, uplink->buffer, HALF_SIZE);
+	uint8_t offer[3 + sizeof(uint32_t)];
+	uint8_t *offer_pos = offer;
+	size_t offer_rest = sizeof offer;
+	if (uplink->codec_wanted == CODEC_ZSTD_DICT) {
+		// With the dictionary we have already, so it doesn't have to be sent again
+		*offer_pos ++ = CODEC_ZSTD_DICT;
+		offer_rest --;
+		uplink_render_uint32(uplink->dict ? uplink->dict_id : 0, &offer_pos, &offer_rest);
+	}
+	*offer_pos ++ = CODEC_ZSTD;
+	*offer_pos ++ = CODEC_ZLIB;
+	offer_rest -= 2;
+	ulog(LLOG_DEBUG, "Offering %s compression to %s:%s\n", codec_name(uplink->codec_wanted), uplink->remote_name, uplink->service);
+	uplink_send_message(uplink, 'Z', offer, sizeof offer - offer_rest);
+	uplink->codec_wait = true;
+	uplink->codec_timeout_id = loop_timeout_add(uplink->loop, UPLINK_CODEC_TIMEOUT, NULL, uplink, codec_timeout);
+}
+
+// The server issued a session token or answered our request to resume
+static void handle_session(struct uplink *uplink) {
+	if (!uplink->buffer_size)
+		goto BROKEN;
+	switch (*uplink->buffer) {
+		case 'I': {
+			struct session_token_msg session;
+			if (!session_token_parse(&session, &uplink->buffer, &uplink->buffer_size, loop_temp_pool(uplink->loop)) || uplink->buffer_size)
+				goto BROKEN;
+			if (session.token_length > UPLINK_SESSION_TOKEN_MAX) {
+				ulog(LLOG_WARN, "Session token from %s:%s too long (%zu bytes), not keeping it\n", uplink->remote_name, uplink->service, session.token_length);
+				uplink->session_token_size = 0;
+				return;
+			}
+			ulog(LLOG_DEBUG, "Got session token valid for %u seconds from %s:%s\n", (unsigned) session.lifetime, uplink->remote_name, uplink->service);
+			memcpy(uplink->session_token, session.token, session.token_length);
+			uplink->session_token_size = session.token_length;
+			uplink->session_expire = loop_now(uplink->loop) + 1000 * (uint64_t) session.lifetime;
+			return;
+		}
+		case 'R':
+			if (!uplink->resume_sent || uplink->buffer_size != 1)
+				goto BROKEN;
+			ulog(LLOG_INFO, "Resumed session with %s:%s\n", uplink->remote_name, uplink->service);
+			uplink->resume_sent = false;
+			uplink->auth_status = AUTHENTICATED;
+			uplink->login_failure_count = 0;
+			// The plugins stay as they were, without the resync
+			if (uplink->session_timeout_scheduled)
+				loop_timeout_cancel(uplink->loop, uplink->session_timeout_id);
+			uplink->session_timeout_scheduled = false;
+			uplink->session_held = false;
+			dump_status(uplink);
+			return;
+		case 'N':
+			if (!uplink->resume_sent || uplink->buffer_size != 1)
+				goto BROKEN;
+			ulog(LLOG_INFO, "Server %s:%s can't resume the session, logging in\n", uplink->remote_name, uplink->service);
+			// As if the connection got lost only now
+			session_forget(uplink);
+			send_login(uplink, uplink->challenge, HALF_SIZE);
+			return;
+	}
+BROKEN:
+	ulog(LLOG_ERROR, "Broken session message from %s:%s\n", uplink->remote_name, uplink->service);
+}
+
+// The server chose the compression. Switch to it and log in.
+static void codec_answer(struct uplink *uplink) {
+	loop_timeout_cancel(uplink->loop, uplink->codec_timeout_id);
+	uplink->codec_wait = false;
+	const uint8_t *buffer = uplink->buffer;
+	size_t rest = uplink->buffer_size;
+	if (!rest)
+		goto BROKEN;
+	enum codec_type type = *buffer ++;
+	rest --;
+	if (type != CODEC_ZLIB && type != CODEC_ZSTD && (type != CODEC_ZSTD_DICT || uplink->codec_wanted != CODEC_ZSTD_DICT)) {
+		ulog(LLOG_ERROR, "Server %s:%s chose compression '%c' we didn't offer, reconnecting\n", uplink->remote_name, uplink->service, (char)type);
+		uplink_reconnect(uplink);
+		return;
+	}
+	if (type == CODEC_ZSTD_DICT) {
+		if (rest < 2 * sizeof(uint32_t))
+			goto BROKEN;
+		uint32_t id = uplink_parse_uint32(&buffer, &rest);
+		uint32_t size = uplink_parse_uint32(&buffer, &rest);
+		if (size != rest)
+			goto BROKEN;
+		if (size) {
+			ulog(LLOG_INFO, "Got compression dictionary %u of %zu bytes from %s:%s\n", (unsigned)id, (size_t)size, uplink->remote_name, uplink->service);
+			if (uplink->dict_pool)
+				mem_pool_reset(uplink->dict_pool);
+			else
+				uplink->dict_pool = mem_pool_create("Uplink dictionary");
+			uplink->dict = mem_pool_alloc(uplink->dict_pool, size);
+			memcpy(uplink->dict, buffer, size);
+			uplink->dict_size = size;
+			uplink->dict_id = id;
+		} else if (!uplink->dict || uplink->dict_id != id) {
+			ulog(LLOG_ERROR, "Server %s:%s wants compression dictionary %u we don't have, reconnecting\n", uplink->remote_name, uplink->service, (unsigned)id);
+			uplink_reconnect(uplink);
+			return;
+		}
+	} else if (rest)
+		goto BROKEN;
+	ulog(LLOG_INFO, "Using %s compression to %s:%s\n", codec_name(type), uplink->remote_name, uplink->service);
+	uplink->codec_chosen = type;
+	if (type != CODEC_ZLIB) {
+		// Our zlib stream ends here, the server switches once it sees the end. It does the same in the other direction.
+		queue_compress(uplink, NULL, 0, CODEC_FLUSH_END);
+		codec_done(&uplink->codec_send);
+		if (!codec_init(&uplink->codec_send, type, true, uplink->codec_level, uplink->dict, uplink->dict_size))
+			die("Could not initialize %s (compression stream)\n", codec_name(type));
+		uplink->recv_switch = true;
+	}
+	send_login(uplink, uplink->challenge, HALF_SIZE);
+	return;
+BROKEN:
+	ulog(LLOG_ERROR, "Broken compression answer from %s:%s, reconnecting\n", uplink->remote_name, uplink->service);
+	uplink_reconnect(uplink);
 }
 
 static void handle_buffer(struct uplink *uplink) {
@@ -652,14 +1924,18 @@ static void handle_buffer(struct uplink *uplink) {
 						 * Such callback can fail and we would like to recover. That is done
 						 * by a longjump directly to the loop. That'd mean this function is not
 						 * completed, therefore we make sure it works well even in such case -
-						 * we create a copy of the buffer and then reset the buffer before
-						 * going to the plugin (resetting it again below doesn't hurt anything).
+						 * we detach the buffer before going to the plugin, so the next message
+						 * starts from scratch. The plugin gets the data directly from the
+						 * buffer_pool, which is not reset until it returns. If it jumps out,
+						 * the pool is reset with the next message.
 						 */
-						uint8_t *buffer = mem_pool_alloc(temp_pool, uplink->buffer_size);
-						memcpy(buffer, uplink->buffer, uplink->buffer_size);
+						const uint8_t *data = uplink->buffer;
 						size_t length = uplink->buffer_size;
-						buffer_reset(uplink);
-						if (loop_plugin_send_data(uplink->loop, plugin_name, buffer, length)) {
+						buffer_detach(uplink);
+						uplink->dispatching = true;
+						bool delivered = loop_plugin_send_data(uplink->loop, plugin_name, data, length);
+						uplink->dispatching = false;
+						if (delivered) {
 							dump_status(uplink);
 						} else {
 							ulog(LLOG_ERROR, "Plugin %s referenced by uplink does not exist\n", plugin_name);
@@ -689,6 +1965,7 @@ static void handle_buffer(struct uplink *uplink) {
 						  break;
 					case 'F':
 						  ulog(LLOG_ERROR, "Server rejected our authentication\n");
+						  session_forget(uplink);
 						  // Schedule another attempt in 10 minutes
 						  uplink_disconnect(uplink, true);
 						  uplink->auth_status = FAILED;
@@ -698,64 +1975,68 @@ static void handle_buffer(struct uplink *uplink) {
 					case 'A':
 						handle_activation(uplink);
 						break;
+					case 'T':
+						handle_session(uplink);
+						break;
+					case 'U': // The server wants the traffic reports
+						if (uplink->buffer_size) {
+							ulog(LLOG_ERROR, "Broken traffic report request\n");
+							break;
+						}
+						uplink->traffic_wanted = true;
+						traffic_send(uplink);
+						break;
+					case 'D': // Spooled messages
+						if (!uplink->buffer_size) {
+							// The server takes them, start sending
+							ulog(LLOG_DEBUG, "Server %s:%s accepts spooled messages\n", uplink->remote_name, uplink->service);
+							uplink->spool_accepted = true;
+							spool_replay(uplink);
+						} else if (uplink->buffer_size == sizeof(uint32_t)) {
+							// Acknowledgement of all the ones up to this sequence number
+							uint32_t seq = uplink_parse_uint32(&uplink->buffer, &uplink->buffer_size);
+							if (uplink->spool)
+								uplink->acked += spool_ack(uplink->spool, seq);
+						} else
+							ulog(LLOG_ERROR, "Broken spool message\n");
+						break;
+					case 'B': { // Memory budget of a plugin
+						const char *plugin_name = uplink_parse_string(temp_pool, &uplink->buffer, &uplink->buffer_size);
+						if (!plugin_name || uplink->buffer_size != 2 * sizeof(uint32_t)) {
+							ulog(LLOG_ERROR, "Broken memory budget message\n");
+							break;
+						}
+						size_t soft = (size_t)uplink_parse_uint32(&uplink->buffer, &uplink->buffer_size) * 1024;
+						size_t hard = (size_t)uplink_parse_uint32(&uplink->buffer, &uplink->buffer_size) * 1024;
+						if (!loop_plugin_memory_budget(uplink->loop, plugin_name, soft, hard))
+							ulog(LLOG_WARN, "Memory budget for non-existent plugin %s\n", plugin_name);
+						break;
+					}
+					case 'S': { // Packet sampling of a plugin
+						struct sampling_msg sampling;
+						if (!sampling_parse(&sampling, &uplink->buffer, &uplink->buffer_size, temp_pool) || uplink->buffer_size || (sampling.mode != SAMPLE_PACKETS && sampling.mode != SAMPLE_FLOWS)) {
+							ulog(LLOG_ERROR, "Broken sampling message\n");
+							break;
+						}
+						if (!loop_plugin_sampling(uplink->loop, sampling.plugin, sampling.mode, sampling.rate))
+							ulog(LLOG_WARN, "Sampling for non-existent plugin %s\n", sampling.plugin);
+						break;
+					}
 					default:
 						  ulog(LLOG_ERROR, "Received unknown command %c from uplink %s:%s\n", command, uplink->remote_name, uplink->service);
 						  break;
 				}
-				if (uplink->auth_status == SENT)
+				if (uplink->auth_status == SENT && !uplink->resume_sent)
 					uplink->auth_status = AUTHENTICATED; // We are authenticated if the server writes to us
 			} else {
-				if (command == 'C' && uplink->auth_status == NOT_STARTED) {
+				if (command == 'C' && uplink->auth_status == NOT_STARTED && !uplink->codec_wait) {
 					// The server is sending a challenge.
-					// We send a „sesssion ID“ ‒ our PID. This way, the server will know if it's the same process reconnecting and drop the old connection sooner.
-					ulog(LLOG_DEBUG, "Sending session ID\n");
-					uint32_t sid = htonl(getpid());
-					uplink_send_message(uplink, 'S', &sid, sizeof sid);
-					ulog(LLOG_DEBUG, "Sending login info\n");
-					// Prepare data
-#define HALF_SIZE 16
-					atsha_big_int server_challenge, client_response;
-					uint8_t local_half[HALF_SIZE] = PASSWD_HALF;
-					sanity(HALF_SIZE + uplink->buffer_size == sizeof(server_challenge.data), "Wrong length of server challenge, givint up\n");
-					server_challenge.bytes = HALF_SIZE + uplink->buffer_size;
-					memcpy(server_challenge.data, local_half, HALF_SIZE);
-					memcpy(server_challenge.data + HALF_SIZE, uplink->buffer, uplink->buffer_size);
-					// Get the chip handle
-					atsha_set_log_callback(atsha_log_callback);
-					struct atsha_handle *cryptochip = atsha_open();
-					if (!cryptochip)
-						die("Couldn't open the ATSHA204 chip\n");
-					// Read the serial number
-					atsha_big_int serial;
-					int result = atsha_serial_number(cryptochip, &serial);
-					if (result != ATSHA_ERR_OK)
-						die("Don't known my own name: %s\n", atsha_error_name(result));
-
-					// Compute response to the server challenge
-					result = atsha_challenge_response(cryptochip, server_challenge, &client_response);
-					if (result != ATSHA_ERR_OK)
-						die("Can't answer challenge: %s\n", atsha_error_name(result));
-					// Close the chip (and unlock)
-					atsha_close(cryptochip);
-
-					// Send all computed stuff
-					size_t len = 1 + 2*sizeof(uint32_t) + serial.bytes + client_response.bytes;
-					uint8_t *message = mem_pool_alloc(temp_pool, len);
-					message[0] = 'O';
-					uint8_t *message_pos = message + 1;
-					size_t len_pos = len - 1;
-					uplink_render_string(serial.data, serial.bytes, &message_pos, &len_pos);
-					uplink_render_string(client_response.data, client_response.bytes, &message_pos, &len_pos);
-					assert(!len_pos);
-					uplink_send_message(uplink, 'L', message, len);
-					/*
-					 * Send 'H'ello. For now, it is empty. In future, we expect to have program & protocol version,
-					 * list of plugins and possibly other things too.
-					 */
-					uplink->auth_status = SENT;
-					uint8_t proto_version = PROTOCOL_VERSION;
-					uplink_send_message(uplink, 'H', &proto_version, sizeof proto_version);
-					loop_uplink_connected(uplink->loop);
+					if (uplink->codec_wanted == CODEC_ZLIB)
+						send_login(uplink, uplink->buffer, uplink->buffer_size);
+					else
+						codec_offer(uplink);
+				} else if (command == 'Z' && uplink->codec_wait) {
+					codec_answer(uplink);
 				} else
 					// This is an insult, and we won't talk to the other side any more!
 					ulog(LLOG_ERROR, "Protocol violation at login\n");
@@ -776,30 +2057,57 @@ static void handle_buffer(struct uplink *uplink) {
 	}
 }
 
-static enum rdd_status read_decompressed_data(struct uplink *uplink, ssize_t *available_output) {
-	// Update stream's output buffer according to uplink "request"
-	uplink->zstrm_recv.avail_out = (unsigned int)uplink->size_rest;
-	uplink->zstrm_recv.next_out = (unsigned char *)uplink->buffer_pos;
-
-	// Try to read from buffers, they can have some data
-	int ret = inflate(&(uplink->zstrm_recv), Z_SYNC_FLUSH);
-	if (ret == Z_DATA_ERROR) {
-		ulog(LLOG_ERROR, "Data for decompression are corrupted. Reconnecting.");
+/*
+ * Decompress as much of the received data as fits into the current message. Switches
+ * to the negotiated compression once the zlib stream of the server ends. Returns false
+ * if the data are broken (and the connection got closed).
+ */
+static bool recv_decompress(struct uplink *uplink, ssize_t *available_output) {
+	struct codec_io io = {
+		.in = uplink->inc_pos,
+		.in_size = uplink->inc_avail,
+		.out = uplink->buffer_pos,
+		.out_size = uplink->size_rest
+	};
+	enum codec_status status = codec_decompress(&uplink->codec_recv, &io);
+	if (status == CODEC_END && uplink->recv_switch) {
+		ulog(LLOG_DEBUG, "Switching decompression from %s:%s to %s\n", uplink->remote_name, uplink->service, codec_name(uplink->codec_chosen));
+		uplink->recv_switch = false;
+		codec_done(&uplink->codec_recv);
+		if (!codec_init(&uplink->codec_recv, uplink->codec_chosen, false, 0, uplink->dict, uplink->dict_size))
+			die("Could not initialize %s (decompression stream)\n", codec_name(uplink->codec_chosen));
+		// The rest of the input belongs to the new stream
+		status = codec_decompress(&uplink->codec_recv, &io);
+	}
+	uplink->inc_pos = io.in;
+	uplink->inc_avail = io.in_size;
+	*available_output = uplink->size_rest - io.out_size;
+	// The stream may end only when switching the compression
+	if (status == CODEC_ERROR || (status == CODEC_END && !*available_output)) {
+		ulog(LLOG_ERROR, "Data for decompression are corrupted. Reconnecting.\n");
 		// Data corrupted. Reconnect.
 		uplink_reconnect(uplink);
-		return RDD_END_LOOP;
+		return false;
 	}
-	*available_output = uplink->size_rest - uplink->zstrm_recv.avail_out;
+	return true;
+}
+
+static enum rdd_status read_decompressed_data(struct uplink *uplink, ssize_t *available_output) {
+	// Try to read from buffers, they can have some data
+	if (!recv_decompress(uplink, available_output))
+		return RDD_END_LOOP;
 
-	// There was some data in deflate or receive buffer
+	// There was some data in decompression or receive buffer
 	if (*available_output != 0) {
 		return RDD_DATA;
 	}
 
 	// Read is requested and there are no more received data
 	// So, try to read something
-	if (uplink->zstrm_recv.avail_in == 0) {
-		ssize_t amount = recv(uplink->fd, uplink->inc_buffer, uplink->inc_buffer_size, MSG_DONTWAIT);
+	if (uplink->inc_avail == 0) {
+		if (uplink->inc_grow)
+			inc_resize(uplink, 2 * uplink->inc_buffer_size);
+		ssize_t amount = transport_recv(uplink, uplink->inc_buffer, uplink->inc_buffer_size);
 		if (amount == -1) {
 			switch (errno) {
 				/*
@@ -833,8 +2141,10 @@ CLOSED:
 			return RDD_END_LOOP; // We are done with this socket.
 		} else {
 			// Some data was read, so update input buffer for stream
-			uplink->zstrm_recv.avail_in = (unsigned int)amount;
-			uplink->zstrm_recv.next_in = (unsigned char *)uplink->inc_buffer;
+			uplink->inc_avail = amount;
+			uplink->inc_pos = uplink->inc_buffer;
+			// There's probably more waiting, read it with fewer calls next time
+			uplink->inc_grow = (size_t)amount == uplink->inc_buffer_size && uplink->inc_buffer_size < UPLINK_RECV_BUFFER_MAX;
 
 			if (MAX_LOG_LEVEL == LLOG_DEBUG_VERBOSE) {
 
@@ -843,15 +2153,9 @@ CLOSED:
 		}
 	}
 
-	// First time had inflate empty buffer - try it again after read
-	ret = inflate(&(uplink->zstrm_recv), Z_SYNC_FLUSH);
-	if (ret == Z_DATA_ERROR) {
-		ulog(LLOG_ERROR, "Data for decompression are corrupted. Reconnecting.");
-		// Data corrupted. Reconnect.
-		uplink_reconnect(uplink);
+	// First time had the decompression empty buffer - try it again after read
+	if (!recv_decompress(uplink, available_output))
 		return RDD_END_LOOP;
-	}
-	*available_output = uplink->size_rest - uplink->zstrm_recv.avail_out;
 
 	if (*available_output == 0) {
 		// The same case as EAGAIN;
@@ -861,20 +2165,107 @@ CLOSED:
 	return RDD_DATA;
 }
 
-static void uplink_read(struct uplink *uplink, uint32_t unused) {
-	(void) unused;
+// Send as much of the queue as the socket takes without blocking
+static void queue_flush(struct uplink *uplink) {
+#ifndef UPLINK_SOCAT
+	if (uplink->tls_handshake)
+		return; // Sent once the connection is complete
+#endif
+	while (uplink->queue_head) {
+		struct queue_chunk *chunk = uplink->queue_head;
+		if (MAX_LOG_LEVEL == LLOG_DEBUG_VERBOSE) {
+			ulog(LLOG_DEBUG_VERBOSE, "compression: send: compressed data (size %zu): %s\n", chunk->end - chunk->start, mem_pool_hex(loop_temp_pool(uplink->loop), chunk->data + chunk->start, chunk->end - chunk->start));
+		}
+		ssize_t amount = transport_send(uplink, chunk->data + chunk->start, chunk->end - chunk->start);
+		if (amount == -1) {
+			switch (errno) {
+				case EAGAIN:
+#if EAGAIN != EWOULDBLOCK
+				case EWOULDBLOCK:
+#endif
+					// Full. Continue when the socket is writable again.
+					if (!uplink->send_blocked) {
+						ulog(LLOG_DEBUG, "Sending to %s:%s blocked with %zu bytes queued\n", uplink->remote_name, uplink->service, uplink->queued);
+						uplink->send_blocked = true;
+						uplink->stall_start = loop_now(uplink->loop);
+						uplink->stall_count ++;
+						update_write_watch(uplink);
+					}
+					return;
+				case EINTR:
+					// Just interrupt called during send. Retry.
+					ulog(LLOG_WARN, "EINTR during send to %s:%s\n", uplink->remote_name, uplink->service);
+					uplink->send_interrupted ++;
+					continue;
+				case ECONNRESET:
+				case EPIPE:
+					// Lost connection. Reconnect.
+					uplink_reconnect(uplink);
+					return;
+				default:
+					// Fatal errors
+					die("Error sending to %s:%s (%s)\n", uplink->remote_name, uplink->service, strerror(errno));
+			}
+		}
+		if ((size_t) amount < chunk->end - chunk->start)
+			uplink->send_partial ++;
+		chunk->start += amount;
+		uplink->queued -= amount;
+		uplink->queue_sent += amount;
+		if (chunk->start == chunk->end) {
+			uplink->queue_head = chunk->next;
+			if (!uplink->queue_head)
+				uplink->queue_tail = NULL;
+			chunk_recycler_release(uplink, chunk);
+		}
+		queue_marks_release(uplink);
+	}
+	// Everything is sent
+	if (uplink->send_blocked) {
+		stall_end(uplink);
+		update_write_watch(uplink);
+	}
+	// Give the waiting messages their turn
+	if (uplink->pending || (uplink->spool && uplink->spool_accepted && spool_pending(uplink->spool)))
+		feed_schedule(uplink);
+}
+
+static void uplink_read(struct uplink *uplink, uint32_t events) {
 	ulog(LLOG_DEBUG, "Read on uplink %s:%s (%d)\n", uplink->remote_name, uplink->service, uplink->fd);
 	if (uplink->fd == -1) {
 		ulog(LLOG_WARN, "Spurious read on uplink\n");
 		return;
 	}
+#ifdef UPLINK_SOCAT
+	(void) events;
+#else
+	if (uplink->tls_handshake) {
+		if (!tls_handshake(uplink))
+			return;
+	} else if (uplink->tls_want_write && (events & EPOLLOUT)) {
+		// The read blocked on write before (renegotiation), it can continue now
+		uplink->tls_want_write = false;
+		update_write_watch(uplink);
+	}
+#endif
+	if (uplink->queue_head && (!uplink->send_blocked || (events & EPOLLOUT))) {
+		queue_flush(uplink);
+		if (uplink->fd == -1)
+			return;
+	}
+	// There may be space in the queue for more of the waiting messages now
+	queue_feed(uplink);
+	if (uplink->fd == -1)
+		return;
+	// A plugin jumped out while processing a message last time, the pool can be reset with the next one
+	uplink->dispatching = false;
 	size_t limit = 50; // Max of 50 messages, so we don't block forever. Arbitrary smallish number.
 	while (limit) {
 		limit --;
 		if (!uplink->buffer) {
 			// No buffer - prepare one for the size
-			uplink->buffer_size = uplink->size_rest = sizeof(uint32_t);
-			uplink->buffer = uplink->buffer_pos = mem_pool_alloc(uplink->buffer_pool, uplink->buffer_size);
+			uplink->buffer_size = uplink->size_rest = sizeof uplink->size_buffer;
+			uplink->buffer = uplink->buffer_pos = uplink->size_buffer;
 		}
 
 		ssize_t amount = 0;
@@ -895,34 +2286,46 @@ static void uplink_read(struct uplink *uplink, uint32_t unused) {
 			if (uplink->size_rest == 0) {
 				handle_buffer(uplink);
 				if (uplink->fd == -1)
-					break; // The connection got closed in handle_buffer
+					return; // The connection got closed in handle_buffer
 			}
 		}
 	}
+#ifndef UPLINK_SOCAT
+	// Some more data may be decrypted inside the TLS buffers already, the socket won't wake us up for them
+	if (!uplink->read_scheduled && SSL_pending(uplink->tls)) {
+		uplink->read_id = loop_timeout_add(uplink->loop, 0, NULL, uplink, read_pending);
+		uplink->read_scheduled = true;
+	}
+#endif
 }
 
 struct uplink *uplink_create(struct loop *loop) {
 	ulog(LLOG_INFO, "Creating uplink\n");
 	struct mem_pool *permanent_pool = loop_permanent_pool(loop);
 	struct uplink *result = mem_pool_alloc(permanent_pool, sizeof *result);
-	unsigned char *incoming_buffer = mem_pool_alloc(permanent_pool, COMPRESSION_BUFFSIZE);
 	*result = (struct uplink) {
 		.uplink_read = uplink_read,
 		.loop = loop,
 		.buffer_pool = loop_pool_create(loop, NULL, mem_pool_printf(loop_temp_pool(loop), "Buffer pool for uplink")),
+		.inc_pool = loop_pool_create(loop, NULL, mem_pool_printf(loop_temp_pool(loop), "Receive buffer pool for uplink")),
+		.addr_pool = loop_pool_create(loop, NULL, mem_pool_printf(loop_temp_pool(loop), "Address pool for uplink")),
+		.resolver = {
+			.handler = {
+				.handler = resolve_read
+			},
+			.fd = -1
+		},
 		.fd = -1,
-		.inc_buffer = incoming_buffer,
-		.inc_buffer_size = COMPRESSION_BUFFSIZE
-
+		.codec_wanted = CODEC_ZLIB,
+		.codec_level = COMPRESSION_LEVEL
 	};
-
-        //fields zalloc, zfree and opaque that are required to be set before calling deflateInit (resp. inflateInit) were set to zero (Z_NULL) by the initializer above
-        if (deflateInit(&(result->zstrm_send), COMPRESSION_LEVEL) != Z_OK)
-		die("Could not initialize zlib (compression stream)\n");
-        //for zstrm_recv it's also necessary to set zstrm_recv.avail_in to 0, this was done by the initializer as well
-	if (inflateInit(&(result->zstrm_recv)) != Z_OK)
-		die("Could not initialize zlib (decompression stream)\n");
+	result->resolver.uplink = result;
+	inc_resize(result, COMPRESSION_BUFFSIZE);
+	// The codecs need to be valid for codec_restart to release them
+	if (!codec_init(&result->codec_send, CODEC_ZLIB, true, COMPRESSION_LEVEL, NULL, 0) || !codec_init(&result->codec_recv, CODEC_ZLIB, false, 0, NULL, 0))
+		die("Could not initialize zlib\n");
 	loop_uplink_set(loop, result);
+	result->traffic_id = loop_timeout_add(loop, UPLINK_TRAFFIC_INTERVAL, NULL, result, traffic_timeout);
 	return result;
 }
 
@@ -960,123 +2363,726 @@ void uplink_configure(struct uplink *uplink, const char *remote_name, const char
 		return;
 	}
 	ulog(LLOG_INFO, "Changing remote uplink address to %s:%s\n", remote_name, service);
+#ifndef UPLINK_SOCAT
+	tls_forget(uplink);
+#endif
+	// The session and the addresses are of the old server
+	session_forget(uplink);
+	resolve_stop(uplink, true);
+	mem_pool_reset(uplink->addr_pool);
+	uplink->addrinfo = NULL;
+	uplink->good_family = AF_UNSPEC;
 	uplink_reconnect(uplink);
-	update_addrinfo(uplink);
 }
 
 void uplink_destroy(struct uplink *uplink) {
 	ulog(LLOG_INFO, "Destroying uplink to %s:%s\n", uplink->remote_name, uplink->service);
 	// The memory pools get destroyed by the loop, we just close the socket, if any.
+	session_forget(uplink);
 	uplink_disconnect(uplink, true);
+	resolve_stop(uplink, true);
+	loop_timeout_cancel(uplink->loop, uplink->traffic_id);
 	// And destroy library handlers
-	deflateEnd(&(uplink->zstrm_send));
-	inflateEnd(&(uplink->zstrm_recv));
+#ifndef UPLINK_SOCAT
+	tls_forget(uplink);
+#endif
+	uplink_set_spool(uplink, NULL, 0);
+	codec_done(&uplink->codec_send);
+	codec_done(&uplink->codec_recv);
+	if (uplink->dict_pool)
+		mem_pool_destroy(uplink->dict_pool);
+#ifdef UPLINK_CAPTURE
+	if (uplink->capture)
+		fclose(uplink->capture);
+#endif
 	if (uplink->status_file)
 		if (unlink(uplink->status_file) == -1)
 			ulog(LLOG_ERROR, "Couldn't remove status file %s: %s\n", uplink->status_file, strerror(errno));
 }
 
-static bool send_raw_data(struct uplink *uplink, const uint8_t *buffer, size_t size, int flags) {
-	// Compression don't produce output every time.
-	// Do not try to send empty data, this case is not rare .
-	if (size == 0)
-		return true;
-	if (MAX_LOG_LEVEL == LLOG_DEBUG_VERBOSE) {
-		ulog(LLOG_DEBUG_VERBOSE, "compression: send: compressed data (size %zu, %s): %s\n", size, (flags == 0) ? "LAST" : "MSG_MORE", mem_pool_hex(loop_temp_pool(uplink->loop), buffer, size));
+// For measuring the compression, finer than loop_now
+static uint64_t clock_ns(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * (uint64_t) 1000000000 + ts.tv_nsec;
+}
+
+// Compress the data into the end of the queue
+static void queue_compress(struct uplink *uplink, const uint8_t *data, size_t size, enum codec_flush flush) {
+	struct codec_io io = {
+		.in = data,
+		.in_size = size
+	};
+	bool done;
+	do {
+		struct queue_chunk *tail = uplink->queue_tail;
+		// zlib wants more than 6 bytes of space for the flush, or it'd produce repeated flush markers
+		if (!tail || UPLINK_CHUNK_SIZE - tail->end < (flush != CODEC_FLUSH_NONE ? 7 : 1)) {
+			tail = chunk_recycler_get(uplink, loop_permanent_pool(uplink->loop));
+			*tail = (struct queue_chunk) {
+				.next = NULL
+			};
+			if (uplink->queue_tail)
+				uplink->queue_tail->next = tail;
+			else
+				uplink->queue_head = tail;
+			uplink->queue_tail = tail;
+		}
+		size_t space = UPLINK_CHUNK_SIZE - tail->end;
+		io.out = tail->data + tail->end;
+		io.out_size = space;
+		// On flush, there may be more output even if all the input is consumed
+		uint64_t before = clock_ns();
+		done = codec_compress(&uplink->codec_send, &io, flush);
+		uplink->message_time += clock_ns() - before;
+		size_t produced = space - io.out_size;
+		tail->end += produced;
+		uplink->queued += produced;
+		uplink->queue_appended += produced;
+		uplink->compressed_total += produced;
+	} while (!done);
+	if (uplink->queued > uplink->queue_peak)
+		uplink->queue_peak = uplink->queued;
+}
+
+// The +1 is for the type sent directly after the length
+#define HEAD_LEN (sizeof(uint32_t) + 1)
+
+// Would a message of this size fit into the queue?
+static bool queue_fits(struct uplink *uplink, const struct plugin_queue *plugin, size_t size) {
+	// The message must fit whole, the compressed stream can't be cut in the middle. The not flushed ones are still inside the compression.
+	size_t bound = codec_bound(uplink->coalesced + HEAD_LEN + size);
+	return uplink->queued + uplink->pending + bound <= UPLINK_QUEUE_MAX && (!plugin || plugin->queued + plugin->pending + bound <= UPLINK_QUEUE_PLUGIN_MAX);
+}
+
+// Is the queue short enough to take the waiting messages? The coalesced ones are about to join it.
+static bool queue_short(const struct uplink *uplink) {
+	return uplink->queued + uplink->coalesced < UPLINK_QUEUE_LOW;
+}
+
+/*
+ * Is the message too large to fit even into an empty queue? Such message is let in alone, once
+ * the queue is empty. Refusing it for being over the limit would refuse it every time.
+ */
+static bool queue_oversize(const struct plugin_queue *plugin, size_t size) {
+	size_t bound = codec_bound(HEAD_LEN + size);
+	return bound > UPLINK_QUEUE_MAX || (plugin && bound > UPLINK_QUEUE_PLUGIN_MAX);
+}
+
+static bool queue_empty(const struct uplink *uplink) {
+	return !uplink->queued && !uplink->pending && !uplink->coalesced;
+}
+
+static void queue_refuse(struct uplink *uplink, struct plugin_queue *plugin, char type, size_t size) {
+	uplink->refused ++;
+	if (queue_oversize(plugin, size)) {
+		// Not an overflow, it can go only into an empty queue. Such messages are rare, log each one.
+		ulog(LLOG_WARN, "Message '%c' of %zu bytes%s%s is larger than the send queue to %s:%s and can go only into empty one, dropping it\n", type, size, plugin ? " from " : "", plugin ? plugin->name : "", uplink->remote_name, uplink->service);
+		if (plugin) {
+			plugin->refused ++;
+			plugin->refused_bytes += size;
+		}
+		return;
 	}
-	while (size > 0) {
-		ssize_t amount = send(uplink->fd, buffer, size, MSG_NOSIGNAL | flags);
-		if (amount == -1) {
-			switch (errno) {
-				case EINTR:
-					// Just interrupt called during send. Retry.
-					ulog(LLOG_WARN, "EINTR during send to %s:%s\n", uplink->remote_name, uplink->service);
-					continue;
-				case ECONNRESET:
-				case EPIPE:
-					// Lost connection. Reconnect.
-					uplink_reconnect(uplink);
-					return false;
-				default:
-					// Fatal errors
-					die("Error sending to %s:%s\n", uplink->remote_name, uplink->service);
-			}
-		} else {
-			buffer += amount;
-			size -= amount;
+	// Log only the start of the overflow, not each message
+	if (!plugin) {
+		if (!uplink->refused_now ++)
+			ulog(LLOG_WARN, "Send queue to %s:%s is full (%zu bytes), dropping messages (the first one '%c' of %zu bytes)\n", uplink->remote_name, uplink->service, uplink->queued, type, size);
+		return;
+	}
+	if (!plugin->refused_now ++)
+		ulog(LLOG_WARN, "Send queue to %s:%s is full for plugin %s (%zu bytes of it, %zu in total), dropping its messages\n", uplink->remote_name, uplink->service, plugin->name, plugin->queued, uplink->queued);
+	plugin->refused ++;
+	plugin->refused_bytes += size;
+}
+
+// Flush the compression of the coalesced messages and send them
+static void queue_sync(struct uplink *uplink) {
+	if (uplink->sync_scheduled) {
+		loop_timeout_cancel(uplink->loop, uplink->sync_id);
+		uplink->sync_scheduled = false;
+	}
+	if (!uplink->coalesced)
+		return;
+	uint64_t start = uplink->queue_appended;
+	queue_compress(uplink, NULL, 0, CODEC_FLUSH_SYNC);
+	size_t produced = uplink->queue_appended - start;
+	// The messages are complete in the stream only now
+	for (struct queue_mark *mark = uplink->coalesced_mark; mark; mark = mark->next) {
+		mark->end = uplink->queue_appended;
+		if (!mark->next) {
+			// Which message the rest of the output belongs to is unknown, give it to the last one
+			mark->size += produced;
+			mark->plugin->queued += produced;
+			mark->plugin->traffic.compressed += produced;
+			mark->plugin->traffic.compress_time += uplink->message_time;
 		}
 	}
-	return true;
+	struct uplink_traffic *traffic = &uplink->type_traffic[(unsigned char) uplink->last_type];
+	traffic->compressed += produced;
+	traffic->compress_time += uplink->message_time;
+	uplink->message_time = 0;
+	uplink->coalesced = 0;
+	uplink->coalesced_mark = NULL;
+	uplink->syncs ++;
+	if (!uplink->send_blocked)
+		queue_flush(uplink);
 }
 
-static bool buffer_send(struct uplink *uplink, const uint8_t *buffer, size_t size, int flags) {
-	size_t buffsize = COMPRESSION_BUFFSIZE;
-	struct mem_pool *temp_pool = loop_temp_pool(uplink->loop);
-	uint8_t *output_buffer = mem_pool_alloc(temp_pool, buffsize);
-	uplink->zstrm_send.avail_in = size;
-	uplink->zstrm_send.next_in = (unsigned char *)buffer;
+static void sync_timeout(struct context *context_unused, void *data, size_t id_unused) {
+	(void) context_unused;
+	(void) id_unused;
+	struct uplink *uplink = data;
+	uplink->sync_scheduled = false;
+	queue_sync(uplink);
+}
 
-	if (MAX_LOG_LEVEL == LLOG_DEBUG_VERBOSE) {
-		ulog(LLOG_DEBUG_VERBOSE, "compression: send: original data (size %zu, %s): %s\n", size, (flags == 0) ? "LAST" : "MSG_MORE", mem_pool_hex(loop_temp_pool(uplink->loop), buffer, size));
-	}
-	unsigned int available_output = 0;
-	while (uplink->zstrm_send.avail_in > 0) {
-		uplink->zstrm_send.avail_out = buffsize;
-		uplink->zstrm_send.next_out = output_buffer;
-		deflate(&(uplink->zstrm_send), Z_NO_FLUSH);
-		available_output = buffsize - uplink->zstrm_send.avail_out;
-		if (available_output == 0) {
-			ulog(LLOG_DEBUG_VERBOSE, "compression: no output data prepared after deflate call\n");
+static size_t iov_size(const struct iovec *iov, size_t count) {
+	size_t size = 0;
+	for (size_t i = 0; i < count; i ++)
+		size += iov[i].iov_len;
+	return size;
+}
+
+// Put a piece of a message into the compression
+static void message_compress(struct uplink *uplink, const uint8_t *data, size_t size) {
+	if (!size)
+		return;
+#ifdef UPLINK_CAPTURE
+	if (!uplink->capture && !(uplink->capture = fopen(UPLINK_CAPTURE, "ab")))
+		die("Can't open uplink capture %s: %s\n", UPLINK_CAPTURE, strerror(errno));
+	if (fwrite(data, size, 1, uplink->capture) != 1)
+		ulog(LLOG_ERROR, "Can't write uplink capture %s\n", UPLINK_CAPTURE);
+#endif
+	queue_compress(uplink, data, size, CODEC_FLUSH_NONE);
+}
+
+// The message can't be sent nor spooled, the connection is down
+static bool traffic_offline(struct uplink *uplink, struct plugin_queue *plugin, char type) {
+	if (plugin)
+		plugin->traffic.offline ++;
+	uplink->type_traffic[(unsigned char) type].offline ++;
+	return false;
+}
+
+static void traffic_add(struct uplink_traffic *traffic, size_t raw, size_t compressed, uint64_t compress_time) {
+	traffic->messages ++;
+	traffic->raw += raw;
+	traffic->compressed += compressed;
+	traffic->compress_time += compress_time;
+}
+
+// The whole message (of size bytes, with the head) is in the compression, started at the start position of the queue
+static void message_finish(struct uplink *uplink, struct plugin_queue *plugin, char type, size_t size, uint64_t start) {
+	if (plugin) {
+		struct queue_mark *mark = mark_recycler_get(uplink, loop_permanent_pool(uplink->loop));
+		*mark = (struct queue_mark) {
+			.plugin = plugin,
+			.size = uplink->queue_appended - start,
+			.queued_at = loop_now(uplink->loop),
+			.type = type
+		};
+		traffic_add(&plugin->traffic, size, mark->size, uplink->message_time);
+		plugin->queued += mark->size;
+		if (uplink->mark_tail)
+			uplink->mark_tail->next = mark;
+		else
+			uplink->mark_head = mark;
+		uplink->mark_tail = mark;
+		if (!uplink->coalesced_mark)
+			uplink->coalesced_mark = mark;
+	}
+	traffic_add(&uplink->type_traffic[(unsigned char) type], size, uplink->queue_appended - start, uplink->message_time);
+	uplink->message_time = 0;
+	uplink->last_type = type;
+	uplink->coalesced += size;
+	uplink->raw_total += size;
+	uplink->messages ++;
+	/*
+	 * Flush the compression once for all the messages of this loop iteration. But not
+	 * for the pings (their latency counts) and the login (the server waits for it) and
+	 * not for too much data.
+	 */
+	if (type == 'P' || type == 'p' || uplink->auth_status != AUTHENTICATED || uplink->coalesced >= UPLINK_COALESCE_MAX) {
+		queue_sync(uplink);
+	} else if (!uplink->sync_scheduled) {
+		uplink->sync_id = loop_timeout_add(uplink->loop, 0, NULL, uplink, sync_timeout);
+		uplink->sync_scheduled = true;
+	}
+}
+
+// Store a piece of a message of the plugin until its turn comes
+static void pending_append(struct uplink *uplink, struct plugin_queue *plugin, const uint8_t *data, size_t size) {
+	uplink->pending += size;
+	plugin->pending += size;
+	while (size) {
+		struct queue_chunk *tail = plugin->pending_tail;
+		if (!tail || tail->end == UPLINK_CHUNK_SIZE) {
+			tail = chunk_recycler_get(uplink, loop_permanent_pool(uplink->loop));
+			*tail = (struct queue_chunk) {
+				.next = NULL
+			};
+			if (plugin->pending_tail)
+				plugin->pending_tail->next = tail;
+			else
+				plugin->pending_head = tail;
+			plugin->pending_tail = tail;
 		}
-		if (!send_raw_data(uplink, output_buffer, available_output, MSG_MORE)) {
-			return false;
+		size_t amount = UPLINK_CHUNK_SIZE - tail->end;
+		if (amount > size)
+			amount = size;
+		memcpy(tail->data + tail->end, data, amount);
+		tail->end += amount;
+		data += amount;
+		size -= amount;
+	}
+}
+
+// Copy the head of the first pending message of the plugin, without removing it
+static void pending_peek(const struct plugin_queue *plugin, uint8_t *head) {
+	size_t size = HEAD_LEN;
+	for (const struct queue_chunk *chunk = plugin->pending_head; size; chunk = chunk->next) {
+		sanity(chunk, "Pending message of plugin %s is shorter than its head\n", plugin->name);
+		size_t amount = chunk->end - chunk->start;
+		if (amount > size)
+			amount = size;
+		memcpy(head, chunk->data + chunk->start, amount);
+		head += amount;
+		size -= amount;
+	}
+}
+
+// Move size bytes of the pending messages of the plugin into the compression
+static void pending_compress(struct uplink *uplink, struct plugin_queue *plugin, size_t size) {
+	uplink->pending -= size;
+	plugin->pending -= size;
+	while (size) {
+		struct queue_chunk *chunk = plugin->pending_head;
+		sanity(chunk, "Pending messages of plugin %s are shorter than %zu bytes\n", plugin->name, size);
+		size_t amount = chunk->end - chunk->start;
+		if (amount > size)
+			amount = size;
+		message_compress(uplink, chunk->data + chunk->start, amount);
+		chunk->start += amount;
+		size -= amount;
+		if (chunk->start == chunk->end) {
+			plugin->pending_head = chunk->next;
+			if (!plugin->pending_head)
+				plugin->pending_tail = NULL;
+			chunk_recycler_release(uplink, chunk);
 		}
 	}
-	if (flags == 0) { // No more data, flush the rest of compressed message and sent it.
-		ulog(LLOG_DEBUG_VERBOSE, "compression: start sync flushing\n");
-		do {
-			uplink->zstrm_send.avail_out = buffsize;
-			uplink->zstrm_send.next_out = output_buffer;
-			deflate(&(uplink->zstrm_send), Z_SYNC_FLUSH);
-			available_output = buffsize - uplink->zstrm_send.avail_out;
-			if (available_output == 0) {
-				ulog(LLOG_DEBUG_VERBOSE, "compression: no output data prepared after deflate call (SYNC)\n");
+}
+
+static void feed_timeout(struct context *context_unused, void *data, size_t id_unused);
+
+static void feed_schedule(struct uplink *uplink) {
+	if (!uplink->feed_scheduled) {
+		uplink->feed_id = loop_timeout_add(uplink->loop, 0, NULL, uplink, feed_timeout);
+		uplink->feed_scheduled = true;
+	}
+}
+
+/*
+ * Move the pending messages into the compression while the queue is short.
+ * The plugins take turns, each one gets UPLINK_QUEUE_QUANTUM bytes times its
+ * weight in a round (deficit round robin), so a plugin sending a lot doesn't
+ * hold back the others. The interactive plugins have a round of their own,
+ * which goes before the bulk one. The spooled messages go only after all of
+ * them.
+ */
+static void queue_feed(struct uplink *uplink) {
+	if (uplink->feed_scheduled) {
+		loop_timeout_cancel(uplink->loop, uplink->feed_id);
+		uplink->feed_scheduled = false;
+	}
+	for (size_t class = 0; class < SEND_CLASS_COUNT; class ++) {
+		struct send_round *round = &uplink->rounds[class];
+		while (round->head) {
+			// Continues once the queue gets sent
+			if (!queue_short(uplink))
+				return;
+			struct plugin_queue *plugin = round->head;
+			uint8_t head[HEAD_LEN];
+			pending_peek(plugin, head);
+			uint32_t length;
+			memcpy(&length, head, sizeof length);
+			size_t size = sizeof length + ntohl(length);
+			if (plugin->deficit < size) {
+				// Its turn is over, the next one goes
+				plugin->deficit += UPLINK_QUEUE_QUANTUM * plugin->weight;
+				if (plugin->next_active) {
+					round->head = plugin->next_active;
+					plugin->next_active = NULL;
+					round->tail->next_active = plugin;
+					round->tail = plugin;
+				}
+				continue;
 			}
-			int finish_flag = (uplink->zstrm_send.avail_out == 0) ? MSG_MORE : 0;
-			if (!send_raw_data(uplink, output_buffer, available_output, finish_flag)) {
-				return false;
+			plugin->deficit -= size;
+			uint64_t start = uplink->queue_appended;
+			pending_compress(uplink, plugin, size);
+			if (!plugin->pending) {
+				// Leaves the round, it doesn't keep the credit for later
+				round->head = plugin->next_active;
+				if (!round->head)
+					round->tail = NULL;
+				plugin->next_active = NULL;
+				plugin->active = false;
+				plugin->deficit = 0;
 			}
-		} while (uplink->zstrm_send.avail_out == 0);
+			message_finish(uplink, plugin, head[HEAD_LEN - 1], size, start);
+			if (uplink->fd == -1)
+				return; // Sending failed and the connection got closed
+		}
 	}
-	ulog(LLOG_DEBUG_VERBOSE, "compression: return\n");
-	return true;
+	spool_replay(uplink);
 }
 
-bool uplink_send_message(struct uplink *uplink, char type, const void *data, size_t size) {
+static void feed_timeout(struct context *context_unused, void *data, size_t id_unused) {
+	(void) context_unused;
+	(void) id_unused;
+	struct uplink *uplink = data;
+	uplink->feed_scheduled = false;
+	queue_feed(uplink);
+}
+
+/*
+ * Queue a message made of the pieces in iov. They are compressed one by one, without concatenating them first.
+ *
+ * The messages of the core go into the compression right away. The ones of the plugins do too if the queue is
+ * short, otherwise they are stored uncompressed and wait for their turn (see queue_feed). The compressed stream
+ * can't interleave messages, so this is the only place where they can be reordered.
+ */
+static bool queue_message(struct uplink *uplink, struct plugin_queue *plugin, char type, const struct iovec *iov, size_t count) {
+	size_t size = iov_size(iov, count);
 	if (uplink->fd == -1)
-		return false; // Not connected, we can't send.
-	// The +1 is for the type sent directly after the length
-	size_t head_len = sizeof(uint32_t) + 1;
-	uint8_t head_buffer[head_len];
+		return traffic_offline(uplink, plugin, type); // Not connected, we can't send.
+	if (uplink->send_blocked && uplink->stall_start + UPLINK_SEND_TIMEOUT < loop_now(uplink->loop)) {
+		ulog(LLOG_ERROR, "Sending to %s:%s is blocked for too long, reconnecting\n", uplink->remote_name, uplink->service);
+		uplink_reconnect(uplink);
+		return false;
+	}
+	bool oversize = queue_oversize(plugin, size);
+	if (oversize && !queue_empty(uplink)) {
+		queue_refuse(uplink, plugin, type, size);
+		return false;
+	} else if (oversize) {
+		ulog(LLOG_WARN, "Message '%c' of %zu bytes for %s:%s is larger than the send queue, sending it alone\n", type, size, uplink->remote_name, uplink->service);
+	} else if (!queue_fits(uplink, plugin, size)) {
+		queue_refuse(uplink, plugin, type, size);
+		return false;
+	}
+	if (plugin && plugin->refused_now) {
+		ulog(LLOG_INFO, "Plugin %s can send to %s:%s again, %zu messages were dropped\n", plugin->name, uplink->remote_name, uplink->service, plugin->refused_now);
+		plugin->refused_now = 0;
+	} else if (!plugin && uplink->refused_now) {
+		ulog(LLOG_INFO, "Can send to %s:%s again, %zu messages were dropped\n", uplink->remote_name, uplink->service, uplink->refused_now);
+		uplink->refused_now = 0;
+	}
+	if (MAX_LOG_LEVEL == LLOG_DEBUG_VERBOSE) {
+		for (size_t i = 0; i < count; i ++)
+			ulog(LLOG_DEBUG_VERBOSE, "compression: send: original data (type %c, size %zu, piece %zu of %zu bytes): %s\n", type, size, i, iov[i].iov_len, mem_pool_hex(loop_temp_pool(uplink->loop), iov[i].iov_base, iov[i].iov_len));
+	}
+	uint8_t head_buffer[HEAD_LEN];
 	uint32_t head_size = htonl(size + 1);
 	memcpy(head_buffer, &head_size, sizeof head_size);
-	head_buffer[head_len - 1] = type;
-	return buffer_send(uplink, head_buffer, head_len, MSG_MORE) && buffer_send(uplink, data, size, 0);
+	head_buffer[HEAD_LEN - 1] = type;
+	if (plugin && (uplink->pending || !queue_short(uplink))) {
+		pending_append(uplink, plugin, head_buffer, HEAD_LEN);
+		for (size_t i = 0; i < count; i ++)
+			pending_append(uplink, plugin, iov[i].iov_base, iov[i].iov_len);
+		if (!plugin->active) {
+			struct send_round *round = &uplink->rounds[plugin->class];
+			if (round->tail)
+				round->tail->next_active = plugin;
+			else
+				round->head = plugin;
+			round->tail = plugin;
+			plugin->active = true;
+		}
+		// If the socket is blocked, the feeding continues once it takes more
+		if (!uplink->send_blocked)
+			feed_schedule(uplink);
+		return true;
+	}
+	uint64_t start = uplink->queue_appended;
+	message_compress(uplink, head_buffer, HEAD_LEN);
+	for (size_t i = 0; i < count; i ++)
+		message_compress(uplink, iov[i].iov_base, iov[i].iov_len);
+	message_finish(uplink, plugin, type, HEAD_LEN + size, start);
+	return true;
 }
 
-bool uplink_plugin_send_message(struct context *context, const void *data, size_t size) {
-	if (!loop_plugin_active(context))
+bool uplink_send_message(struct uplink *uplink, char type, const void *data, size_t size) {
+	struct iovec iov = {
+		.iov_base = (void *)data,
+		.iov_len = size
+	};
+	return queue_message(uplink, NULL, type, &iov, 1);
+}
+
+static struct plugin_queue *plugin_queue_get(struct uplink *uplink, const char *name) {
+	LFOR(plugin_queues, plugin, &uplink->plugin_queues)
+		if (strcmp(plugin->name, name) == 0)
+			return plugin;
+	// The plugin may go away, but we keep its statistics
+	struct mem_pool *pool = loop_permanent_pool(uplink->loop);
+	struct plugin_queue *plugin = plugin_queues_append_pool(&uplink->plugin_queues, pool);
+	*plugin = (struct plugin_queue) {
+		.name = mem_pool_strdup(pool, name),
+		.weight = 1,
+		.class = SEND_BULK
+	};
+	return plugin;
+}
+
+static void replay_continue(struct context *context_unused, void *data, size_t id_unused) {
+	(void) context_unused;
+	(void) id_unused;
+	struct uplink *uplink = data;
+	uplink->replay_scheduled = false;
+	spool_replay(uplink);
+}
+
+// Send the spooled messages, as long as they fit into the queue
+static void spool_replay(struct uplink *uplink) {
+	// The live messages of the plugins go first
+	if (!uplink->spool || !uplink->spool_accepted || uplink->replay_scheduled || uplink->pending || uplink->fd == -1)
+		return;
+	struct mem_pool *temp_pool = loop_temp_pool(uplink->loop);
+	uint64_t now = time(NULL);
+	for (size_t i = 0; i < UPLINK_SPOOL_BATCH; i ++) {
+		uint32_t seq;
+		uint64_t when;
+		size_t size;
+		const uint8_t *data = spool_next(uplink->spool, &seq, &when, &size);
+		if (!data)
+			return; // All sent
+		// The data start with the name of the plugin, for the accounting in the queue
+		const uint8_t *name_pos = data;
+		size_t name_rest = size;
+		const char *name = uplink_parse_string(temp_pool, &name_pos, &name_rest);
+		if (!name) {
+			// It gets dropped once the ones before it are acknowledged
+			ulog(LLOG_ERROR, "Broken spooled message %u, dropping\n", (unsigned)seq);
+			spool_discard(uplink->spool);
+			continue;
+		}
+		struct plugin_queue *plugin = plugin_queue_get(uplink, name);
+		size_t length = 2 * sizeof(uint32_t) + size;
+		// One too large for the queue waits until the queue is empty (like in queue_message), it would never fit otherwise
+		bool fits = queue_oversize(plugin, length) ? queue_empty(uplink) : queue_fits(uplink, plugin, length);
+		// Don't let them delay the rest, continues once the queue gets sent
+		if (!queue_short(uplink) || !fits)
+			return;
+		uint8_t head[2 * sizeof(uint32_t)];
+		uint8_t *head_pos = head;
+		size_t head_rest = sizeof head;
+		uplink_render_uint32(seq, &head_pos, &head_rest);
+		// How old the message is, the server may want to know
+		uplink_render_uint32(now > when ? now - when : 0, &head_pos, &head_rest);
+		// The data stay valid, nothing gets appended to the spool meanwhile
+		const struct iovec iov[] = {
+			{ .iov_base = head, .iov_len = sizeof head },
+			{ .iov_base = (void *)data, .iov_len = size }
+		};
+		spool_advance(uplink->spool);
+		uplink->replayed ++;
+		if (!queue_message(uplink, plugin, 'D', iov, sizeof iov / sizeof *iov))
+			return; // The connection broke, the spool got rewound
+	}
+	if (spool_pending(uplink->spool)) {
+		// Let the rest of the loop run in between
+		uplink->replay_id = loop_timeout_add(uplink->loop, 0, NULL, uplink, replay_continue);
+		uplink->replay_scheduled = true;
+	}
+}
+
+static bool spool_message(struct uplink *uplink, const struct iovec *iov, size_t count) {
+	if (!spool_appendv(uplink->spool, iov, count)) {
+		uplink->spool_refused ++;
+		if (!uplink->spool_refused_now ++)
+			ulog(LLOG_WARN, "Spool %s is full (%zu messages), dropping messages\n", uplink->spool_path, spool_count(uplink->spool));
 		return false;
+	}
+	if (uplink->spool_refused_now) {
+		ulog(LLOG_INFO, "Spool %s takes messages again, %zu were dropped\n", uplink->spool_path, uplink->spool_refused_now);
+		uplink->spool_refused_now = 0;
+	}
+	uplink->spooled ++;
+	spool_replay(uplink);
+	return true;
+}
+
+bool uplink_plugin_send_messagev(struct context *context, const struct iovec *iov, size_t count) {
+	struct uplink *uplink = context->uplink;
 	const char *name = loop_plugin_get_name(context);
-	ulog(LLOG_DEBUG, "Sending message of size %zu from plugin %s\n", size, name);
+	bool spool;
+	if (uplink->session_held) {
+		// The connection is down, but the plugin stays active for when the session is resumed. Keep the message for then.
+		if (!loop_plugin_active(context))
+			return false;
+		if (!uplink_spooling(uplink))
+			return traffic_offline(uplink, plugin_queue_get(uplink, name), 'R');
+		spool = true;
+	} else if (loop_plugin_active(context)) {
+		// Keep the order, don't overtake the spooled messages still being sent
+		spool = uplink->spool && uplink->spool_accepted && spool_pending(uplink->spool);
+	} else {
+		// Not active because the connection is down? Keep its messages for later.
+		if (uplink->fd != -1 && (uplink->auth_status == AUTHENTICATED || uplink->auth_status == SENT))
+			return false;
+		if (!uplink_spooling(uplink) || !loop_plugin_may_spool(context))
+			return traffic_offline(uplink, plugin_queue_get(uplink, name), 'R');
+		spool = true;
+	}
+	ulog(LLOG_DEBUG, "%s message of size %zu from plugin %s\n", spool ? "Spooling" : "Sending", iov_size(iov, count), name);
+	// The name (as a string) goes before the pieces of the plugin
 	uint32_t name_length = strlen(name);
-	uint32_t length = sizeof name_length + name_length + size;
-	uint8_t *buffer = mem_pool_alloc(context->temp_pool, length);
-	uint8_t *buffer_pos = buffer;
-	size_t buffer_len = length;
-	uplink_render_string(name, name_length, &buffer_pos, &buffer_len);
-	memcpy(buffer_pos, data, size);
-	return uplink_send_message(context->uplink, 'R', buffer, length);
+	uint32_t name_length_net = htonl(name_length);
+	struct iovec *pieces = mem_pool_alloc(context->temp_pool, (count + 2) * sizeof *pieces);
+	pieces[0] = (struct iovec) {
+		.iov_base = &name_length_net,
+		.iov_len = sizeof name_length_net
+	};
+	pieces[1] = (struct iovec) {
+		.iov_base = (void *)name,
+		.iov_len = name_length
+	};
+	memcpy(pieces + 2, iov, count * sizeof *iov);
+	if (spool)
+		return spool_message(uplink, pieces, count + 2);
+	struct plugin_queue *plugin = plugin_queue_get(uplink, name);
+	bool interactive;
+	plugin->weight = loop_plugin_send_weight(context, &interactive);
+	// Takes effect the next time it joins a round, its messages stay in order
+	plugin->class = interactive ? SEND_INTERACTIVE : SEND_BULK;
+	return queue_message(uplink, plugin, 'R', pieces, count + 2);
+}
+
+bool uplink_plugin_send_message(struct context *context, const void *data, size_t size) {
+	struct iovec iov = {
+		.iov_base = (void *)data,
+		.iov_len = size
+	};
+	return uplink_plugin_send_messagev(context, &iov, 1);
+}
+
+void uplink_set_spool(struct uplink *uplink, const char *path, size_t size) {
+	if (uplink->spool && path && strcmp(uplink->spool_path, path) == 0 && uplink->spool_size == size)
+		return; // No change
+	if (uplink->spool) {
+		spool_close(uplink->spool);
+		mem_pool_destroy(uplink->spool_pool);
+		uplink->spool = NULL;
+		uplink->spool_pool = NULL;
+		uplink->spool_path = NULL;
+	}
+	if (!path)
+		return;
+	struct mem_pool *pool = mem_pool_create("Uplink spool");
+	uplink->spool = spool_open(pool, path, size);
+	if (!uplink->spool) {
+		ulog(LLOG_ERROR, "Running without spool\n");
+		mem_pool_destroy(pool);
+		return;
+	}
+	uplink->spool_pool = pool;
+	uplink->spool_path = mem_pool_strdup(pool, path);
+	uplink->spool_size = size;
+	// If there's something from the last run and we are connected, send it
+	spool_replay(uplink);
+}
+
+void uplink_set_compression(struct uplink *uplink, char codec, int level) {
+	enum codec_type type = codec;
+	sanity(codec_supported(type), "Compression %s is not compiled in\n", codec_name(type));
+	if (uplink->codec_wanted == type && uplink->codec_level == level)
+		return;
+	ulog(LLOG_INFO, "Setting %s compression of level %d for %s:%s\n", codec_name(type), level, uplink->remote_name, uplink->service);
+	uplink->codec_wanted = type;
+	uplink->codec_level = level;
+	// It is chosen during login
+	if (uplink->fd != -1)
+		uplink_reconnect(uplink);
+}
+
+bool uplink_spooling(const struct uplink *uplink) {
+	return uplink && uplink->spool;
+}
+
+static struct traffic_entry_msg traffic_entry(char kind, const char *name, size_t name_length, const struct uplink_traffic *traffic) {
+	// The counters wrap around, the server looks at the differences between the reports
+	return (struct traffic_entry_msg) {
+		.kind = kind,
+		.name = name,
+		.name_length = name_length,
+		.messages = traffic->messages,
+		.raw = traffic->raw,
+		.compressed = traffic->compressed,
+		.compress_time = traffic->compress_time / 1000,
+		.wait_time = traffic->wait_time,
+		.offline = traffic->offline
+	};
+}
+
+// Tell the server what the messages of each plugin and each type cost so far
+static void traffic_send(struct uplink *uplink) {
+	struct mem_pool *temp_pool = loop_temp_pool(uplink->loop);
+	size_t max = UCHAR_MAX + 1;
+	LFOR(plugin_queues, plugin, &uplink->plugin_queues)
+		max ++;
+	struct traffic_entry_msg *entries = mem_pool_alloc(temp_pool, max * sizeof *entries);
+	size_t count = 0;
+	LFOR(plugin_queues, plugin, &uplink->plugin_queues)
+		if (traffic_used(&plugin->traffic))
+			entries[count ++] = traffic_entry('P', plugin->name, strlen(plugin->name), &plugin->traffic);
+	char *types = mem_pool_alloc(temp_pool, UCHAR_MAX + 1);
+	for (size_t i = 0; i <= UCHAR_MAX; i ++)
+		if (traffic_used(&uplink->type_traffic[i])) {
+			types[i] = i;
+			entries[count ++] = traffic_entry('T', &types[i], 1, &uplink->type_traffic[i]);
+		}
+	size_t size = sizeof(uint32_t);
+	for (size_t i = 0; i < count; i ++)
+		size += traffic_entry_size(&entries[i]);
+	uint8_t *message = mem_pool_alloc(temp_pool, size);
+	uint8_t *pos = message;
+	size_t rest = size;
+	uplink_render_uint32(count, &pos, &rest);
+	for (size_t i = 0; i < count; i ++)
+		traffic_entry_render(&entries[i], &pos, &rest);
+	uplink_send_message(uplink, 'U', message, size);
+}
+
+static void traffic_timeout(struct context *context_unused, void *data, size_t id_unused) {
+	(void) context_unused;
+	(void) id_unused;
+	struct uplink *uplink = data;
+	uplink->traffic_id = loop_timeout_add(uplink->loop, UPLINK_TRAFFIC_INTERVAL, NULL, uplink, traffic_timeout);
+	dump_status(uplink);
+	if (uplink->traffic_wanted)
+		traffic_send(uplink);
+}
+
+char *uplink_stats(struct uplink *uplink, struct mem_pool *pool) {
+	uint64_t stall_time = uplink->stall_time;
+	if (uplink->send_blocked)
+		stall_time += loop_now(uplink->loop) - uplink->stall_start;
+	char *result = mem_pool_printf(pool, "queue %zu bytes (peak %zu, limit %zu), %zu bytes pending, %zu messages in %zu flushes, stalled %zu times for %llu ms, %zu messages refused", uplink->queued, uplink->queue_peak, (size_t)UPLINK_QUEUE_MAX, uplink->pending, uplink->messages, uplink->syncs, uplink->stall_count, (unsigned long long)stall_time, uplink->refused);
+	if (uplink->raw_total)
+		result = mem_pool_printf(pool, "%s, %s compression to %llu%% of %llu bytes", result, codec_name(uplink->codec_chosen), (unsigned long long)(100 * uplink->compressed_total / uplink->raw_total), (unsigned long long)uplink->raw_total);
+	if (uplink->spool)
+		result = mem_pool_printf(pool, "%s, spool %zu messages (%zu bytes of %zu), %zu spooled, %zu replayed, %zu acknowledged, %zu refused", result, spool_count(uplink->spool), spool_used(uplink->spool), uplink->spool_size, uplink->spooled, uplink->replayed, uplink->acked, uplink->spool_refused);
+	if (uplink->send_interrupted || uplink->send_partial)
+		result = mem_pool_printf(pool, "%s, %zu sends interrupted, %zu partial", result, uplink->send_interrupted, uplink->send_partial);
+	LFOR(plugin_queues, plugin, &uplink->plugin_queues) {
+		const struct uplink_traffic *traffic = &plugin->traffic;
+		result = mem_pool_printf(pool, "%s, plugin %s: %zu bytes queued, %zu pending, %zu messages (%zu bytes) refused, %llu messages of %llu bytes compressed to %llu in %llu us, waited %llu ms in the queue, %llu dropped offline", result, plugin->name, plugin->queued, plugin->pending, plugin->refused, plugin->refused_bytes, (unsigned long long) traffic->messages, (unsigned long long) traffic->raw, (unsigned long long) traffic->compressed, (unsigned long long) traffic->compress_time / 1000, (unsigned long long) traffic->wait_time, (unsigned long long) traffic->offline);
+	}
+	uplink->queue_peak = uplink->queued;
+	return result;
 }
 
 void uplink_realloc_config(struct uplink *uplink, struct mem_pool *pool) {
@@ -1099,6 +3105,13 @@ struct addrinfo *uplink_addrinfo(struct uplink *uplink) {
 void uplink_close(struct uplink *uplink) {
 	if (uplink->fd != -1)
 		close(uplink->fd);
+	if (uplink->resolver.fd != -1)
+		close(uplink->resolver.fd);
+#ifndef UPLINK_SOCAT
+	for (size_t i = 0; i < uplink->attempt_count; i ++)
+		if (uplink->attempts[i].fd != -1)
+			close(uplink->attempts[i].fd);
+#endif
 }
 
 bool uplink_connected(const struct uplink *uplink) {
@@ -25,6 +25,7 @@
 #include <stdint.h>
 #include <stddef.h>
 #include <stdbool.h>
+#include <sys/uio.h>
 
 struct uplink;
 struct loop;
@@ -79,11 +80,14 @@ void uplink_close(struct uplink *uplink) __attribute__((nonnull));
  * The message will have the given type and carry the provided data. The data may be
  * NULL in case size is 0.
  *
- * Blocking, we expect to send small amounts of data, so the link should not get filled.
+ * Non-blocking. The message is compressed into the send queue and sent from there
+ * as fast as the connection takes it. The messages from the same loop iteration are
+ * flushed out of the compression and sent together, at the start of the next one
+ * (pings, pongs and login messages are sent right away).
  *
- * Returns if the message was successfully sent. The connection might have been lost
- * during the send, or not exist at all, in which case it returns false. The message
- * is dropped!
+ * Returns if the message was successfully queued. If there's no connection, or the
+ * queue is full (UPLINK_QUEUE_MAX), it returns false and the message is dropped!
+ * A queued message is lost too if the connection breaks before it is sent.
  */
 bool uplink_send_message(struct uplink *uplink, char type, const void *data, size_t size) __attribute__((nonnull(1)));
 
@@ -91,9 +95,28 @@ bool uplink_send_message(struct uplink *uplink, char type, const void *data, siz
  * Send a message from plugin to the server. Semantics is similar as above, but the header is
  * generated by the function.
  *
- * Also, it returns false if the plugin is not active.
+ * Also, it returns false if the plugin is not active or if its messages already take
+ * UPLINK_QUEUE_PLUGIN_MAX bytes of the queue.
+ *
+ * If there's a spool (see uplink_set_spool), the messages of a plugin that was active when
+ * the connection got lost are stored there instead of being dropped (unless the spool is full).
+ * They are sent in order once the connection is back and removed when the server
+ * acknowledges them.
  */
 bool uplink_plugin_send_message(struct context *context, const void *data, size_t size) __attribute__((nonnull(1)));
+/*
+ * The same as uplink_plugin_send_message, but the message is made of count pieces
+ * (concatenated in the order). They are fed to the compression directly, so a big
+ * message or an array of records doesn't need to be copied into one buffer first.
+ */
+bool uplink_plugin_send_messagev(struct context *context, const struct iovec *iov, size_t count) __attribute__((nonnull(1)));
+
+/*
+ * Describe the state of the send queue ‒ its current and peak size, how long the
+ * sending was blocked and how many messages were refused (also for each plugin).
+ * The peak is reset afterwards.
+ */
+char *uplink_stats(struct uplink *uplink, struct mem_pool *pool) __attribute__((nonnull)) __attribute__((malloc)) __attribute__((returns_nonnull));
 
 // Some parsing & rendering functions
 
@@ -137,8 +160,25 @@ void uplink_render(uint8_t **buffer, size_t *length, const char *format, ...);
  */
 uint8_t *uplink_render_alloc(size_t *length, size_t extra_space, struct mem_pool *pool, const char *format, ...);
 
+/*
+ * Set the spool file for the plugin messages while the uplink is down, with the given size
+ * in bytes. NULL path turns the spool off. The messages from a previous run found in
+ * the file are sent too.
+ *
+ * If the file can't be used, it runs without a spool.
+ */
+void uplink_set_spool(struct uplink *uplink, const char *path, size_t size) __attribute__((nonnull(1)));
+
+/*
+ * Set the compression of the uplink, the codec is the letter from codec.h. Anything
+ * but zlib is offered to the server at login and it chooses. A change reconnects.
+ */
+void uplink_set_compression(struct uplink *uplink, char codec, int level) __attribute__((nonnull));
+
 // Is the uplink connected and authenticated right now?
 bool uplink_connected(const struct uplink *uplink);
+// Is there a spool to take the plugin messages while the uplink is not connected?
+bool uplink_spooling(const struct uplink *uplink);
 
 // Get the addresses of uplink, to check the values against packets. It should include all available addresses.
 struct addrinfo;
@@ -0,0 +1,253 @@
+/*
+    Ucollect - small utility for real-time analysis of network data
+    Copyright (C) 2015 CZ.NIC, z.s.p.o. (http://www.nic.cz/)
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+/*
+ * This header is little bit special in that it generates new code.
+ * You define bunch of defines and macros and include the header.
+ * The header introduces bunch of functions and undefines the macros.
+ *
+ * The header doesn't have the usual #ifndef guard, since it is expected
+ * to include multiple times, with different defines.
+ *
+ * This one generates the encoding and decoding of one message in the
+ * uplink wire format (the same one uplink_parse and uplink_render use).
+ * Unlike these, the message is described at compile time, so there's no
+ * format string to interpret, no variadic arguments and the size checks
+ * are done once for all the fixed-size fields.
+ *
+ * The definitions are:
+ * - WIRE_NAME(X): Macro returning name of types and functions provided
+ *   part of the name. Could be something like prefix_##X.
+ * - WIRE_FIELDS(FIELD, FIELD_IF): The fields, in the order on the wire.
+ *   Each one is either FIELD(type, name) or FIELD_IF(type, name, condition).
+ *   The conditional field is present only if the condition holds. It is an
+ *   expression on msg (pointer to the message) and it may use only the
+ *   fields before it. The types are:
+ *   - uint32: uint32_t, in network byte order.
+ *   - bool: bool, single byte.
+ *   - char: char, single byte.
+ *   - string: const char *name and size_t name_length. The uint32 length
+ *     followed by the data. On parse, it is copied to the memory pool and
+ *     terminated by '\0'.
+ * - WIRE_OPCODE: Optional. The char the message starts with. It is written
+ *   on render and checked on parse.
+ *
+ * The generated things are:
+ * - struct WIRE_NAME(msg): The message, with the fields as members.
+ * - WIRE_NAME(fixed_size): Constant, size of the opcode and the fields that
+ *   are always present, without the data of the strings.
+ * - WIRE_NAME(size)(msg): Size of the rendered message.
+ * - WIRE_NAME(render)(msg, &buffer, &length): Write the message to the
+ *   buffer, updating the position and the remaining length. Not enough
+ *   space is a programmer error.
+ * - WIRE_NAME(render_alloc)(msg, extra_space, &length, pool): Allocate the
+ *   exact space (plus extra_space bytes at the end) from the pool, render
+ *   the message there and return it. The length doesn't include the extra
+ *   space.
+ * - WIRE_NAME(parse)(msg, &buffer, &length, pool): Read the message from
+ *   the buffer. Returns false if the data is too short (or starts with a
+ *   different opcode), leaving the buffer untouched. Otherwise the buffer
+ *   is updated to point after the message. The pool is used only by the
+ *   strings.
+ */
+
+#include "mem_pool.h"
+#include "util.h"
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <arpa/inet.h>
+
+// Check all needed defines are there
+#ifndef WIRE_NAME
+#error "WIRE_NAME not defined"
+#endif
+#ifndef WIRE_FIELDS
+#error "WIRE_FIELDS not defined"
+#endif
+
+// Things common to all the messages, defined only once
+#ifndef UCOLLECT_WIRE_MESSAGE_COMMON
+#define UCOLLECT_WIRE_MESSAGE_COMMON
+
+#define WIRE_MEMBER_uint32(NAME) uint32_t NAME;
+#define WIRE_MEMBER_bool(NAME) bool NAME;
+#define WIRE_MEMBER_char(NAME) char NAME;
+#define WIRE_MEMBER_string(NAME) const char *NAME; size_t NAME##_length;
+
+// The part of the size known at compile time
+#define WIRE_FIXED_uint32 sizeof(uint32_t)
+#define WIRE_FIXED_bool 1
+#define WIRE_FIXED_char 1
+#define WIRE_FIXED_string sizeof(uint32_t)
+
+#define WIRE_SIZE_uint32(NAME) WIRE_FIXED_uint32
+#define WIRE_SIZE_bool(NAME) WIRE_FIXED_bool
+#define WIRE_SIZE_char(NAME) WIRE_FIXED_char
+#define WIRE_SIZE_string(NAME) (WIRE_FIXED_string + msg->NAME##_length)
+
+// Writing without checks, the space is checked for the whole message
+static inline void wire_put_uint32(uint8_t **pos, uint32_t value) {
+	value = htonl(value);
+	memcpy(*pos, &value, sizeof value);
+	*pos += sizeof value;
+}
+
+#define WIRE_PUT_uint32(NAME) wire_put_uint32(&pos, msg->NAME);
+#define WIRE_PUT_bool(NAME) *pos ++ = msg->NAME;
+#define WIRE_PUT_char(NAME) *pos ++ = msg->NAME;
+#define WIRE_PUT_string(NAME) \
+	wire_put_uint32(&pos, msg->NAME##_length); \
+	memcpy(pos, msg->NAME, msg->NAME##_length); \
+	pos += msg->NAME##_length;
+
+static inline uint32_t wire_get_uint32(const uint8_t **pos) {
+	uint32_t result;
+	memcpy(&result, *pos, sizeof result);
+	*pos += sizeof result;
+	return ntohl(result);
+}
+
+static inline const char *wire_get_string(const uint8_t **pos, size_t length, struct mem_pool *pool) {
+	char *result = mem_pool_alloc(pool, length + 1);
+	memcpy(result, *pos, length);
+	result[length] = '\0';
+	*pos += length;
+	return result;
+}
+
+/*
+ * Reading. The end - pos >= need holds before each field, where need is the fixed
+ * size of the rest of the fields that are always present. So only the strings and
+ * the conditional fields need to be checked.
+ */
+#define WIRE_GET_uint32(NAME) \
+	msg->NAME = wire_get_uint32(&pos); \
+	need -= WIRE_FIXED_uint32;
+#define WIRE_GET_bool(NAME) \
+	msg->NAME = *pos ++; \
+	need -= WIRE_FIXED_bool;
+#define WIRE_GET_char(NAME) \
+	msg->NAME = *pos ++; \
+	need -= WIRE_FIXED_char;
+#define WIRE_GET_string(NAME) \
+	msg->NAME##_length = wire_get_uint32(&pos); \
+	need -= WIRE_FIXED_string; \
+	if ((size_t)(end - pos) - need < msg->NAME##_length) \
+		return false; \
+	msg->NAME = wire_get_string(&pos, msg->NAME##_length, pool);
+// The conditional ones are not counted in need, so they check their own space and don't update it
+#define WIRE_GET_IF_uint32(NAME) \
+	if ((size_t)(end - pos) - need < WIRE_FIXED_uint32) \
+		return false; \
+	msg->NAME = wire_get_uint32(&pos);
+#define WIRE_GET_IF_bool(NAME) \
+	if ((size_t)(end - pos) == need) \
+		return false; \
+	msg->NAME = *pos ++;
+#define WIRE_GET_IF_char(NAME) WIRE_GET_IF_bool(NAME)
+#define WIRE_GET_IF_string(NAME) \
+	if ((size_t)(end - pos) - need < WIRE_FIXED_string) \
+		return false; \
+	msg->NAME##_length = wire_get_uint32(&pos); \
+	if ((size_t)(end - pos) - need < msg->NAME##_length) \
+		return false; \
+	msg->NAME = wire_get_string(&pos, msg->NAME##_length, pool);
+
+// Expansions of the field list for the generated functions
+#define WIRE_GEN_MEMBER(TYPE, NAME) WIRE_MEMBER_##TYPE(NAME)
+#define WIRE_GEN_MEMBER_IF(TYPE, NAME, COND) WIRE_MEMBER_##TYPE(NAME)
+#define WIRE_GEN_FIXED(TYPE, NAME) + WIRE_FIXED_##TYPE
+#define WIRE_GEN_FIXED_IF(TYPE, NAME, COND)
+#define WIRE_GEN_SIZE(TYPE, NAME) size += WIRE_SIZE_##TYPE(NAME);
+#define WIRE_GEN_SIZE_IF(TYPE, NAME, COND) if (COND) size += WIRE_SIZE_##TYPE(NAME);
+#define WIRE_GEN_PUT(TYPE, NAME) WIRE_PUT_##TYPE(NAME)
+#define WIRE_GEN_PUT_IF(TYPE, NAME, COND) if (COND) { WIRE_PUT_##TYPE(NAME) }
+#define WIRE_GEN_GET(TYPE, NAME) WIRE_GET_##TYPE(NAME)
+#define WIRE_GEN_GET_IF(TYPE, NAME, COND) if (COND) { WIRE_GET_IF_##TYPE(NAME) }
+
+#endif
+
+#ifdef WIRE_OPCODE
+#define WIRE_OPCODE_SIZE 1
+#else
+#define WIRE_OPCODE_SIZE 0
+#endif
+
+struct WIRE_NAME(msg) {
+	WIRE_FIELDS(WIRE_GEN_MEMBER, WIRE_GEN_MEMBER_IF)
+};
+
+enum {
+	WIRE_NAME(fixed_size) = WIRE_OPCODE_SIZE WIRE_FIELDS(WIRE_GEN_FIXED, WIRE_GEN_FIXED_IF)
+};
+
+static inline size_t WIRE_NAME(size)(const struct WIRE_NAME(msg) *msg) {
+	(void) msg; // Not used if all the fields have fixed size
+	size_t size = WIRE_OPCODE_SIZE;
+	WIRE_FIELDS(WIRE_GEN_SIZE, WIRE_GEN_SIZE_IF)
+	return size;
+}
+
+static inline void WIRE_NAME(render)(const struct WIRE_NAME(msg) *msg, uint8_t **buffer, size_t *length) {
+	size_t size = WIRE_NAME(size)(msg);
+	sanity(*length >= size, "Not enough space to render %zu bytes long message, only %zu bytes available\n", size, *length);
+	uint8_t *pos = *buffer;
+#ifdef WIRE_OPCODE
+	*pos ++ = WIRE_OPCODE;
+#endif
+	WIRE_FIELDS(WIRE_GEN_PUT, WIRE_GEN_PUT_IF)
+	*buffer = pos;
+	*length -= size;
+}
+
+static inline uint8_t *WIRE_NAME(render_alloc)(const struct WIRE_NAME(msg) *msg, size_t extra_space, size_t *length, struct mem_pool *pool) {
+	*length = WIRE_NAME(size)(msg);
+	uint8_t *result = mem_pool_alloc(pool, *length + extra_space);
+	uint8_t *pos = result;
+	size_t rest = *length;
+	WIRE_NAME(render)(msg, &pos, &rest);
+	return result;
+}
+
+static inline bool WIRE_NAME(parse)(struct WIRE_NAME(msg) *msg, const uint8_t **buffer, size_t *length, struct mem_pool *pool) {
+	const uint8_t *pos = *buffer;
+	const uint8_t *end = pos + *length;
+	// Not used if there are no strings or conditional fields
+	(void) pool;
+	(void) end;
+	size_t need = WIRE_NAME(fixed_size);
+	if (*length < need)
+		return false;
+#ifdef WIRE_OPCODE
+	if (*pos ++ != WIRE_OPCODE)
+		return false;
+	need --;
+#endif
+	WIRE_FIELDS(WIRE_GEN_GET, WIRE_GEN_GET_IF)
+	*length -= pos - *buffer;
+	*buffer = pos;
+	return true;
+}
+
+#undef WIRE_NAME
+#undef WIRE_FIELDS
+#undef WIRE_OPCODE
+#undef WIRE_OPCODE_SIZE
@@ -0,0 +1,58 @@
+/*
+    Ucollect - small utility for real-time analysis of network data
+    Copyright (C) 2015 CZ.NIC, z.s.p.o. (http://www.nic.cz/)
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#ifndef UCOLLECT_DIFF_MESSAGES_H
+#define UCOLLECT_DIFF_MESSAGES_H
+
+/*
+ * The messages for keeping the diff stores in sync with the server. They
+ * are the same in all the plugins using the stores (the plugin may put its
+ * own header in front of them).
+ */
+
+// Ask the server for an update, either a full one or from the old version
+#define WIRE_NAME(X) diff_update_request_##X
+#define WIRE_OPCODE 'U'
+#define WIRE_FIELDS(FIELD, FIELD_IF) \
+	FIELD(bool, full) \
+	FIELD(string, name) \
+	FIELD(uint32, epoch) \
+	FIELD_IF(uint32, old_version, !msg->full) \
+	FIELD(uint32, new_version)
+#include "../../core/wire_message.h"
+
+// The server announces the current version of a store
+#define WIRE_NAME(X) diff_version_##X
+#define WIRE_FIELDS(FIELD, FIELD_IF) \
+	FIELD(string, name) \
+	FIELD(uint32, epoch) \
+	FIELD(uint32, version)
+#include "../../core/wire_message.h"
+
+// The header of an update from the server, the diff itself follows
+#define WIRE_NAME(X) diff_header_##X
+#define WIRE_FIELDS(FIELD, FIELD_IF) \
+	FIELD(string, name) \
+	FIELD(bool, full) \
+	FIELD(uint32, epoch) \
+	FIELD_IF(uint32, from, !msg->full) \
+	FIELD(uint32, to)
+#include "../../core/wire_message.h"
+
+#endif
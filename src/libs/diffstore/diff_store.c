@@ -24,6 +24,8 @@
 #include "../../core/util.h"
 #include "../../core/mem_pool.h"
 
+#include <string.h>
+
 struct trie_data {
 	int dummy; // Just to prevent warning about empty struct
 };
@@ -45,10 +47,7 @@ static enum diff_store_action diff_addr_store_action(struct diff_addr_store *sto
 	sanity(store, "No store to operate on\n");
 	if (epoch == store->epoch && version == store->version)
 		return DIFF_STORE_NO_ACTION; // Nothing changed. Ignore the update.
-	size_t active = store->added - store->deleted;
-	ulog(LLOG_DEBUG, "%zu active, %zu deleted\n", active, store->deleted);
-	if (active * 10 < store->deleted && store->deleted > 100)
-		return DIFF_STORE_CONFIG_RELOAD; // There's too much cruft around. Reload the whole config and force freeing memory by that.
+	ulog(LLOG_DEBUG, "%zu active, %zu deleted\n", store->added - store->deleted, store->deleted);
 	if (epoch != store->epoch)
 		return DIFF_STORE_FULL;
 	*orig_version = store->version;
@@ -76,6 +75,41 @@ static void debug_dump(const uint8_t *key, size_t key_size, struct trie_data *da
 }
 #endif
 
+struct key_node {
+	struct key_node *next;
+	uint8_t *key;
+	size_t key_size;
+};
+
+struct key_list {
+	struct mem_pool *pool;
+	struct key_node *head;
+};
+
+static void key_collect(const uint8_t *key, size_t key_size, struct trie_data *data, void *userdata) {
+	(void)data;
+	struct key_list *list = userdata;
+	struct key_node *node = mem_pool_alloc(list->pool, sizeof *node);
+	*node = (struct key_node) {
+		.next = list->head,
+		.key = mem_pool_alloc(list->pool, key_size),
+		.key_size = key_size
+	};
+	memcpy(node->key, key, key_size);
+	list->head = node;
+}
+
+// Delete all the addresses, so the memory is reused by the trie for the new ones
+static void store_clear(struct mem_pool *tmp_pool, struct diff_addr_store *store) {
+	struct key_list list = {
+		.pool = tmp_pool
+	};
+	// The trie can't be modified during the walk, so collect the keys first
+	trie_walk(store->trie, key_collect, &list, tmp_pool);
+	for (struct key_node *node = list.head; node; node = node->next)
+		trie_delete(store->trie, node->key, node->key_size);
+}
+
 static enum diff_store_action diff_addr_store_apply(struct mem_pool *tmp_pool, struct diff_addr_store *store, bool full, uint32_t epoch, uint32_t from, uint32_t to, const uint8_t *diff, size_t diff_size, uint32_t *orig_version) {
 	sanity(tmp_pool, "Missing temporary pool\n");
 	sanity(store, "No store to operate on\n");
@@ -94,7 +128,7 @@ static enum diff_store_action diff_addr_store_apply(struct mem_pool *tmp_pool, s
 		signal_end = true;
 		if (store->added != store->deleted) {
 			store->deleted = store->added;
-			store->trie = trie_alloc(store->pool);
+			store_clear(tmp_pool, store);
 		}
 	}
 	size_t addr_no = 0;
@@ -103,9 +137,9 @@ static enum diff_store_action diff_addr_store_apply(struct mem_pool *tmp_pool, s
 		ulog(LLOG_DEBUG_VERBOSE, "Address flags: %hhu\n", flags);
 		uint8_t addr_len = flags & size_mask;
 		sanity(addr_len <= diff_size, "Store diff for %s corrupted, need %hhu bytes, have only %zu\n", store->name, addr_len, diff_size);
-		struct trie_data **data = trie_index(store->trie, diff, addr_len);
 		bool add = flags & add_mask;
 		if (add) {
+			struct trie_data **data = trie_index(store->trie, diff, addr_len);
 			if (*data) {
 				ulog(LLOG_WARN, "Asked to add an address %s (#%zu) of size %hhu to store %s, but that already exists\n", mem_pool_hex(tmp_pool, diff, addr_len), addr_no, addr_len, store->name);
 			} else {
@@ -115,10 +149,10 @@ static enum diff_store_action diff_addr_store_apply(struct mem_pool *tmp_pool, s
 				store->added ++;
 			}
 		} else {
-			if (*data) {
+			if (trie_lookup(store->trie, diff, addr_len)) {
 				if (store->remove_hook)
 					store->remove_hook(store, diff, addr_len);
-				*data = NULL;
+				trie_delete(store->trie, diff, addr_len);
 				store->deleted ++;
 			} else {
 				ulog(LLOG_WARN, "Asked to delete an address %s (#%zu) of size %hhu from store %s, but that is not there\n", mem_pool_hex(tmp_pool, diff, addr_len), addr_no, addr_len, store->name);
@@ -156,7 +190,11 @@ static void diff_addr_store_cp(struct diff_addr_store *target, const struct diff
 	trie_walk(source->trie, das_cp, target, tmp_pool);
 }
 
+#ifdef STATIC
+struct pluglib *pluglib_info_diffstore(void) {
+#else
 struct pluglib *pluglib_info(void) {
+#endif
 	static struct pluglib_export *exports[] = {
 		&diff_addr_store_init_export,
 		&diff_addr_store_action_export,
@@ -44,7 +44,7 @@ struct diff_addr_store {
 	struct trie *trie;
 	struct mem_pool *pool;
 	uint32_t epoch, version;
-	size_t added, deleted; // Statistics, to know when to re-requested the whole filter config
+	size_t added, deleted; // Statistics of the changes
 	/* The following 5 members - 4 hooks and userdata - may be filled directly by the user.
 	 * The hooks would be called at appropriate moments. All of them happen before the update
 	 * in the data structures. It is legal not to fill the hooks in (or set them as NULL),
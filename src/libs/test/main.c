@@ -26,7 +26,11 @@ void hello_world(void) {
 	ulog(LLOG_WARN, "Hello new world!\n");
 }
 
+#ifdef STATIC
+struct pluglib *pluglib_info_test(void) {
+#else
 struct pluglib *pluglib_info(void) {
+#endif
 	static struct pluglib_export *exports[] = {
 		&hello_world_export,
 		NULL
@@ -34,6 +34,10 @@ import timers
 logger = logging.getLogger(name='client')
 sysrand = random.SystemRandom()
 challenge_len = 128 # 128 bits of random should be enough for log-in to protect against replay attacks
+session_token_len = 128 # The same for the session tokens, they replace the log-in
+session_lifetime = 300 # How long a session may be resumed after the last refresh of its token (in seconds)
+session_held_max = 1000 # The most messages held for a client that may resume its session
+sessions = {} # The connections by the tokens of their sessions, both the live and the held ones
 
 with database.transaction() as t:
 	# As we just started, there's no plugin active anywhere.
@@ -68,8 +72,12 @@ class ClientConn(twisted.protocols.basic.Int32StringReceiver):
 			'Sniff': 1
 		}
 		self.__plugin_versions = {}
+		self.__traffic = {}
 		self.last_pong = time.time()
 		self.session_id = None
+		self.__session_token = None
+		self.__session_expire = None
+		self.__held_messages = None # The messages to send once the held session is resumed
 
 	def has_plugin(self, plugin_name):
 		return plugin_name in self.__available_plugins
@@ -87,6 +95,95 @@ class ClientConn(twisted.protocols.basic.Int32StringReceiver):
 			self.transport.abortConnection()
 		self.__pings_outstanding += 1
 		self.sendString('P')
+		if self.__session_token is not None:
+			# Keep the token valid as long as the connection lives
+			self.__session_issue()
+
+	def __start_pinger(self):
+		self.__pinger = timers.timer(self.__ping, 45 if self.cid() in self.__fastpings else 120, False)
+
+	def sendString(self, string):
+		if self.__held_messages is not None:
+			# The connection is gone, the client gets it if it resumes the session
+			if len(self.__held_messages) >= session_held_max:
+				logger.warn("Too many messages held for %s, dropping its session", self.cid())
+				self.session_drop()
+				return
+			self.__held_messages.append(string)
+		else:
+			twisted.protocols.basic.Int32StringReceiver.sendString(self, string)
+
+	def __session_issue(self):
+		"""
+		Give the client a token (or refresh the lifetime of the one it has), so it can
+		resume the session after a short loss of the connection. It then skips the
+		log-in and the resync of the plugins.
+		"""
+		if self.__session_token is None:
+			self.__session_token = ''
+			for i in range(0, session_token_len / 8):
+				self.__session_token += chr(sysrand.getrandbits(8))
+			sessions[self.__session_token] = self
+		self.__session_expire = time.time() + session_lifetime
+		self.sendString('TI' + format_string(self.__session_token) + struct.pack('!I', session_lifetime))
+
+	def __session_resume(self, old):
+		"""
+		Take over the session of the old connection. The client and the plugins
+		keep their state, only the messages held meanwhile are sent.
+		"""
+		(self.__cid, self.__proto_version, self.__available_plugins, self.__plugin_versions, self.__traffic, self.session_id, messages) = old.session_take()
+		self.__authenticated = True
+		self.__logged_in = True
+		self.__plugins.resume_client(self)
+		plugin_versions.add_client(self)
+		self.sendString('TR')
+		for message in messages:
+			self.sendString(message)
+		# The client forgets these with the connection, ask again
+		self.sendString('D')
+		self.sendString('U')
+		self.__session_issue()
+		self.__start_pinger()
+		logger.info('Client %s resumed its session', self.cid())
+		# The allowed plugins might have changed meanwhile
+		self.recheck_versions()
+
+	def session_held(self):
+		"""
+		Is the connection gone, with the session waiting to be resumed?
+		"""
+		return self.__held_messages is not None
+
+	def session_take(self):
+		"""
+		A new connection resumes the session. Hand over the state, without logging out.
+		"""
+		if self.__connected:
+			# The client noticed the connection is dead sooner than we did
+			logger.info('Client %s resumes its session on a new connection, dropping the old one', self.cid())
+			self.__connected = False
+			self.__pinger.stop()
+			self.transport.abortConnection()
+		else:
+			self.__expire_call.cancel()
+		del sessions[self.__session_token]
+		messages = self.__held_messages or []
+		self.__held_messages = None
+		self.__logged_in = False
+		return (self.__cid, self.__proto_version, self.__available_plugins, self.__plugin_versions, self.__traffic, self.session_id, messages)
+
+	def session_drop(self):
+		"""
+		Give up the held session (the client logged in anew or too much waits for
+		it). The plugins of the client get deactivated.
+		"""
+		self.__expire_call.cancel()
+		self.__logout()
+
+	def __session_expired(self):
+		logger.info("Session of %s expired without being resumed", self.cid())
+		self.__logout()
 
 	def connectionMade(self):
 		# Send challenge for login.
@@ -104,16 +201,30 @@ class ClientConn(twisted.protocols.basic.Int32StringReceiver):
 		if self.__logged_in:
 			logger.info("Connection lost from %s", self.cid())
 			self.__pinger.stop()
-			self.__plugins.unregister_client(self)
-			now = database.now()
-			def log_plugins(transaction):
-				logger.debug("Dropping plugin list of %s", self.cid())
-				transaction.execute("INSERT INTO plugin_history (client, name, timestamp, active) SELECT ap.client, ap.name, %s, false FROM active_plugins AS ap JOIN clients ON ap.client = clients.id WHERE clients.name = %s", (now, self.cid()))
-				transaction.execute('DELETE FROM active_plugins WHERE client IN (SELECT id FROM clients WHERE name = %s)', (self.cid(),))
-				return True
-			activity.push(log_plugins)
-			activity.log_activity(self.cid(), "logout")
-			self.transport.abortConnection()
+			if self.__session_token is not None and reason is not None and self.__session_expire > time.time():
+				# The client may come back soon. Keep the plugins active, until the token expires.
+				logger.debug("Holding session of %s for %s seconds", self.cid(), int(self.__session_expire - time.time()))
+				self.__held_messages = []
+				self.__expire_call = reactor.callLater(self.__session_expire - time.time(), self.__session_expired)
+				self.transport.abortConnection()
+				return
+			self.__logout()
+
+	def __logout(self):
+		self.__held_messages = None
+		if self.__session_token is not None:
+			del sessions[self.__session_token]
+			self.__session_token = None
+		self.__plugins.unregister_client(self)
+		now = database.now()
+		def log_plugins(transaction):
+			logger.debug("Dropping plugin list of %s", self.cid())
+			transaction.execute("INSERT INTO plugin_history (client, name, timestamp, active) SELECT ap.client, ap.name, %s, false FROM active_plugins AS ap JOIN clients ON ap.client = clients.id WHERE clients.name = %s", (now, self.cid()))
+			transaction.execute('DELETE FROM active_plugins WHERE client IN (SELECT id FROM clients WHERE name = %s)', (self.cid(),))
+			return True
+		activity.push(log_plugins)
+		activity.log_activity(self.cid(), "logout")
+		self.transport.abortConnection()
 
 	def __check_logged(self):
 		if self.__connected and not self.__logged_in:
@@ -181,8 +292,16 @@ class ClientConn(twisted.protocols.basic.Int32StringReceiver):
 						else:
 							# Please tell me when there're changes to the allowed plugins
 							plugin_versions.add_client(self)
+						if self.__proto_version >= 2:
+							# We take the messages the client spooled while disconnected
+							self.sendString('D')
+						if self.__proto_version >= 3:
+							# Tell us what the messages of the plugins cost
+							self.sendString('U')
+							# And take a token to resume the session after a short loss of the connection
+							self.__session_issue()
 						self.__logged_in = True
-						self.__pinger = timers.timer(self.__ping, 45 if self.cid() in self.__fastpings else 120, False)
+						self.__start_pinger()
 						activity.log_activity(self.cid(), "login")
 						logger.info('Client %s logged in', self.cid())
 					else:
@@ -190,6 +309,18 @@ class ClientConn(twisted.protocols.basic.Int32StringReceiver):
 				else:
 					login_failure('Asked for session before loging in')
 					return
+			elif msg == 'T':
+				# The client resumes its session instead of logging in
+				if params[:1] != 'R' or len(params) < 5:
+					login_failure('Protocol violation')
+					return
+				(token, params) = extract_string(params[1:])
+				old = sessions.get(token)
+				if old is None or params != '':
+					logger.info("Client %s can't resume its session, it has to log in", self.cid())
+					self.sendString('TN')
+					return
+				self.__session_resume(old)
 			elif msg == 'S':
 				if len(params) != 4:
 					logger.warn("Wrong session ID length on client %s: %s", self.cid(), len(params))
@@ -205,6 +336,13 @@ class ClientConn(twisted.protocols.basic.Int32StringReceiver):
 			(plugin, data) = extract_string(params)
 			self.__plugins.route_to_plugin(plugin, data, self.cid())
 			# TODO: Handle the possibility the plugin doesn't exist somehow (#2705)
+		elif msg == 'D': # Data to a plugin, spooled by the client while disconnected
+			(seq, age) = struct.unpack('!II', params[:8])
+			(plugin, data) = extract_string(params[8:])
+			logger.debug("Spooled message %s for %s from %s, %s seconds old", seq, plugin, self.cid(), age)
+			self.__plugins.route_to_plugin(plugin, data, self.cid())
+			# Confirm it, so the client can drop it from the spool
+			self.sendString('D' + struct.pack('!I', seq))
 		elif msg == 'V': # New list of versions of the client
 			if self.__proto_version == 0:
 				self.__available_plugins = {}
@@ -215,9 +353,30 @@ class ClientConn(twisted.protocols.basic.Int32StringReceiver):
 					params = params[2:]
 			else:
 				self.__handle_versions(params)
+		elif msg == 'U': # Report of the traffic of the client
+			self.__handle_traffic(params)
 		else:
 			logger.warn("Unknown message from client %s: %s", self.cid(), msg)
 
+	def __handle_traffic(self, params):
+		"""
+		Log what the messages of each plugin and each type cost since the last
+		report. The client sends the totals, wrapping around at 32 bits.
+		"""
+		(count,) = struct.unpack('!I', params[:4])
+		params = params[4:]
+		report = {}
+		for i in range(0, count):
+			kind = params[0]
+			(name, params) = extract_string(params[1:])
+			report[(kind, name)] = struct.unpack('!IIIIII', params[:24])
+			params = params[24:]
+		for ((kind, name), values) in report.items():
+			old = self.__traffic.get((kind, name), (0,) * 6)
+			(messages, raw, compressed, compress_time, wait_time, offline) = [(new - prev) & 0xFFFFFFFF for (new, prev) in zip(values, old)]
+			logger.info("Traffic of %s %s on %s: %s messages of %s bytes compressed to %s in %s us, waited %s ms, %s dropped offline", 'plugin' if kind == 'P' else 'type', name, self.cid(), messages, raw, compressed, compress_time, wait_time, offline)
+		self.__traffic = report
+
 	def __handle_versions(self, params):
 		"""
 		Parse the client's message about the plugins it knows.
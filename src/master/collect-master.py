@@ -90,6 +90,8 @@ class Socat(protocol.ProcessProtocol):
 #logging.debug('Starting proxy with: %s', args)
 #reactor.spawnProcess(Socat(), './soxy/soxy', args=args, env=os.environ)
 args = ['./soxy/soxy', master_config.get('cert'), master_config.get('key'), master_config.get('ca'), str(master_config.getint('port_compression')), os.getcwd() + '/collect-master.sock', 'compress']
+if master_config.get('compression_dict'):
+	args.append(master_config.get('compression_dict'))
 logging.debug('Starting proxy with: %s', args)
 reactor.spawnProcess(Socat(), './soxy/soxy', args=args, env=os.environ)
 
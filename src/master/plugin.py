@@ -168,7 +168,10 @@ class Plugins:
 		When a client connects.
 		"""
 		if client.cid() in self.__clients:
-			if self.__clients[client.cid()].last_pong + 900 < time.time():
+			if self.__clients[client.cid()].session_held():
+				logger.info('Client %s logged in instead of resuming its session, dropping the session', client.cid())
+				self.__clients[client.cid()].session_drop()
+			elif self.__clients[client.cid()].last_pong + 900 < time.time():
 				# The client seems connected, but it didn't pong for really long time, kill it
 				logger.warn('Stray connection from %s, dropping old connection', client.cid())
 			elif client.session_id is not None and self.__clients[client.cid()].session_id == client.session_id:
@@ -180,6 +183,13 @@ class Plugins:
 		self.__clients[client.cid()] = client
 		return True
 
+	def resume_client(self, client):
+		"""
+		When a client resumes its session on a new connection. It takes
+		the place of the old one, the plugins stay active.
+		"""
+		self.__clients[client.cid()] = client
+
 	def unregister_client(self, client):
 		"""
 		When a client disconnects.
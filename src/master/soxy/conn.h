@@ -26,17 +26,32 @@
 #include <QSslConfiguration>
 #include <QTimer>
 #include <zlib.h>
+#include <zstd.h>
 
 static const int COMPRESSION_LEVEL = 9;
+static const int ZSTD_COMPRESSION_LEVEL = 3;
+// Must match UPLINK_ZSTD_WINDOW_LOG of the client, it limits the memory of the decompression
+static const int ZSTD_WINDOW_LOG = 17;
 static const unsigned int COMPRESSION_BUFFSIZE = 4096;
+// The offer of compression is tiny, anything bigger is broken
+static const unsigned int MAX_OFFER_SIZE = 1024;
 
 class Connection : public QObject {
 	Q_OBJECT
 public:
 	static bool enableCompression;
+	// Provided to the clients that want zstd with dictionary, empty if none
+	static QByteArray dictionary;
+	static quint32 dictionaryId;
 	Connection(int socket, QSslConfiguration &config);
 	~Connection();
 private:
+	// The letters used in the protocol
+	enum Codec {
+		CodecZlib = 'z',
+		CodecZstd = 's',
+		CodecZstdDict = 'd'
+	};
 	QSslSocket remote;
 	QLocalSocket local;
 	QTimer timer;
@@ -45,8 +60,22 @@ private:
 	unsigned char decompressOutBuffer[COMPRESSION_BUFFSIZE];
 	z_stream zStreamCompress;
 	z_stream zStreamDecompress;
+	ZSTD_CCtx *zstdCompress;
+	ZSTD_DCtx *zstdDecompress;
+	Codec compressCodec, decompressCodec;
+	// The client ends its zlib stream after the negotiation, then the decompression switches to this one
+	Codec nextDecompress;
+	bool switchPending;
+	// Still looking at the first message from the client, it may be the offer of compression
+	bool negotiating;
+	QByteArray firstMessage;
 	bool inReady, outReady;
 	void touch();
+	bool compress(const char *data, size_t size, bool end);
+	bool decompressStep(const unsigned char *&input, size_t &avail, size_t &produced, bool &ended);
+	bool switchDecompression();
+	bool received(const char *data, size_t size);
+	bool negotiate(const QByteArray &offer);
 private slots:
 	void incoming();
 	void error(QAbstractSocket::SocketError);
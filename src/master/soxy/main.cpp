@@ -23,6 +23,7 @@
 #include <QSslKey>
 #include <QFile>
 #include <QStringList>
+#include <QtEndian>
 #include <cstdio>
 #include <sys/types.h>
 #include <sys/socket.h>
@@ -36,6 +37,8 @@
 #include "conn.h"
 
 bool Connection::enableCompression = false;
+QByteArray Connection::dictionary;
+quint32 Connection::dictionaryId = 0;
 
 Receiver::Receiver() {
 	QFile certFile(QCoreApplication::arguments()[1]);
@@ -77,6 +80,13 @@ void Handler::putFd(int fd) {
 QList<Handler *> handlers;
 
 Connection::Connection(int sock, QSslConfiguration &config) :
+	zstdCompress(NULL),
+	zstdDecompress(NULL),
+	compressCodec(CodecZlib),
+	decompressCodec(CodecZlib),
+	nextDecompress(CodecZlib),
+	switchPending(false),
+	negotiating(Connection::enableCompression),
 	inReady(false),
 	outReady(false)
 {
@@ -120,9 +130,181 @@ Connection::Connection(int sock, QSslConfiguration &config) :
 
 Connection::~Connection() {
 	if (Connection::enableCompression) {
+		if (compressCodec == CodecZlib)
+			deflateEnd(&zStreamCompress);
+		if (decompressCodec == CodecZlib)
+			inflateEnd(&zStreamDecompress);
+	}
+	// Freeing NULL is fine
+	ZSTD_freeCCtx(zstdCompress);
+	ZSTD_freeDCtx(zstdDecompress);
+}
+
+// Compress the data into the output buffer, flushed so the client can read all of it. The end finishes the stream.
+bool Connection::compress(const char *data, size_t size, bool end) {
+	if (compressCodec == CodecZlib) {
+		zStreamCompress.next_in = (unsigned char *)data;
+		zStreamCompress.avail_in = size;
+		do {
+			zStreamCompress.next_out = compressOutBuffer;
+			zStreamCompress.avail_out = COMPRESSION_BUFFSIZE;
+			deflate(&zStreamCompress, end ? Z_FINISH : Z_SYNC_FLUSH);
+			outBuf.append((char *)compressOutBuffer, COMPRESSION_BUFFSIZE - zStreamCompress.avail_out);
+			// A full output buffer means there may be more to flush
+		} while (zStreamCompress.avail_in > 0 || zStreamCompress.avail_out == 0);
+	} else {
+		ZSTD_inBuffer in = { data, size, 0 };
+		size_t remaining;
+		do {
+			ZSTD_outBuffer out = { compressOutBuffer, COMPRESSION_BUFFSIZE, 0 };
+			remaining = ZSTD_compressStream2(zstdCompress, &out, &in, end ? ZSTD_e_end : ZSTD_e_flush);
+			if (ZSTD_isError(remaining)) {
+				error("Zstd compression failed");
+				return false;
+			}
+			outBuf.append((char *)compressOutBuffer, out.pos);
+		} while (in.pos < in.size || remaining);
+	}
+	return true;
+}
+
+// Decompress a piece of the input into decompressOutBuffer. Ended is set if the compressed stream is over.
+bool Connection::decompressStep(const unsigned char *&input, size_t &avail, size_t &produced, bool &ended) {
+	if (decompressCodec == CodecZlib) {
+		zStreamDecompress.next_in = (unsigned char *)input;
+		zStreamDecompress.avail_in = avail;
+		zStreamDecompress.next_out = decompressOutBuffer;
+		zStreamDecompress.avail_out = COMPRESSION_BUFFSIZE;
+		int ret = inflate(&zStreamDecompress, Z_SYNC_FLUSH);
+		if (ret != Z_OK && ret != Z_STREAM_END && ret != Z_BUF_ERROR)
+			return false;
+		input = zStreamDecompress.next_in;
+		avail = zStreamDecompress.avail_in;
+		produced = COMPRESSION_BUFFSIZE - zStreamDecompress.avail_out;
+		ended = ret == Z_STREAM_END;
+	} else {
+		ZSTD_inBuffer in = { input, avail, 0 };
+		ZSTD_outBuffer out = { decompressOutBuffer, COMPRESSION_BUFFSIZE, 0 };
+		size_t ret = ZSTD_decompressStream(zstdDecompress, &out, &in);
+		if (ZSTD_isError(ret))
+			return false;
+		input += in.pos;
+		avail -= in.pos;
+		produced = out.pos;
+		// The client never ends the zstd frame
+		ended = ret == 0;
+	}
+	return true;
+}
+
+// The zlib stream from the client ended after the negotiation, continue with the chosen compression
+bool Connection::switchDecompression() {
+	inflateEnd(&zStreamDecompress);
+	decompressCodec = nextDecompress;
+	switchPending = false;
+	zstdDecompress = ZSTD_createDCtx();
+	if (!zstdDecompress || ZSTD_isError(ZSTD_DCtx_setParameter(zstdDecompress, ZSTD_d_windowLogMax, ZSTD_WINDOW_LOG)) || (decompressCodec == CodecZstdDict && ZSTD_isError(ZSTD_DCtx_loadDictionary(zstdDecompress, dictionary.constData(), dictionary.size())))) {
+		error("Could not initialize zstd (decompression stream)");
+		return false;
+	}
+	return true;
+}
+
+/*
+ * Pass the decompressed data to the master. But the first message from
+ * the client may be the offer of compression, which is handled here
+ * (the master doesn't know about the compression at all).
+ */
+bool Connection::received(const char *data, size_t size) {
+	if (!negotiating) {
+		inBuf.append(data, size);
+		return true;
+	}
+	firstMessage.append(data, size);
+	if (firstMessage.size() < 5)
+		return true; // Need the length and the type
+	quint32 len = qFromBigEndian<quint32>((const uchar *)firstMessage.constData());
+	if (firstMessage[4] != 'Z') {
+		// Not negotiating, just a client using zlib
+		negotiating = false;
+		inBuf += firstMessage;
+		firstMessage.clear();
+		return true;
+	}
+	if (len > MAX_OFFER_SIZE) {
+		error("Compression offer too large");
+		return false;
+	}
+	if ((quint32)firstMessage.size() < 4 + len)
+		return true; // Wait for the rest
+	negotiating = false;
+	QByteArray offer = firstMessage.mid(5, len - 1);
+	inBuf += firstMessage.mid(4 + len);
+	firstMessage.clear();
+	return negotiate(offer);
+}
+
+/*
+ * Choose the first offered compression we support and answer it. Our zlib
+ * stream ends after the answer (unless zlib is chosen) and the other
+ * compression starts. The client does the same once it reads the answer.
+ */
+bool Connection::negotiate(const QByteArray &offer) {
+	Codec chosen = CodecZlib;
+	bool found = false;
+	quint32 clientDictionary = 0;
+	for (int i = 0; i < offer.size();) {
+		char codec = offer[i ++];
+		if (codec == CodecZstdDict) {
+			if (i + 4 > offer.size()) {
+				error("Broken compression offer");
+				return false;
+			}
+			clientDictionary = qFromBigEndian<quint32>((const uchar *)offer.constData() + i);
+			i += 4;
+		} else if (codec != CodecZstd && codec != CodecZlib)
+			break; // Unknown, we don't know its parameters to skip them
+		if (!found && (codec != CodecZstdDict || !dictionary.isEmpty())) {
+			chosen = Codec(codec);
+			found = true;
+		}
+	}
+	QByteArray answer;
+	answer.append('Z');
+	answer.append(char(chosen));
+	if (chosen == CodecZstdDict) {
+		// Don't send the dictionary if the client has it from the last time
+		QByteArray sent = clientDictionary == dictionaryId ? QByteArray() : dictionary;
+		uchar number[4];
+		qToBigEndian<quint32>(dictionaryId, number);
+		answer.append((const char *)number, sizeof number);
+		qToBigEndian<quint32>(sent.size(), number);
+		answer.append((const char *)number, sizeof number);
+		answer += sent;
+	}
+	uchar length[4];
+	qToBigEndian<quint32>(answer.size(), length);
+	answer.prepend((const char *)length, sizeof length);
+	if (!compress(answer.constData(), answer.size(), false))
+		return false;
+	if (chosen != CodecZlib) {
+		if (!compress(NULL, 0, true))
+			return false;
 		deflateEnd(&zStreamCompress);
-		inflateEnd(&zStreamDecompress);
+		compressCodec = chosen;
+		zstdCompress = ZSTD_createCCtx();
+		if (!zstdCompress ||
+				ZSTD_isError(ZSTD_CCtx_setParameter(zstdCompress, ZSTD_c_compressionLevel, ZSTD_COMPRESSION_LEVEL)) ||
+				ZSTD_isError(ZSTD_CCtx_setParameter(zstdCompress, ZSTD_c_windowLog, ZSTD_WINDOW_LOG)) ||
+				(chosen == CodecZstdDict && ZSTD_isError(ZSTD_CCtx_loadDictionary(zstdCompress, dictionary.constData(), dictionary.size())))) {
+			error("Could not initialize zstd (compression stream)");
+			return false;
+		}
+		nextDecompress = chosen;
+		switchPending = true;
 	}
+	tryWriteRemote();
+	return true;
 }
 
 void Connection::incoming() {
@@ -130,23 +312,26 @@ void Connection::incoming() {
 	if (ar.isEmpty())
 		return;
 	if (Connection::enableCompression) {
-		unsigned int available_output;
-		unsigned char *input_data = (unsigned char *)ar.data();
-		zStreamDecompress.next_in = input_data;
-		zStreamDecompress.avail_in = ar.size();
-
-		while (zStreamDecompress.avail_in > 0) {
-			zStreamDecompress.next_out = decompressOutBuffer;
-			zStreamDecompress.avail_out = COMPRESSION_BUFFSIZE;
-			int ret = inflate(&zStreamDecompress, Z_SYNC_FLUSH);
-			if (ret == Z_DATA_ERROR) {
-				deleteLater();
+		const unsigned char *input = (const unsigned char *)ar.constData();
+		size_t avail = ar.size();
+		while (avail > 0) {
+			size_t produced;
+			bool ended;
+			if (!decompressStep(input, avail, produced, ended)) {
+				error("Corrupted compressed data");
 				return;
 			}
-			available_output = COMPRESSION_BUFFSIZE - zStreamDecompress.avail_out;
-			if (available_output == 0)
+			if (produced && !received((const char *)decompressOutBuffer, produced))
 				return;
-			inBuf.append((char *)decompressOutBuffer, available_output);
+			if (ended) {
+				if (!switchPending) {
+					error("Compressed stream ended unexpectedly");
+					return;
+				}
+				if (!switchDecompression())
+					return;
+			} else if (!produced)
+				break; // All in the decompression state already
 		}
 	} else {
 		inBuf += ar;
@@ -200,20 +385,8 @@ void Connection::outgoing() {
 	if (ar.isEmpty())
 		return;
 	if (Connection::enableCompression) {
-		unsigned int available_output;
-		unsigned char *input_data = (unsigned char *)ar.data();
-		zStreamCompress.next_in = input_data;
-		zStreamCompress.avail_in = ar.size();
-
-		while (zStreamCompress.avail_in > 0) {
-			zStreamCompress.next_out = compressOutBuffer;
-			zStreamCompress.avail_out = COMPRESSION_BUFFSIZE;
-			deflate(&zStreamCompress, Z_SYNC_FLUSH);
-			available_output = COMPRESSION_BUFFSIZE - zStreamCompress.avail_out;
-			if (available_output == 0)
-				return;
-			outBuf.append((char *)compressOutBuffer, available_output);
-		}
+		if (!compress(ar.constData(), ar.size(), false))
+			return;
 	} else {
 		outBuf += ar;
 	}
@@ -331,9 +504,20 @@ int main(int argc, char *argv[]) {
 	addr.sin6_port = htons(QCoreApplication::arguments()[4].toInt());
 	c(bind(sock, static_cast<sockaddr *>(static_cast<void *>(&addr)), sizeof addr), "bind");
 	c(listen(sock, 50), "listen");
-	if (QCoreApplication::arguments().count() == 7 && QCoreApplication::arguments().at(6) == "compress") {
+	if (QCoreApplication::arguments().count() >= 7 && QCoreApplication::arguments().at(6) == "compress") {
 		Connection::enableCompression = true;
 	}
+	if (Connection::enableCompression && QCoreApplication::arguments().count() == 8) {
+		// The dictionary for zstd, trained on the plugin traffic
+		QFile dictFile(QCoreApplication::arguments()[7]);
+		if (!dictFile.open(QIODevice::ReadOnly)) {
+			fprintf(stderr, "Can't read dictionary %s\n", argv[7]);
+			abort();
+		}
+		Connection::dictionary = dictFile.readAll();
+		// Identifies the dictionary, so the clients that have it don't get it again
+		Connection::dictionaryId = crc32(0, (const Bytef *)Connection::dictionary.constData(), Connection::dictionary.size());
+	}
 	for (int *sig = sigs; *sig; sig ++) {
 		struct sigaction action;
 		memset(&action, 0, sizeof action);
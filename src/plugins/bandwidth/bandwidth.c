@@ -151,7 +151,7 @@ void update_buckets(struct context *context, uint64_t in, uint64_t out, uint64_t
 	}
 }
 
-void packet_handle(struct context *context, const struct packet_info *info) {
+static void packet_handle(struct context *context, const struct packet_info *info) {
 	struct user_data *d = context->user_data;
 	uint64_t packet_timestamp = loop_now(context->loop);
 
@@ -211,9 +211,9 @@ void packet_handle(struct context *context, const struct packet_info *info) {
 		// Just find the right frame and store the value
 		size_t corresponding_frame = (cwindow->current_frame + ((packet_timestamp - cwindow->timestamp) / cwindow->len)) % cwindow->cnt;
 		if (info->direction == DIR_IN) {
-			cwindow->frames[corresponding_frame].in_sum += info->length;
+			cwindow->frames[corresponding_frame].in_sum += info->wire_length;
 		} else {
-			cwindow->frames[corresponding_frame].out_sum += info->length;
+			cwindow->frames[corresponding_frame].out_sum += info->wire_length;
 		}
 	}
 }
@@ -401,7 +401,7 @@ void dbg_dump(struct context *context, void *data, size_t id) {
 	context->user_data->dbg_dump_timeout = loop_timeout_add(context->loop, DBG_DUMP_INTERVAL, context, NULL, dbg_dump);
 }
 
-void init(struct context *context) {
+static void init(struct context *context) {
 	context->user_data = mem_pool_alloc(context->permanent_pool, sizeof *context->user_data);
 
 	// User data initialization
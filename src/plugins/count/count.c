@@ -137,7 +137,7 @@ static void packet_handle_internal(struct context *context, const struct packet_
 }
 
 static void packet_handle(struct context *context, const struct packet_info *info) {
-	packet_handle_internal(context, info, info->length, false);
+	packet_handle_internal(context, info, info->wire_length, false);
 }
 
 static void initialize(struct context *context) {
@@ -52,7 +52,11 @@ static void data_crash(struct context *context_unused, const uint8_t *data_unuse
 	abort();
 }
 
+#ifdef STATIC
+struct plugin *plugin_info_crash(void) {
+#else
 struct plugin *plugin_info(void) {
+#endif
 	static struct plugin plugin = {
 		.name = "Crash",
 		.uplink_data_callback = data_crash,
@@ -233,7 +233,7 @@ static char *addr2str(struct mem_pool *pool, struct sockaddr *addr, socklen_t ad
 }
 
 static bool log_send(struct context *context, bool force) {
-	if (!force && !uplink_connected(context->uplink))
+	if (!force && !uplink_connected(context->uplink) && !uplink_spooling(context->uplink))
 		return false;
 	struct user_data *u = context->user_data;
 	size_t msg_size;
@@ -22,8 +22,8 @@
 
 #include <stdbool.h>
 
-struct context *context;
-struct fd_tag *tag;
+struct context;
+struct fd_tag;
 
 /*
  * Report that the connection was closed by either side.
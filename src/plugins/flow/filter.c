@@ -23,6 +23,7 @@
 #include "../../libs/diffstore/diff_store.h"
 
 #include "../../core/trie.h"
+#include "../../core/trie_frozen.h"
 #include "../../core/mem_pool.h"
 #include "../../core/util.h"
 #include "../../core/packet.h"
@@ -45,7 +46,7 @@ struct filter {
 	filter_fun function;
 	size_t sub_count;
 	struct filter *subfilters;
-	struct trie *trie;
+	struct trie_frozen *values; // The matched values, read-only once parsed
 	const struct filter_type *type;
 	// Info for differential plugins
 	struct diff_addr_store *diff_addr_store;
@@ -116,7 +117,7 @@ static bool filter_value_match(struct mem_pool *tmp_pool, const struct filter *f
 			return false;
 	}
 	// Look if this one is one of the matched
-	return trie_lookup(filter->trie, data, size);
+	return trie_frozen_lookup(filter->values, data, size);
 }
 
 static bool filter_differential(struct mem_pool *tmp_pool, const struct filter *filter, const struct packet_info *packet) {
@@ -195,17 +196,18 @@ static void parse_ip_match(struct mem_pool *pool, struct filter *dest, const str
 	(*desc) += sizeof ip_count;
 	(*size) -= sizeof ip_count;
 	ip_count = ntohl(ip_count);
-	dest->trie = trie_alloc(pool);
+	struct trie *trie = trie_alloc(pool);
 	for (size_t i = 0; i < ip_count; i ++) {
 		sanity(*size, "Short data for IP address size in %c filter at IP #%zu\n", type->code, i);
 		uint8_t ip_size = **desc;
 		(*desc) ++;
 		(*size) --;
 		sanity(*size >= ip_size, "Short data for IP address in %c filter at IP %zu (available %zu, need %hhu)\n", type->code, i, *size, ip_size);
-		*trie_index(dest->trie, *desc, ip_size) = &mark;
+		*trie_index(trie, *desc, ip_size) = &mark;
 		(*desc) += ip_size;
 		(*size) -= ip_size;
 	}
+	dest->values = trie_freeze(trie, pool);
 }
 
 static void parse_port_match(struct mem_pool *pool, struct filter *dest, const struct filter_type *type, const uint8_t **desc, size_t *size) {
@@ -215,15 +217,16 @@ static void parse_port_match(struct mem_pool *pool, struct filter *dest, const s
 	(*desc) += sizeof port_count;
 	(*size) -= sizeof port_count;
 	port_count = ntohs(port_count);
-	dest->trie = trie_alloc(pool);
+	struct trie *trie = trie_alloc(pool);
 	for (size_t i = 0; i < port_count; i ++) {
 		uint16_t port;
 		sanity(*size >= sizeof port, "Short data for port in %c filter at port #%zu, only %zu available\n", type->code, i, *size);
 		memcpy(&port, *desc, sizeof port);
 		(*desc) += sizeof port;
 		(*size) -= sizeof port;
-		*trie_index(dest->trie, (const uint8_t *)&port, sizeof port) = &mark;
+		*trie_index(trie, (const uint8_t *)&port, sizeof port) = &mark;
 	}
+	dest->values = trie_freeze(trie, pool);
 }
 
 static void parse_differential(struct mem_pool *pool, struct filter *dest, const struct filter_type *type, const uint8_t **desc, size_t *size) {
@@ -22,6 +22,7 @@
 
 #define PLUGLIB_DO_IMPORT PLUGLIB_PUBLIC
 #include "../../libs/diffstore/diff_store.h"
+#include "../../libs/diffstore/diff_messages.h"
 
 #include "../../core/plugin.h"
 #include "../../core/context.h"
@@ -54,65 +55,41 @@ struct user_data {
 	bool timeout_missed;
 };
 
-struct flush_data {
-	size_t size;
-	size_t i;
-	size_t *sizes;
-	size_t pos;
-	uint32_t min_packets;
-	uint8_t *output;
-};
-
-static void get_size(const uint8_t *key, size_t key_size, struct trie_data *flow, void *userdata) {
-	struct flush_data *data = userdata;
-	(void)key;
-	(void)key_size;
-	if (flow && flow->flow.count[0] + flow->flow.count[1] >= data->min_packets) {
-		data->size += data->sizes[data->i ++] = flow_size(&flow->flow);
-	} else {
-		// Empty flow, created when the limit is reached.
-		data->sizes[data->i ++] = 0;
-	}
-}
-
-static void format_flow(const uint8_t *key, size_t key_size, struct trie_data *flow, void *userdata) {
-	struct flush_data *data = userdata;
-	(void)key;
-	(void)key_size;
-	if (flow && flow->flow.count[0] + flow->flow.count[1] >= data->min_packets) {
-		flow_render(data->output + data->pos, data->sizes[data->i], &flow->flow);
-		data->pos += data->sizes[data->i ++];
-	} else {
-		// Empty flow, skip
-		data->i ++;
-	}
-}
-
 static bool flush(struct context *context, bool force) {
-	if (!force && !uplink_connected(context->uplink))
-		return false; // Don't try to send if we are not connected.
+	if (!force && !uplink_connected(context->uplink) && !uplink_spooling(context->uplink))
+		return false; // Don't try to send if we are not connected and there's no spool.
 	struct user_data *u = context->user_data;
 	size_t header = sizeof(char) + sizeof(uint32_t) + sizeof(uint64_t);
-	struct flush_data d = {
-		.sizes = mem_pool_alloc(context->temp_pool, trie_size(u->trie) * sizeof *d.sizes),
-		.pos = header,
-		.min_packets = u->min_packets
-	};
-	ulog(LLOG_INFO, "Sending %zu flows\n", trie_size(u->trie));
-	trie_walk(u->trie, get_size, &d, context->temp_pool);
-	sanity(d.i == trie_size(u->trie), "Wrong number of flows counted: %zu/%zu\n", d.i, trie_size(u->trie));
-	size_t total_size = header + d.size;
-	d.output = mem_pool_alloc(context->temp_pool, total_size);
-	*d.output = 'D';
+	size_t count = trie_size(u->trie);
+	ulog(LLOG_INFO, "Sending %zu flows\n", count);
+	// Pick the flows to send and compute their sizes in a single pass through the trie
+	const struct flow **flows = mem_pool_alloc(context->temp_pool, count * sizeof *flows);
+	size_t *sizes = mem_pool_alloc(context->temp_pool, count * sizeof *sizes);
+	size_t selected = 0, seen = 0, total_size = header;
+	struct trie_iter *iter = trie_iter_create(u->trie, NULL, 0, false, context->temp_pool);
+	struct trie_data *flow;
+	while (trie_iter_next(iter, NULL, NULL, &flow)) {
+		seen ++;
+		// Empty flows are created when the limit is reached, skip them
+		if (flow && flow->flow.count[0] + flow->flow.count[1] >= u->min_packets) {
+			flows[selected] = &flow->flow;
+			total_size += sizes[selected ++] = flow_size(&flow->flow);
+		}
+	}
+	sanity(seen == count, "Wrong number of flows counted: %zu/%zu\n", seen, count);
+	uint8_t *output = mem_pool_alloc(context->temp_pool, total_size);
+	*output = 'D';
 	uint32_t conf_id = htonl(u->conf_id);
-	memcpy(d.output + sizeof(char), &conf_id, sizeof conf_id);
+	memcpy(output + sizeof(char), &conf_id, sizeof conf_id);
 	uint64_t now = htobe64(loop_now(context->loop));
-	memcpy(d.output + sizeof(char) + sizeof conf_id, &now, sizeof now);
-	d.i = 0;
-	trie_walk(u->trie, format_flow, &d, context->temp_pool);
-	sanity(d.i == trie_size(u->trie), "Wrong number of flows flushed: %zu/%zu\n", d.i, trie_size(u->trie));
-	sanity(d.pos == total_size, "Wrong size after flow flush: %zu/%zu\n", d.pos, total_size);
-	if (!uplink_plugin_send_message(context, d.output, total_size) && !force)
+	memcpy(output + sizeof(char) + sizeof conf_id, &now, sizeof now);
+	size_t pos = header;
+	for (size_t i = 0; i < selected; i ++) {
+		flow_render(output + pos, sizes[i], flows[i]);
+		pos += sizes[i];
+	}
+	sanity(pos == total_size, "Wrong size after flow flush: %zu/%zu\n", pos, total_size);
+	if (!uplink_plugin_send_message(context, output, total_size) && !force)
 		return false; // Don't clean the data if we failed to send. But do clean them if the force is in effect, to not overflow the limit by too much
 	mem_pool_reset(u->flow_pool);
 	u->trie = trie_alloc(u->flow_pool);
@@ -200,7 +177,7 @@ static void packet_handle(struct context *context, const struct packet_info *inf
 	// Add to statisticts
 	struct flow *f = &(*data)->flow;
 	f->count[info->direction] ++;
-	f->size[info->direction] += info->length;
+	f->size[info->direction] += info->wire_length;
 	f->last_time[info->direction] = loop_now(context->loop);
 	if (!f->first_time[info->direction])
 		f->first_time[info->direction] = loop_now(context->loop);
@@ -245,18 +222,19 @@ static void initialize(struct context *context) {
 	connected(context);
 }
 
-struct config {
-	uint32_t conf_id;
-	uint32_t max_flows;
-	uint32_t timeout;
-	uint32_t min_packets;
-};
+// The config message, the description of the filter follows
+#define WIRE_NAME(X) flow_config_##X
+#define WIRE_FIELDS(FIELD, FIELD_IF) \
+	FIELD(uint32, conf_id) \
+	FIELD(uint32, max_flows) \
+	FIELD(uint32, timeout) \
+	FIELD(uint32, min_packets)
+#include "../../core/wire_message.h"
 
 static void config_parse(struct context *context, const uint8_t *data, size_t length) {
-	struct config config;
-	sanity(length >= sizeof config, "Flow config message too short, expected %zu bytes, got %zu\n", sizeof config, length);
-	memcpy(&config, data, sizeof config); // Copy out, because of alignment
-	configure(context, ntohl(config.conf_id), ntohl(config.max_flows), ntohl(config.timeout), ntohl(config.min_packets), data + sizeof config, length - sizeof config);
+	struct flow_config_msg config;
+	sanity(flow_config_parse(&config, &data, &length, NULL), "Flow config message too short, expected %zu bytes, got %zu\n", (size_t)flow_config_fixed_size, length);
+	configure(context, config.conf_id, config.max_flows, config.timeout, config.min_packets, data, length);
 }
 
 static void handle_filter_action(struct context *context, enum diff_store_action action, const char *name, uint32_t epoch, uint32_t old_version, uint32_t new_version) {
@@ -271,21 +249,16 @@ static void handle_filter_action(struct context *context, enum diff_store_action
 			break;
 		case DIFF_STORE_INCREMENTAL:
 		case DIFF_STORE_FULL: {
-			bool full = (action == DIFF_STORE_FULL);
-			size_t len = 1 + 1 + sizeof(uint32_t) + strlen(name) + (2 + !full) * sizeof(uint32_t);
-			uint8_t *message = mem_pool_alloc(context->temp_pool, len);
-			uint8_t *pos = message;
-			size_t rest = len;
-			*(pos ++) = 'U';
-			rest --;
-			*(pos ++) = full;
-			rest --;
-			uplink_render_string(name, strlen(name), &pos, &rest);
-			uplink_render_uint32(epoch, &pos, &rest);
-			if (!full)
-				uplink_render_uint32(old_version, &pos, &rest);
-			uplink_render_uint32(new_version, &pos, &rest);
-			sanity(!rest, "Leftover buffer when requesting filter update: %zu bytes left\n", rest);
+			struct diff_update_request_msg request = {
+				.full = (action == DIFF_STORE_FULL),
+				.name = name,
+				.name_length = strlen(name),
+				.epoch = epoch,
+				.old_version = old_version,
+				.new_version = new_version
+			};
+			size_t len;
+			uint8_t *message = diff_update_request_render_alloc(&request, 0, &len, context->temp_pool);
 			uplink_plugin_send_message(context, message, len);
 			break;
 		}
@@ -307,18 +280,16 @@ static void communicate(struct context *context, const uint8_t *data, size_t len
 				return; // The basic config is not there yet. No filter to apply the diff to.
 			data ++;
 			length --;
-			char *name = uplink_parse_string(context->temp_pool, &data, &length);
-			sanity(name, "Update message too short to contain filter name\n");
-			uint32_t epoch = uplink_parse_uint32(&data, &length);
-			uint32_t version = uplink_parse_uint32(&data, &length);
+			struct diff_version_msg update;
+			sanity(diff_version_parse(&update, &data, &length, context->temp_pool), "Update message too short (%zu bytes)\n", length);
 			if (length)
 				ulog(LLOG_WARN, "Extra data at the end of diff-filter update message (%zu bytes: %s)\n", length, mem_pool_hex(context->temp_pool, data, length));
 			uint32_t orig_version;
-			ulog(LLOG_DEBUG, "Received version update of diff filter %s: %u %u\n", name, epoch, version);
-			enum diff_store_action action = filter_action(context->user_data->filter, name, epoch, version, &orig_version);
+			ulog(LLOG_DEBUG, "Received version update of diff filter %s: %u %u\n", update.name, update.epoch, update.version);
+			enum diff_store_action action = filter_action(context->user_data->filter, update.name, update.epoch, update.version, &orig_version);
 			if (action == DIFF_STORE_UNKNOWN)
-				ulog(LLOG_WARN, "Update for unknown filter %s received\n", name);
-			handle_filter_action(context, action, name, epoch, orig_version, version);
+				ulog(LLOG_WARN, "Update for unknown filter %s received\n", update.name);
+			handle_filter_action(context, action, update.name, update.epoch, orig_version, update.version);
 			break;
 		}
 		case 'D': { // difference to apply to a filter (may be asked for or not)
@@ -326,38 +297,25 @@ static void communicate(struct context *context, const uint8_t *data, size_t len
 				return; // The basic config is not there yet. No filter to apply the diff to.
 			data ++;
 			length --;
-			char *name = uplink_parse_string(context->temp_pool, &data, &length);
-			if (!name) {
-				ulog(LLOG_ERROR, "Diff message too short to contain filter name\n");
-				abort();
-			}
-			if (!length) {
-				ulog(LLOG_ERROR, "Diff message too short, missing update fullness flag\n");
+			struct diff_header_msg diff = { .from = 0 };
+			if (!diff_header_parse(&diff, &data, &length, context->temp_pool)) {
+				ulog(LLOG_ERROR, "Diff message too short to contain the header (%zu bytes)\n", length);
 				abort();
 			}
-			bool full = *data;
-			length --;
-			data ++;
 			ulog(LLOG_DEBUG_VERBOSE, "Length: %zu\n", length);
-			uint32_t epoch = uplink_parse_uint32(&data, &length);
-			uint32_t from = 0;
-			if (!full)
-				from = uplink_parse_uint32(&data, &length);
-			uint32_t to = uplink_parse_uint32(&data, &length);
 			uint32_t orig_version;
-			ulog(LLOG_DEBUG_VERBOSE, "Length: %zu\n", length);
-			enum diff_store_action action = filter_diff_apply(context->temp_pool, context->user_data->filter, name, full, epoch, from, to, data, length, &orig_version);
+			enum diff_store_action action = filter_diff_apply(context->temp_pool, context->user_data->filter, diff.name, diff.full, diff.epoch, diff.from, diff.to, data, length, &orig_version);
 			switch (action) {
 				case DIFF_STORE_UNKNOWN:
-					ulog(LLOG_WARN, "Diff for unknown filter %s received \n", name);
+					ulog(LLOG_WARN, "Diff for unknown filter %s received \n", diff.name);
 					break;
 				case DIFF_STORE_INCREMENTAL:
 				case DIFF_STORE_FULL:
-					ulog(LLOG_WARN, "Filter %s out of sync, dropping diff\n", name);
+					ulog(LLOG_WARN, "Filter %s out of sync, dropping diff\n", diff.name);
 					break;
 				default:;
 			}
-			handle_filter_action(context, action, name, epoch, orig_version, to);
+			handle_filter_action(context, action, diff.name, diff.epoch, orig_version, diff.to);
 			break;
 		}
 		default:
@@ -366,11 +324,26 @@ static void communicate(struct context *context, const uint8_t *data, size_t len
 	}
 }
 
-#ifndef STATIC
+static void memory_pressure(struct context *context) {
+	struct user_data *u = context->user_data;
+	if (!u->configured)
+		return; // No flows yet
+	ulog(LLOG_WARN, "Memory pressure, flushing %zu flows early\n", trie_size(u->trie));
+	// Forced, so the flows are dropped even if we can't send them
+	flush(context, true);
+	sanity(u->timeout_scheduled, "Missing timeout after flush\n");
+	loop_timeout_cancel(context->loop, u->timeout_id);
+	u->timeout_scheduled = false;
+	schedule_timeout(context);
+}
+
+#ifdef STATIC
+unsigned api_version_flow(void) {
+#else
 unsigned api_version() {
+#endif
 	return UCOLLECT_PLUGIN_API_VERSION;
 }
-#endif
 
 #ifdef STATIC
 struct plugin *plugin_info_flow(void) {
@@ -388,6 +361,7 @@ struct plugin *plugin_info(void) {
 		.init_callback = initialize,
 		.uplink_connected_callback = connected,
 		.uplink_data_callback = communicate,
+		.memory_pressure_callback = memory_pressure,
 		.name = "Flow",
 		.version = 2,
 		.imports = imports
@@ -22,6 +22,7 @@
 
 #define PLUGLIB_DO_IMPORT PLUGLIB_LOCAL
 #include "../../libs/diffstore/diff_store.h"
+#include "../../libs/diffstore/diff_messages.h"
 
 #include "../../core/plugin.h"
 #include "../../core/context.h"
@@ -161,6 +162,22 @@ struct config {
 	uint32_t set_count;
 } __attribute__((packed));
 
+// Description of one set in the config
+#define WIRE_NAME(X) set_desc_##X
+#define WIRE_FIELDS(FIELD, FIELD_IF) \
+	FIELD(string, name) \
+	FIELD(char, type) \
+	FIELD(uint32, max_size) \
+	FIELD(uint32, hash_size)
+#include "../../core/wire_message.h"
+
+// Ask for the version of a set
+#define WIRE_NAME(X) version_ask_##X
+#define WIRE_OPCODE 'A'
+#define WIRE_FIELDS(FIELD, FIELD_IF) \
+	FIELD(string, name)
+#include "../../core/wire_message.h"
+
 static void addr_cmd(struct diff_addr_store *store, const char *cmd, const uint8_t *addr, size_t length) {
 	struct set *set = store->userdata;
 	char *composed = mem_pool_printf(set->context->temp_pool, "%s %s %s\n", cmd, set->tmp_name ? set->tmp_name : set->name, set->type->addr2str(addr, length, set->context->temp_pool));
@@ -220,27 +237,21 @@ static void store_set_hooks(struct set *set) {
 }
 
 static bool set_parse(struct mem_pool *pool, struct set *target, const uint8_t **data, size_t *length) {
-	char *name;
-	uint8_t t;
-	uint32_t max_size;
-	uint32_t hash_size;
-	uplink_parse(data, length, "scuu",
-			&name, (size_t *)NULL, pool, "set name in FWUp config",
-			&t, "set type in FWUp config",
-			&max_size, "max size of set in FWUp config",
-			&hash_size, "hash size of set in FWUp config");
+	struct set_desc_msg desc;
+	sanity(set_desc_parse(&desc, data, length, pool), "Set description in FWUp config too short (%zu bytes)\n", *length);
+	uint8_t t = desc.type;
 	const struct set_type *type = &set_types[t];
 	if (!type->desc) {
-		ulog(LLOG_WARN, "Set %s of unknown type '%c' (%hhu), ignoring\n", name, t, t);
+		ulog(LLOG_WARN, "Set %s of unknown type '%c' (%hhu), ignoring\n", desc.name, t, t);
 		return false;
 	}
 	*target = (struct set) {
-		.name = name,
+		.name = desc.name,
 		.type = type,
 		.state = SS_NEWBORN,
-		.max_size = max_size,
-		.hash_size = hash_size,
-		.store = diff_addr_store_init(pool, name)
+		.max_size = desc.max_size,
+		.hash_size = desc.hash_size,
+		.store = diff_addr_store_init(pool, desc.name)
 	};
 	store_set_hooks(target);
 	return true;
@@ -248,8 +259,12 @@ static bool set_parse(struct mem_pool *pool, struct set *target, const uint8_t *
 
 static void version_ask(struct context *context, const char *setname) {
 	ulog(LLOG_DEBUG_VERBOSE, "Asking for version of set %s\n", setname);
+	const struct version_ask_msg ask = {
+		.name = setname,
+		.name_length = strlen(setname)
+	};
 	size_t len;
-	const uint8_t *message = uplink_render_alloc(&len, 0, context->temp_pool, "cs", 'A' /* 'A'sk for a version */, setname, strlen(setname));
+	const uint8_t *message = version_ask_render_alloc(&ask, 0, &len, context->temp_pool);
 	// Ignore success result ‒ if it fails, it's because we aren't connected. We shall ask again once we connect.
 	uplink_plugin_send_message(context, message, len);
 }
@@ -424,17 +439,17 @@ static void handle_action(struct context *context, const char *name, enum diff_s
 		}
 		case DIFF_STORE_INCREMENTAL:
 		case DIFF_STORE_FULL: {
-			bool full = (action == DIFF_STORE_FULL);
-			set_find(u, name)->state = full ? SS_PENDING : SS_VALID;
-			size_t len = 1 /* 'U' */ + 1 /* full? */ + sizeof(uint32_t) + strlen(name) + (2 + !full) * sizeof(uint32_t);
-			uint8_t *message = mem_pool_alloc(context->temp_pool, len);
-			uint8_t *pos = message;
-			size_t rest = len;
-			uplink_render(&pos, &rest, "cbsu", 'U', full, name, strlen(name), epoch);
-			if (!full)
-				uplink_render_uint32(old_version, &pos, &rest);
-			uplink_render_uint32(new_version, &pos, &rest);
-			sanity(!rest, "Leftover of %zu bytes after rendering request for update on %s\n", rest, name);
+			const struct diff_update_request_msg request = {
+				.full = (action == DIFF_STORE_FULL),
+				.name = name,
+				.name_length = strlen(name),
+				.epoch = epoch,
+				.old_version = old_version,
+				.new_version = new_version
+			};
+			set_find(u, name)->state = request.full ? SS_PENDING : SS_VALID;
+			size_t len;
+			uint8_t *message = diff_update_request_render_alloc(&request, 0, &len, context->temp_pool);
 			uplink_plugin_send_message(context, message, len);
 			break;
 		}
@@ -446,24 +461,20 @@ static void version_received(struct context *context, const uint8_t *data, size_
 	struct user_data *u = context->user_data;
 	if (!config_version_check(u, &data, &length, "version update"))
 		return;
-	char *name;
-	uint32_t epoch, version;
-	uplink_parse(&data, &length, "suu",
-			&name, (size_t *)NULL, context->temp_pool, "version IPSet name",
-			&epoch, "version epoch",
-			&version, "version");
+	struct diff_version_msg update;
+	sanity(diff_version_parse(&update, &data, &length, context->temp_pool), "IPSet version message too short (%zu bytes)\n", length);
 	if (length)
-		ulog(LLOG_WARN, "Extra %zu bytes after version for IPSet %s, ignoring for compatibility reasons\n", length, name);
-	struct set *set = set_find(u, name);
+		ulog(LLOG_WARN, "Extra %zu bytes after version for IPSet %s, ignoring for compatibility reasons\n", length, update.name);
+	struct set *set = set_find(u, update.name);
 	if (!set) {
-		ulog(LLOG_ERROR, "Update for unknown set %s received\n", name);
+		ulog(LLOG_ERROR, "Update for unknown set %s received\n", update.name);
 		return;
 	}
 	set->context = context;
-	ulog(LLOG_DEBUG, "Received IPset version update for %s: %u %u\n", name, epoch, version);
+	ulog(LLOG_DEBUG, "Received IPset version update for %s: %u %u\n", update.name, update.epoch, update.version);
 	uint32_t orig_version;
-	enum diff_store_action action = diff_addr_store_action(set->store, epoch, version, &orig_version);
-	handle_action(context, name, action, epoch, orig_version, version);
+	enum diff_store_action action = diff_addr_store_action(set->store, update.epoch, update.version, &orig_version);
+	handle_action(context, update.name, action, update.epoch, orig_version, update.version);
 	set->context = NULL;
 }
 
@@ -472,33 +483,25 @@ static void diff_received(struct context *context, const uint8_t *data, size_t l
 	struct user_data *u = context->user_data;
 	if (!config_version_check(u, &data, &length, "diff update"))
 		return;
-	char *name;
-	bool full;
-	uint32_t epoch, from = 0, to;
-	uplink_parse(&data, &length, "sbu",
-			&name, (size_t *)NULL, context->temp_pool, "diff IPset",
-			&full, "diff fullness flag",
-			&epoch, "diff epoch");
-	if (!full)
-		from = uplink_parse_uint32(&data, &length);
-	to = uplink_parse_uint32(&data, &length);
-	struct set *set = set_find(u, name);
+	struct diff_header_msg diff = { .from = 0 };
+	sanity(diff_header_parse(&diff, &data, &length, context->temp_pool), "IPSet diff too short to contain the header (%zu bytes)\n", length);
+	struct set *set = set_find(u, diff.name);
 	if (!set) {
-		ulog(LLOG_ERROR, "Diff for unknown set %s received\n", name);
+		ulog(LLOG_ERROR, "Diff for unknown set %s received\n", diff.name);
 		return;
 	}
 	set->context = context;
 	uint32_t orig_version;
-	ulog(LLOG_INFO, "Updating ipset %s from version %u to version %u (epoch %u)\n", name, (unsigned)from, (unsigned)to, (unsigned)epoch);
-	enum diff_store_action action = diff_addr_store_apply(context->temp_pool, set->store, full, epoch, from, to, data, length, &orig_version);
+	ulog(LLOG_INFO, "Updating ipset %s from version %u to version %u (epoch %u)\n", diff.name, (unsigned)diff.from, (unsigned)diff.to, (unsigned)diff.epoch);
+	enum diff_store_action action = diff_addr_store_apply(context->temp_pool, set->store, diff.full, diff.epoch, diff.from, diff.to, data, length, &orig_version);
 	switch (action) {
 		case DIFF_STORE_INCREMENTAL:
 		case DIFF_STORE_FULL:
-			ulog(LLOG_WARN, "IPSet %s out of sync, dropping diff\n", name);
+			ulog(LLOG_WARN, "IPSet %s out of sync, dropping diff\n", diff.name);
 			break;
 		default:;
 	}
-	handle_action(context, name, action, epoch, orig_version, to);
+	handle_action(context, diff.name, action, diff.epoch, orig_version, diff.to);
 	set->context = NULL;
 }
 
@@ -567,9 +570,10 @@ static void initialize(struct context *context) {
 }
 
 #ifdef STATIC
-#error "FWUp is not ready for static linkage. Nobody needed it."
+struct plugin *plugin_info_fwup(void) {
 #else
 struct plugin *plugin_info(void) {
+#endif
 	static struct pluglib_import *imports[] = {
 		&diff_addr_store_init_import,
 		&diff_addr_store_cp_import,
@@ -590,7 +594,10 @@ struct plugin *plugin_info(void) {
 	return &plugin;
 }
 
+#ifdef STATIC
+unsigned api_version_fwup(void) {
+#else
 unsigned api_version() {
+#endif
 	return UCOLLECT_PLUGIN_API_VERSION;
 }
-#endif
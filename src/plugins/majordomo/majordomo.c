@@ -36,6 +36,7 @@
 #include "../../core/uplink.h"
 #include "../../core/loop.h"
 #include "../../core/trie.h"
+#include "../../core/lpm.h"
 
 #define DUMP_FILE_DST "/tmp/ucollect_majordomo"
 #define SOURCE_SIZE_LIMIT 6000
@@ -100,10 +101,9 @@ struct src_items {
 #define LIST_WANT_LFOR
 #include "../../core/link_list.h"
 
-struct filter_rule {
-	struct in6_addr addr;
-	size_t prefix;
-	int family;
+// Only marks the ignored subnets, the table needs some non-NULL data
+struct lpm_data {
+	bool ignored;
 };
 
 struct user_data {
@@ -112,36 +112,13 @@ struct user_data {
 	struct src_items sources;
 	struct mem_pool *data_pool;
 	struct mem_pool *config_pool;
-	struct filter_rule *filter;
-	size_t filter_size;
+	struct lpm *filter;
 	size_t timeout;
 	char *src_str;
 	char *dst_str;
 	FILE *dump_file;
 };
 
-static uint32_t masks[33];
-
-static void precompute_masks() {
-	uint32_t mask = 0xFFFFFFFF;
-
-	for (ssize_t i = 32; i >= 0; i--) {
-		masks[i] = htonl(mask);
-		mask <<= 1;
-	}
-}
-
-static bool bitcmp(uint32_t *a, uint32_t *b, size_t bits) {
-	while (bits > 32) {
-		if (a[0] != b[0]) return false;
-		a++;
-		b++;
-		bits -= 32;
-	}
-
-	return ((a[0] & masks[bits]) == (b[0] & masks[bits]));
-}
-
 static bool parse_address(const char *addrstr, struct in6_addr *addr, int *family) {
 	if (inet_pton(AF_INET, addrstr, addr) == 1) {
 		*family = 4;
@@ -182,15 +159,16 @@ static void get_string_from_raw_bytes(unsigned char *bytes, unsigned char addr_l
 	}
 }
 
-static void update_value(struct trie_data *value, enum direction direction, uint64_t size, uint64_t data_size) {
+// The scale is the sampling rate, each packet we see stands for that many
+static void update_value(struct trie_data *value, enum direction direction, uint64_t size, uint64_t data_size, uint64_t scale) {
 	if (direction == DIRECTION_UPLOAD) {
-		value->u_count++;
-		value->u_size += size;
-		value->u_data_size += data_size;
+		value->u_count += scale;
+		value->u_size += size * scale;
+		value->u_data_size += data_size * scale;
 	} else if (direction == DIRECTION_DOWNLOAD) {
-		value->d_count++;
-		value->d_size += size;
-		value->d_data_size += data_size;
+		value->d_count += scale;
+		value->d_size += size * scale;
+		value->d_data_size += data_size * scale;
 	} else {
 		// DIR_UNKNOWN is filtered in packet_handle
 		assert(0);
@@ -214,12 +192,12 @@ static struct key* build_key(struct mem_pool *pool,
 	return key;
 }
 
-static void init_trie_data(struct mem_pool *pool, struct trie_data **data, const struct packet_info *info) {
+static void init_trie_data(struct mem_pool *pool, struct trie_data **data, const struct packet_info *info, uint64_t scale) {
 	*data = mem_pool_alloc(pool, sizeof **data);
 	**data = (struct trie_data) {
-		.u_count = 1,
-		.u_size = info->length,
-		.u_data_size = info->length - info->hdr_length
+		.u_count = scale,
+		.u_size = info->wire_length * scale,
+		.u_data_size = (info->wire_length - info->hdr_length) * scale
 		// Item can be created only in one direction and the rest will be zero
 	};
 }
@@ -235,18 +213,10 @@ static struct src_item *find_src(struct src_items *sources, const unsigned char
 }
 
 static bool filter_address(struct user_data *d, const void *addr_bytes, int family) {
-	struct in6_addr addr;
-	memcpy(&addr, addr_bytes, (family == 4 ? 4 : 16));
-
-	for (size_t i = 0; i < d->filter_size; i++) {
-		if (family == d->filter[i].family && bitcmp((uint32_t *) &addr, (uint32_t *) &(d->filter[i].addr), d->filter[i].prefix))
-			return true;
-	}
-
-	return false;
+	return d->filter && lpm_lookup(d->filter, addr_bytes, family == 4 ? 4 : 16);
 }
 
-void packet_handle(struct context *context, const struct packet_info *info) {
+static void packet_handle(struct context *context, const struct packet_info *info) {
 	struct user_data *d = context->user_data;
 	const struct packet_info *l2 = info;
 
@@ -288,11 +258,12 @@ void packet_handle(struct context *context, const struct packet_info *info) {
 	);
 
 	struct trie_data **data = trie_index(d->communication, (uint8_t *) key, sizeof *key);
+	uint64_t scale = loop_plugin_sample_rate(context);
 
 	// Item exists
 	if (*data != NULL) {
 		//Update info
-		update_value(*data, l2->direction, info->length, (info->length - info->hdr_length));
+		update_value(*data, l2->direction, info->wire_length, (info->wire_length - info->hdr_length), scale);
 		return;
 	}
 
@@ -300,7 +271,7 @@ void packet_handle(struct context *context, const struct packet_info *info) {
 	struct src_item *src = find_src(&(d->sources), l2->addresses[local_endpoint], l2->addr_len);
 	// This is first communication from this source
 	if (src == NULL) {
-		init_trie_data(d->data_pool, data, info);
+		init_trie_data(d->data_pool, data, info, scale);
 
 		src = src_items_append_pool(&(d->sources), d->data_pool);
 		memcpy(src->from.addr, l2->addresses[local_endpoint], l2->addr_len);
@@ -313,10 +284,10 @@ void packet_handle(struct context *context, const struct packet_info *info) {
 	} else {
 		// Source has some records; check its limit
 		if (src->items_in_comm_list < SOURCE_SIZE_LIMIT) {
-			init_trie_data(d->data_pool, data, info);
+			init_trie_data(d->data_pool, data, info, scale);
 		} else {
 			// Source exceeded the limit - update its 'other' value
-			update_value(&(src->other), l2->direction, info->length, (info->length - info->hdr_length));
+			update_value(&(src->other), l2->direction, info->wire_length, (info->wire_length - info->hdr_length), scale);
 		}
 	}
 }
@@ -402,7 +373,7 @@ void scheduled_dump(struct context *context, void *data, size_t id) {
 	context->user_data->timeout = loop_timeout_add(context->loop, DUMP_TIMEOUT, context, NULL, scheduled_dump);
 }
 
-void init(struct context *context) {
+static void init(struct context *context) {
 	context->user_data = mem_pool_alloc(context->permanent_pool, sizeof *context->user_data);
 	*context->user_data = (struct user_data) {
 		.data_pool = loop_pool_create(context->loop, context, "Majordomo data pool"),
@@ -414,9 +385,7 @@ void init(struct context *context) {
 		.src_str = mem_pool_alloc(context->permanent_pool, ADDRSTRLEN),
 		.dst_str = mem_pool_alloc(context->permanent_pool, ADDRSTRLEN)
 	};
-	context->user_data->communication = trie_alloc(context->user_data->data_pool),
-
-	precompute_masks();
+	context->user_data->communication = trie_alloc(context->user_data->data_pool);
 }
 
 static bool parse_option(struct mem_pool *temp_pool, const char *cfg_line, struct in6_addr *addr, size_t *prefix, int *family) {
@@ -468,17 +437,21 @@ void finish_config(struct context *context, bool commit) {
 	mem_pool_reset(d->config_pool);
 	// Empty filter is acceptable
 	d->filter = NULL;
-	d->filter_size = 0;
 
 	const struct config_node *conf = loop_plugin_option_get(context, "ignore_subnet");
 	if (!conf)
 		return;
-	d->filter_size = conf->value_count;
-	d->filter = mem_pool_alloc(d->config_pool, d->filter_size * sizeof(*d->filter));
+	d->filter = lpm_create(d->config_pool);
+	struct lpm_data *ignored = mem_pool_alloc(d->config_pool, sizeof *ignored);
+	ignored->ignored = true;
 
 	// Parse (again) new configuration and store it
-	for (size_t i = 0; i < d->filter_size; i++) {
-		parse_option(context->temp_pool, conf->values[i], &(d->filter[i].addr), &(d->filter[i].prefix), &(d->filter[i].family));
+	for (size_t i = 0; i < conf->value_count; i++) {
+		struct in6_addr addr;
+		size_t prefix;
+		int family;
+		parse_option(context->temp_pool, conf->values[i], &addr, &prefix, &family);
+		lpm_insert(d->filter, (const uint8_t *)&addr, family == 4 ? 4 : 16, prefix, ignored);
 		ulog(LLOG_DEBUG, "Majordomo: Add %s to subnet filter\n", conf->values[i]);
 	}
 }
@@ -487,6 +460,14 @@ void destroy(struct context *context) {
 	dump(context);
 }
 
+#ifdef STATIC
+unsigned api_version_majordomo(void) {
+#else
+unsigned api_version() {
+#endif
+	return UCOLLECT_PLUGIN_API_VERSION;
+}
+
 #ifdef STATIC
 struct plugin *plugin_info_majordomo(void) {
 #else
@@ -498,7 +479,8 @@ struct plugin *plugin_info(void) {
 		.init_callback = init,
 		.finish_callback = destroy,
 		.config_check_callback = check_config,
-		.config_finish_callback = finish_config
+		.config_finish_callback = finish_config,
+		.sample_scaled = true
 	};
 	return &plugin;
 }
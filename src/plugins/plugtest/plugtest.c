@@ -33,11 +33,13 @@ static void init(struct context *context) {
 	timeout(context, NULL, 0);
 }
 
-#ifndef STATIC
+#ifdef STATIC
+unsigned api_version_plugtest(void) {
+#else
 unsigned api_version() {
+#endif
 	return UCOLLECT_PLUGIN_API_VERSION;
 }
-#endif
 
 #ifdef STATIC
 struct plugin *plugin_info_plugtest(void) {
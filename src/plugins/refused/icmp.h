@@ -25,7 +25,7 @@
 #include <stdlib.h>
 #include <stdint.h>
 
-struct packet_info *info;
+struct packet_info;
 
 /*
  * Look into a packet and decide if it is a destination unreachable ICMP packet
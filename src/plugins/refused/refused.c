@@ -35,8 +35,9 @@
 
 struct user_data {
 	bool active;
-	struct mem_pool *active_pool, *standby_pool; // One pool to allocate the trie from, another to be able to copy some data to when cleaning the first one
+	struct mem_pool *active_pool, *standby_pool; // The trie and the records live in the active one, the other one is to copy them to when the memory needs to be released
 	struct trie *connections; // We store the connections here
+	struct trie_data *record_recycler; // Records of connections dropped by consolidation
 	size_t undecided, finished; // Number of yet undecided connections and number of decided ones
 	size_t send_v4, send_v6; // How many records would be sent
 	struct trie_data *timeout_head, *timeout_tail; // Link list sorted by the timeouts
@@ -65,7 +66,7 @@ struct trie_data {
 	bool transmitted;
 	char nak_type;
 	struct trie_data *next, *prev; // Link list sorted by timeouts
-	struct trie_data *new_instance; // A friend allocated from new pool
+	struct trie_data *new_instance; // A friend allocated from the standby pool, during compaction
 };
 
 #define LIST_NODE struct trie_data
@@ -74,12 +75,17 @@ struct trie_data {
 #define LIST_TAIL timeout_tail
 #define LIST_PREV prev
 #define LIST_NAME(X) timeout_##X
-#define LIST_WANT_APPEND_POOL
 #define LIST_WANT_REMOVE
+#define LIST_WANT_INSERT_AFTER
 #define LIST_WANT_LFOR
-#define LIST_INSERT_AFTER
 #include "../../core/link_list.h"
 
+#define RECYCLER_NODE struct trie_data
+#define RECYCLER_BASE struct user_data
+#define RECYCLER_HEAD record_recycler
+#define RECYCLER_NAME(X) record_recycler_##X
+#include "../../core/recycler.h"
+
 static bool transmit(struct context *context, bool force);
 static void consolidate(struct context *context);
 
@@ -161,8 +167,8 @@ static bool transmit(struct context *context, bool force) {
 		loop_timeout_cancel(context->loop, u->timeout_id);
 	u->timeout_scheduled = true;
 	u->timeout_id = loop_timeout_add(context->loop, u->max_age, context, NULL, send_timeout);
-	if (!force && !uplink_connected(context->uplink))
-		// Don't send when not connected.
+	if (!force && !uplink_connected(context->uplink) && !uplink_spooling(context->uplink))
+		// Don't send when not connected and there's no spool.
 		return false;
 	ulog(LLOG_INFO, "Sending %zu IPv4 refused connections and %zu IPv6 ones\n", u->send_v4, u->send_v6);
 	size_t msg_size = 1 + sizeof(uint64_t) + u->send_v4 * (sizeof(struct conn_record) + 4) + u->send_v6 * (sizeof(struct conn_record) + 16);
@@ -190,70 +196,98 @@ static bool transmit(struct context *context, bool force) {
 	}
 }
 
+struct drop_node {
+	struct drop_node *next;
+	uint8_t *key;
+	size_t key_size;
+	struct trie_data *data;
+};
+
 struct consolidate_params {
-	struct trie *dest;
-	struct mem_pool *pool, *tmp;
-	size_t undecided, finished, send_v4, send_v6;
+	struct mem_pool *tmp;
+	struct drop_node *drop;
+	size_t dropped;
 };
 
 static void consolidate_callback(const uint8_t *key, size_t key_size, struct trie_data *data, void *userdata) {
-	if (data->transmitted)
-		// Drop this one, we already sent it
-		return;
-	if (data->completed && data->events[EVENT_ACK])
-		// This one is not going to be sent. Ever.
+	bool drop = data->transmitted // We already sent it
+		|| (data->completed && data->events[EVENT_ACK]) // This one is not going to be sent. Ever.
+		|| (data->completed && !data->events[EVENT_SYN]); // There was no attempt
+	if (!drop)
 		return;
-	if (data->completed && !data->events[EVENT_SYN])
-		// There was no attempt
-		return;
-	// Create a copy of the node and put it into the other trie
+	// The trie can't be modified during the walk, so just note it
 	struct consolidate_params *params = userdata;
-	struct trie_data *new = mem_pool_alloc(params->pool, sizeof *new);
-	memcpy(new, data, sizeof *new);
-	*trie_index(params->dest, key, key_size) = new;
-	// Link to the new one, so it can be found in the linked list
-	data->new_instance = new;
-	// Update stats
-	if (data->completed) {
-		params->finished ++;
-		if (data->v6)
-			params->send_v6 ++;
-		else
-			params->send_v4 ++;
-	} else {
-		params->undecided ++;
-	}
+	struct drop_node *node = mem_pool_alloc(params->tmp, sizeof *node);
+	*node = (struct drop_node) {
+		.next = params->drop,
+		.key = mem_pool_alloc(params->tmp, key_size),
+		.key_size = key_size,
+		.data = data
+	};
+	memcpy(node->key, key, key_size);
+	params->drop = node;
+	params->dropped ++;
 }
 
-// Go through the trie of connections and copy the ones that are still useful to a new one, dropping the old
+// Go through the trie of connections and drop the ones that are no longer useful
 static void consolidate(struct context *context) {
 	ulog(LLOG_DEBUG, "Consolidating refused connection store\n");
 	struct user_data *u = context->user_data;
 	struct consolidate_params params = {
-		.dest = trie_alloc(u->standby_pool),
-		.pool = u->standby_pool,
 		.tmp = context->temp_pool
 	};
-	// Copy relevant nodes
 	trie_walk(u->connections, consolidate_callback, &params, context->temp_pool);
+	for (struct drop_node *node = params.drop; node; node = node->next) {
+		// Only the completed ones are dropped and these are no longer in the timeout list
+		assert(node->data->completed);
+		trie_delete(u->connections, node->key, node->key_size);
+		record_recycler_release(u, node->data);
+	}
+	// We may lose some finished here
+	assert(u->finished >= params.dropped);
+	u->finished -= params.dropped;
+}
+
+struct compact_params {
+	struct trie *dest;
+	struct mem_pool *pool;
+};
+
+static void compact_callback(const uint8_t *key, size_t key_size, struct trie_data *data, void *userdata) {
+	struct compact_params *params = userdata;
+	struct trie_data *new = mem_pool_alloc(params->pool, sizeof *new);
+	*new = *data;
+	*trie_index(params->dest, key, key_size) = new;
+	// Link to the new one, so it can be found in the linked list
+	data->new_instance = new;
+}
+
+/*
+ * The deleted trie nodes and the recycled records stay in the pool, so
+ * consolidation doesn't lower the memory usage. Copy all the connections to
+ * the standby pool and reset the active one, to really release the memory.
+ */
+static void compact(struct context *context) {
+	struct user_data *u = context->user_data;
+	struct compact_params params = {
+		.dest = trie_alloc(u->standby_pool),
+		.pool = u->standby_pool
+	};
+	trie_walk(u->connections, compact_callback, &params, context->temp_pool);
 	// Create a new linked list for timeouts
 	struct user_data tmp_data = { .timeout_head = NULL };
 	LFOR(timeout, old, u)
 		timeout_insert_after(&tmp_data, old->new_instance, tmp_data.timeout_tail);
 	u->timeout_head = tmp_data.timeout_head;
 	u->timeout_tail = tmp_data.timeout_tail;
-	// Drop the old data
+	// The recycled records are in the old pool too
+	u->record_recycler = NULL;
+	size_t before = mem_pool_allocated(u->active_pool);
 	mem_pool_reset(u->active_pool);
-	// Use the new values
 	u->standby_pool = u->active_pool;
 	u->active_pool = params.pool;
 	u->connections = params.dest;
-	assert(u->undecided == params.undecided);
-	// We may lose some finished here
-	assert(u->finished >= params.finished);
-	u->finished = params.finished;
-	assert(u->send_v4 == params.send_v4);
-	assert(u->send_v6 == params.send_v6);
+	ulog(LLOG_DEBUG, "Compacted refused connection store from %zu to %zu bytes\n", before, mem_pool_allocated(u->active_pool));
 }
 
 static void handle_event_found(struct context *context, enum event_type type, char nak_type, struct trie_data *d) {
@@ -296,7 +330,8 @@ static void handle_event(struct context *context, enum event_type type, char nak
 			return;
 		}
 		u->undecided ++;
-		d = *trie_index(u->connections, key, key_len) = timeout_append_pool(u, u->active_pool);
+		d = *trie_index(u->connections, key, key_len) = record_recycler_get(u, u->active_pool);
+		timeout_insert_after(u, d, u->timeout_tail);
 		d->time = loop_now(context->loop);
 		d->completed = false;
 		d->transmitted = false;
@@ -446,6 +481,26 @@ static void init(struct context *context) {
 	connected(context);
 }
 
+static void memory_pressure(struct context *context) {
+	struct user_data *u = context->user_data;
+	ulog(LLOG_WARN, "Memory pressure, sending %zu IPv4 and %zu IPv6 refused connections early\n", u->send_v4, u->send_v6);
+	// Forced, so the completed connections get dropped even if we can't send them
+	if (u->send_v4 || u->send_v6)
+		transmit(context, true);
+	// Drop the transmitted and useless records
+	consolidate(context);
+	// And give the memory back, as the dropped ones are only recycled
+	compact(context);
+}
+
+#ifdef STATIC
+unsigned api_version_refused(void) {
+#else
+unsigned api_version() {
+#endif
+	return UCOLLECT_PLUGIN_API_VERSION;
+}
+
 #ifdef STATIC
 struct plugin *plugin_info_refused(void) {
 #else
@@ -457,6 +512,7 @@ struct plugin *plugin_info(void) {
 		.packet_callback = packet,
 		.uplink_connected_callback = connected,
 		.uplink_data_callback = uplink_data,
+		.memory_pressure_callback = memory_pressure,
 		.version = 1
 	};
 	return &plugin;
@@ -41,6 +41,8 @@ static void dump_stats(struct context *context, void *data, size_t id) {
 		ulog(LLOG_INFO, "Mempool stats: %s\n", tok);
 	}
 	ulog(LLOG_INFO, "Mempool stats done\n");
+	ulog(LLOG_INFO, "Uplink stats: %s\n", uplink_stats(uplink, loop_temp_pool(loop)));
+	ulog(LLOG_INFO, "Loop stats: %s\n", loop_stats(loop, loop_temp_pool(loop)));
 	loop_timeout_add(loop, STAT_DUMP_TIMEOUT, NULL, NULL, dump_stats);
 }
 